@@ -0,0 +1,539 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "audio_dsp.h"
+#include "audio_ring.h"
+#include "audio_sink.h"
+#include "log.h"
+
+namespace {
+
+    // One ALSA device of the aggregate, playing a range of the host's
+    // channels through its own ring and writer thread. The first
+    // member is the master and plays as it comes. The others are
+    // resampled so that they play each frame when the master does: a
+    // large offset is removed at once by dropping or inserting
+    // frames, what is left and the clock drift by adjusting the
+    // resampling ratio.
+    class member_t {
+    public:
+        static const size_t chunk_size = 256;
+        std::string _name;
+        unsigned int _first_channel;
+        unsigned int _channel_count;
+        unsigned int _sample_width_byte;
+        // The member sink's own telemetry, its delay is the PCM's
+        device_state_t *_state;
+        audio_sink_t *_sink;
+        // Serializes the sink between the writer thread and
+        // start() and stop()
+        pthread_mutex_t _mutex;
+        audio_ring_t _ring;
+        // Host side, the member's channels of the frames written
+        std::vector<char> _stage;
+        int64_t _underrun_count;
+        const member_t *_master;
+        const int64_t *_stop;
+        // The aggregate's, broadcast whenever frames were queued or
+        // the writers are to stop
+        pthread_mutex_t *_wake_mutex;
+        pthread_cond_t *_wake;
+        unsigned int _sample_rate;
+        // CLOCK_MONOTONIC time at which the first frame of the ring
+        // was or would have been heard, published by the writer
+        // after each write, 0 until then. Comparing it between
+        // members gives their offset regardless of when the host
+        // filled each ring.
+        int64_t _origin_ns;
+        pthread_t _thread;
+        bool _thread_alive;
+        // Writer side, _step being the input frames per output frame
+        double _ratio;
+        double _step;
+        audio_resampler_t _resampler;
+        double _error;
+        double _integral;
+        // Master only, time the PCM has taken no frames for
+        uint64_t _refused_ms;
+        member_t(const std::string &name, unsigned int first_channel,
+                 unsigned int channel_count)
+            : _name(name), _first_channel(first_channel),
+              _channel_count(channel_count), _sample_width_byte(0),
+              _state(new device_state_t()), _sink(NULL),
+              _underrun_count(0), _master(NULL), _stop(NULL),
+              _wake_mutex(NULL), _wake(NULL),
+              _sample_rate(0), _origin_ns(0), _thread_alive(false),
+              _ratio(1), _step(1), _error(0), _integral(0),
+              _refused_ms(0)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+        }
+        ~member_t()
+        {
+            delete _sink;
+            _state->release();
+            pthread_mutex_destroy(&_mutex);
+        }
+        // Input frames read but not yet written to the PCM
+        double pending(void) const
+        {
+            return _resampler.pending();
+        }
+        // Input frames until a frame written now is heard
+        double latency(void) const
+        {
+            return _ring.readable() + pending() +
+                atomic_load(&_state->_delay) * _step;
+        }
+        // Right after a write, while the PCM delay is current
+        void publish_origin(void)
+        {
+            const double heard = _ring.read_position() - pending() -
+                atomic_load(&_state->_delay) * _step;
+            struct timespec current;
+
+            clock_gettime(CLOCK_MONOTONIC, &current);
+
+            const int64_t current_ns =
+                static_cast<int64_t>(current.tv_sec) * 1000000000LL +
+                current.tv_nsec;
+
+            atomic_store(&_origin_ns, current_ns -
+                         static_cast<int64_t>(heard * 1e+9 /
+                                              _sample_rate));
+        }
+        // Counts another millisecond without progress, true once it
+        // adds up to the ring
+        bool refusing(void)
+        {
+            const bool refusing =
+                _refused_ms * _sample_rate >= 1000 * _ring.capacity();
+
+            if (!refusing && ++_refused_ms * _sample_rate >=
+                1000 * _ring.capacity()) {
+                log_message(log_warning, "aggregate %s: the PCM takes "
+                            "no frames, dropping them", _name);
+            }
+
+            return refusing;
+        }
+        void wait_readable(void)
+        {
+            pthread_mutex_lock(_wake_mutex);
+            while (_ring.readable() == 0 && atomic_load(_stop) == 0) {
+                pthread_cond_wait(_wake, _wake_mutex);
+            }
+            pthread_mutex_unlock(_wake_mutex);
+        }
+        uint32_t sink_write(const void *buffer, uint32_t frame_count)
+        {
+            pthread_mutex_lock(&_mutex);
+
+            const uint32_t written = _sink->write(buffer, frame_count);
+
+            pthread_mutex_unlock(&_mutex);
+
+            return written;
+        }
+        void write_silence(size_t frame_count)
+        {
+            const std::vector<char> silence
+                (chunk_size * _channel_count * _sample_width_byte, 0);
+
+            while (frame_count > 0 && atomic_load(_stop) == 0) {
+                size_t count = chunk_size;
+
+                if (count > frame_count) {
+                    count = frame_count;
+                }
+
+                const uint32_t written = sink_write(&silence[0], count);
+
+                if (written == 0) {
+                    break;
+                }
+                frame_count -= written;
+            }
+        }
+        // Before each chunk, returns false if it dropped frames
+        // instead
+        bool align(void)
+        {
+            // About half a second to settle at 256 frames a chunk
+            const double smoothing = 0.01;
+            const double kp = 1e-5;
+            const double ki = 1e-8;
+            const double integral_max = 1e-3;
+            const double correction_max = 2e-3;
+            const double coarse = 4.0 * chunk_size;
+            const int64_t origin_ns = atomic_load(&_origin_ns);
+            const int64_t master_origin_ns =
+                atomic_load(&_master->_origin_ns);
+
+            if (origin_ns == 0 || master_origin_ns == 0) {
+                return true;
+            }
+            // Frames this member plays behind the master
+            _error += ((origin_ns - master_origin_ns) * 1e-9 *
+                       _sample_rate - _error) * smoothing;
+            if (fabs(_error) > coarse) {
+                const size_t frame_count = static_cast<size_t>
+                    (fabs(_error));
+
+                if (_error > 0) {
+                    const size_t readable = _ring.readable();
+
+                    _ring.skip(frame_count < readable ?
+                               frame_count : readable);
+                }
+                else {
+                    write_silence(static_cast<size_t>
+                                  (frame_count / _ratio));
+                }
+                // Until the writer publishes where it is now
+                atomic_store(&_origin_ns, int64_t(0));
+                _error = 0;
+                return false;
+            }
+            _integral += ki * _error;
+            if (_integral > integral_max) {
+                _integral = integral_max;
+            }
+            else if (_integral < -integral_max) {
+                _integral = -integral_max;
+            }
+
+            double correction = kp * _error + _integral;
+
+            if (correction > correction_max) {
+                correction = correction_max;
+            }
+            else if (correction < -correction_max) {
+                correction = -correction_max;
+            }
+            _step = _ratio * (1 + correction);
+            return true;
+        }
+        static void *writer_thread(void *arg)
+        {
+            member_t *m = static_cast<member_t *>(arg);
+
+            while (atomic_load(m->_stop) == 0) {
+                const void *data;
+                const size_t count = m->_ring.peek(&data, chunk_size);
+
+                if (count == 0) {
+                    m->wait_readable();
+                    continue;
+                }
+                if (m->_master == NULL) {
+                    // What the PCM did not take, after XRUN recovery
+                    // for instance, is tried again
+                    const uint32_t written = m->sink_write(data, count);
+
+                    if (written > 0) {
+                        m->_ring.skip(written);
+                        m->_refused_ms = 0;
+                        m->publish_origin();
+                        continue;
+                    }
+                    // Unless it takes nothing for as long as the ring
+                    // lasts, not to block the host for good
+                    if (m->refusing()) {
+                        m->_ring.skip(count);
+                    }
+                    usleep(1000);
+                    continue;
+                }
+                if (!m->align()) {
+                    continue;
+                }
+
+                const size_t produced =
+                    m->_resampler.process(data, count, m->_step);
+
+                m->_ring.skip(count);
+                for (size_t done = 0; done < produced; ) {
+                    const uint32_t written = m->sink_write
+                        (m->_resampler.output() +
+                         done * m->_ring.frame_byte(), produced - done);
+
+                    if (written == 0) {
+                        usleep(1000);
+                        break;
+                    }
+                    done += written;
+                    m->publish_origin();
+                }
+            }
+
+            return NULL;
+        }
+    };
+
+    // Several ALSA devices as one output, each playing a range of the
+    // host's channels, phase aligned to the first one
+    class aggregate_sink_t : public audio_sink_t {
+    protected:
+        static const uint32_t default_buffer_size = 8192;
+        std::string _spec;
+        std::vector<member_t *> _member;
+        unsigned int _channel_count;
+        unsigned int _sample_width_byte;
+        int64_t _stop;
+        pthread_mutex_t _wake_mutex;
+        pthread_cond_t _wake;
+        int64_t _underrun_count;
+        // "pcm@first-last;..." with channels counted from 1, for
+        // instance "hw:0,0@1-8;hw:1,0@9-10". Channels past
+        // channel_count are left out.
+        bool parse(unsigned int channel_count)
+        {
+            for (size_t begin = 0; begin < _spec.size(); ) {
+                size_t end = _spec.find(';', begin);
+
+                if (end == std::string::npos) {
+                    end = _spec.size();
+                }
+
+                const std::string item = _spec.substr(begin, end - begin);
+                const size_t at = item.rfind('@');
+
+                begin = end + 1;
+                if (at == std::string::npos || at == 0) {
+                    return false;
+                }
+
+                const char *range = item.c_str() + at + 1;
+                char *next;
+                unsigned long first = strtoul(range, &next, 10);
+                unsigned long last = first;
+
+                if (*next == '-') {
+                    last = strtoul(next + 1, &next, 10);
+                }
+                if (next == range || *next != '\0' || first == 0 ||
+                    last < first) {
+                    return false;
+                }
+                if (first > channel_count) {
+                    continue;
+                }
+                if (last > channel_count) {
+                    last = channel_count;
+                }
+                _member.push_back(new member_t(item.substr(0, at),
+                                               first - 1,
+                                               last - first + 1));
+            }
+
+            return !_member.empty();
+        }
+        bool stalled(void) const
+        {
+            return atomic_load(&_stop) != 0;
+        }
+        void ring_written(void)
+        {
+            pthread_mutex_lock(&_wake_mutex);
+            pthread_cond_broadcast(&_wake);
+            pthread_mutex_unlock(&_wake_mutex);
+        }
+        void wait_empty(void)
+        {
+            for (size_t i = 0; i < _member.size(); i++) {
+                ring_wait_empty(&_member[i]->_ring);
+            }
+        }
+        void stop_threads(void)
+        {
+            atomic_store(&_stop, int64_t(1));
+            ring_written();
+            for (size_t i = 0; i < _member.size(); i++) {
+                if (_member[i]->_thread_alive) {
+                    pthread_join(_member[i]->_thread, NULL);
+                    _member[i]->_thread_alive = false;
+                }
+            }
+        }
+        void update_underrun_count(void)
+        {
+            int64_t underrun_count = 0;
+
+            for (size_t i = 0; i < _member.size(); i++) {
+                underrun_count +=
+                    atomic_load(&_member[i]->_state->_underrun_count);
+            }
+            for (; _underrun_count < underrun_count; _underrun_count++) {
+                _state->add_underrun();
+            }
+        }
+    public:
+        aggregate_sink_t(const std::string &spec, device_state_t *state)
+            : audio_sink_t(state), _spec(spec), _channel_count(0),
+              _sample_width_byte(0), _stop(0), _underrun_count(0)
+        {
+            pthread_mutex_init(&_wake_mutex, NULL);
+            pthread_cond_init(&_wake, NULL);
+        }
+        ~aggregate_sink_t()
+        {
+            stop_threads();
+            for (size_t i = 0; i < _member.size(); i++) {
+                delete _member[i];
+            }
+            pthread_cond_destroy(&_wake);
+            pthread_mutex_destroy(&_wake_mutex);
+        }
+        bool open(unsigned int *sample_rate,
+                  unsigned int sample_width_byte,
+                  unsigned int channel_count)
+        {
+            if (!parse(channel_count)) {
+                log_message(log_error, "aggregate %s: expected "
+                            "device@first-last;... covering channel 1 to "
+                            "%u", _spec, channel_count);
+                return false;
+            }
+
+            int64_t buffer_size =
+                atomic_load(&_state->_buffer_size_request);
+
+            if (buffer_size <= 0) {
+                buffer_size = default_buffer_size;
+            }
+            for (size_t i = 0; i < _member.size(); i++) {
+                member_t *m = _member[i];
+                // The master sets the rate, the others resample to
+                // theirs if they cannot follow
+                unsigned int rate = *sample_rate;
+
+                atomic_store(&m->_state->_buffer_size_request,
+                             atomic_load(&_state->_buffer_size_request));
+                atomic_store(&m->_state->_period_size_request,
+                             atomic_load(&_state->_period_size_request));
+                m->_sink = audio_sink_t::create(audio_backend_alsa,
+                                                m->_name, m->_state);
+                if (m->_sink == NULL ||
+                    !m->_sink->open(&rate, sample_width_byte,
+                                    m->_channel_count)) {
+                    log_message(log_error, "aggregate: cannot open %s",
+                                m->_name);
+                    return false;
+                }
+                if (i == 0) {
+                    *sample_rate = rate;
+                }
+                else if (rate != *sample_rate) {
+                    log_message(log_info, "aggregate: %s runs at %u Hz, "
+                                "resampling from %u Hz", m->_name, rate,
+                                *sample_rate);
+                }
+                m->_sample_width_byte = sample_width_byte;
+                m->_resampler.configure(m->_channel_count,
+                                        sample_width_byte);
+                m->_ratio = static_cast<double>(*sample_rate) / rate;
+                m->_step = m->_ratio;
+                m->_master = i > 0 ? _member[0] : NULL;
+                m->_stop = &_stop;
+                m->_wake_mutex = &_wake_mutex;
+                m->_wake = &_wake;
+                m->_sample_rate = *sample_rate;
+                m->_ring.allocate(m->_channel_count * sample_width_byte,
+                                  buffer_size);
+                m->_stage.resize(m->_ring.capacity() *
+                                 m->_ring.frame_byte());
+            }
+            _sample_rate = *sample_rate;
+            _channel_count = channel_count;
+            _sample_width_byte = sample_width_byte;
+            for (size_t i = 0; i < _member.size(); i++) {
+                if (pthread_create(&_member[i]->_thread, NULL,
+                                   &member_t::writer_thread,
+                                   _member[i]) != 0) {
+                    log_message(log_error, "aggregate: cannot start the "
+                                "writer of %s", _member[i]->_name);
+                    return false;
+                }
+                _member[i]->_thread_alive = true;
+            }
+            atomic_store(&_state->_buffer_size, static_cast<int64_t>
+                         (_member[0]->_ring.capacity()) +
+                         atomic_load(&_member[0]->_state->_buffer_size));
+            restart_drift();
+
+            return true;
+        }
+        uint32_t write(const void *buffer, uint32_t frame_count)
+        {
+            const size_t frame_byte = _channel_count * _sample_width_byte;
+            const char *source = static_cast<const char *>(buffer);
+
+            update_underrun_count();
+            for (uint32_t done = 0; done < frame_count; ) {
+                const uint32_t count =
+                    frame_count - done < _member[0]->_ring.capacity() ?
+                    frame_count - done : _member[0]->_ring.capacity();
+
+                for (size_t i = 0; i < _member.size(); i++) {
+                    member_t *m = _member[i];
+
+                    audio_extract_channels(&m->_stage[0],
+                                           m->_ring.frame_byte(),
+                                           source + done * frame_byte,
+                                           frame_byte,
+                                           m->_first_channel *
+                                           _sample_width_byte, count);
+                    ring_write(&m->_ring, &m->_stage[0], count);
+                }
+                done += count;
+            }
+            update_telemetry(frame_count, _member[0]->_ring.readable() +
+                             atomic_load(&_member[0]->_state->
+                                         _buffer_fill),
+                             static_cast<int64_t>
+                             (_member[0]->latency()));
+
+            return frame_count;
+        }
+        void start(void)
+        {
+            for (size_t i = 0; i < _member.size(); i++) {
+                pthread_mutex_lock(&_member[i]->_mutex);
+                _member[i]->_sink->start();
+                pthread_mutex_unlock(&_member[i]->_mutex);
+            }
+            restart_drift();
+        }
+        void stop(void)
+        {
+            wait_empty();
+            for (size_t i = 0; i < _member.size(); i++) {
+                pthread_mutex_lock(&_member[i]->_mutex);
+                _member[i]->_sink->stop();
+                pthread_mutex_unlock(&_member[i]->_mutex);
+            }
+        }
+        void drain(void)
+        {
+            wait_empty();
+            stop_threads();
+            for (size_t i = 0; i < _member.size(); i++) {
+                _member[i]->_sink->drain();
+            }
+        }
+    };
+
+}
+
+audio_sink_t *create_aggregate_sink(const std::string &spec,
+                                    device_state_t *state)
+{
+    return new aggregate_sink_t(spec, state);
+}
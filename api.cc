@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cerrno>
 #include <cstring>
 #include <ctime>
 #include <cmath>
@@ -7,97 +8,379 @@
 #include <map>
 #include <string>
 #include <dlfcn.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <alsa/asoundlib.h>
 #include "DeckLinkAPI.h"
+#include "SoundDeckAPI.h"
 
 #include "common.h"
+#include "convert.h"
+#include "audio_dsp.h"
+#include "audio_ring.h"
+#include "audio_sink.h"
+#include "device_state.h"
+#include "frame_pool.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "v4l2_source.h"
 
 namespace {
 
-    static const unsigned int bmd_display_mode[][5] = {
-        {720,  486,  bmdModeNTSC,        30000, 1001},
-        {720,  576,  bmdModePAL,         25000, 1000},
-
-        {1920, 1080, bmdModeHD1080p2398, 24000, 1001},
-        {1920, 1080, bmdModeHD1080p24,   24000, 1000},
-        {1920, 1080, bmdModeHD1080p25,   25000, 1000},
-        {1920, 1080, bmdModeHD1080p2997, 30000, 1001},
-        {1920, 1080, bmdModeHD1080p30,   30000, 1000},
-        {1920, 1080, bmdModeHD1080i50,   50000, 1000},
-        {1920, 1080, bmdModeHD1080i5994, 60000, 1001},
-        {1920, 1080, bmdModeHD1080i6000, 60000, 1000},
-        {1920, 1080, bmdModeHD1080p50,   50000, 1000},
-        {1920, 1080, bmdModeHD1080p5994, 60000, 1001},
-        {1920, 1080, bmdModeHD1080p6000, 60000, 1000},
-
-        {1280, 720,  bmdModeHD720p50,    50000, 1000},
-        {1280, 720,  bmdModeHD720p5994,  60000, 1001},
-        {1280, 720,  bmdModeHD720p60,    60000, 1000},
-
-        {0}
+    class display_mode_t {
+    public:
+        BMDDisplayMode _display_mode;
+        long _width;
+        long _height;
+        const char *_name;
+        BMDTimeValue _frame_duration;
+        BMDTimeScale _time_scale;
+        BMDFieldDominance _field_dominance;
+        BMDDisplayModeFlags _flags;
+    };
+
+    static const display_mode_t display_mode[] = {
+        {bmdModeNTSC,        720,  486,  "NTSC",       1001, 30000,
+         bmdLowerFieldFirst,  bmdDisplayModeColorspaceRec601},
+        {bmdModePAL,         720,  576,  "PAL",        1000, 25000,
+         bmdLowerFieldFirst,  bmdDisplayModeColorspaceRec601},
+        {bmdModeNTSC2398,    720,  486,  "NTSC 23.98", 1001, 24000,
+         bmdLowerFieldFirst,  bmdDisplayModeColorspaceRec601},
+        {bmdModeNTSCp,       720,  486,  "NTSC Progressive", 1001, 30000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec601},
+        {bmdModePALp,        720,  576,  "PAL Progressive", 1000, 25000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec601},
+
+        {bmdModeHD1080p2398, 1920, 1080, "1080p23.98", 1001, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p24,   1920, 1080, "1080p24",    1000, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p25,   1920, 1080, "1080p25",    1000, 25000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p2997, 1920, 1080, "1080p29.97", 1001, 30000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p30,   1920, 1080, "1080p30",    1000, 30000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080i50,   1920, 1080, "1080i50",    1000, 50000,
+         bmdUpperFieldFirst,  bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080i5994, 1920, 1080, "1080i59.94", 1001, 60000,
+         bmdUpperFieldFirst,  bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080i6000, 1920, 1080, "1080i60",    1000, 60000,
+         bmdUpperFieldFirst,  bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p50,   1920, 1080, "1080p50",    1000, 50000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p5994, 1920, 1080, "1080p59.94", 1001, 60000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD1080p6000, 1920, 1080, "1080p60",    1000, 60000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+
+        {bmdModeHD720p50,    1280, 720,  "720p50",     1000, 50000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD720p5994,  1280, 720,  "720p59.94",  1001, 60000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdModeHD720p60,    1280, 720,  "720p60",     1000, 60000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+
+        {bmdMode2k2398,      2048, 1556, "2K 23.98",   1001, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode2k24,        2048, 1556, "2K 24",      1000, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode2k25,        2048, 1556, "2K 25",      1000, 25000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+
+        {bmdMode2kDCI2398,   2048, 1080, "2K DCI 23.98", 1001, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode2kDCI24,     2048, 1080, "2K DCI 24",  1000, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode2kDCI25,     2048, 1080, "2K DCI 25",  1000, 25000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+
+        {bmdMode4K2160p2398, 3840, 2160, "2160p23.98", 1001, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p24,   3840, 2160, "2160p24",    1000, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p25,   3840, 2160, "2160p25",    1000, 25000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p2997, 3840, 2160, "2160p29.97", 1001, 30000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p30,   3840, 2160, "2160p30",    1000, 30000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p50,   3840, 2160, "2160p50",    1000, 50000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p5994, 3840, 2160, "2160p59.94", 1001, 60000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4K2160p60,   3840, 2160, "2160p60",    1000, 60000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+
+        {bmdMode4kDCI2398,   4096, 2160, "4K DCI 23.98", 1001, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4kDCI24,     4096, 2160, "4K DCI 24",  1000, 24000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709},
+        {bmdMode4kDCI25,     4096, 2160, "4K DCI 25",  1000, 25000,
+         bmdProgressiveFrame, bmdDisplayModeColorspaceRec709}
+    };
+
+    static const size_t display_mode_count =
+        sizeof(display_mode) / sizeof(*display_mode);
+
+    // 64-bit FNV-1a, folded to 32 bit at the end so that hosts that
+    // store persistent IDs in a 32-bit integer still see distinct
+    // values
+    class id_hash_t {
+    protected:
+        uint64_t _h;
+    public:
+        id_hash_t(void)
+            : _h(14695981039346656037ULL)
+        {
+        }
+        id_hash_t &operator<<(const std::string &s)
+        {
+            // Include the terminating '\0', so that ("ab", "c") and
+            // ("a", "bc") hash differently
+            for (size_t i = 0; i <= s.size(); i++) {
+                _h ^= static_cast<unsigned char>(s.c_str()[i]);
+                _h *= 1099511628211ULL;
+            }
+            return *this;
+        }
+        int64_t value(void) const
+        {
+            return static_cast<int64_t>((_h ^ (_h >> 32)) & 0xffffffffU);
+        }
+    };
+
+    // Resolved sysfs path of the card's parent device, e.g.
+    // "/sys/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0", which
+    // identifies the physical port rather than the enumeration order
+    std::string card_bus_path(int card)
+    {
+        // "/sys/class/sound/card" + 11 characters max for int +
+        // "/device" + '\0'
+        char link[40];
+        char path[PATH_MAX];
+
+        snprintf(link, 40, "/sys/class/sound/card%d/device", card);
+        if (realpath(link, path) == NULL) {
+            return std::string();
+        }
+
+        return path;
+    }
+
+    class audio_device_t {
+    public:
+        audio_backend_t _backend;
+        // ALSA PCM name, the recording directory or the aggregate's
+        // devices, empty for the sound server backends
+        std::string _name;
+        // Empty if the device has no capture stream
+        std::string _capture_name;
+        std::string _display_name;
+        int64_t _persistent_id;
+        int64_t _topological_id;
+        int64_t _number_of_subdevices;
+        int64_t _subdevice_index;
+        audio_device_t(audio_backend_t backend, std::string name,
+                       std::string capture_name,
+                       std::string display_name,
+                       int64_t persistent_id, int64_t topological_id,
+                       int64_t number_of_subdevices = 1,
+                       int64_t subdevice_index = 0)
+            : _backend(backend), _name(name),
+              _capture_name(capture_name),
+              _display_name(display_name),
+              _persistent_id(persistent_id),
+              _topological_id(topological_id),
+              _number_of_subdevices(number_of_subdevices),
+              _subdevice_index(subdevice_index)
+        {
+        }
+    };
+
+    // The hardware reference clock of both input and output, so that
+    // hosts can relate capture timestamps to scheduled playback
+    int64_t monotonic_ns(void)
+    {
+        struct timespec current;
+
+        clock_gettime(CLOCK_MONOTONIC, &current);
+
+        return static_cast<int64_t>(current.tv_sec) * 1000000000LL +
+            current.tv_nsec;
+    }
+
+    // ns in time_scale units, without overflowing for large scales
+    BMDTimeValue ns_to_time(int64_t ns, BMDTimeScale time_scale)
+    {
+        const int64_t second = ns / 1000000000LL;
+
+        return second * time_scale +
+            (ns - second * 1000000000LL) * time_scale / 1000000000LL;
+    }
+
+    // Entry points of the real DeckLink library, when it is installed
+    // and there is a card for it to drive. It is never unloaded, the
+    // objects it handed out may outlive any of ours.
+    class vendor_api_t {
+    public:
+        void *_library;
+        IDeckLinkIterator *(*_create_iterator)(void);
+        IDeckLinkAPIInformation *(*_create_api_information)(void);
+        IDeckLinkVideoConversion *(*_create_video_conversion)(void);
+        IDeckLinkDiscovery *(*_create_discovery)(void);
     };
 
-    void *lib_api = NULL;
+    vendor_api_t vendor_api_instance = { NULL, NULL, NULL, NULL, NULL };
+    pthread_once_t vendor_api_once = PTHREAD_ONCE_INIT;
+
+    bool blackmagic_card_present(void)
+    {
+        glob_t device;
+        const bool present =
+            glob("/dev/blackmagic*", GLOB_NOSORT, NULL, &device) == 0;
+
+        globfree(&device);
+
+        return present;
+    }
+
+    // libDeckLinkAPI.so in the directories the vendor packages and
+    // ld.so use, one of which is usually this library. Looked up
+    // directly rather than by running ldconfig inside the host.
+    std::vector<std::string> vendor_library_candidates(void)
+    {
+        static const char *const directory[] = {
+            "/usr/local/lib", "/usr/lib", "/usr/lib64",
+            "/usr/lib/x86_64-linux-gnu", "/usr/lib/aarch64-linux-gnu",
+            "/lib", "/lib64", NULL
+        };
+        std::vector<std::string> candidate;
+
+        for (size_t i = 0; directory[i] != NULL; i++) {
+            const std::string path =
+                std::string(directory[i]) + "/libDeckLinkAPI.so";
+
+            if (access(path.c_str(), R_OK) == 0) {
+                candidate.push_back(path);
+            }
+        }
+
+        return candidate;
+    }
+
+    void *open_vendor_library(const std::string &path)
+    {
+        // Deep binding keeps the vendor library's calls into its own
+        // entry points from resolving to the ones exported here. It
+        // also binds its malloc() and friends to libc rather than to an
+        // allocator the host interposes.
+        // Candidates for another architecture just fail to load.
+        void *library =
+            dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+
+        if (library != NULL &&
+            dlsym(library, "SoundDeckLinkLibrary") != NULL) {
+            // This library, or another installed copy of it
+            dlclose(library);
+            library = NULL;
+        }
 
-    void load_lib_api(void)
+        return library;
+    }
+
+    // SOUNDDECK_VENDOR_LIBRARY names the library to forward to, empty
+    // to not forward at all. Otherwise the library directories are
+    // searched, only when a card is present so that there is nothing
+    // to pay without one.
+    void load_vendor_api(void)
     {
-#ifdef PATH_A
-        if (lib_api == NULL) {
-            lib_api = dlopen(PATH_A, RTLD_NOW | RTLD_GLOBAL);
+        const char *path = getenv("SOUNDDECK_VENDOR_LIBRARY");
+        void *library = NULL;
+
+        if (path != NULL) {
+            if (path[0] != '\0') {
+                library = open_vendor_library(path);
+            }
+        }
+        else if (blackmagic_card_present()) {
+            const std::vector<std::string> candidate =
+                vendor_library_candidates();
+
+            for (size_t i = 0; library == NULL && i < candidate.size();
+                 i++) {
+                library = open_vendor_library(candidate[i]);
+            }
+        }
+        if (library == NULL) {
+            return;
         }
-#endif // PATH_A
+
+        vendor_api_t &api = vendor_api_instance;
+
+        api._library = library;
+        api._create_iterator =
+            reinterpret_cast<IDeckLinkIterator *(*)(void)>
+            (dlsym(library, "CreateDeckLinkIteratorInstance_0002"));
+        api._create_api_information =
+            reinterpret_cast<IDeckLinkAPIInformation *(*)(void)>
+            (dlsym(library, "CreateDeckLinkAPIInformationInstance_0001"));
+        api._create_video_conversion =
+            reinterpret_cast<IDeckLinkVideoConversion *(*)(void)>
+            (dlsym(library, "CreateVideoConversionInstance_0001"));
+        api._create_discovery =
+            reinterpret_cast<IDeckLinkDiscovery *(*)(void)>
+            (dlsym(library, "CreateDeckLinkDiscoveryInstance_0001"));
+    }
+
+    // Loads the vendor library on first use, all NULL without one
+    const vendor_api_t &vendor_api(void)
+    {
+        pthread_once(&vendor_api_once, &load_vendor_api);
+
+        return vendor_api_instance;
     }
 
 }
 
+// Display modes are immutable and shared, the iterator and output hand
+// out pointers into display_mode_table() without allocating
 class SoundDeckLinkDisplayMode :
     public IDeckLinkDisplayMode {
 protected:
-    long _width;
-    long _height;
-    std::string _name;
-    BMDDisplayMode _display_mode;
-    std::pair<BMDTimeValue, BMDTimeScale> _frame_rate;
-    BMDFieldDominance _field_dominance;
-    BMDDisplayModeFlags _flags;
+    const display_mode_t *_mode;
 public:
-    DUMMY_IUNKNOWN;
-    SoundDeckLinkDisplayMode(long width, long height,
-                              std::string name,
-                              BMDDisplayMode display_mode,
-                              std::pair<BMDTimeValue, BMDTimeScale>
-                              frame_rate,
-                              BMDFieldDominance field_dominance,
-                              BMDDisplayModeFlags flags)
-        : _width(width), _height(height), _name(name),
-          _display_mode(display_mode), _frame_rate(frame_rate),
-          _field_dominance(field_dominance), _flags(flags)
+    STATIC_IUNKNOWN;
+    SoundDeckLinkDisplayMode(const display_mode_t *mode)
+        : _mode(mode)
     {
     }
     HRESULT GetName(const char **name)
     {
-        *name = strdup(_name.c_str());
+        *name = strdup(_mode->_name);
         return S_OK;
     }
     BMDDisplayMode GetDisplayMode(void)
     {
-        return _display_mode;
+        return _mode->_display_mode;
     }
     long GetWidth(void)
     {
-        return _width;
+        return _mode->_width;
     }
     long GetHeight(void)
     {
-        return _height;
+        return _mode->_height;
     }
     HRESULT GetFrameRate(BMDTimeValue *frameDuration,
                          BMDTimeScale *timeScale)
     {
         if (frameDuration != NULL && timeScale != NULL) {
-            *frameDuration = _frame_rate.first;
-            *timeScale = _frame_rate.second;
+            *frameDuration = _mode->_frame_duration;
+            *timeScale = _mode->_time_scale;
             return S_OK;
         }
         else {
@@ -106,74 +389,92 @@ public:
     }
     BMDFieldDominance GetFieldDominance(void)
     {
-        return _field_dominance;
+        return _mode->_field_dominance;
     }
     BMDDisplayModeFlags GetFlags(void)
     {
-        return _flags;
+        return _mode->_flags;
     }
 };
 
+namespace {
+
+    // The display mode objects in table order, plus an open addressing
+    // hash from BMDDisplayMode to table index
+    class display_mode_table_t {
+    protected:
+        static const unsigned int slot_bits = 7;
+        std::vector<SoundDeckLinkDisplayMode> _object;
+        // Table index + 1, 0 for an empty slot
+        size_t _slot[1 << slot_bits];
+        static size_t hash(BMDDisplayMode display_mode)
+        {
+            return static_cast<uint32_t>(display_mode * 0x9e3779b1U) >>
+                (32 - slot_bits);
+        }
+    public:
+        display_mode_table_t(void)
+        {
+            memset(_slot, 0, sizeof(_slot));
+            _object.reserve(display_mode_count);
+            for (size_t i = 0; i < display_mode_count; i++) {
+                _object.push_back
+                    (SoundDeckLinkDisplayMode(&display_mode[i]));
+
+                size_t h = hash(display_mode[i]._display_mode);
+
+                while (_slot[h] != 0) {
+                    h = (h + 1) & ((1 << slot_bits) - 1);
+                }
+                _slot[h] = i + 1;
+            }
+        }
+        size_t size(void) const
+        {
+            return _object.size();
+        }
+        SoundDeckLinkDisplayMode *at(size_t index)
+        {
+            return &_object[index];
+        }
+        SoundDeckLinkDisplayMode *find(BMDDisplayMode display_mode)
+        {
+            for (size_t h = hash(display_mode); _slot[h] != 0;
+                 h = (h + 1) & ((1 << slot_bits) - 1)) {
+                if (_object[_slot[h] - 1].GetDisplayMode() ==
+                    display_mode) {
+                    return &_object[_slot[h] - 1];
+                }
+            }
+
+            return NULL;
+        }
+    };
+
+    display_mode_table_t &display_mode_table(void)
+    {
+        static display_mode_table_t table;
+
+        return table;
+    }
+
+}
+
 class SoundDeckLinkDisplayModeIterator :
     public IDeckLinkDisplayModeIterator {
 protected:
-    std::vector<SoundDeckLinkDisplayMode> _display_mode;
-    std::vector<SoundDeckLinkDisplayMode>::iterator _iterator;
+    size_t _index;
 public:
-    DUMMY_IUNKNOWN;
+    DUMMY_IUNKNOWN(SoundDeckLinkDisplayModeIterator);
     SoundDeckLinkDisplayModeIterator(bool not_empty = true)
+        : _index(not_empty ? 0 : display_mode_table().size())
     {
-        if (not_empty) {
-        for (const unsigned int (*p)[5] = bmd_display_mode;
-             (*p)[0] != 0; p++) {
-            const BMDFieldDominance field_dominance =
-                (*p)[2] == bmdModeNTSC ||
-                (*p)[2] == bmdModeNTSC2398 ||
-                (*p)[2] == bmdModePAL ?
-                bmdLowerFieldFirst :
-                (*p)[2] == bmdModeHD1080i50 ||
-                (*p)[2] == bmdModeHD1080i5994 ||
-                (*p)[2] == bmdModeHD1080i6000 ?
-                bmdUpperFieldFirst :
-                bmdProgressiveFrame;
-
-            char name[11];
-
-            if ((*p)[2] == bmdModeNTSC) {
-                snprintf(name, 11, "NTSC");
-            }
-            else if ((*p)[2] == bmdModePAL) {
-                snprintf(name, 11, "PAL");
-            }
-            else {
-                snprintf(name, 11, "%d%c%.4g", (*p)[1],
-                         field_dominance == bmdProgressiveFrame ?
-                         'p' : 'i',
-                         static_cast<double>((*p)[3]) /
-                         static_cast<double>((*p)[4]));
-            }
-            _display_mode.push_back(SoundDeckLinkDisplayMode(
-                (*p)[0], (*p)[1], name, (*p)[2],
-                std::pair<BMDTimeValue, BMDTimeScale>
-                ((*p)[4], (*p)[3]),
-                field_dominance,
-                (*p)[2] == bmdModeNTSC ||
-                (*p)[2] == bmdModeNTSC2398 ||
-                (*p)[2] == bmdModeNTSCp ||
-                (*p)[2] == bmdModePAL ||
-                (*p)[2] == bmdModePALp ?
-                bmdDisplayModeColorspaceRec601 :
-                bmdDisplayModeColorspaceRec709));
-        }
-        }
-        _iterator = _display_mode.begin();
     }
     HRESULT Next(IDeckLinkDisplayMode **deckLinkDisplayMode)
     {
-        if (_iterator != _display_mode.end()) {
-            *deckLinkDisplayMode =
-                new SoundDeckLinkDisplayMode(*_iterator);
-            _iterator++;
+        if (_index < display_mode_table().size()) {
+            *deckLinkDisplayMode = display_mode_table().at(_index);
+            _index++;
             return S_OK;
         }
         else {
@@ -189,10 +490,10 @@ protected:
     std::map<BMDDeckLinkAttributeID, double> _float;
     std::map<BMDDeckLinkAttributeID, std::string> _string;
 public:
-    DUMMY_IUNKNOWN;
+    DUMMY_IUNKNOWN(SoundDeckLinkAttributes);
     SoundDeckLinkAttributes
-    (bool supports_internal_keying = false,
-     bool supports_external_keying = false,
+    (bool supports_internal_keying = true,
+     bool supports_external_keying = true,
      bool supports_hd_keying = true,
      // Set to 16, since Resolve will ask for 16 channels regardless
      int64_t maximum_audio_channels = 16,
@@ -271,7 +572,7 @@ public:
                       const char **value)
     {
         if (_string.find(cfgID) != _string.end()) {
-            *value = _string[cfgID].c_str();
+            *value = strdup(_string[cfgID].c_str());
             return S_OK;
         }
         else {
@@ -280,537 +581,2484 @@ public:
     }
 };
 
-class SoundDeckLinkOutput : public IDeckLinkOutput {
+class SoundDeckLinkTimecode : public IDeckLinkTimecode {
 protected:
-    class callback_arg_t {
-    public:
-        SoundDeckLinkOutput *_this;
-        pthread_cond_t _cond;
-        pthread_mutex_t _mutex;
-        bool _stop;
-        callback_arg_t(SoundDeckLinkOutput *this_)
-            : _this(this_), _stop(false)
-        {
-            pthread_cond_init(&_cond, NULL);
-            pthread_mutex_init(&_mutex, NULL);
+    uint8_t _hours;
+    uint8_t _minutes;
+    uint8_t _seconds;
+    uint8_t _frames;
+    BMDTimecodeFlags _flags;
+    BMDTimecodeUserBits _user_bits;
+    // "hh:mm:ss:ff" + '\0'
+    char _string[12];
+    static BMDTimecodeBCD bcd(uint8_t value)
+    {
+        return ((value / 10) << 4) | (value % 10);
+    }
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkTimecode);
+    SoundDeckLinkTimecode(uint8_t hours, uint8_t minutes,
+                          uint8_t seconds, uint8_t frames,
+                          BMDTimecodeFlags flags,
+                          BMDTimecodeUserBits user_bits)
+        : _hours(hours), _minutes(minutes), _seconds(seconds),
+          _frames(frames), _flags(flags), _user_bits(user_bits)
+    {
+        // Drop frame timecode is conventionally separated by ';'
+        snprintf(_string, sizeof(_string), "%02u:%02u:%02u%c%02u",
+                 _hours % 100, _minutes % 100, _seconds % 100,
+                 (_flags & bmdTimecodeIsDropFrame) != 0 ? ';' : ':',
+                 _frames % 100);
+    }
+    BMDTimecodeBCD GetBCD(void)
+    {
+        return (bcd(_hours) << 24) | (bcd(_minutes) << 16) |
+            (bcd(_seconds) << 8) | bcd(_frames);
+    }
+    HRESULT GetComponents(uint8_t *hours, uint8_t *minutes,
+                          uint8_t *seconds, uint8_t *frames)
+    {
+        if (hours == NULL || minutes == NULL || seconds == NULL ||
+            frames == NULL) {
+            return E_INVALIDARG;
         }
-    };
-    std::pair<BMDTimeValue, BMDTimeScale> _frame_rate;
-    IDeckLinkVideoOutputCallback *_frame_completion;
-    IDeckLinkScreenPreviewCallback *_screen_preview;
-    std::deque<std::pair<BMDTimeValue, IDeckLinkVideoFrame *> > _frame_buffer;
-    IDeckLinkMemoryAllocator *_allocator;
-    callback_arg_t _callback_arg;
-    pthread_t _callback_thread;
-    bool _callback_thread_alive;
-    struct timespec _playback_start;
-    size_t _channel_count;
-    size_t _channel_count_physical;
-    size_t _sample_width_byte;
-    std::string _alsa_device;
-    snd_pcm_t *_alsa_pcm;
-    snd_pcm_hw_params_t *_alsa_hw_params;
-    static void *callback_thread(void *arg)
+        *hours = _hours;
+        *minutes = _minutes;
+        *seconds = _seconds;
+        *frames = _frames;
+        return S_OK;
+    }
+    HRESULT GetString(const char **timecode)
     {
-        class callback_arg_t *c =
-            reinterpret_cast<class callback_arg_t *>(arg);
-
-        while (true) {
-            pthread_mutex_lock(&c->_mutex);
-
-            if (c->_stop) {
-                while (!c->_this->_frame_buffer.empty()) {
-                    c->_this->_frame_buffer.front().second->
-                        Release();
-                    c->_this->_frame_buffer.pop_front();
-                }
-                pthread_mutex_unlock(&c->_mutex);
-                return NULL;
-            }
-
-            if (c->_this->_frame_completion != NULL &&
-                c->_this->_frame_buffer.size() >= 2 &&
-                c->_this->_frame_buffer.front().first <
-                rint(c->_this->time_elapsed
-                     (c->_this->_playback_start,
-                      c->_this->_frame_rate.second))) {
-                c->_this->_frame_completion->
-                    ScheduledFrameCompleted
-                    (c->_this->_frame_buffer.front().second,
-                     bmdOutputFrameCompleted);
-                c->_this->_frame_buffer.front().second->Release();
-                c->_this->_frame_buffer.pop_front();
-            }
-
-            if (c->_this->_screen_preview != NULL &&
-                c->_this->_frame_buffer.size() >= 1) {
-                c->_this->_screen_preview->DrawFrame
-                    (c->_this->_frame_buffer.front().second);
-            }
-
-            struct timespec abstime;
-
-            clock_gettime(CLOCK_REALTIME, &abstime);
-
-            double frame_ns = 1e+9 * c->_this->_frame_rate.first /
-                c->_this->_frame_rate.second;
-
-            while (abstime.tv_nsec + frame_ns >= 1e+9) {
-                abstime.tv_sec++;
-                frame_ns -= 1e+9;
-            }
-            abstime.tv_nsec += frame_ns;
-            pthread_cond_timedwait(&c->_cond, &c->_mutex, &abstime);
-            pthread_mutex_unlock(&c->_mutex);
-        };
-
-        return NULL;
+        *timecode = strdup(_string);
+        return S_OK;
     }
-    double time_elapsed(struct timespec start,
-                        BMDTimeScale time_scale)
+    BMDTimecodeFlags GetFlags(void)
     {
-        struct timespec current;
-
-        clock_gettime(CLOCK_REALTIME, &current);
-
-        const double dsec = static_cast<double>(current.tv_sec) -
-            static_cast<double>(start.tv_sec);
-        const double dnsec = static_cast<double>(current.tv_nsec) -
-            static_cast<double>(start.tv_nsec);
-
-        return (dsec + dnsec / 1e+9) * time_scale;
+        return _flags;
     }
-    uint32_t alsa_write(void *buffer, uint32_t sample_frame_count)
+    HRESULT GetTimecodeUserBits(BMDTimecodeUserBits *userBits)
     {
-        if (_alsa_pcm == NULL) {
-            return 0;
-        }
-
-        if (snd_pcm_state(_alsa_pcm) == SND_PCM_STATE_XRUN) {
-            snd_pcm_prepare(_alsa_pcm);
+        if (userBits == NULL) {
+            return E_INVALIDARG;
         }
+        *userBits = _user_bits;
+        return S_OK;
+    }
+};
 
-        const size_t channel_step = _channel_count * _sample_width_byte;
-        const size_t channel_step_physical =
-            _channel_count_physical * _sample_width_byte;
-
-        int alsa_status = 0;
-
-        unsigned char *o =
-            new unsigned char[channel_step * sample_frame_count];
-
-        for (uint32_t i = 0; i < sample_frame_count; i++) {
-            memcpy(o + i * channel_step_physical,
-                   reinterpret_cast<unsigned char *>(buffer) +
-                   i * channel_step, channel_step_physical);
+// Frames returned by CreateVideoFrame. The buffer comes from the
+// host allocator if one is set, otherwise from the output's
+// frame_pool_t, and goes back there on the final Release. They are
+// 2D frames carrying the default (SDR) metadata, hosts wanting to
+// output HDR or stereo implement the extensions on their own frames.
+class SoundDeckLinkMutableVideoFrame :
+    public IDeckLinkMutableVideoFrame,
+    public IDeckLinkVideoFrame3DExtensions,
+    public IDeckLinkVideoFrameMetadataExtensions {
+protected:
+    long _width;
+    long _height;
+    long _row_bytes;
+    BMDPixelFormat _pixel_format;
+    BMDFrameFlags _flags;
+    void *_buffer;
+    size_t _size;
+    frame_pool_t *_pool;
+    IDeckLinkMemoryAllocator *_allocator;
+    std::map<BMDTimecodeFormat, SoundDeckLinkTimecode *> _timecode;
+    IDeckLinkVideoFrameAncillary *_ancillary;
+    hdr_metadata_t _metadata;
+    static BMDTimecodeFormat playback_format(BMDTimecodeFormat format)
+    {
+        return format == bmdTimecodeRP188Any ?
+            static_cast<BMDTimecodeFormat>(bmdTimecodeRP188VITC1) :
+            format;
+    }
+    void set_timecode(BMDTimecodeFormat format,
+                      SoundDeckLinkTimecode *timecode)
+    {
+        // Timecodes already handed out stay unchanged, the frame
+        // just drops its reference
+        std::map<BMDTimecodeFormat, SoundDeckLinkTimecode *>::iterator
+            iterator = _timecode.find(playback_format(format));
+
+        if (iterator != _timecode.end()) {
+            iterator->second->Release();
+            iterator->second = timecode;
         }
-
-        alsa_status = snd_pcm_writei(_alsa_pcm, o, sample_frame_count);
-
-        if (alsa_status < 0) {
-            snd_pcm_prepare(_alsa_pcm);
-            alsa_status =
-                snd_pcm_writei(_alsa_pcm, o, sample_frame_count);
+        else {
+            _timecode[playback_format(format)] = timecode;
         }
-
-        delete [] o;
-
-        return alsa_status > 0 ? alsa_status : 0;
     }
 public:
-    DUMMY_IUNKNOWN;
-    SoundDeckLinkOutput(IDeckLinkOutput *forward = NULL)
-        : _frame_completion(NULL),
-          _screen_preview(NULL), _allocator(NULL),
-          _callback_arg(this), _callback_thread_alive(false),
-          _channel_count(0), _channel_count_physical(0),
-          _sample_width_byte(0), _alsa_pcm(NULL)
+    IUNKNOWN_REFERENCE(SoundDeckLinkMutableVideoFrame);
+    HRESULT QueryInterface(REFIID id, void **outputInterface)
     {
+        static const size_t size_iid = 16;
+        static const REFIID iid_unknown = IID_IUnknown;
+
+        if (memcmp(&id, &iid_unknown, size_iid) == 0 ||
+            memcmp(&id, &IID_IDeckLinkVideoFrame, size_iid) == 0 ||
+            memcmp(&id, &IID_IDeckLinkMutableVideoFrame,
+                   size_iid) == 0) {
+            AddRef();
+            *outputInterface = static_cast<IDeckLinkMutableVideoFrame *>
+                (this);
+            return S_OK;
+        }
+        if (memcmp(&id, &IID_IDeckLinkVideoFrame3DExtensions,
+                   size_iid) == 0) {
+            AddRef();
+            *outputInterface =
+                static_cast<IDeckLinkVideoFrame3DExtensions *>(this);
+            return S_OK;
+        }
+        if (memcmp(&id, &IID_IDeckLinkVideoFrameMetadataExtensions,
+                   size_iid) == 0) {
+            AddRef();
+            *outputInterface =
+                static_cast<IDeckLinkVideoFrameMetadataExtensions *>
+                (this);
+            return S_OK;
+        }
+        return E_NOINTERFACE;
     }
-    SoundDeckLinkOutput(std::string alsa_device)
-        : _frame_completion(NULL),
-          _screen_preview(NULL), _allocator(NULL),
-          _callback_arg(this), _callback_thread_alive(false),
-          _channel_count(0), _channel_count_physical(0),
-          _sample_width_byte(0),
-          _alsa_device(alsa_device), _alsa_pcm(NULL)
-    {
+    SoundDeckLinkMutableVideoFrame(long width, long height,
+                                   long row_bytes,
+                                   BMDPixelFormat pixel_format,
+                                   BMDFrameFlags flags,
+                                   void *buffer, size_t size,
+                                   frame_pool_t *pool,
+                                   IDeckLinkMemoryAllocator *allocator)
+        : _width(width), _height(height), _row_bytes(row_bytes),
+          _pixel_format(pixel_format), _flags(flags), _buffer(buffer),
+          _size(size), _pool(pool), _allocator(allocator),
+          _ancillary(NULL)
+    {
+        if (_allocator != NULL) {
+            _allocator->AddRef();
+        }
+        else {
+            _pool->add_ref();
+        }
     }
-    ~SoundDeckLinkOutput()
+    virtual ~SoundDeckLinkMutableVideoFrame()
     {
-        if (_callback_thread_alive) {
-            pthread_mutex_lock(&_callback_arg._mutex);
-            _callback_arg._stop = true;
-            pthread_mutex_unlock(&_callback_arg._mutex);
+        for (std::map<BMDTimecodeFormat, SoundDeckLinkTimecode *>::
+                 iterator iterator = _timecode.begin();
+             iterator != _timecode.end(); iterator++) {
+            iterator->second->Release();
         }
-        if (_alsa_pcm != NULL) {
-            snd_pcm_close(_alsa_pcm);
+        if (_ancillary != NULL) {
+            _ancillary->Release();
+        }
+        if (_allocator != NULL) {
+            _allocator->ReleaseBuffer(_buffer);
+            _allocator->Release();
+        }
+        else {
+            _pool->put(_buffer, _size);
+            _pool->release();
         }
     }
-    HRESULT DoesSupportVideoMode(BMDDisplayMode displayMode,
-                                 BMDPixelFormat pixelFormat,
-                                 BMDVideoOutputFlags flags,
-                                 BMDDisplayModeSupport *result,
-                                 IDeckLinkDisplayMode **
-                                 resultDisplayMode)
+    long GetWidth(void)
     {
-        return S_OK;
+        return _width;
     }
-    HRESULT GetDisplayModeIterator(IDeckLinkDisplayModeIterator **
-                                   iterator)
+    long GetHeight(void)
     {
-        *iterator = new SoundDeckLinkDisplayModeIterator();
-        return S_OK;
+        return _height;
     }
-    HRESULT SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *
-                                     previewCallback)
+    long GetRowBytes(void)
     {
-        _screen_preview = previewCallback;
-        return S_OK;
+        return _row_bytes;
     }
-    HRESULT EnableVideoOutput(BMDDisplayMode displayMode,
-                              BMDVideoOutputFlags flags)
+    BMDPixelFormat GetPixelFormat(void)
+    {
+        return _pixel_format;
+    }
+    BMDFrameFlags GetFlags(void)
+    {
+        return _flags;
+    }
+    HRESULT GetBytes(void **buffer)
+    {
+        *buffer = _buffer;
+        return S_OK;
+    }
+    HRESULT GetTimecode(BMDTimecodeFormat format,
+                        IDeckLinkTimecode **timecode)
     {
-        clock_gettime(CLOCK_REALTIME, &_playback_start);
-        for (const unsigned int (*p)[5] = bmd_display_mode;
-             (*p)[0] != 0; p++) {
-            if ((*p)[2] == displayMode) {
-                _frame_rate = std::pair<BMDTimeValue, BMDTimeScale>
-                    ((*p)[4], (*p)[3]);
+        static const BMDTimecodeFormat rp188_any[] = {
+            bmdTimecodeRP188VITC1, bmdTimecodeRP188LTC,
+            bmdTimecodeRP188VITC2
+        };
+        const BMDTimecodeFormat *begin = &format;
+        const BMDTimecodeFormat *end = &format + 1;
+
+        if (timecode == NULL) {
+            return E_INVALIDARG;
+        }
+        if (format == bmdTimecodeRP188Any) {
+            begin = rp188_any;
+            end = rp188_any + sizeof(rp188_any) / sizeof(*rp188_any);
+        }
+        for (const BMDTimecodeFormat *f = begin; f != end; f++) {
+            std::map<BMDTimecodeFormat, SoundDeckLinkTimecode *>::
+                const_iterator iterator = _timecode.find(*f);
+
+            if (iterator != _timecode.end()) {
+                iterator->second->AddRef();
+                *timecode = iterator->second;
                 return S_OK;
             }
         }
-        return E_FAIL;
+        *timecode = NULL;
+        return S_FALSE;
+    }
+    HRESULT GetAncillaryData(IDeckLinkVideoFrameAncillary **ancillary)
+    {
+        if (ancillary == NULL) {
+            return E_INVALIDARG;
+        }
+        if (_ancillary == NULL) {
+            *ancillary = NULL;
+            return S_FALSE;
+        }
+        _ancillary->AddRef();
+        *ancillary = _ancillary;
+        return S_OK;
+    }
+    HRESULT SetFlags(BMDFrameFlags newFlags)
+    {
+        _flags = newFlags;
+        return S_OK;
+    }
+    HRESULT SetTimecode(BMDTimecodeFormat format,
+                        IDeckLinkTimecode *timecode)
+    {
+        uint8_t hours;
+        uint8_t minutes;
+        uint8_t seconds;
+        uint8_t frames;
+        BMDTimecodeUserBits user_bits = 0;
+
+        if (timecode == NULL ||
+            timecode->GetComponents(&hours, &minutes, &seconds,
+                                    &frames) != S_OK) {
+            return E_INVALIDARG;
+        }
+        timecode->GetTimecodeUserBits(&user_bits);
+        set_timecode(format, new SoundDeckLinkTimecode
+                     (hours, minutes, seconds, frames,
+                      timecode->GetFlags(), user_bits));
+        return S_OK;
+    }
+    HRESULT SetTimecodeFromComponents(BMDTimecodeFormat format,
+                                      uint8_t hours, uint8_t minutes,
+                                      uint8_t seconds, uint8_t frames,
+                                      BMDTimecodeFlags flags)
+    {
+        set_timecode(format, new SoundDeckLinkTimecode
+                     (hours, minutes, seconds, frames, flags, 0));
+        return S_OK;
+    }
+    HRESULT SetAncillaryData(IDeckLinkVideoFrameAncillary *ancillary)
+    {
+        if (ancillary != NULL) {
+            ancillary->AddRef();
+        }
+        std::swap(_ancillary, ancillary);
+        if (ancillary != NULL) {
+            ancillary->Release();
+        }
+        return S_OK;
+    }
+    HRESULT SetTimecodeUserBits(BMDTimecodeFormat format,
+                                BMDTimecodeUserBits userBits)
+    {
+        std::map<BMDTimecodeFormat, SoundDeckLinkTimecode *>::
+            const_iterator iterator =
+            _timecode.find(playback_format(format));
+
+        if (iterator == _timecode.end()) {
+            return E_FAIL;
+        }
+
+        uint8_t hours;
+        uint8_t minutes;
+        uint8_t seconds;
+        uint8_t frames;
+
+        iterator->second->GetComponents(&hours, &minutes, &seconds,
+                                        &frames);
+        set_timecode(format, new SoundDeckLinkTimecode
+                     (hours, minutes, seconds, frames,
+                      iterator->second->GetFlags(), userBits));
+        return S_OK;
+    }
+    BMDVideo3DPackingFormat Get3DPackingFormat(void)
+    {
+        return bmdVideo3DPackingLeftOnly;
+    }
+    HRESULT GetFrameForRightEye(IDeckLinkVideoFrame **rightEyeFrame)
+    {
+        if (rightEyeFrame == NULL) {
+            return E_INVALIDARG;
+        }
+        *rightEyeFrame = NULL;
+        return S_FALSE;
+    }
+    HRESULT GetInt(BMDDeckLinkFrameMetadataID metadataID, int64_t *value)
+    {
+        return _metadata.get_int(metadataID, value);
+    }
+    HRESULT GetFloat(BMDDeckLinkFrameMetadataID metadataID, double *value)
+    {
+        return _metadata.get_float(metadataID, value);
+    }
+    HRESULT GetFlag(BMDDeckLinkFrameMetadataID metadataID, bool *value)
+    {
+        return E_INVALIDARG;
+    }
+    HRESULT GetString(BMDDeckLinkFrameMetadataID metadataID,
+                      const char **value)
+    {
+        return E_INVALIDARG;
+    }
+};
+
+class SoundDeckLinkOutput : public IDeckLinkOutput {
+protected:
+    class callback_arg_t {
+    public:
+        SoundDeckLinkOutput *_this;
+        pthread_cond_t _cond;
+        pthread_mutex_t _mutex;
+        bool _stop;
+        // Set by the output's destructor when it runs on the callback
+        // thread, see callback_thread()
+        bool *_destroyed;
+        callback_arg_t(SoundDeckLinkOutput *this_)
+            : _this(this_), _stop(false), _destroyed(NULL)
+        {
+            pthread_cond_init(&_cond, NULL);
+            pthread_mutex_init(&_mutex, NULL);
+        }
+        ~callback_arg_t()
+        {
+            pthread_cond_destroy(&_cond);
+            pthread_mutex_destroy(&_mutex);
+        }
+    };
+    // Also paces the callback thread, 25 Hz until video is enabled
+    std::pair<BMDTimeValue, BMDTimeScale> _frame_rate;
+    IDeckLinkVideoOutputCallback *_frame_completion;
+    IDeckLinkScreenPreviewCallback *_screen_preview;
+    // Scheduled frames with their end time, in the display mode's time
+    // scale whatever the host scheduled them in
+    std::deque<std::pair<BMDTimeValue, IDeckLinkVideoFrame *> > _frame_buffer;
+    IDeckLinkMemoryAllocator *_allocator;
+    frame_pool_t *_pool;
+    callback_arg_t _callback_arg;
+    pthread_t _callback_thread;
+    bool _callback_thread_alive;
+    struct timespec _playback_start;
+    audio_backend_t _backend;
+    std::string _sink_name;
+    audio_sink_t *_sink;
+    device_state_t *_state;
+    // Offline, the stream time is the end of the last completed frame
+    // rather than the clock
+    BMDTimeValue _completed_time;
+    // Time of day at stream time 0 from the first frame timecode, and
+    // the stream time of the first audio sample, for the recording's
+    // time reference
+    static const int64_t time_unknown = -0x7fffffffffffffffLL - 1;
+    int64_t _timecode_origin_ns;
+    int64_t _audio_start_ns;
+    // The screen preview is drawn at most once per interval and only
+    // when the front frame changed, the frame being identified by its
+    // display time as hosts reuse frame objects
+    int64_t _preview_interval_ns;
+    long _preview_scale;
+    struct timespec _preview_drawn_time;
+    std::pair<BMDTimeValue, IDeckLinkVideoFrame *> _preview_drawn;
+    static int64_t preview_interval_ns(void)
+    {
+        // SOUNDDECK_PREVIEW_RATE=0 draws every frame
+        const char *rate = getenv("SOUNDDECK_PREVIEW_RATE");
+        const double hz = rate != NULL ? atof(rate) : 30;
+
+        return hz > 0 ? static_cast<int64_t>(1e+9 / hz) : 0;
+    }
+    static long preview_scale(void)
+    {
+        const char *scale = getenv("SOUNDDECK_PREVIEW_SCALE");
+        const long s = scale != NULL ? atol(scale) : 1;
+
+        return s == 2 || s == 4 ? s : 1;
+    }
+    // Called with the callback mutex held, returns the frame to draw
+    // with a reference, or NULL
+    IDeckLinkVideoFrame *preview_due(void)
+    {
+        if (_screen_preview == NULL || _frame_buffer.empty() ||
+            _frame_buffer.front() == _preview_drawn) {
+            return NULL;
+        }
+
+        struct timespec current;
+
+        clock_gettime(CLOCK_MONOTONIC, &current);
+        if ((static_cast<int64_t>(current.tv_sec) -
+             _preview_drawn_time.tv_sec) * 1000000000LL +
+            (current.tv_nsec - _preview_drawn_time.tv_nsec) <
+            _preview_interval_ns) {
+            return NULL;
+        }
+        _preview_drawn_time = current;
+        _preview_drawn = _frame_buffer.front();
+        _preview_drawn.second->AddRef();
+
+        return _preview_drawn.second;
+    }
+    // A box filtered copy of the frame from the frame pool, or NULL if
+    // the format has no downscale kernel
+    IDeckLinkVideoFrame *preview_proxy(IDeckLinkVideoFrame *frame)
+    {
+        image_t source = {
+            frame->GetPixelFormat(), frame->GetWidth(),
+            frame->GetHeight(), frame->GetRowBytes(), NULL
+        };
+        image_t destination = {
+            source._pixel_format, source._width / _preview_scale,
+            source._height / _preview_scale,
+            row_bytes_min(source._pixel_format,
+                          source._width / _preview_scale), NULL
+        };
+
+        if (destination._width <= 0 || destination._height <= 0 ||
+            destination._row_bytes <= 0 ||
+            frame->GetBytes(&source._data) != S_OK) {
+            return NULL;
+        }
+
+        const size_t size = destination._row_bytes * destination._height;
+
+        destination._data = _pool->get(size);
+        if (destination._data == NULL) {
+            return NULL;
+        }
+
+        SoundDeckLinkMutableVideoFrame *proxy =
+            new SoundDeckLinkMutableVideoFrame
+            (destination._width, destination._height,
+             destination._row_bytes, destination._pixel_format,
+             frame->GetFlags(), destination._data, size, _pool, NULL);
+
+        if (!downscale_image(source, destination)) {
+            proxy->Release();
+            return NULL;
+        }
+
+        return proxy;
+    }
+    void record_metadata(IDeckLinkVideoFrame *frame)
+    {
+        hdr_metadata_t metadata;
+
+        _state->set_hdr_metadata(metadata.read(frame) ? &metadata : NULL);
+    }
+    // Recording to a file, frames complete as fast as the host
+    // schedules them
+    bool offline(void) const
+    {
+        return _backend == audio_backend_file;
+    }
+    // Called with the callback mutex held. The front frame is on air
+    // until the next one is due, so there are always two queued.
+    bool completion_due(void)
+    {
+        if (_frame_completion == NULL || _frame_buffer.size() < 2) {
+            return false;
+        }
+        if (offline()) {
+            return true;
+        }
+        return _frame_buffer.front().first <
+            rint(time_elapsed(_playback_start, _frame_rate.second));
+    }
+    void record_timecode(IDeckLinkVideoFrame *frame,
+                         BMDTimeValue display_time,
+                         BMDTimeScale time_scale)
+    {
+        IDeckLinkTimecode *timecode;
+        uint8_t hours;
+        uint8_t minutes;
+        uint8_t seconds;
+        uint8_t frames;
+
+        if (atomic_load(&_timecode_origin_ns) != time_unknown ||
+            time_scale <= 0 ||
+            frame->GetTimecode(bmdTimecodeRP188Any, &timecode) != S_OK) {
+            return;
+        }
+        if (timecode->GetComponents(&hours, &minutes, &seconds,
+                                    &frames) == S_OK) {
+            // Timecode counts whole frames, 30 for 29.97 Hz
+            const int64_t nominal =
+                (_frame_rate.second + _frame_rate.first - 1) /
+                _frame_rate.first;
+            const int64_t minute = hours * 60 + minutes;
+            int64_t frame_count = (minute * 60 + seconds) * nominal +
+                frames;
+
+            // Drop frame skips the first frame numbers of every minute
+            // but every tenth
+            if ((timecode->GetFlags() & bmdTimecodeIsDropFrame) != 0) {
+                frame_count -= nominal / 15 * (minute - minute / 10);
+            }
+            atomic_store(&_timecode_origin_ns, static_cast<int64_t>
+                         (rint(1e+9 * frame_count * _frame_rate.first /
+                               _frame_rate.second -
+                               1e+9 * display_time / time_scale)));
+            update_time_reference();
+        }
+        timecode->Release();
+    }
+    // The time of day of the first recorded sample, in samples, once
+    // both the timecode and the audio start are known
+    void update_time_reference(void)
+    {
+        static const int64_t day_ns = 86400000000000LL;
+        const int64_t origin = atomic_load(&_timecode_origin_ns);
+        const int64_t audio_start = atomic_load(&_audio_start_ns);
+
+        if (origin == time_unknown || audio_start == time_unknown ||
+            _sink == NULL) {
+            return;
+        }
+
+        int64_t ns = (origin + audio_start) % day_ns;
+
+        if (ns < 0) {
+            ns += day_ns;
+        }
+        _sink->set_time_reference(static_cast<uint64_t>
+                                  (rint(ns / 1e+9 *
+                                        _sink->sample_rate())));
+    }
+    void draw_preview(IDeckLinkScreenPreviewCallback *preview,
+                      IDeckLinkVideoFrame *frame)
+    {
+        IDeckLinkVideoFrame *proxy =
+            _preview_scale > 1 ? preview_proxy(frame) : NULL;
+
+        preview->DrawFrame(proxy != NULL ? proxy : frame);
+        if (proxy != NULL) {
+            proxy->Release();
+        }
+    }
+    static void *callback_thread(void *arg)
+    {
+        class callback_arg_t *c =
+            reinterpret_cast<class callback_arg_t *>(arg);
+        bool destroyed = false;
+
+        // The host releasing the last reference to the output from a
+        // callback destroys c on this thread, which must not touch it
+        // after the callback returns
+        c->_destroyed = &destroyed;
+        while (true) {
+            TRACE_SCOPE("callback iteration");
+
+            pthread_mutex_lock(&c->_mutex);
+
+            if (c->_stop) {
+                while (!c->_this->_frame_buffer.empty()) {
+                    c->_this->_frame_buffer.front().second->
+                        Release();
+                    c->_this->_frame_buffer.pop_front();
+                }
+                pthread_mutex_unlock(&c->_mutex);
+                return NULL;
+            }
+
+            if (c->_this->completion_due()) {
+                // Called without the lock, hosts schedule the next
+                // frame from the callback
+                IDeckLinkVideoOutputCallback *completion =
+                    c->_this->_frame_completion;
+                IDeckLinkVideoFrame *frame =
+                    c->_this->_frame_buffer.front().second;
+
+                completion->AddRef();
+                atomic_store(&c->_this->_completed_time,
+                             c->_this->_frame_buffer.front().first);
+                c->_this->_frame_buffer.pop_front();
+                pthread_mutex_unlock(&c->_mutex);
+                {
+                    TRACE_SCOPE("ScheduledFrameCompleted");
+
+                    completion->ScheduledFrameCompleted
+                        (frame, bmdOutputFrameCompleted);
+                }
+                completion->Release();
+                frame->Release();
+                if (destroyed) {
+                    return NULL;
+                }
+                c->_this->_state->keyer_tick();
+                pthread_mutex_lock(&c->_mutex);
+                if (c->_stop) {
+                    pthread_mutex_unlock(&c->_mutex);
+                    continue;
+                }
+            }
+
+            IDeckLinkVideoFrame *preview_frame = c->_this->preview_due();
+
+            if (preview_frame != NULL) {
+                // Draw without the lock, the host may take a while and
+                // scaling a UHD frame is not free either
+                IDeckLinkScreenPreviewCallback *preview =
+                    c->_this->_screen_preview;
+
+                preview->AddRef();
+                pthread_mutex_unlock(&c->_mutex);
+                {
+                    TRACE_SCOPE("DrawFrame");
+
+                    c->_this->draw_preview(preview, preview_frame);
+                }
+                preview->Release();
+                preview_frame->Release();
+                if (destroyed) {
+                    return NULL;
+                }
+                pthread_mutex_lock(&c->_mutex);
+                if (c->_stop) {
+                    pthread_mutex_unlock(&c->_mutex);
+                    continue;
+                }
+            }
+            if (c->_this->offline() && c->_this->completion_due()) {
+                pthread_mutex_unlock(&c->_mutex);
+                continue;
+            }
+
+            struct timespec abstime;
+
+            clock_gettime(CLOCK_REALTIME, &abstime);
+
+            double frame_ns = 1e+9 * c->_this->_frame_rate.first /
+                c->_this->_frame_rate.second;
+
+            while (abstime.tv_nsec + frame_ns >= 1e+9) {
+                abstime.tv_sec++;
+                frame_ns -= 1e+9;
+            }
+            abstime.tv_nsec += frame_ns;
+
+            int wait_status;
+
+            {
+                TRACE_SCOPE("callback wait");
+
+                wait_status = pthread_cond_timedwait(&c->_cond, &c->_mutex,
+                                                     &abstime);
+            }
+            if (wait_status == ETIMEDOUT && !c->_this->offline()) {
+                struct timespec wakeup;
+
+                clock_gettime(CLOCK_REALTIME, &wakeup);
+
+                const int64_t lateness_ns =
+                    (static_cast<int64_t>(wakeup.tv_sec) -
+                     abstime.tv_sec) * 1000000000LL +
+                    (wakeup.tv_nsec - abstime.tv_nsec);
+
+                c->_this->_state->_jitter.record
+                    (lateness_ns > 0 ? lateness_ns : 0);
+            }
+            pthread_mutex_unlock(&c->_mutex);
+        };
+
+        return NULL;
+    }
+    double time_elapsed(struct timespec start,
+                        BMDTimeScale time_scale)
+    {
+        struct timespec current;
+
+        clock_gettime(CLOCK_MONOTONIC, &current);
+
+        const double dsec = static_cast<double>(current.tv_sec) -
+            static_cast<double>(start.tv_sec);
+        const double dnsec = static_cast<double>(current.tv_nsec) -
+            static_cast<double>(start.tv_nsec);
+
+        return (dsec + dnsec / 1e+9) * time_scale;
+    }
+    // Frames are only ever timed and handed back, so any uncompressed
+    // format works
+    static bool pixel_format_supported(BMDPixelFormat pixel_format)
+    {
+        switch (pixel_format) {
+        case bmdFormat8BitYUV:
+        case bmdFormat10BitYUV:
+        case bmdFormat8BitARGB:
+        case bmdFormat8BitBGRA:
+        case bmdFormat10BitRGB:
+        case bmdFormat12BitRGB:
+        case bmdFormat12BitRGBLE:
+        case bmdFormat10BitRGBXLE:
+        case bmdFormat10BitRGBX:
+            return true;
+        default:
+            return false;
+        }
+    }
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkOutput);
+    SoundDeckLinkOutput(IDeckLinkOutput *forward = NULL)
+        : _frame_rate(1000, 25000), _frame_completion(NULL),
+          _screen_preview(NULL), _allocator(NULL),
+          _pool(new frame_pool_t()), _callback_arg(this),
+          _callback_thread_alive(false), _backend(audio_backend_alsa),
+          _sink(NULL), _state(new device_state_t()), _completed_time(0),
+          _timecode_origin_ns(time_unknown), _audio_start_ns(time_unknown),
+          _preview_interval_ns(preview_interval_ns()),
+          _preview_scale(preview_scale()),
+          _preview_drawn(-1, static_cast<IDeckLinkVideoFrame *>(NULL))
+    {
+        _preview_drawn_time.tv_sec = 0;
+        _preview_drawn_time.tv_nsec = 0;
+    }
+    SoundDeckLinkOutput(audio_backend_t backend, std::string sink_name,
+                        device_state_t *state)
+        : _frame_rate(1000, 25000), _frame_completion(NULL),
+          _screen_preview(NULL), _allocator(NULL),
+          _pool(new frame_pool_t()), _callback_arg(this),
+          _callback_thread_alive(false), _backend(backend),
+          _sink_name(sink_name), _sink(NULL), _state(state),
+          _completed_time(0), _timecode_origin_ns(time_unknown),
+          _audio_start_ns(time_unknown),
+          _preview_interval_ns(preview_interval_ns()),
+          _preview_scale(preview_scale()),
+          _preview_drawn(-1, static_cast<IDeckLinkVideoFrame *>(NULL))
+    {
+        _preview_drawn_time.tv_sec = 0;
+        _preview_drawn_time.tv_nsec = 0;
+        _state->add_ref();
+    }
+    ~SoundDeckLinkOutput()
+    {
+        if (_callback_thread_alive &&
+            pthread_equal(pthread_self(), _callback_thread)) {
+            *_callback_arg._destroyed = true;
+            pthread_detach(_callback_thread);
+        }
+        else if (_callback_thread_alive) {
+            pthread_mutex_lock(&_callback_arg._mutex);
+            _callback_arg._stop = true;
+            pthread_cond_signal(&_callback_arg._cond);
+            pthread_mutex_unlock(&_callback_arg._mutex);
+            pthread_join(_callback_thread, NULL);
+        }
+        // Frames scheduled without the callback thread ever running,
+        // or left to a detached one
+        while (!_frame_buffer.empty()) {
+            _frame_buffer.front().second->Release();
+            _frame_buffer.pop_front();
+        }
+        if (_frame_completion != NULL) {
+            _frame_completion->Release();
+        }
+        if (_screen_preview != NULL) {
+            _screen_preview->Release();
+        }
+        if (_allocator != NULL) {
+            _allocator->Decommit();
+            _allocator->Release();
+        }
+        _pool->release();
+        delete _sink;
+        _state->set_output_enabled(device_state_t::output_audio |
+                                   device_state_t::output_video, false);
+        _state->release();
+    }
+    HRESULT DoesSupportVideoMode(BMDDisplayMode displayMode,
+                                 BMDPixelFormat pixelFormat,
+                                 BMDVideoOutputFlags flags,
+                                 BMDDisplayModeSupport *result,
+                                 IDeckLinkDisplayMode **
+                                 resultDisplayMode)
+    {
+        SoundDeckLinkDisplayMode *mode =
+            display_mode_table().find(displayMode);
+
+        if (mode != NULL &&
+            (!pixel_format_supported(pixelFormat) ||
+             ((flags & bmdVideoOutputDualStream3D) != 0 &&
+              (mode->GetFlags() & bmdDisplayModeSupports3D) == 0))) {
+            mode = NULL;
+        }
+        if (result != NULL) {
+            *result = mode != NULL ?
+                bmdDisplayModeSupported : bmdDisplayModeNotSupported;
+        }
+        if (resultDisplayMode != NULL) {
+            *resultDisplayMode = mode;
+        }
+        return S_OK;
+    }
+    HRESULT GetDisplayModeIterator(IDeckLinkDisplayModeIterator **
+                                   iterator)
+    {
+        *iterator = new SoundDeckLinkDisplayModeIterator();
+        return S_OK;
+    }
+    HRESULT SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *
+                                     previewCallback)
+    {
+        if (previewCallback != NULL) {
+            previewCallback->AddRef();
+        }
+        pthread_mutex_lock(&_callback_arg._mutex);
+        std::swap(_screen_preview, previewCallback);
+        // A new callback gets the current frame right away
+        _preview_drawn.second = NULL;
+        _preview_drawn_time.tv_sec = 0;
+        pthread_mutex_unlock(&_callback_arg._mutex);
+        if (previewCallback != NULL) {
+            previewCallback->Release();
+        }
+        return S_OK;
+    }
+    HRESULT EnableVideoOutput(BMDDisplayMode displayMode,
+                              BMDVideoOutputFlags flags)
+    {
+        SoundDeckLinkDisplayMode *mode =
+            display_mode_table().find(displayMode);
+
+        if (mode == NULL ||
+            ((flags & bmdVideoOutputDualStream3D) != 0 &&
+             (mode->GetFlags() & bmdDisplayModeSupports3D) == 0)) {
+            return E_FAIL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &_playback_start);
+        mode->GetFrameRate(&_frame_rate.first, &_frame_rate.second);
+        atomic_store(&_completed_time, BMDTimeValue(0));
+        atomic_store(&_timecode_origin_ns, time_unknown);
+        atomic_store(&_state->_video_output_flags,
+                     static_cast<int64_t>(flags));
+        _state->set_video_output_mode(displayMode);
+        _state->set_output_enabled(device_state_t::output_video, true);
+        return S_OK;
+    }
+    HRESULT DisableVideoOutput(void)
+    {
+        _state->set_video_output_mode(bmdModeUnknown);
+        _state->set_output_enabled(device_state_t::output_video, false);
+        return S_OK;
+    }
+    HRESULT
+    SetVideoOutputFrameMemoryAllocator(IDeckLinkMemoryAllocator *
+                                       theAllocator)
+    {
+        if (theAllocator != NULL) {
+            if (theAllocator->Commit() != S_OK) {
+                return E_FAIL;
+            }
+            theAllocator->AddRef();
+        }
+        pthread_mutex_lock(&_callback_arg._mutex);
+        std::swap(_allocator, theAllocator);
+        pthread_mutex_unlock(&_callback_arg._mutex);
+        // Frames still out keep their own reference to release their
+        // buffers through
+        if (theAllocator != NULL) {
+            theAllocator->Decommit();
+            theAllocator->Release();
+        }
+        return S_OK;
+    }
+    HRESULT
+    CreateVideoFrame(int32_t width, int32_t height, int32_t rowBytes,
+                     BMDPixelFormat pixelFormat, BMDFrameFlags flags,
+                     IDeckLinkMutableVideoFrame **outFrame)
+    {
+        if (outFrame == NULL || width <= 0 || height <= 0 ||
+            !pixel_format_supported(pixelFormat) ||
+            rowBytes < row_bytes_min(pixelFormat, width)) {
+            return E_INVALIDARG;
+        }
+
+        const size_t size = static_cast<size_t>(rowBytes) * height;
+
+        pthread_mutex_lock(&_callback_arg._mutex);
+
+        IDeckLinkMemoryAllocator *allocator = _allocator;
+
+        if (allocator != NULL) {
+            allocator->AddRef();
+        }
+        pthread_mutex_unlock(&_callback_arg._mutex);
+
+        void *buffer = NULL;
+
+        if (allocator != NULL) {
+            if (allocator->AllocateBuffer(size, &buffer) != S_OK) {
+                buffer = NULL;
+            }
+        }
+        else {
+            buffer = _pool->get(size);
+        }
+        if (buffer == NULL) {
+            if (allocator != NULL) {
+                allocator->Release();
+            }
+            return E_OUTOFMEMORY;
+        }
+        *outFrame = new SoundDeckLinkMutableVideoFrame
+            (width, height, rowBytes, pixelFormat, flags, buffer, size,
+             _pool, allocator);
+        if (allocator != NULL) {
+            allocator->Release();
+        }
+        return S_OK;
+    }
+    HRESULT CreateAncillaryData(BMDPixelFormat pixelFormat,
+                                IDeckLinkVideoFrameAncillary **
+                                outBuffer)
+    {
+        return E_FAIL;
+    }
+    HRESULT DisplayVideoFrameSync(IDeckLinkVideoFrame *theFrame)
+    {
+        pthread_mutex_lock(&_callback_arg._mutex);
+
+        BMDTimeValue display_time = 0;
+
+        if (!_frame_buffer.empty()) {
+            display_time = _frame_buffer.front().first;
+            _frame_buffer.front().second->Release();
+            _frame_buffer.pop_front();
+        }
+        record_metadata(theFrame);
+        _state->keyer_tick();
+        theFrame->AddRef();
+        _frame_buffer.push_front
+            (std::pair<BMDTimeValue, IDeckLinkVideoFrame *>
+             (display_time, theFrame));
+        pthread_mutex_unlock(&_callback_arg._mutex);
+
+        return S_OK;
+    }
+    HRESULT ScheduleVideoFrame(IDeckLinkVideoFrame *theFrame,
+                               BMDTimeValue displayTime,
+                               BMDTimeValue displayDuration,
+                               BMDTimeScale timeScale)
+    {
+        atomic_store(&_state->_video_output_pixel_format,
+                     static_cast<int64_t>(theFrame->GetPixelFormat()));
+        record_metadata(theFrame);
+        if (offline()) {
+            record_timecode(theFrame, displayTime, timeScale);
+        }
+        if (_frame_completion != NULL || _screen_preview != NULL) {
+            BMDTimeValue end_time = displayTime + displayDuration;
+
+            if (timeScale > 0 && timeScale != _frame_rate.second) {
+                end_time = end_time * _frame_rate.second / timeScale;
+            }
+            pthread_mutex_lock(&_callback_arg._mutex);
+            // This is needed to prevent segfault from the caller
+            // deallocating the frame while in our frame buffer
+            theFrame->AddRef();
+            _frame_buffer.push_back
+                (std::pair<BMDTimeValue, IDeckLinkVideoFrame *>
+                 (end_time, theFrame));
+            if (offline()) {
+                pthread_cond_signal(&_callback_arg._cond);
+            }
+            pthread_mutex_unlock(&_callback_arg._mutex);
+        }
+        return S_OK;
+    }
+    HRESULT
+    SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback *
+                                        theCallback)
+    {
+        if (theCallback != NULL) {
+            theCallback->AddRef();
+        }
+        pthread_mutex_lock(&_callback_arg._mutex);
+        std::swap(_frame_completion, theCallback);
+        pthread_mutex_unlock(&_callback_arg._mutex);
+        if (theCallback != NULL) {
+            theCallback->Release();
+        }
+        return S_OK;
+    }
+    HRESULT GetBufferedVideoFrameCount(uint32_t *bufferedFrameCount)
+    {
+        pthread_mutex_lock(&_callback_arg._mutex);
+        *bufferedFrameCount = _frame_buffer.size();
+        pthread_mutex_unlock(&_callback_arg._mutex);
+        return S_OK;
+    }
+    HRESULT EnableAudioOutput(BMDAudioSampleRate sampleRate,
+                              BMDAudioSampleType sampleType,
+                              uint32_t channelCount,
+                              BMDAudioOutputStreamType streamType)
+    {
+        unsigned int sample_width_byte;
+
+        switch (sampleType) {
+        case bmdAudioSampleType16bitInteger:
+            sample_width_byte = 2;
+            break;
+        case bmdAudioSampleType32bitInteger:
+            sample_width_byte = 4;
+            break;
+        default:
+            log_message(log_error, "EnableAudioOutput: sample type %u is "
+                        "neither 16 nor 32-bit integer", sampleType);
+            return E_FAIL;
+        }
+
+        delete _sink;
+        _sink = audio_sink_t::create(_backend, _sink_name, _state);
+        if (_sink == NULL) {
+            log_message(log_error, "EnableAudioOutput: %s output not "
+                        "built in", audio_backend_name(_backend));
+            return E_FAIL;
+        }
+
+        unsigned int sample_rate = sampleRate;
+
+        log_message(log_info, "EnableAudioOutput: opening %s %s at %u Hz, "
+                    "%u-bit, %u channels", audio_backend_name(_backend),
+                    _sink_name, sample_rate, sample_width_byte * 8,
+                    channelCount);
+        if (!_sink->open(&sample_rate, sample_width_byte, channelCount)) {
+            log_message(log_error, "EnableAudioOutput: cannot open %s %s",
+                        audio_backend_name(_backend), _sink_name);
+            delete _sink;
+            _sink = NULL;
+            return E_FAIL;
+        }
+        if (sample_rate != sampleRate) {
+            log_message(log_warning, "EnableAudioOutput: %s %s runs at "
+                        "%u Hz instead of %u Hz",
+                        audio_backend_name(_backend), _sink_name,
+                        sample_rate, sampleRate);
+        }
+        _state->set_sample_rate(sample_rate);
+        _state->set_output_enabled(device_state_t::output_audio, true);
+        atomic_store(&_audio_start_ns, time_unknown);
+
+        return S_OK;
+    }
+    HRESULT DisableAudioOutput(void)
+    {
+        if (_sink == NULL) {
+            return E_FAIL;
+        }
+        _sink->drain();
+        delete _sink;
+        _sink = NULL;
+        _state->set_sample_rate(0);
+        _state->set_output_enabled(device_state_t::output_audio, false);
+        return S_OK;
+    }
+    HRESULT WriteAudioSamplesSync(void *buffer,
+                                  uint32_t sampleFrameCount,
+                                  uint32_t *sampleFramesWritten)
+    {
+        *sampleFramesWritten = _sink != NULL ?
+            _sink->write(buffer, sampleFrameCount) : 0;
+        return S_OK;
+    }
+    HRESULT BeginAudioPreroll(void)
+    {
+        return S_OK;
+    }
+    HRESULT EndAudioPreroll(void)
+    {
+        return S_OK;
+    }
+    HRESULT ScheduleAudioSamples(void *buffer,
+                                 uint32_t sampleFrameCount,
+                                 BMDTimeValue streamTime,
+                                 BMDTimeScale timeScale,
+                                 uint32_t *sampleFramesWritten)
+    {
+        if (offline() && timeScale > 0 &&
+            atomic_load(&_audio_start_ns) == time_unknown) {
+            atomic_store(&_audio_start_ns, static_cast<int64_t>
+                         (rint(1e+9 * streamTime / timeScale)));
+            update_time_reference();
+        }
+        *sampleFramesWritten = _sink != NULL ?
+            _sink->write(buffer, sampleFrameCount) : 0;
+        return S_OK;
+    }
+    HRESULT
+    GetBufferedAudioSampleFrameCount(uint32_t *
+                                     bufferedSampleFrameCount)
+    {
+        return E_FAIL;
+    }
+    HRESULT FlushBufferedAudioSamples(void)
+    {
+        return E_FAIL;
+    }
+    HRESULT SetAudioCallback(IDeckLinkAudioOutputCallback *
+                             theCallback)
+    {
+        return S_OK;
+    }
+    HRESULT StartScheduledPlayback(BMDTimeValue playbackStartTime,
+                                   BMDTimeScale timeScale,
+                                   double playbackSpeed)
+    {
+        if (!_callback_thread_alive) {
+            pthread_create(&_callback_thread, NULL,
+                           &SoundDeckLinkOutput::callback_thread,
+                           &_callback_arg);
+            _callback_thread_alive = true;
+        }
+        else if (_sink != NULL) {
+            _sink->start();
+        }
+        return S_OK;
+    }
+    HRESULT StopScheduledPlayback(BMDTimeValue stopPlaybackAtTime,
+                                  BMDTimeValue *actualStopTime,
+                                  BMDTimeScale timeScale)
+    {
+        if (_sink != NULL) {
+            _sink->stop();
+        }
+        return S_OK;
+    }
+    HRESULT IsScheduledPlaybackRunning(bool *active)
+    {
+        *active = true;
+        return S_OK;
+    }
+    HRESULT GetScheduledStreamTime(BMDTimeScale desiredTimeScale,
+                                   BMDTimeValue *streamTime,
+                                   double *playbackSpeed)
+    {
+        if (offline()) {
+            *streamTime = atomic_load(&_completed_time) *
+                desiredTimeScale / _frame_rate.second;
+        }
+        else {
+            *streamTime =
+                rint(time_elapsed(_playback_start, desiredTimeScale));
+        }
+        return S_OK;
+    }
+    HRESULT GetReferenceStatus(BMDReferenceStatus *referenceStatus)
+    {
+        return E_FAIL;
+    }
+    HRESULT GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
+                                      BMDTimeValue *hardwareTime,
+                                      BMDTimeValue *timeInFrame,
+                                      BMDTimeValue *ticksPerFrame)
+    {
+        if (desiredTimeScale <= 0) {
+            return E_INVALIDARG;
+        }
+
+        const int64_t current = monotonic_ns();
+
+        *hardwareTime = ns_to_time(current, desiredTimeScale);
+        *timeInFrame = 0;
+        *ticksPerFrame = 0;
+        if ((atomic_load(&_state->_output_enabled) &
+             device_state_t::output_video) != 0) {
+            const int64_t start =
+                static_cast<int64_t>(_playback_start.tv_sec) *
+                1000000000LL + _playback_start.tv_nsec;
+
+            *ticksPerFrame = _frame_rate.first * desiredTimeScale /
+                _frame_rate.second;
+            if (*ticksPerFrame > 0) {
+                *timeInFrame = ns_to_time(current - start,
+                                          desiredTimeScale) %
+                    *ticksPerFrame;
+            }
+        }
+        return S_OK;
+    }
+    HRESULT
+    GetFrameCompletionReferenceTimestamp(IDeckLinkVideoFrame *
+                                         theFrame,
+                                         BMDTimeScale
+                                         desiredTimeScale,
+                                         BMDTimeValue *
+                                         frameCompletionTimestamp)
+    {
+        return E_FAIL;
+    }
+};
+
+class SoundDeckLinkVideoInputFrame : public IDeckLinkVideoInputFrame {
+protected:
+    long _width;
+    long _height;
+    long _row_bytes;
+    BMDPixelFormat _pixel_format;
+    BMDFrameFlags _flags;
+    void *_buffer;
+    size_t _size;
+    frame_pool_t *_pool;
+    IDeckLinkMemoryAllocator *_allocator;
+    // Stream time is the frame index in display mode units, hardware
+    // time when the frame started on the reference clock
+    BMDTimeValue _frame_index;
+    BMDTimeValue _frame_duration;
+    BMDTimeScale _time_scale;
+    int64_t _hardware_ns;
+public:
+    IUNKNOWN_REFERENCE(SoundDeckLinkVideoInputFrame);
+    HRESULT QueryInterface(REFIID id, void **outputInterface)
+    {
+        static const size_t size_iid = 16;
+        static const REFIID iid_unknown = IID_IUnknown;
+
+        if (memcmp(&id, &iid_unknown, size_iid) == 0 ||
+            memcmp(&id, &IID_IDeckLinkVideoFrame, size_iid) == 0 ||
+            memcmp(&id, &IID_IDeckLinkVideoInputFrame, size_iid) == 0) {
+            AddRef();
+            *outputInterface = static_cast<IDeckLinkVideoInputFrame *>
+                (this);
+            return S_OK;
+        }
+        return E_NOINTERFACE;
+    }
+    SoundDeckLinkVideoInputFrame(long width, long height,
+                                 long row_bytes,
+                                 BMDPixelFormat pixel_format,
+                                 BMDFrameFlags flags,
+                                 void *buffer, size_t size,
+                                 frame_pool_t *pool,
+                                 IDeckLinkMemoryAllocator *allocator,
+                                 BMDTimeValue frame_index,
+                                 BMDTimeValue frame_duration,
+                                 BMDTimeScale time_scale,
+                                 int64_t hardware_ns)
+        : _width(width), _height(height), _row_bytes(row_bytes),
+          _pixel_format(pixel_format), _flags(flags), _buffer(buffer),
+          _size(size), _pool(pool), _allocator(allocator),
+          _frame_index(frame_index), _frame_duration(frame_duration),
+          _time_scale(time_scale), _hardware_ns(hardware_ns)
+    {
+        if (_allocator != NULL) {
+            _allocator->AddRef();
+        }
+        else {
+            _pool->add_ref();
+        }
+    }
+    virtual ~SoundDeckLinkVideoInputFrame()
+    {
+        if (_allocator != NULL) {
+            _allocator->ReleaseBuffer(_buffer);
+            _allocator->Release();
+        }
+        else {
+            _pool->put(_buffer, _size);
+            _pool->release();
+        }
+    }
+    long GetWidth(void)
+    {
+        return _width;
+    }
+    long GetHeight(void)
+    {
+        return _height;
+    }
+    long GetRowBytes(void)
+    {
+        return _row_bytes;
+    }
+    BMDPixelFormat GetPixelFormat(void)
+    {
+        return _pixel_format;
+    }
+    BMDFrameFlags GetFlags(void)
+    {
+        return _flags;
+    }
+    HRESULT GetBytes(void **buffer)
+    {
+        *buffer = _buffer;
+        return S_OK;
+    }
+    HRESULT GetTimecode(BMDTimecodeFormat format,
+                        IDeckLinkTimecode **timecode)
+    {
+        if (timecode == NULL) {
+            return E_INVALIDARG;
+        }
+        *timecode = NULL;
+        return S_FALSE;
+    }
+    HRESULT GetAncillaryData(IDeckLinkVideoFrameAncillary **ancillary)
+    {
+        if (ancillary == NULL) {
+            return E_INVALIDARG;
+        }
+        *ancillary = NULL;
+        return S_FALSE;
+    }
+    HRESULT GetStreamTime(BMDTimeValue *frameTime,
+                          BMDTimeValue *frameDuration,
+                          BMDTimeScale timeScale)
+    {
+        if (timeScale <= 0) {
+            return E_INVALIDARG;
+        }
+        *frameTime = _frame_index * _frame_duration * timeScale /
+            _time_scale;
+        *frameDuration = _frame_duration * timeScale / _time_scale;
+        return S_OK;
+    }
+    HRESULT GetHardwareReferenceTimestamp(BMDTimeScale timeScale,
+                                          BMDTimeValue *frameTime,
+                                          BMDTimeValue *frameDuration)
+    {
+        if (timeScale <= 0) {
+            return E_INVALIDARG;
+        }
+        *frameTime = ns_to_time(_hardware_ns, timeScale);
+        *frameDuration = _frame_duration * timeScale / _time_scale;
+        return S_OK;
+    }
+};
+
+class SoundDeckLinkAudioInputPacket : public IDeckLinkAudioInputPacket {
+protected:
+    void *_buffer;
+    long _frame_count;
+    size_t _size;
+    frame_pool_t *_pool;
+    // The first sample frame is _position samples after the stream
+    // time _offset_ns
+    int64_t _offset_ns;
+    uint64_t _position;
+    unsigned int _sample_rate;
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkAudioInputPacket);
+    SoundDeckLinkAudioInputPacket(void *buffer, long frame_count,
+                                  size_t size, frame_pool_t *pool,
+                                  int64_t offset_ns, uint64_t position,
+                                  unsigned int sample_rate)
+        : _buffer(buffer), _frame_count(frame_count), _size(size),
+          _pool(pool), _offset_ns(offset_ns), _position(position),
+          _sample_rate(sample_rate)
+    {
+        _pool->add_ref();
+    }
+    ~SoundDeckLinkAudioInputPacket()
+    {
+        _pool->put(_buffer, _size);
+        _pool->release();
+    }
+    long GetSampleFrameCount(void)
+    {
+        return _frame_count;
+    }
+    HRESULT GetBytes(void **buffer)
+    {
+        *buffer = _buffer;
+        return S_OK;
+    }
+    HRESULT GetPacketTime(BMDTimeValue *packetTime,
+                          BMDTimeScale timeScale)
+    {
+        if (timeScale <= 0) {
+            return E_INVALIDARG;
+        }
+        // Sample accurate when timeScale is the sample rate
+        *packetTime = ns_to_time(_offset_ns, timeScale) +
+            static_cast<BMDTimeValue>(_position) * timeScale /
+            _sample_rate;
+        return S_OK;
+    }
+};
+
+// Audio comes from the ALSA capture PCM of the device, video from the
+// V4L2 device named by SOUNDDECK_V4L2_DEVICE or else a black
+// generator, which stands in for a signal so that hosts recording
+// audio only keep getting callbacks. A capture thread moves audio into
+// a preallocated ring, the input thread ticks at the frame rate and
+// hands each frame to the host with the audio captured meanwhile.
+class SoundDeckLinkInput : public IDeckLinkInput {
+protected:
+    // Without video, audio packets are delivered at this rate
+    static const int64_t audio_only_period_ns = 20000000;
+    // Audio buffered between the capture and the input thread
+    static const size_t ring_second = 2;
+    std::string _capture_name;
+    device_state_t *_state;
+    frame_pool_t *_pool;
+    // Protects the callbacks, the allocator, the ring's consumer side
+    // and the flags below
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    IDeckLinkInputCallback *_callback;
+    IDeckLinkScreenPreviewCallback *_screen_preview;
+    IDeckLinkMemoryAllocator *_allocator;
+    bool _stop;
+    bool _paused;
+    bool _running;
+    pthread_t _input_thread;
+    pthread_t _capture_thread;
+    int64_t _stream_start_ns;
+    // Video
+    bool _video_enabled;
+    long _width;
+    long _height;
+    BMDPixelFormat _pixel_format;
+    BMDTimeValue _frame_duration;
+    BMDTimeScale _time_scale;
+    BMDDisplayModeFlags _colorspace;
+    v4l2_source_t _v4l2;
+    // Latest picture in 2vuy, black until the V4L2 device delivers
+    std::vector<uint8_t> _picture;
+    // Audio
+    snd_pcm_t *_alsa_pcm;
+    unsigned int _sample_rate;
+    size_t _channel_count;
+    size_t _channel_count_physical;
+    size_t _sample_width_byte;
+    snd_pcm_uframes_t _period_size;
+    std::vector<char> _capture_buffer;
+    std::vector<char> _expand_buffer;
+    audio_ring_t _ring;
+    // Reference clock time of ring position 0, updated by the capture
+    // thread whenever samples were lost
+    int64_t _audio_anchor_ns;
+    image_t picture(void)
+    {
+        image_t picture = {
+            bmdFormat8BitYUV, _width, _height,
+            row_bytes_min(bmdFormat8BitYUV, _width), &_picture[0]
+        };
+
+        return picture;
+    }
+    static void *capture_thread(void *arg)
+    {
+        reinterpret_cast<SoundDeckLinkInput *>(arg)->capture();
+        return NULL;
+    }
+    void capture(void)
+    {
+        const size_t frame_byte_physical =
+            _channel_count_physical * _sample_width_byte;
+        bool anchor = true;
+
+        pthread_mutex_lock(&_mutex);
+        while (!_stop) {
+            pthread_mutex_unlock(&_mutex);
+
+            snd_pcm_sframes_t count = 0;
+
+            if (snd_pcm_wait(_alsa_pcm, 100) > 0) {
+                count = snd_pcm_readi(_alsa_pcm, &_capture_buffer[0],
+                                      _period_size);
+            }
+
+            const int64_t current = monotonic_ns();
+
+            if (count == -EPIPE || count == -ESTRPIPE) {
+                log_message(log_warning, "ALSA %s: overrun",
+                            _capture_name);
+                snd_pcm_recover(_alsa_pcm, count, 1);
+                snd_pcm_start(_alsa_pcm);
+                _state->add_overrun();
+                anchor = true;
+            }
+            else if (count < 0) {
+                log_message(log_warning, "ALSA %s: read failed, "
+                            "recovering: %s", _capture_name,
+                            snd_strerror(static_cast<int>(count)));
+                snd_pcm_recover(_alsa_pcm, count, 1);
+            }
+            else if (count > 0) {
+                const char *buffer = &_capture_buffer[0];
+
+                if (_channel_count_physical != _channel_count) {
+                    // Channels beyond what the device has are silent
+                    audio_expand_channels(&_expand_buffer[0],
+                                          _ring.frame_byte(), buffer,
+                                          frame_byte_physical, count);
+                    buffer = &_expand_buffer[0];
+                }
+                if (anchor) {
+                    // The last frame read was captured delay frames
+                    // ago, which are still waiting in the buffer
+                    snd_pcm_sframes_t delay = 0;
+
+                    snd_pcm_delay(_alsa_pcm, &delay);
+
+                    const uint64_t position = _ring.write_position();
+
+                    atomic_store(&_audio_anchor_ns, current -
+                                 static_cast<int64_t>
+                                 ((position + count + delay) *
+                                  1000000000LL / _sample_rate));
+                    anchor = false;
+                }
+                if (_ring.write(buffer, count) <
+                    static_cast<size_t>(count)) {
+                    log_message(log_warning, "%s: input ring full, the "
+                                "host is not reading", _capture_name);
+                    _state->add_overrun();
+                    anchor = true;
+                }
+            }
+            pthread_mutex_lock(&_mutex);
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+    static void *input_thread(void *arg)
+    {
+        reinterpret_cast<SoundDeckLinkInput *>(arg)->input();
+        return NULL;
+    }
+    void input(void)
+    {
+        int64_t period_ns = audio_only_period_ns;
+
+        if (_video_enabled) {
+            period_ns = _frame_duration * 1000000000LL / _time_scale;
+        }
+
+        pthread_mutex_lock(&_mutex);
+        for (int64_t index = 0; !_stop; index++) {
+            const int64_t deadline_ns =
+                _stream_start_ns + (index + 1) * period_ns;
+            struct timespec deadline;
+
+            deadline.tv_sec = deadline_ns / 1000000000LL;
+            deadline.tv_nsec = deadline_ns % 1000000000LL;
+            while (!_stop &&
+                   pthread_cond_timedwait(&_cond, &_mutex,
+                                          &deadline) != ETIMEDOUT) {
+            }
+            if (_stop) {
+                break;
+            }
+
+            // Late by more than a frame, e.g. after a suspend, skip
+            // ahead rather than delivering a burst
+            const int64_t late_ns = monotonic_ns() - deadline_ns;
+
+            if (late_ns > period_ns) {
+                index += late_ns / period_ns;
+            }
+
+            const int64_t frame_ns = _stream_start_ns + index * period_ns;
+
+            IDeckLinkAudioInputPacket *packet = read_audio();
+            IDeckLinkInputCallback *callback = _callback;
+            IDeckLinkScreenPreviewCallback *preview = _screen_preview;
+            IDeckLinkMemoryAllocator *allocator = _allocator;
+
+            if (_paused) {
+                if (packet != NULL) {
+                    packet->Release();
+                }
+                continue;
+            }
+            if (callback != NULL) {
+                callback->AddRef();
+            }
+            if (preview != NULL) {
+                preview->AddRef();
+            }
+            if (allocator != NULL) {
+                allocator->AddRef();
+            }
+            pthread_mutex_unlock(&_mutex);
+
+            IDeckLinkVideoInputFrame *frame = _video_enabled ?
+                read_video(allocator, index, frame_ns) : NULL;
+
+            if (preview != NULL && frame != NULL) {
+                preview->DrawFrame(frame);
+            }
+            if (callback != NULL && (frame != NULL || packet != NULL)) {
+                callback->VideoInputFrameArrived(frame, packet);
+            }
+            if (frame != NULL) {
+                frame->Release();
+            }
+            if (packet != NULL) {
+                packet->Release();
+            }
+            if (allocator != NULL) {
+                allocator->Release();
+            }
+            if (preview != NULL) {
+                preview->Release();
+            }
+            if (callback != NULL) {
+                callback->Release();
+            }
+            pthread_mutex_lock(&_mutex);
+        }
+        pthread_mutex_unlock(&_mutex);
     }
-    HRESULT DisableVideoOutput(void)
+    // Called with the mutex held, everything captured so far
+    IDeckLinkAudioInputPacket *read_audio(void)
     {
-        return S_OK;
+        const size_t count =
+            _alsa_pcm != NULL && _sample_rate != 0 ? _ring.readable() : 0;
+
+        if (count == 0) {
+            return NULL;
+        }
+
+        const size_t size = count * _ring.frame_byte();
+        void *buffer = _pool->get(size);
+
+        if (buffer == NULL) {
+            return NULL;
+        }
+
+        const uint64_t position = _ring.read_position();
+
+        _ring.read(buffer, count);
+
+        return new SoundDeckLinkAudioInputPacket
+            (buffer, count, size, _pool,
+             atomic_load(&_audio_anchor_ns) - _stream_start_ns,
+             position, _sample_rate);
     }
-    HRESULT
-    SetVideoOutputFrameMemoryAllocator(IDeckLinkMemoryAllocator *
-                                       theAllocator)
+    IDeckLinkVideoInputFrame *read_video(IDeckLinkMemoryAllocator *
+                                         allocator, int64_t index,
+                                         int64_t frame_ns)
     {
-        _allocator = theAllocator;
-        return S_OK;
+        const image_t source = picture();
+        image_t destination = {
+            _pixel_format, _width, _height,
+            row_bytes_min(_pixel_format, _width), NULL
+        };
+        const size_t size =
+            static_cast<size_t>(destination._row_bytes) * _height;
+
+        _v4l2.read(source);
+        if (allocator != NULL) {
+            if (allocator->AllocateBuffer(size, &destination._data) !=
+                S_OK) {
+                destination._data = NULL;
+            }
+        }
+        else {
+            destination._data = _pool->get(size);
+        }
+        if (destination._data == NULL) {
+            return NULL;
+        }
+
+        SoundDeckLinkVideoInputFrame *frame =
+            new SoundDeckLinkVideoInputFrame
+            (_width, _height, destination._row_bytes, _pixel_format,
+             bmdFrameFlagDefault, destination._data, size, _pool,
+             allocator, index, _frame_duration, _time_scale, frame_ns);
+
+        if (_pixel_format == bmdFormat8BitYUV) {
+            memcpy(destination._data, source._data, size);
+        }
+        else {
+            convert_image(source, destination, _colorspace);
+        }
+
+        return frame;
     }
-    HRESULT
-    CreateVideoFrame(int32_t width, int32_t height, int32_t rowBytes,
-                     BMDPixelFormat pixelFormat, BMDFrameFlags flags,
-                     IDeckLinkMutableVideoFrame **outFrame)
+    void stop_streams(void)
     {
-        return E_FAIL;
+        if (!_running) {
+            return;
+        }
+        pthread_mutex_lock(&_mutex);
+        _stop = true;
+        pthread_cond_broadcast(&_cond);
+        pthread_mutex_unlock(&_mutex);
+        pthread_join(_input_thread, NULL);
+        if (_alsa_pcm != NULL) {
+            pthread_join(_capture_thread, NULL);
+            snd_pcm_drop(_alsa_pcm);
+        }
+        _running = false;
     }
-    HRESULT CreateAncillaryData(BMDPixelFormat pixelFormat,
-                                IDeckLinkVideoFrameAncillary **
-                                outBuffer)
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkInput);
+    SoundDeckLinkInput(std::string capture_name, device_state_t *state)
+        : _capture_name(capture_name), _state(state),
+          _pool(new frame_pool_t()), _callback(NULL),
+          _screen_preview(NULL), _allocator(NULL), _stop(false),
+          _paused(false), _running(false), _stream_start_ns(0),
+          _video_enabled(false), _width(0), _height(0),
+          _pixel_format(bmdFormat8BitYUV), _frame_duration(0),
+          _time_scale(0), _colorspace(bmdDisplayModeColorspaceRec709),
+          _alsa_pcm(NULL), _sample_rate(0), _channel_count(0),
+          _channel_count_physical(0), _sample_width_byte(0),
+          _period_size(0), _audio_anchor_ns(0)
+    {
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&_mutex, NULL);
+        _state->add_ref();
+    }
+    ~SoundDeckLinkInput()
+    {
+        stop_streams();
+        DisableVideoInput();
+        DisableAudioInput();
+        if (_callback != NULL) {
+            _callback->Release();
+        }
+        if (_screen_preview != NULL) {
+            _screen_preview->Release();
+        }
+        if (_allocator != NULL) {
+            _allocator->Decommit();
+            _allocator->Release();
+        }
+        _pool->release();
+        pthread_cond_destroy(&_cond);
+        pthread_mutex_destroy(&_mutex);
+        _state->release();
+    }
+    // Anything the black frame can be converted to
+    static bool pixel_format_supported(BMDPixelFormat pixel_format)
     {
-        return E_FAIL;
+        return convert_supported(bmdFormat8BitYUV, pixel_format);
     }
-    HRESULT DisplayVideoFrameSync(IDeckLinkVideoFrame *theFrame)
+    HRESULT DoesSupportVideoMode(BMDDisplayMode displayMode,
+                                 BMDPixelFormat pixelFormat,
+                                 BMDVideoInputFlags flags,
+                                 BMDDisplayModeSupport *result,
+                                 IDeckLinkDisplayMode **
+                                 resultDisplayMode)
     {
-        pthread_mutex_lock(&_callback_arg._mutex);
-
-        BMDTimeValue display_time = 0;
+        SoundDeckLinkDisplayMode *mode =
+            display_mode_table().find(displayMode);
 
-        if (!_frame_buffer.empty()) {
-            display_time = _frame_buffer.front().first;
-            _frame_buffer.front().second->Release();
-            _frame_buffer.pop_front();
+        if (mode != NULL &&
+            (!pixel_format_supported(pixelFormat) ||
+             (flags & bmdVideoInputDualStream3D) != 0)) {
+            mode = NULL;
         }
-        theFrame->AddRef();
-        _frame_buffer.push_front
-            (std::pair<BMDTimeValue, IDeckLinkVideoFrame *>
-             (display_time, theFrame));
-        pthread_mutex_unlock(&_callback_arg._mutex);
-
-        return S_OK;
-    }
-    HRESULT ScheduleVideoFrame(IDeckLinkVideoFrame *theFrame,
-                               BMDTimeValue displayTime,
-                               BMDTimeValue displayDuration,
-                               BMDTimeScale timeScale)
-    {
-        if (_frame_completion != NULL || _screen_preview != NULL) {
-            pthread_mutex_lock(&_callback_arg._mutex);
-            // This is needed to prevent segfault from the caller
-            // deallocating the frame while in our frame buffer
-            theFrame->AddRef();
-            _frame_buffer.push_back
-                (std::pair<BMDTimeValue, IDeckLinkVideoFrame *>
-                 (displayTime + displayDuration, theFrame));
-            pthread_mutex_unlock(&_callback_arg._mutex);
+        if (result != NULL) {
+            *result = mode != NULL ?
+                bmdDisplayModeSupported : bmdDisplayModeNotSupported;
+        }
+        if (resultDisplayMode != NULL) {
+            *resultDisplayMode = mode;
         }
         return S_OK;
     }
-    HRESULT
-    SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback *
-                                        theCallback)
+    HRESULT GetDisplayModeIterator(IDeckLinkDisplayModeIterator **
+                                   iterator)
     {
-        _frame_completion = theCallback;
+        *iterator = new SoundDeckLinkDisplayModeIterator();
         return S_OK;
     }
-    HRESULT GetBufferedVideoFrameCount(uint32_t *bufferedFrameCount)
+    HRESULT SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *
+                                     previewCallback)
     {
-        pthread_mutex_lock(&_callback_arg._mutex);
-        *bufferedFrameCount = _frame_buffer.size();
-        pthread_mutex_unlock(&_callback_arg._mutex);
+        if (previewCallback != NULL) {
+            previewCallback->AddRef();
+        }
+        pthread_mutex_lock(&_mutex);
+        std::swap(_screen_preview, previewCallback);
+        pthread_mutex_unlock(&_mutex);
+        if (previewCallback != NULL) {
+            previewCallback->Release();
+        }
         return S_OK;
     }
-    HRESULT EnableAudioOutput(BMDAudioSampleRate sampleRate,
-                              BMDAudioSampleType sampleType,
-                              uint32_t channelCount,
-                              BMDAudioOutputStreamType streamType)
+    HRESULT EnableVideoInput(BMDDisplayMode displayMode,
+                             BMDPixelFormat pixelFormat,
+                             BMDVideoInputFlags flags)
     {
-        _channel_count = channelCount;
+        SoundDeckLinkDisplayMode *mode =
+            display_mode_table().find(displayMode);
 
-        int alsa_status =
-            snd_pcm_open(&_alsa_pcm, _alsa_device.c_str(),
-                         SND_PCM_STREAM_PLAYBACK, 0);
-
-        if (_alsa_pcm == NULL) {
+        if (_running || mode == NULL ||
+            !pixel_format_supported(pixelFormat) ||
+            (flags & bmdVideoInputDualStream3D) != 0) {
             return E_FAIL;
         }
+        _width = mode->GetWidth();
+        _height = mode->GetHeight();
+        _pixel_format = pixelFormat;
+        mode->GetFrameRate(&_frame_duration, &_time_scale);
+        _colorspace = mode->GetFlags() &
+            (bmdDisplayModeColorspaceRec601 |
+             bmdDisplayModeColorspaceRec709);
+
+        // 2vuy black, Cb Y Cr Y
+        _picture.resize(row_bytes_min(bmdFormat8BitYUV, _width) *
+                        _height);
+        for (size_t i = 0; i < _picture.size(); i += 2) {
+            _picture[i] = 0x80;
+            _picture[i + 1] = 0x10;
+        }
 
-        snd_pcm_hw_params_alloca(&_alsa_hw_params);
-        alsa_status = snd_pcm_hw_params_any(_alsa_pcm,
-                                            _alsa_hw_params);
+        const char *v4l2_device = getenv("SOUNDDECK_V4L2_DEVICE");
 
-        if (alsa_status != 0) {
+        _v4l2.close();
+        if (v4l2_device != NULL) {
+            _v4l2.open(v4l2_device, _width, _height);
+        }
+        _video_enabled = true;
+        atomic_store(&_state->_video_input_flags,
+                     static_cast<int64_t>(flags));
+        atomic_store(&_state->_video_input_pixel_format,
+                     static_cast<int64_t>(pixelFormat));
+        atomic_store(&_state->_video_input_locked,
+                     static_cast<int64_t>(_v4l2.is_open()));
+        _state->set_video_input_mode(displayMode);
+        _state->set_input_enabled(device_state_t::input_video, true);
+        return S_OK;
+    }
+    HRESULT DisableVideoInput(void)
+    {
+        if (_running) {
             return E_FAIL;
         }
-
-        alsa_status = snd_pcm_hw_params_set_access
-            (_alsa_pcm, _alsa_hw_params,
-             SND_PCM_ACCESS_RW_INTERLEAVED);
-
-        if (alsa_status != 0) {
+        _v4l2.close();
+        _video_enabled = false;
+        atomic_store(&_state->_video_input_locked, int64_t(0));
+        _state->set_video_input_mode(bmdModeUnknown);
+        _state->set_input_enabled(device_state_t::input_video, false);
+        return S_OK;
+    }
+    HRESULT GetAvailableVideoFrameCount(uint32_t *availableFrameCount)
+    {
+        // Frames are pushed as they arrive, never queued
+        *availableFrameCount = 0;
+        return S_OK;
+    }
+    HRESULT
+    SetVideoInputFrameMemoryAllocator(IDeckLinkMemoryAllocator *
+                                      theAllocator)
+    {
+        if (theAllocator != NULL) {
+            if (theAllocator->Commit() != S_OK) {
+                return E_FAIL;
+            }
+            theAllocator->AddRef();
+        }
+        pthread_mutex_lock(&_mutex);
+        std::swap(_allocator, theAllocator);
+        pthread_mutex_unlock(&_mutex);
+        if (theAllocator != NULL) {
+            theAllocator->Decommit();
+            theAllocator->Release();
+        }
+        return S_OK;
+    }
+    HRESULT EnableAudioInput(BMDAudioSampleRate sampleRate,
+                             BMDAudioSampleType sampleType,
+                             uint32_t channelCount)
+    {
+        if (_running || _alsa_pcm != NULL || _capture_name.empty() ||
+            channelCount == 0) {
+            log_message(log_error, "EnableAudioInput: %s",
+                        _capture_name.empty() ? "no capture device" :
+                        channelCount == 0 ? "no channels requested" :
+                        "already enabled");
             return E_FAIL;
         }
 
-        alsa_status =
-            snd_pcm_hw_params_set_rate_near(_alsa_pcm,
-                                            _alsa_hw_params,
-                                            &sampleRate, NULL);
+        int alsa_status = snd_pcm_open(&_alsa_pcm, _capture_name.c_str(),
+                                       SND_PCM_STREAM_CAPTURE, 0);
 
         if (alsa_status != 0) {
+            log_message(log_error, "EnableAudioInput: cannot open ALSA "
+                        "%s: %s", _capture_name,
+                        snd_strerror(alsa_status));
+            _alsa_pcm = NULL;
             return E_FAIL;
         }
 
+        snd_pcm_hw_params_t *hw_params;
+        snd_pcm_format_t format;
+        unsigned int rate = sampleRate;
+        // What failed, for the log
+        const char *step = "read the hardware parameters";
+
         switch (sampleType) {
         case bmdAudioSampleType16bitInteger:
-            alsa_status = snd_pcm_hw_params_set_format
-                (_alsa_pcm, _alsa_hw_params, SND_PCM_FORMAT_S16_LE);
+            format = SND_PCM_FORMAT_S16_LE;
             _sample_width_byte = 2;
             break;
         case bmdAudioSampleType32bitInteger:
-            alsa_status = snd_pcm_hw_params_set_format
-                (_alsa_pcm, _alsa_hw_params, SND_PCM_FORMAT_S32_LE);
+            format = SND_PCM_FORMAT_S32_LE;
             _sample_width_byte = 4;
             break;
         default:
+            log_message(log_error, "EnableAudioInput: sample type %u is "
+                        "neither 16 nor 32-bit integer", sampleType);
+            snd_pcm_close(_alsa_pcm);
+            _alsa_pcm = NULL;
             return E_FAIL;
         }
 
-        if (alsa_status != 0) {
-            return E_FAIL;
+        snd_pcm_hw_params_alloca(&hw_params);
+        alsa_status = snd_pcm_hw_params_any(_alsa_pcm, hw_params);
+        if (alsa_status == 0) {
+            step = "set interleaved access";
+            alsa_status = snd_pcm_hw_params_set_access
+                (_alsa_pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
         }
-
-        for (unsigned int c = channelCount; c > 0; c--) {
-            alsa_status =
-                snd_pcm_hw_params_set_channels(_alsa_pcm,
-                                               _alsa_hw_params,
-                                               c);
-            if (alsa_status == 0) {
+        if (alsa_status == 0) {
+            step = "set the requested sample rate";
+            alsa_status = snd_pcm_hw_params_set_rate
+                (_alsa_pcm, hw_params, rate, 0);
+        }
+        if (alsa_status == 0) {
+            step = _sample_width_byte == 2 ?
+                "set format S16_LE" : "set format S32_LE";
+            alsa_status = snd_pcm_hw_params_set_format
+                (_alsa_pcm, hw_params, format);
+        }
+        _channel_count_physical = 0;
+        for (unsigned int c = channelCount;
+             alsa_status == 0 && c > 0; c--) {
+            if (snd_pcm_hw_params_set_channels(_alsa_pcm, hw_params,
+                                               c) == 0) {
                 _channel_count_physical = c;
                 break;
             }
         }
-        alsa_status = snd_pcm_hw_params(_alsa_pcm, _alsa_hw_params);
-
+        if (alsa_status == 0 && _channel_count_physical == 0) {
+            step = "set any channel count up to the requested one";
+            alsa_status = -EINVAL;
+        }
+        if (alsa_status == 0) {
+            step = "set the configured buffer and period size";
+            alsa_status = alsa_set_buffer_size(_alsa_pcm, hw_params,
+                                               _state);
+        }
+        if (alsa_status == 0) {
+            step = "apply the hardware parameters";
+            alsa_status = snd_pcm_hw_params(_alsa_pcm, hw_params);
+        }
+        if (alsa_status == 0) {
+            step = "read the period size";
+            alsa_status = snd_pcm_hw_params_get_period_size
+                (hw_params, &_period_size, NULL);
+        }
         if (alsa_status != 0) {
+            log_message(log_error, "EnableAudioInput: ALSA %s: cannot %s: "
+                        "%s", _capture_name, step,
+                        snd_strerror(alsa_status));
+            snd_pcm_close(_alsa_pcm);
+            _alsa_pcm = NULL;
             return E_FAIL;
         }
+        if (_channel_count_physical < channelCount) {
+            log_message(log_warning, "EnableAudioInput: ALSA %s has %u of "
+                        "%u channels, the others are silent",
+                        _capture_name, _channel_count_physical,
+                        channelCount);
+        }
+        log_message(log_info, "EnableAudioInput: ALSA %s at %u Hz, "
+                    "%u-bit, %u channels, period of %lu frames",
+                    _capture_name, rate, _sample_width_byte * 8,
+                    channelCount, _period_size);
 
+        // Everything the capture thread touches is allocated here
+        _sample_rate = rate;
+        _channel_count = channelCount;
+        _capture_buffer.resize(_period_size * _channel_count_physical *
+                               _sample_width_byte);
+        _expand_buffer.resize(_period_size * _channel_count *
+                              _sample_width_byte);
+        _ring.allocate(_channel_count * _sample_width_byte,
+                       ring_second * _sample_rate);
+        _state->set_input_enabled(device_state_t::input_audio, true);
         return S_OK;
     }
-    HRESULT DisableAudioOutput(void)
+    HRESULT DisableAudioInput(void)
     {
-        if (_alsa_pcm == NULL) {
+        if (_running || _alsa_pcm == NULL) {
             return E_FAIL;
         }
-        snd_pcm_drain(_alsa_pcm);
         snd_pcm_close(_alsa_pcm);
+        _alsa_pcm = NULL;
+        _sample_rate = 0;
+        _state->set_input_enabled(device_state_t::input_audio, false);
         return S_OK;
     }
-    HRESULT WriteAudioSamplesSync(void *buffer,
-                                  uint32_t sampleFrameCount,
-                                  uint32_t *sampleFramesWritten)
+    HRESULT GetAvailableAudioSampleFrameCount(uint32_t *
+                                              availableSampleFrameCount)
     {
-        *sampleFramesWritten = alsa_write(buffer, sampleFrameCount);
+        pthread_mutex_lock(&_mutex);
+        *availableSampleFrameCount =
+            _alsa_pcm != NULL ? _ring.readable() : 0;
+        pthread_mutex_unlock(&_mutex);
         return S_OK;
     }
-    HRESULT BeginAudioPreroll(void)
+    HRESULT StartStreams(void)
     {
+        if (_running || (!_video_enabled && _alsa_pcm == NULL)) {
+            return E_FAIL;
+        }
+        _stop = false;
+        _paused = false;
+        _stream_start_ns = monotonic_ns();
+        if (_alsa_pcm != NULL) {
+            _ring.reset();
+            atomic_store(&_audio_anchor_ns, _stream_start_ns);
+            snd_pcm_prepare(_alsa_pcm);
+            snd_pcm_start(_alsa_pcm);
+            pthread_create(&_capture_thread, NULL,
+                           &SoundDeckLinkInput::capture_thread, this);
+        }
+        pthread_create(&_input_thread, NULL,
+                       &SoundDeckLinkInput::input_thread, this);
+        _running = true;
         return S_OK;
     }
-    HRESULT EndAudioPreroll(void)
+    HRESULT StopStreams(void)
     {
+        if (!_running) {
+            return E_FAIL;
+        }
+        stop_streams();
         return S_OK;
     }
-    HRESULT ScheduleAudioSamples(void *buffer,
-                                 uint32_t sampleFrameCount,
-                                 BMDTimeValue streamTime,
-                                 BMDTimeScale timeScale,
-                                 uint32_t *sampleFramesWritten)
+    HRESULT PauseStreams(void)
     {
-        *sampleFramesWritten = alsa_write(buffer, sampleFrameCount);
+        if (!_running) {
+            return E_FAIL;
+        }
+        // Calling it again resumes, audio captured meanwhile is
+        // dropped
+        pthread_mutex_lock(&_mutex);
+        _paused = !_paused;
+        pthread_mutex_unlock(&_mutex);
         return S_OK;
     }
-    HRESULT
-    GetBufferedAudioSampleFrameCount(uint32_t *
-                                     bufferedSampleFrameCount)
+    HRESULT FlushStreams(void)
     {
-        return E_FAIL;
+        pthread_mutex_lock(&_mutex);
+        if (_alsa_pcm != NULL) {
+            _ring.skip(_ring.readable());
+        }
+        pthread_mutex_unlock(&_mutex);
+        return S_OK;
     }
-    HRESULT FlushBufferedAudioSamples(void)
+    HRESULT SetCallback(IDeckLinkInputCallback *theCallback)
     {
-        return E_FAIL;
+        if (theCallback != NULL) {
+            theCallback->AddRef();
+        }
+        pthread_mutex_lock(&_mutex);
+        std::swap(_callback, theCallback);
+        pthread_mutex_unlock(&_mutex);
+        if (theCallback != NULL) {
+            theCallback->Release();
+        }
+        return S_OK;
     }
-    HRESULT SetAudioCallback(IDeckLinkAudioOutputCallback *
-                             theCallback)
+    HRESULT GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
+                                      BMDTimeValue *hardwareTime,
+                                      BMDTimeValue *timeInFrame,
+                                      BMDTimeValue *ticksPerFrame)
+    {
+        if (desiredTimeScale <= 0) {
+            return E_INVALIDARG;
+        }
+
+        const int64_t current = monotonic_ns();
+
+        *hardwareTime = ns_to_time(current, desiredTimeScale);
+        *timeInFrame = 0;
+        *ticksPerFrame = 0;
+        if (_video_enabled) {
+            *ticksPerFrame = _frame_duration * desiredTimeScale /
+                _time_scale;
+            if (_running && *ticksPerFrame > 0) {
+                *timeInFrame = ns_to_time(current - _stream_start_ns,
+                                          desiredTimeScale) %
+                    *ticksPerFrame;
+            }
+        }
+        return S_OK;
+    }
+};
+
+class SoundDeckLinkConfiguration : public IDeckLinkConfiguration {
+protected:
+    device_state_t *_state;
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkConfiguration);
+    SoundDeckLinkConfiguration(device_state_t *state)
+        : _state(state)
+    {
+        _state->add_ref();
+    }
+    ~SoundDeckLinkConfiguration()
+    {
+        _state->release();
+    }
+    HRESULT SetFlag(BMDDeckLinkConfigurationID cfgID, bool value)
     {
         return S_OK;
     }
-    HRESULT StartScheduledPlayback(BMDTimeValue playbackStartTime,
-                                   BMDTimeScale timeScale,
-                                   double playbackSpeed)
+    HRESULT GetFlag(BMDDeckLinkConfigurationID cfgID, bool *value)
     {
-        if (!_callback_thread_alive) {
-            pthread_create(&_callback_thread, NULL,
-                           &SoundDeckLinkOutput::callback_thread,
-                           &_callback_arg);
-            _callback_thread_alive = true;
+        return S_OK;
+    }
+    HRESULT SetInt(BMDDeckLinkConfigurationID cfgID, int64_t value)
+    {
+        switch (cfgID) {
+        case bmdDeckLinkConfigSoundDeckBufferSize:
+        case bmdDeckLinkConfigSoundDeckPeriodSize:
+            if (value < 0) {
+                return E_INVALIDARG;
+            }
+            atomic_store(cfgID == bmdDeckLinkConfigSoundDeckBufferSize ?
+                         &_state->_buffer_size_request :
+                         &_state->_period_size_request, value);
+            return S_OK;
+        default:
+            return S_OK;
         }
-        else if (_alsa_pcm != NULL) {
-            snd_pcm_prepare(_alsa_pcm);
+    }
+    HRESULT GetInt(BMDDeckLinkConfigurationID cfgID, int64_t *value)
+    {
+        switch (cfgID) {
+        case bmdDeckLinkConfigSoundDeckBufferSize:
+            *value = atomic_load(&_state->_buffer_size_request);
+            return S_OK;
+        case bmdDeckLinkConfigSoundDeckPeriodSize:
+            *value = atomic_load(&_state->_period_size_request);
+            return S_OK;
+        default:
+            return S_OK;
         }
+    }
+    HRESULT SetFloat(BMDDeckLinkConfigurationID cfgID, double value)
+    {
+        return S_OK;
+    }
+    HRESULT GetFloat(BMDDeckLinkConfigurationID cfgID, double *value)
+    {
+        return S_OK;
+    }
+    HRESULT SetString(BMDDeckLinkConfigurationID cfgID, const char *value)
+    {
+        return S_OK;
+    }
+    HRESULT GetString(BMDDeckLinkConfigurationID cfgID, const char **value)
+    {
+        return S_OK;
+    }
+    HRESULT WriteConfigurationToPreferences(void)
+    {
+        _state->_notifier.post_preferences_changed();
         return S_OK;
     }
-    HRESULT StopScheduledPlayback(BMDTimeValue stopPlaybackAtTime,
-                                  BMDTimeValue *actualStopTime,
-                                  BMDTimeScale timeScale)
+};
+
+// Nothing is composited, the keyer only keeps its mode and level
+// (ramps advance once per output frame) for IDeckLinkStatus
+class SoundDeckLinkKeyer : public IDeckLinkKeyer {
+protected:
+    device_state_t *_state;
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkKeyer);
+    SoundDeckLinkKeyer(device_state_t *state)
+        : _state(state)
+    {
+        _state->add_ref();
+    }
+    ~SoundDeckLinkKeyer()
     {
-        if (_alsa_pcm != NULL) {
-            snd_pcm_drain(_alsa_pcm);
-            snd_pcm_drop(_alsa_pcm);
-        }
-        return S_OK;
+        _state->release();
     }
-    HRESULT IsScheduledPlaybackRunning(bool *active)
+    HRESULT Enable(bool isExternal)
     {
-        *active = true;
+        _state->set_keyer_mode(isExternal ?
+                               device_state_t::keyer_external :
+                               device_state_t::keyer_internal);
         return S_OK;
     }
-    HRESULT GetScheduledStreamTime(BMDTimeScale desiredTimeScale,
-                                   BMDTimeValue *streamTime,
-                                   double *playbackSpeed)
+    HRESULT SetLevel(uint8_t level)
     {
-        *streamTime =
-            rint(time_elapsed(_playback_start, desiredTimeScale));
+        _state->set_keyer_ramp(level, 0);
         return S_OK;
     }
-    HRESULT GetReferenceStatus(BMDReferenceStatus *referenceStatus)
+    HRESULT RampUp(uint32_t numberOfFrames)
     {
-        return E_FAIL;
+        _state->set_keyer_ramp(0xff, numberOfFrames);
+        return S_OK;
     }
-    HRESULT GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
-                                      BMDTimeValue *hardwareTime,
-                                      BMDTimeValue *timeInFrame,
-                                      BMDTimeValue *ticksPerFrame)
+    HRESULT RampDown(uint32_t numberOfFrames)
     {
-        return E_FAIL;
+        _state->set_keyer_ramp(0, numberOfFrames);
+        return S_OK;
     }
-    HRESULT
-    GetFrameCompletionReferenceTimestamp(IDeckLinkVideoFrame *
-                                         theFrame,
-                                         BMDTimeScale
-                                         desiredTimeScale,
-                                         BMDTimeValue *
-                                         frameCompletionTimestamp)
+    HRESULT Disable(void)
     {
-        return E_FAIL;
+        _state->set_keyer_mode(device_state_t::keyer_disabled);
+        return S_OK;
     }
 };
 
-class SoundDeckLinkConfiguration : public IDeckLinkConfiguration {
+class SoundDeckLinkStatus : public IDeckLinkStatus {
+protected:
+    device_state_t *_state;
 public:
-    DUMMY_IUNKNOWN;
-    HRESULT SetFlag(BMDDeckLinkConfigurationID cfgID, bool value)
+    DUMMY_IUNKNOWN(SoundDeckLinkStatus);
+    SoundDeckLinkStatus(device_state_t *state)
+        : _state(state)
     {
-        return S_OK;
+        _state->add_ref();
     }
-    HRESULT GetFlag(BMDDeckLinkConfigurationID cfgID, bool *value)
+    ~SoundDeckLinkStatus()
     {
-        return S_OK;
+        _state->release();
     }
-    HRESULT SetInt(BMDDeckLinkConfigurationID cfgID, int64_t value)
+    HRESULT GetFlag(BMDDeckLinkStatusID statusID, bool *value)
     {
-        return S_OK;
+        hdr_metadata_t metadata;
+
+        switch (statusID) {
+        case bmdDeckLinkStatusVideoInputSignalLocked:
+            *value = atomic_load(&_state->_video_input_locked) != 0;
+            return S_OK;
+        case bmdDeckLinkStatusReferenceSignalLocked:
+            *value = false;
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckHDRMetadata:
+            *value = _state->hdr_metadata(&metadata);
+            return S_OK;
+        default:
+            return E_INVALIDARG;
+        }
     }
-    HRESULT GetInt(BMDDeckLinkConfigurationID cfgID, int64_t *value)
+    HRESULT GetInt(BMDDeckLinkStatusID statusID, int64_t *value)
     {
-        return S_OK;
+        switch (statusID) {
+        case bmdDeckLinkStatusCurrentVideoOutputMode:
+            *value = atomic_load(&_state->_video_output_mode);
+            return S_OK;
+        case bmdDeckLinkStatusCurrentVideoOutputFlags:
+            *value = atomic_load(&_state->_video_output_flags);
+            return S_OK;
+        case bmdDeckLinkStatusLastVideoOutputPixelFormat:
+            *value = atomic_load(&_state->_video_output_pixel_format);
+            return S_OK;
+        case bmdDeckLinkStatusCurrentVideoInputMode:
+            *value = atomic_load(&_state->_video_input_mode);
+            return S_OK;
+        case bmdDeckLinkStatusCurrentVideoInputFlags:
+            *value = atomic_load(&_state->_video_input_flags);
+            return S_OK;
+        case bmdDeckLinkStatusCurrentVideoInputPixelFormat:
+            *value = atomic_load(&_state->_video_input_pixel_format);
+            return S_OK;
+        case bmdDeckLinkStatusBusy:
+            *value = (atomic_load(&_state->_output_enabled) != 0 ?
+                      bmdDevicePlaybackBusy : 0) |
+                (atomic_load(&_state->_input_enabled) != 0 ?
+                 bmdDeviceCaptureBusy : 0);
+            return S_OK;
+        case bmdDeckLinkStatusDuplexMode:
+            *value = bmdDuplexStatusFullDuplex;
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckBufferSize:
+            *value = atomic_load(&_state->_buffer_size);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckBufferFill:
+            *value = atomic_load(&_state->_buffer_fill);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckSampleRate:
+            *value = atomic_load(&_state->_sample_rate);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckDelay:
+            *value = atomic_load(&_state->_delay);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckUnderrunCount:
+            *value = atomic_load(&_state->_underrun_count);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckOverrunCount:
+            *value = atomic_load(&_state->_overrun_count);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckSchedulerJitterP50:
+            *value = _state->_jitter.quantile(0.5);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckSchedulerJitterP99:
+            *value = _state->_jitter.quantile(0.99);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckSchedulerJitterMax:
+            *value = _state->_jitter.max();
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckKeyerMode:
+            *value = atomic_load(&_state->_keyer_mode);
+            return S_OK;
+        case bmdDeckLinkStatusSoundDeckKeyerLevel:
+            *value = _state->keyer_level();
+            return S_OK;
+        default:
+            hdr_metadata_t metadata;
+
+            _state->hdr_metadata(&metadata);
+            return metadata.get_int(statusID, value);
+        }
     }
-    HRESULT SetFloat(BMDDeckLinkConfigurationID cfgID, double value)
+    HRESULT GetFloat(BMDDeckLinkStatusID statusID, double *value)
     {
-        return S_OK;
+        switch (statusID) {
+        case bmdDeckLinkStatusSoundDeckDriftPPM:
+            *value = _state->drift_ppm();
+            return S_OK;
+        default:
+            hdr_metadata_t metadata;
+
+            _state->hdr_metadata(&metadata);
+            return metadata.get_float(statusID, value);
+        }
     }
-    HRESULT GetFloat(BMDDeckLinkConfigurationID cfgID, double *value)
+    HRESULT GetString(BMDDeckLinkStatusID statusID, const char **value)
     {
-        return S_OK;
+        return E_INVALIDARG;
     }
-    HRESULT SetString(BMDDeckLinkConfigurationID cfgID, const char *value)
+    HRESULT GetBytes(BMDDeckLinkStatusID statusID, void *buffer,
+                     uint32_t *bufferSize)
     {
-        return S_OK;
+        return E_INVALIDARG;
     }
-    HRESULT GetString(BMDDeckLinkConfigurationID cfgID, const char **value)
+};
+
+class SoundDeckLinkNotification : public IDeckLinkNotification {
+protected:
+    device_state_t *_state;
+public:
+    DUMMY_IUNKNOWN(SoundDeckLinkNotification);
+    SoundDeckLinkNotification(device_state_t *state)
+        : _state(state)
     {
-        return S_OK;
+        _state->add_ref();
     }
-    HRESULT WriteConfigurationToPreferences(void)
+    virtual ~SoundDeckLinkNotification()
     {
-        return S_OK;
+        _state->release();
+    }
+    HRESULT Subscribe(BMDNotifications topic,
+                      IDeckLinkNotificationCallback *theCallback)
+    {
+        return _state->_notifier.subscribe(topic, theCallback);
+    }
+    HRESULT Unsubscribe(BMDNotifications topic,
+                        IDeckLinkNotificationCallback *theCallback)
+    {
+        return _state->_notifier.unsubscribe(topic, theCallback);
     }
 };
 
 class SoundDeckLink : public IDeckLink {
 protected:
-    std::string _alsa_device;
+    audio_backend_t _backend;
+    std::string _audio_device;
+    std::string _alsa_capture_device;
     std::string _model_display_name;
+    int64_t _persistent_id;
+    int64_t _topological_id;
+    int64_t _number_of_subdevices;
+    int64_t _subdevice_index;
+    device_state_t *_state;
 public:
-    DUMMY_IUNKNOWN_REFERENCE;
+    IUNKNOWN_REFERENCE(SoundDeckLink);
     HRESULT QueryInterface(REFIID id, void **outputInterface)
     {
         static const size_t size_iid = 16;
 
         if (memcmp(&id, &IID_IDeckLinkAttributes, size_iid) == 0) {
-            *outputInterface = new SoundDeckLinkAttributes();
+            const bool input = !_alsa_capture_device.empty();
+
+            *outputInterface = new SoundDeckLinkAttributes
+                (true, true, true, 16, true, false,
+                 _number_of_subdevices, _subdevice_index, true,
+                 _persistent_id, _topological_id,
+                 (1 << 6) - 1, (1 << 5) - 1,
+                 input ? (1 << 6) - 1 : 0, input ? (1 << 5) - 1 : 0);
             return S_OK;
         }
         if (memcmp(&id, &IID_IDeckLinkOutput, size_iid) == 0) {
-            *outputInterface = new SoundDeckLinkOutput(_alsa_device);
+            *outputInterface =
+                new SoundDeckLinkOutput(_backend, _audio_device, _state);
+            return S_OK;
+        }
+        if (memcmp(&id, &IID_IDeckLinkInput, size_iid) == 0 &&
+            !_alsa_capture_device.empty()) {
+            *outputInterface =
+                new SoundDeckLinkInput(_alsa_capture_device, _state);
+            return S_OK;
+        }
+        if (memcmp(&id, &IID_IDeckLinkStatus, size_iid) == 0) {
+            *outputInterface = new SoundDeckLinkStatus(_state);
+            return S_OK;
+        }
+        if (memcmp(&id, &IID_IDeckLinkNotification, size_iid) == 0) {
+            *outputInterface = new SoundDeckLinkNotification(_state);
             return S_OK;
         }
         if (memcmp(&id, &IID_IDeckLinkConfiguration, size_iid) == 0) {
-            *outputInterface = new SoundDeckLinkConfiguration();
+            *outputInterface = new SoundDeckLinkConfiguration(_state);
+            return S_OK;
+        }
+        if (memcmp(&id, &IID_IDeckLinkKeyer, size_iid) == 0) {
+            *outputInterface = new SoundDeckLinkKeyer(_state);
             return S_OK;
         }
         return E_NOINTERFACE;
     }
-    SoundDeckLink(std::pair<std::string, std::string> alsa_device)
-        : _alsa_device(alsa_device.first),
-          _model_display_name(alsa_device.second)
+    SoundDeckLink(const audio_device_t &audio_device)
+        : _backend(audio_device._backend),
+          _audio_device(audio_device._name),
+          _alsa_capture_device(audio_device._capture_name),
+          _model_display_name(audio_device._display_name),
+          _persistent_id(audio_device._persistent_id),
+          _topological_id(audio_device._topological_id),
+          _number_of_subdevices(audio_device._number_of_subdevices),
+          _subdevice_index(audio_device._subdevice_index),
+          _state(new device_state_t())
     {
+        metrics_register(_state, _model_display_name.c_str());
+    }
+    ~SoundDeckLink()
+    {
+        _state->release();
     }
     HRESULT GetModelName(const char **modelName)
     {
@@ -827,38 +3075,50 @@ public:
 class SoundDeckLinkAPIInformation :
     public IDeckLinkAPIInformation {
 protected:
+    // The vendor library's, whose version the host must be compatible
+    // with to drive the real cards
     IDeckLinkAPIInformation *_forward;
+    bool _forward_loaded;
     unsigned int _api_version_int;
     std::string _api_version_str;
-    void load_bmd(void)
+    // Loads the vendor library on the first query rather than when
+    // the host merely creates the object
+    IDeckLinkAPIInformation *forward(void)
     {
-        load_lib_api();
-
-        IDeckLinkAPIInformation *(*create_api_information_f)(void) =
-            reinterpret_cast<IDeckLinkAPIInformation *(*)(void)>
-            (dlsym(lib_api, "CreateDeckLinkAPIInformationInstance_0001"));
+        if (!_forward_loaded) {
+            const vendor_api_t &api = vendor_api();
 
-        if (create_api_information_f != NULL) {
-            _forward = create_api_information_f();
+            if (api._create_api_information != NULL) {
+                _forward = api._create_api_information();
+            }
+            _forward_loaded = true;
         }
+
+        return _forward;
     }
 public:
-    DUMMY_IUNKNOWN;
+    DUMMY_IUNKNOWN(SoundDeckLinkAPIInformation);
     SoundDeckLinkAPIInformation(void)
-        : _forward(NULL), _api_version_int(0x0a090000),
-          _api_version_str("10.9")
+        : _forward(NULL), _forward_loaded(false),
+          _api_version_int(0x0a090000), _api_version_str("10.9")
+    {
+    }
+    ~SoundDeckLinkAPIInformation()
     {
-#ifdef PATH_A
-        load_bmd();
-#endif // PATH_A
+        if (_forward != NULL) {
+            _forward->Release();
+        }
     }
     HRESULT GetFlag(BMDDeckLinkAPIInformationID cfgID, bool *value)
     {
+        if (forward() != NULL) {
+            return _forward->GetFlag(cfgID, value);
+        }
         return E_FAIL;
     }
     HRESULT GetInt(BMDDeckLinkAPIInformationID cfgID, int64_t *value)
     {
-        if (_forward != NULL) {
+        if (forward() != NULL) {
             return _forward->GetInt(cfgID, value);
         }
         else if (cfgID == BMDDeckLinkAPIVersion) {
@@ -872,12 +3132,15 @@ public:
     HRESULT GetFloat(BMDDeckLinkAPIInformationID cfgID,
                      double *value)
     {
+        if (forward() != NULL) {
+            return _forward->GetFloat(cfgID, value);
+        }
         return E_FAIL;
     }
     HRESULT GetString(BMDDeckLinkAPIInformationID cfgID,
                       const char **value)
     {
-        if (_forward != NULL) {
+        if (forward() != NULL) {
             return _forward->GetString(cfgID, value);
         }
         else if (cfgID == BMDDeckLinkAPIVersion) {
@@ -890,14 +3153,27 @@ public:
     }
 };
 
-class SoundDeckLinkIterator : public IDeckLinkIterator {
-protected:
-    std::vector<std::pair<std::string, std::string> > _alsa_device;
-    std::vector<std::pair<std::string, std::string> >::const_iterator
-    _iterator_alsa_device;
-    size_t _count;
-    IDeckLinkIterator *_iterator_bmd;
-    void enumerate_alsa_dev(void)
+namespace {
+
+    void add_device(std::vector<audio_device_t> &audio_device,
+                    const std::string &name,
+                    const std::string &capture_name,
+                    const std::string &display_name,
+                    const std::string card_identity[3],
+                    const std::string &bus_path,
+                    const std::string &pcm_name,
+                    int64_t number_of_subdevices,
+                    int64_t subdevice_index)
+    {
+        audio_device.push_back(audio_device_t(
+            audio_backend_alsa, name, capture_name, display_name,
+            (id_hash_t() << card_identity[0] << card_identity[1] <<
+             card_identity[2] << pcm_name).value(),
+            (id_hash_t() << bus_path << pcm_name).value(),
+            number_of_subdevices, subdevice_index));
+    }
+
+    void enumerate_alsa_dev(std::vector<audio_device_t> &audio_device)
     {
         snd_pcm_info_t *pcm_info;
         snd_ctl_card_info_t *card_info;
@@ -922,6 +3198,22 @@ protected:
                 continue;
             }
 
+            // Both IDs are derived from what identifies the card
+            // itself, never from the card index, which depends on
+            // the enumeration order
+            const std::string card_identity[3] = {
+                snd_ctl_card_info_get_id(card_info),
+                snd_ctl_card_info_get_driver(card_info),
+                snd_ctl_card_info_get_longname(card_info)
+            };
+            std::string bus_path = card_bus_path(card);
+
+            if (bus_path.empty()) {
+                // No sysfs (e.g. containers), fall back to the card
+                // identity, which is still stable across restarts
+                bus_path = card_identity[0] + card_identity[2];
+            }
+
             int dev = -1;
 
             while (!(snd_ctl_pcm_next_device(alsa_ctl, &dev),
@@ -934,36 +3226,290 @@ protected:
                     continue;
                 }
 
-                // "hw:" + 2 x 11 characters max for int + ',' + '\0'
-                char card_dev_name[27];
-
-                snprintf(card_dev_name, 27, "hw:%d,%d", card, dev);
+                const std::string display_name =
+                    snd_ctl_card_info_get_name(card_info) +
+                    std::string(" ") + snd_pcm_info_get_name(pcm_info);
+                const unsigned int subdevice_count =
+                    snd_pcm_info_get_subdevices_count(pcm_info);
+                // The hw subdevices (or hw:card,dev itself), followed
+                // by the plughw and dmix variants, which are all
+                // separately openable PCMs sharing the same device
+                const int64_t number_of_subdevices =
+                    (subdevice_count > 1 ? subdevice_count : 1) + 2;
+                // The input captures from the same device, through
+                // dsnoop where the output goes through dmix
+                char capture_name[3][31] = { "", "", "" };
+
+                snd_pcm_info_set_stream(pcm_info, SND_PCM_STREAM_CAPTURE);
+                if (snd_ctl_pcm_info(alsa_ctl, pcm_info) == 0) {
+                    snprintf(capture_name[0], 31, "hw:%d,%d", card, dev);
+                    snprintf(capture_name[1], 31, "plughw:%d,%d",
+                             card, dev);
+                    snprintf(capture_name[2], 31, "dsnoop:%d,%d",
+                             card, dev);
+                }
+                int64_t subdevice_index = 0;
+                // "plughw:" + 2 x 11 characters max for int + ',' +
+                // '\0'
+                char card_dev_name[31];
+                // "pcm" + 2 x 11 characters max for int + ',' + '\0'
+                char pcm_name[27];
+
+                if (subdevice_count > 1) {
+                    for (unsigned int sub = 0; sub < subdevice_count;
+                         sub++) {
+                        snprintf(card_dev_name, 31, "hw:%d,%d,%u",
+                                 card, dev, sub);
+                        snprintf(pcm_name, 27, "pcm%d,%u", dev, sub);
+
+                        // "#" + 10 characters max for unsigned int +
+                        // '\0'
+                        char subdevice_name[12];
+
+                        snprintf(subdevice_name, 12, "#%u", sub + 1);
+                        add_device(audio_device, card_dev_name,
+                                   capture_name[0],
+                                   display_name + " " + subdevice_name,
+                                   card_identity, bus_path, pcm_name,
+                                   number_of_subdevices,
+                                   subdevice_index++);
+                    }
+                }
+                else {
+                    snprintf(card_dev_name, 31, "hw:%d,%d", card, dev);
+                    snprintf(pcm_name, 27, "pcm%d", dev);
+                    add_device(audio_device, card_dev_name,
+                               capture_name[0], display_name,
+                               card_identity, bus_path, pcm_name,
+                               number_of_subdevices, subdevice_index++);
+                }
 
-                _alsa_device.push_back(
-                    std::pair<std::string, std::string>(
-                        card_dev_name,
-                        snd_ctl_card_info_get_name(card_info) +
-                        std::string(" ") +
-                        snd_pcm_info_get_name(pcm_info)));
+                snprintf(card_dev_name, 31, "plughw:%d,%d", card, dev);
+                snprintf(pcm_name, 27, "pcm%d plug", dev);
+                add_device(audio_device, card_dev_name, capture_name[1],
+                           display_name + " (plug)",
+                           card_identity, bus_path, pcm_name,
+                           number_of_subdevices, subdevice_index++);
+
+                snprintf(card_dev_name, 31, "dmix:%d,%d", card, dev);
+                snprintf(pcm_name, 27, "pcm%d dmix", dev);
+                add_device(audio_device, card_dev_name, capture_name[2],
+                           display_name + " (dmix)",
+                           card_identity, bus_path, pcm_name,
+                           number_of_subdevices, subdevice_index++);
             }
             snd_ctl_close(alsa_ctl);
         }
-        _iterator_alsa_device = _alsa_device.begin();
     }
-    void load_bmd(void)
+
+    // One device per running sound server, whose graph decides where
+    // the audio goes
+    void enumerate_sound_server(std::vector<audio_device_t> &audio_device)
     {
-        load_lib_api();
+        static const audio_backend_t backend[] = {
+            audio_backend_pipewire, audio_backend_jack
+        };
+        static const char *const display_name[] = {
+            "PipeWire", "JACK"
+        };
 
-        IDeckLinkIterator *(*create_iterator_f)(void) =
-            reinterpret_cast<IDeckLinkIterator *(*)(void)>
-            (dlsym(lib_api, "CreateDeckLinkIteratorInstance_0002"));
+        for (size_t i = 0; i < sizeof(backend) / sizeof(*backend); i++) {
+            if (audio_sink_t::available(backend[i])) {
+                const int64_t id =
+                    (id_hash_t() << display_name[i]).value();
+
+                audio_device.push_back(audio_device_t(
+                    backend[i], "", "", display_name[i], id, id));
+            }
+        }
+    }
+
+    // Lists the cards present, to tell whether a scan is still current
+    std::vector<int> card_list(void)
+    {
+        std::vector<int> card_index;
+        int card = -1;
+
+        while (!(snd_card_next(&card) < 0 || card < 0)) {
+            card_index.push_back(card);
+        }
+
+        return card_index;
+    }
+
+    // What the scan started at load found. Owned jointly with the
+    // detached thread doing it, whichever lets go last deletes it.
+    class scan_result_t {
+    protected:
+        reference_count_t _ref;
+        ~scan_result_t()
+        {
+            pthread_cond_destroy(&_cond);
+            pthread_mutex_destroy(&_mutex);
+        }
+    public:
+        pthread_mutex_t _mutex;
+        pthread_cond_t _cond;
+        bool _done;
+        std::vector<audio_device_t> _audio_device;
+        std::vector<int> _card;
+        scan_result_t(void)
+            : _done(false)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+            pthread_cond_init(&_cond, NULL);
+        }
+        void add_ref(void)
+        {
+            _ref.add_ref();
+        }
+        void release(void)
+        {
+            if (_ref.release() == 0) {
+                delete this;
+            }
+        }
+    };
+
+    // The ALSA card scan and the sound server probes take tens of
+    // milliseconds. They run on a thread started as the library is
+    // loaded, in parallel with the host's own initialization, and the
+    // result is reused for as long as the same cards are present. The
+    // thread is detached rather than joined by the static destructor,
+    // so that unloading never waits for it.
+    class device_scan_t {
+    protected:
+        pthread_mutex_t _mutex;
+        // The scan started at load until audio_device() took it
+        scan_result_t *_pending;
+        bool _scanned;
+        std::vector<audio_device_t> _audio_device;
+        // What _audio_device was scanned from
+        std::vector<int> _card;
+        void scan(void)
+        {
+            _card = card_list();
+            _audio_device.clear();
+            enumerate_alsa_dev(_audio_device);
+            enumerate_sound_server(_audio_device);
+            _scanned = true;
+        }
+        static void *scan_thread(void *arg)
+        {
+            scan_result_t *result = static_cast<scan_result_t *>(arg);
+            std::vector<int> card = card_list();
+            std::vector<audio_device_t> audio_device;
+
+            enumerate_alsa_dev(audio_device);
+            enumerate_sound_server(audio_device);
+            pthread_mutex_lock(&result->_mutex);
+            result->_card.swap(card);
+            result->_audio_device.swap(audio_device);
+            result->_done = true;
+            pthread_cond_broadcast(&result->_cond);
+            pthread_mutex_unlock(&result->_mutex);
+            result->release();
+
+            return NULL;
+        }
+    public:
+        device_scan_t(void)
+            : _pending(new scan_result_t()), _scanned(false)
+        {
+            pthread_t thread;
+
+            pthread_mutex_init(&_mutex, NULL);
+            _pending->add_ref();
+            if (pthread_create(&thread, NULL, &scan_thread,
+                               _pending) == 0) {
+                pthread_detach(thread);
+            }
+            else {
+                _pending->release();
+                _pending->release();
+                _pending = NULL;
+            }
+        }
+        ~device_scan_t()
+        {
+            if (_pending != NULL) {
+                _pending->release();
+            }
+            pthread_mutex_destroy(&_mutex);
+        }
+        // Waits for the scan started at load, or scans again if the
+        // cards changed since
+        std::vector<audio_device_t> audio_device(void)
+        {
+            pthread_mutex_lock(&_mutex);
+            if (_pending != NULL) {
+                pthread_mutex_lock(&_pending->_mutex);
+                while (!_pending->_done) {
+                    pthread_cond_wait(&_pending->_cond,
+                                      &_pending->_mutex);
+                }
+                _card.swap(_pending->_card);
+                _audio_device.swap(_pending->_audio_device);
+                _scanned = true;
+                pthread_mutex_unlock(&_pending->_mutex);
+                _pending->release();
+                _pending = NULL;
+            }
+            if (!_scanned || card_list() != _card) {
+                scan();
+            }
+
+            const std::vector<audio_device_t> result = _audio_device;
+
+            pthread_mutex_unlock(&_mutex);
+
+            return result;
+        }
+    };
+
+    device_scan_t device_scan;
+
+}
+
+class SoundDeckLinkIterator : public IDeckLinkIterator {
+protected:
+    std::vector<audio_device_t> _audio_device;
+    std::vector<audio_device_t>::const_iterator _iterator_audio_device;
+    // _audio_device is filled by the first Next()
+    bool _scanned;
+    // Whether to go on with the vendor library's devices after ours
+    bool _forward;
+    IDeckLinkIterator *_iterator_bmd;
+    // Devices set up through the environment. SOUNDDECK_AGGREGATE
+    // lists ALSA devices played as one, each taking a range of the
+    // channels, see aggregate_sink.cc. SOUNDDECK_RECORD_DIR records to
+    // files there as fast as the host schedules, for offline renders.
+    void enumerate_virtual(void)
+    {
+        static const audio_backend_t backend[] = {
+            audio_backend_aggregate, audio_backend_file
+        };
+        static const char *const variable[] = {
+            "SOUNDDECK_AGGREGATE", "SOUNDDECK_RECORD_DIR"
+        };
+        static const char *const display_name[] = {
+            "Aggregate", "File recorder"
+        };
 
-        if (create_iterator_f != NULL) {
-            _iterator_bmd = create_iterator_f();
+        for (size_t i = 0; i < sizeof(backend) / sizeof(*backend); i++) {
+            const char *value = getenv(variable[i]);
+
+            if (value != NULL && value[0] != '\0') {
+                const int64_t id =
+                    (id_hash_t() << display_name[i] << value).value();
+
+                _audio_device.push_back(audio_device_t(
+                    backend[i], value, "", display_name[i], id, id));
+            }
         }
     }
 public:
-    DUMMY_IUNKNOWN_REFERENCE;
+    IUNKNOWN_REFERENCE(SoundDeckLinkIterator);
     HRESULT QueryInterface(REFIID id, void **outputInterface)
     {
         static const size_t size_iid = 16;
@@ -974,23 +3520,42 @@ public:
         }
         return E_NOINTERFACE;
     }
-    SoundDeckLinkIterator(void)
-        : IDeckLinkIterator(), _count(0), _iterator_bmd(NULL)
+    SoundDeckLinkIterator(bool forward = true)
+        : IDeckLinkIterator(), _scanned(false), _forward(forward),
+          _iterator_bmd(NULL)
+    {
+    }
+    virtual ~SoundDeckLinkIterator()
     {
-        enumerate_alsa_dev();
-#ifdef PATH_A
-        load_bmd();
-#endif // PATH_A
+        if (_iterator_bmd != NULL) {
+            _iterator_bmd->Release();
+        }
     }
     HRESULT Next(IDeckLink **deckLinkInstance)
     {
-        if (_iterator_alsa_device != _alsa_device.end()) {
+        if (!_scanned) {
+            _audio_device = device_scan.audio_device();
+            enumerate_virtual();
+            _iterator_audio_device = _audio_device.begin();
+            _scanned = true;
+        }
+        if (_iterator_audio_device != _audio_device.end()) {
             *deckLinkInstance =
-                new SoundDeckLink(*_iterator_alsa_device);
-            _iterator_alsa_device++;
+                new SoundDeckLink(*_iterator_audio_device);
+            _iterator_audio_device++;
             return S_OK;
         }
-        else if (_iterator_bmd != NULL) {
+        // The real cards follow, the vendor library is only loaded
+        // once the host has gone through ours
+        if (_forward) {
+            const vendor_api_t &api = vendor_api();
+
+            if (api._create_iterator != NULL) {
+                _iterator_bmd = api._create_iterator();
+            }
+            _forward = false;
+        }
+        if (_iterator_bmd != NULL) {
             return _iterator_bmd->Next(deckLinkInstance);
         }
         else {
@@ -1002,33 +3567,149 @@ public:
 class SoundDeckLinkVideoConversion :
     public IDeckLinkVideoConversion {
 protected:
+    // The vendor library's, for the pairs convert.cc does not handle
+    IDeckLinkVideoConversion *_forward;
 public:
-    DUMMY_IUNKNOWN;
+    DUMMY_IUNKNOWN(SoundDeckLinkVideoConversion);
+    SoundDeckLinkVideoConversion(void)
+        : _forward(NULL)
+    {
+    }
+    ~SoundDeckLinkVideoConversion()
+    {
+        if (_forward != NULL) {
+            _forward->Release();
+        }
+    }
     HRESULT ConvertFrame(IDeckLinkVideoFrame *srcFrame,
                          IDeckLinkVideoFrame *dstFrame)
     {
+        if (srcFrame == NULL || dstFrame == NULL) {
+            return E_INVALIDARG;
+        }
+
+        image_t source = {
+            srcFrame->GetPixelFormat(), srcFrame->GetWidth(),
+            srcFrame->GetHeight(), srcFrame->GetRowBytes(), NULL
+        };
+        image_t destination = {
+            dstFrame->GetPixelFormat(), dstFrame->GetWidth(),
+            dstFrame->GetHeight(), dstFrame->GetRowBytes(), NULL
+        };
+
+        if (!convert_supported(source._pixel_format,
+                               destination._pixel_format)) {
+            const vendor_api_t &api = vendor_api();
+
+            if (_forward == NULL && api._create_video_conversion != NULL) {
+                _forward = api._create_video_conversion();
+            }
+            if (_forward != NULL) {
+                return _forward->ConvertFrame(srcFrame, dstFrame);
+            }
+            return E_FAIL;
+        }
+        if (srcFrame->GetBytes(&source._data) != S_OK ||
+            dstFrame->GetBytes(&destination._data) != S_OK) {
+            return E_FAIL;
+        }
+        // Frames do not carry their colorspace, so follow the display
+        // mode table: SD is Rec. 601, everything else Rec. 709
+        if (!convert_image(source, destination,
+                           source._height < 720 ?
+                           bmdDisplayModeColorspaceRec601 :
+                           bmdDisplayModeColorspaceRec709)) {
+            return E_INVALIDARG;
+        }
         return S_OK;
     }
 };
 
+// Announces the sound devices as arrived on installation, the vendor
+// library's discovery reports the real cards, hot plugged ones included
 class SoundDeckLinkDiscovery : public IDeckLinkDiscovery {
 protected:
+    bool _installed;
+    // Announced to the callback, released on uninstallation
+    std::vector<IDeckLink *> _device;
+    IDeckLinkDiscovery *_forward;
 public:
-    DUMMY_IUNKNOWN;
+    DUMMY_IUNKNOWN(SoundDeckLinkDiscovery);
+    SoundDeckLinkDiscovery(void)
+        : _installed(false), _forward(NULL)
+    {
+    }
+    ~SoundDeckLinkDiscovery()
+    {
+        UninstallDeviceNotifications();
+        if (_forward != NULL) {
+            _forward->Release();
+        }
+    }
     HRESULT
     InstallDeviceNotifications(IDeckLinkDeviceNotificationCallback *
                                deviceNotificationCallback)
     {
+        if (deviceNotificationCallback == NULL) {
+            return E_INVALIDARG;
+        }
+        if (_installed) {
+            return E_FAIL;
+        }
+        _installed = true;
+
+        IDeckLinkIterator *iterator = new SoundDeckLinkIterator(false);
+        IDeckLink *device;
+
+        while (iterator->Next(&device) == S_OK) {
+            _device.push_back(device);
+        }
+        iterator->Release();
+        for (size_t i = 0; i < _device.size(); i++) {
+            deviceNotificationCallback->DeckLinkDeviceArrived(_device[i]);
+        }
+
+        const vendor_api_t &api = vendor_api();
+
+        if (_forward == NULL && api._create_discovery != NULL) {
+            _forward = api._create_discovery();
+        }
+        if (_forward != NULL) {
+            _forward->InstallDeviceNotifications
+                (deviceNotificationCallback);
+        }
+
         return S_OK;
     }
     HRESULT UninstallDeviceNotifications(void)
     {
+        if (!_installed) {
+            return S_OK;
+        }
+        if (_forward != NULL) {
+            _forward->UninstallDeviceNotifications();
+        }
+        for (size_t i = 0; i < _device.size(); i++) {
+            _device[i]->Release();
+        }
+        _device.clear();
+        _installed = false;
+
         return S_OK;
     }
 };
 
+// The entry points are all the library exports, everything else is
+// built with hidden visibility, see the Makefile
+#pragma GCC visibility push(default)
+
 extern "C" {
 
+    // Lets the vendor library lookup tell other copies of this library
+    // from the real one
+    extern const int SoundDeckLinkLibrary;
+    const int SoundDeckLinkLibrary = 1;
+
     IDeckLinkIterator *CreateDeckLinkIteratorInstance_0002(void)
     {
         return new SoundDeckLinkIterator();
@@ -1052,3 +3733,5 @@ extern "C" {
     }
 
 }
+
+#pragma GCC visibility pop
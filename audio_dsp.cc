@@ -0,0 +1,206 @@
+#include <cmath>
+#include <cstring>
+
+#include "DeckLinkAPI.h"
+
+#include "audio_dsp.h"
+
+namespace {
+
+    // With the size known at compile time the memcpy() becomes a few
+    // moves instead of a call per frame
+    template <size_t frame_byte>
+    void copy_frames(char *destination, size_t destination_stride,
+                     const char *source, size_t source_stride,
+                     size_t frame_count)
+    {
+        for (size_t i = 0; i < frame_count; i++) {
+            memcpy(destination, source, frame_byte);
+            destination += destination_stride;
+            source += source_stride;
+        }
+    }
+
+    void copy_frames(char *destination, size_t destination_stride,
+                     const char *source, size_t source_stride,
+                     size_t frame_byte, size_t frame_count)
+    {
+        switch (frame_byte) {
+        case 2:
+            copy_frames<2>(destination, destination_stride, source,
+                           source_stride, frame_count);
+            break;
+        case 4:
+            copy_frames<4>(destination, destination_stride, source,
+                           source_stride, frame_count);
+            break;
+        case 8:
+            copy_frames<8>(destination, destination_stride, source,
+                           source_stride, frame_count);
+            break;
+        case 16:
+            copy_frames<16>(destination, destination_stride, source,
+                            source_stride, frame_count);
+            break;
+        case 32:
+            copy_frames<32>(destination, destination_stride, source,
+                            source_stride, frame_count);
+            break;
+        default:
+            for (size_t i = 0; i < frame_count; i++) {
+                memcpy(destination, source, frame_byte);
+                destination += destination_stride;
+                source += source_stride;
+            }
+            break;
+        }
+    }
+
+    template <typename sample_t>
+    void to_float_planar(float *const *destination, size_t offset,
+                         const sample_t *source, size_t channel_count,
+                         size_t frame_count, float scale)
+    {
+        // Channel by channel, so that each output stream is written
+        // sequentially
+        for (size_t c = 0; c < channel_count; c++) {
+            float *d = destination[c] + offset;
+            const sample_t *s = source + c;
+
+            for (size_t i = 0; i < frame_count; i++) {
+                d[i] = s[i * channel_count] * scale;
+            }
+        }
+    }
+
+}
+
+void audio_extract_channels(void *destination,
+                            size_t destination_frame_byte,
+                            const void *source, size_t source_frame_byte,
+                            size_t first_byte, size_t frame_count)
+{
+    copy_frames(static_cast<char *>(destination), destination_frame_byte,
+                static_cast<const char *>(source) + first_byte,
+                source_frame_byte, destination_frame_byte, frame_count);
+}
+
+void audio_expand_channels(void *destination,
+                           size_t destination_frame_byte,
+                           const void *source, size_t source_frame_byte,
+                           size_t frame_count)
+{
+    memset(destination, 0, frame_count * destination_frame_byte);
+    copy_frames(static_cast<char *>(destination), destination_frame_byte,
+                static_cast<const char *>(source), source_frame_byte,
+                source_frame_byte, frame_count);
+}
+
+void audio_to_float_planar(float *const *destination, size_t offset,
+                           const void *source,
+                           unsigned int sample_width_byte,
+                           size_t channel_count, size_t frame_count)
+{
+    if (sample_width_byte == 2) {
+        to_float_planar(destination, offset,
+                        static_cast<const int16_t *>(source),
+                        channel_count, frame_count, 1.0f / 32768);
+    }
+    else {
+        to_float_planar(destination, offset,
+                        static_cast<const int32_t *>(source),
+                        channel_count, frame_count, 1.0f / 2147483648.0f);
+    }
+}
+
+audio_resampler_t::audio_resampler_t(void)
+    : _channel_count(1), _sample_width_byte(2), _history(1, 0),
+      _position(1)
+{
+}
+
+void audio_resampler_t::configure(unsigned int channel_count,
+                                  unsigned int sample_width_byte)
+{
+    _channel_count = channel_count;
+    _sample_width_byte = sample_width_byte;
+    // One silent frame before the first input one, which the
+    // interpolation starts from
+    _history.assign(channel_count, 0);
+    _position = 1;
+}
+
+size_t audio_resampler_t::process(const void *data, size_t frame_count,
+                                  double step)
+{
+    const size_t channel_count = _channel_count;
+    const size_t base = _history.size();
+
+    _history.resize(base + frame_count * channel_count);
+    if (_sample_width_byte == 2) {
+        const int16_t *s = static_cast<const int16_t *>(data);
+
+        for (size_t i = 0; i < frame_count * channel_count; i++) {
+            _history[base + i] = s[i];
+        }
+    }
+    else {
+        const int32_t *s = static_cast<const int32_t *>(data);
+
+        for (size_t i = 0; i < frame_count * channel_count; i++) {
+            _history[base + i] = s[i];
+        }
+    }
+
+    const size_t history_frame_count = _history.size() / channel_count;
+    const double maximum = _sample_width_byte == 2 ?
+        32767.0 : 2147483647.0;
+    size_t produced = 0;
+
+    _output.resize((static_cast<size_t>(history_frame_count / step) + 2) *
+                   channel_count * _sample_width_byte);
+    for (; _position + 2 < history_frame_count;
+         _position += step, produced++) {
+        const size_t i = static_cast<size_t>(_position);
+        const double t = _position - i;
+        const double *x = &_history[(i - 1) * channel_count];
+
+        for (size_t c = 0; c < channel_count; c++) {
+            const double xm1 = x[c];
+            const double x0 = x[channel_count + c];
+            const double x1 = x[2 * channel_count + c];
+            const double x2 = x[3 * channel_count + c];
+            const double c1 = 0.5 * (x1 - xm1);
+            const double c2 = xm1 - 2.5 * x0 + 2 * x1 - 0.5 * x2;
+            const double c3 = 0.5 * (x2 - xm1) + 1.5 * (x0 - x1);
+            double y = rint(((c3 * t + c2) * t + c1) * t + x0);
+
+            if (y > maximum) {
+                y = maximum;
+            }
+            else if (y < -maximum - 1) {
+                y = -maximum - 1;
+            }
+
+            const size_t o = produced * channel_count + c;
+
+            if (_sample_width_byte == 2) {
+                reinterpret_cast<int16_t *>(&_output[0])[o] =
+                    static_cast<int16_t>(y);
+            }
+            else {
+                reinterpret_cast<int32_t *>(&_output[0])[o] =
+                    static_cast<int32_t>(y);
+            }
+        }
+    }
+
+    // Keeps the frames still needed, from the one before _position on
+    const size_t drop = static_cast<size_t>(_position) - 1;
+
+    _history.erase(_history.begin(),
+                   _history.begin() + drop * channel_count);
+    _position -= drop;
+
+    return produced;
+}
@@ -0,0 +1,62 @@
+#ifndef AUDIO_DSP_H_
+#define AUDIO_DSP_H_
+
+#include <cstddef>
+#include <vector>
+
+// Per sample frame work of the audio path, on interleaved 16 or 32-bit
+// little endian integer frames. Frame sizes are in bytes, so that the
+// same kernels serve both sample widths.
+
+// Copies destination_frame_byte bytes from first_byte into each source
+// frame, to pick a range of channels or drop the trailing ones
+void audio_extract_channels(void *destination,
+                            size_t destination_frame_byte,
+                            const void *source, size_t source_frame_byte,
+                            size_t first_byte, size_t frame_count);
+
+// Copies each source frame to the start of a larger destination frame,
+// the channels past it silent
+void audio_expand_channels(void *destination,
+                           size_t destination_frame_byte,
+                           const void *source, size_t source_frame_byte,
+                           size_t frame_count);
+
+// Deinterleaves into one float buffer per channel, from offset on,
+// scaled to [-1, 1)
+void audio_to_float_planar(float *const *destination, size_t offset,
+                           const void *source,
+                           unsigned int sample_width_byte,
+                           size_t channel_count, size_t frame_count);
+
+// Variable ratio resampling by 4-point cubic Hermite interpolation.
+// The ratio may change between calls, the input is continuous across
+// them.
+class audio_resampler_t {
+protected:
+    unsigned int _channel_count;
+    unsigned int _sample_width_byte;
+    // The input frames around _position, converted for interpolation
+    std::vector<double> _history;
+    double _position;
+    std::vector<char> _output;
+public:
+    audio_resampler_t(void);
+    // Also clears the history
+    void configure(unsigned int channel_count,
+                   unsigned int sample_width_byte);
+    // Returns the frames produced into output(), step being the input
+    // frames per output frame
+    size_t process(const void *data, size_t frame_count, double step);
+    const char *output(void) const
+    {
+        return &_output[0];
+    }
+    // Input frames taken but not yet interpolated past
+    double pending(void) const
+    {
+        return _history.size() / _channel_count - _position;
+    }
+};
+
+#endif // AUDIO_DSP_H_
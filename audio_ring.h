@@ -0,0 +1,147 @@
+#ifndef AUDIO_RING_H_
+#define AUDIO_RING_H_
+
+#include <cstring>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "common.h"
+
+// Single producer, single consumer ring of interleaved sample frames.
+// The buffer is allocated up front, so neither the capture thread
+// writing into it nor the thread delivering packets out of it ever
+// allocates or locks. Positions count frames since the last reset()
+// and never wrap in practice.
+class audio_ring_t {
+protected:
+    std::vector<char> _buffer;
+    size_t _frame_byte;
+    size_t _capacity;
+    uint64_t _write_position;
+    uint64_t _read_position;
+    // Frames from position up to the end of the buffer, the rest
+    // wraps around to the start
+    size_t contiguous(uint64_t position, size_t frame_count) const
+    {
+        const size_t offset = position & (_capacity - 1);
+
+        return frame_count < _capacity - offset ?
+            frame_count : _capacity - offset;
+    }
+    char *at(uint64_t position)
+    {
+        return &_buffer[(position & (_capacity - 1)) * _frame_byte];
+    }
+public:
+    audio_ring_t(void)
+        : _frame_byte(0), _capacity(0), _write_position(0),
+          _read_position(0)
+    {
+    }
+    // Not thread safe, only while neither side is running.
+    // frame_count is rounded up to a power of two.
+    void allocate(size_t frame_byte, size_t frame_count)
+    {
+        size_t capacity = 1;
+
+        while (capacity < frame_count) {
+            capacity <<= 1;
+        }
+        _buffer.assign(frame_byte * capacity, 0);
+        _frame_byte = frame_byte;
+        _capacity = capacity;
+        reset();
+    }
+    void reset(void)
+    {
+        atomic_store(&_write_position, uint64_t(0));
+        atomic_store(&_read_position, uint64_t(0));
+    }
+    size_t frame_byte(void) const
+    {
+        return _frame_byte;
+    }
+    size_t capacity(void) const
+    {
+        return _capacity;
+    }
+    // Producer side
+    uint64_t write_position(void) const
+    {
+        return atomic_load(&_write_position);
+    }
+    // Returns the frames actually written
+    size_t write(const void *buffer, size_t frame_count)
+    {
+        const uint64_t position = atomic_load(&_write_position);
+        const size_t free =
+            _capacity - (position - atomic_load(&_read_position));
+
+        if (frame_count > free) {
+            frame_count = free;
+        }
+        const char *source = reinterpret_cast<const char *>(buffer);
+        const size_t first = contiguous(position, frame_count);
+
+        memcpy(at(position), source, first * _frame_byte);
+        memcpy(at(0), source + first * _frame_byte,
+               (frame_count - first) * _frame_byte);
+        atomic_store(&_write_position, position + frame_count);
+
+        return frame_count;
+    }
+    // Consumer side
+    size_t readable(void) const
+    {
+        return atomic_load(&_write_position) -
+            atomic_load(&_read_position);
+    }
+    uint64_t read_position(void) const
+    {
+        return atomic_load(&_read_position);
+    }
+    size_t read(void *buffer, size_t frame_count)
+    {
+        const uint64_t position = atomic_load(&_read_position);
+        const size_t available =
+            atomic_load(&_write_position) - position;
+
+        if (frame_count > available) {
+            frame_count = available;
+        }
+        char *destination = reinterpret_cast<char *>(buffer);
+        const size_t first = contiguous(position, frame_count);
+
+        memcpy(destination, at(position), first * _frame_byte);
+        memcpy(destination + first * _frame_byte, at(0),
+               (frame_count - first) * _frame_byte);
+        atomic_store(&_read_position, position + frame_count);
+
+        return frame_count;
+    }
+    // The readable frames that are contiguous in the buffer, up to
+    // frame_count, for consumers that convert in place rather than
+    // copy out. Consume them with skip().
+    size_t peek(const void **data, size_t frame_count)
+    {
+        const uint64_t position = atomic_load(&_read_position);
+        const size_t available =
+            atomic_load(&_write_position) - position;
+
+        *data = at(position);
+
+        return contiguous(position, frame_count < available ?
+                          frame_count : available);
+    }
+    void skip(size_t frame_count)
+    {
+        const uint64_t position = atomic_load(&_read_position);
+        const size_t available =
+            atomic_load(&_write_position) - position;
+
+        atomic_store(&_read_position, position +
+                     (frame_count < available ? frame_count : available));
+    }
+};
+
+#endif // AUDIO_RING_H_
@@ -0,0 +1,370 @@
+#include <cerrno>
+#include <vector>
+#include <unistd.h>
+
+#include "audio_dsp.h"
+#include "audio_sink.h"
+#include "log.h"
+#include "trace.h"
+
+namespace {
+
+    class alsa_sink_t : public audio_sink_t {
+    protected:
+        std::string _name;
+        snd_pcm_t *_pcm;
+        size_t _frame_byte;
+        size_t _frame_byte_physical;
+        int64_t _buffer_size;
+        // Frames with the channels the PCM did not take dropped
+        std::vector<unsigned char> _physical;
+        void prepare(void)
+        {
+            snd_pcm_prepare(_pcm);
+            restart_drift();
+        }
+    public:
+        alsa_sink_t(const std::string &name, device_state_t *state)
+            : audio_sink_t(state), _name(name), _pcm(NULL),
+              _frame_byte(0), _frame_byte_physical(0), _buffer_size(0)
+        {
+        }
+        ~alsa_sink_t()
+        {
+            if (_pcm != NULL) {
+                snd_pcm_close(_pcm);
+            }
+        }
+        bool open(unsigned int *sample_rate,
+                  unsigned int sample_width_byte,
+                  unsigned int channel_count)
+        {
+            int alsa_status = snd_pcm_open(&_pcm, _name.c_str(),
+                                           SND_PCM_STREAM_PLAYBACK, 0);
+
+            if (alsa_status < 0) {
+                log_message(log_error, "ALSA %s: cannot open: %s", _name,
+                            snd_strerror(alsa_status));
+                _pcm = NULL;
+                return false;
+            }
+
+            snd_pcm_hw_params_t *hw_params;
+            // What failed, for the log
+            const char *step = "read the hardware parameters";
+
+            snd_pcm_hw_params_alloca(&hw_params);
+            alsa_status = snd_pcm_hw_params_any(_pcm, hw_params);
+            if (alsa_status == 0) {
+                step = "set interleaved access";
+                alsa_status = snd_pcm_hw_params_set_access
+                    (_pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+            }
+            if (alsa_status == 0) {
+                step = "set a sample rate near the requested one";
+                alsa_status = snd_pcm_hw_params_set_rate_near
+                    (_pcm, hw_params, sample_rate, NULL);
+            }
+            if (alsa_status == 0) {
+                step = sample_width_byte == 2 ?
+                    "set format S16_LE" : "set format S32_LE";
+                alsa_status = snd_pcm_hw_params_set_format
+                    (_pcm, hw_params, sample_width_byte == 2 ?
+                     SND_PCM_FORMAT_S16_LE : SND_PCM_FORMAT_S32_LE);
+            }
+
+            unsigned int channel_count_physical = 0;
+
+            for (unsigned int c = channel_count;
+                 alsa_status == 0 && c > 0; c--) {
+                if (snd_pcm_hw_params_set_channels(_pcm, hw_params,
+                                                   c) == 0) {
+                    channel_count_physical = c;
+                    break;
+                }
+            }
+            if (alsa_status == 0 && channel_count_physical == 0) {
+                step = "set any channel count up to the requested one";
+                alsa_status = -EINVAL;
+            }
+            if (alsa_status == 0) {
+                step = "set the configured buffer and period size";
+                alsa_status = alsa_set_buffer_size(_pcm, hw_params,
+                                                   _state);
+            }
+            if (alsa_status == 0) {
+                step = "apply the hardware parameters";
+                alsa_status = snd_pcm_hw_params(_pcm, hw_params);
+            }
+            if (alsa_status != 0) {
+                log_message(log_error, "ALSA %s: cannot %s: %s", _name,
+                            step, snd_strerror(alsa_status));
+                snd_pcm_close(_pcm);
+                _pcm = NULL;
+                return false;
+            }
+            if (channel_count_physical < channel_count) {
+                log_message(log_warning, "ALSA %s: takes %u of %u "
+                            "channels, dropping the others", _name,
+                            channel_count_physical, channel_count);
+            }
+
+            snd_pcm_uframes_t buffer_size = 0;
+
+            snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size);
+            _buffer_size = buffer_size;
+            _frame_byte = channel_count * sample_width_byte;
+            _frame_byte_physical =
+                channel_count_physical * sample_width_byte;
+            _sample_rate = *sample_rate;
+            atomic_store(&_state->_buffer_size, _buffer_size);
+            restart_drift();
+            log_message(log_debug, "ALSA %s: buffer of %lld frames", _name,
+                        static_cast<long long>(_buffer_size));
+
+            return true;
+        }
+        uint32_t write(const void *buffer, uint32_t frame_count)
+        {
+            TRACE_SCOPE("alsa write");
+
+            if (snd_pcm_state(_pcm) == SND_PCM_STATE_XRUN) {
+                TRACE_SCOPE("xrun recovery");
+
+                log_message(log_warning, "ALSA %s: underrun", _name);
+                _state->add_underrun();
+                prepare();
+            }
+
+            const void *source = buffer;
+
+            // Same layout as the PCM goes straight to snd_pcm_writei()
+            if (_frame_byte_physical != _frame_byte) {
+                _physical.resize(_frame_byte_physical * frame_count);
+                audio_extract_channels(&_physical[0], _frame_byte_physical,
+                                       buffer, _frame_byte, 0,
+                                       frame_count);
+                source = &_physical[0];
+            }
+
+            snd_pcm_sframes_t written;
+
+            {
+                TRACE_SCOPE("snd_pcm_writei");
+
+                written = snd_pcm_writei(_pcm, source, frame_count);
+            }
+            if (written < 0) {
+                TRACE_SCOPE("xrun recovery");
+
+                if (written == -EPIPE) {
+                    log_message(log_warning, "ALSA %s: underrun", _name);
+                    _state->add_underrun();
+                }
+                else {
+                    log_message(log_warning, "ALSA %s: write failed, "
+                                "restarting: %s", _name,
+                                snd_strerror(static_cast<int>(written)));
+                }
+                prepare();
+                written = snd_pcm_writei(_pcm, source, frame_count);
+            }
+
+            snd_pcm_sframes_t avail;
+            snd_pcm_sframes_t delay;
+
+            if (written > 0 &&
+                snd_pcm_avail_delay(_pcm, &avail, &delay) == 0) {
+                update_telemetry(written, _buffer_size - avail, delay);
+            }
+
+            return written > 0 ? written : 0;
+        }
+        void start(void)
+        {
+            prepare();
+        }
+        void stop(void)
+        {
+            snd_pcm_drain(_pcm);
+            snd_pcm_drop(_pcm);
+        }
+        void drain(void)
+        {
+            snd_pcm_drain(_pcm);
+        }
+    };
+
+}
+
+audio_sink_t::audio_sink_t(device_state_t *state)
+    : _state(state), _sample_rate(0), _drift_frame_count(0)
+{
+    _state->add_ref();
+}
+
+audio_sink_t::~audio_sink_t()
+{
+    atomic_store(&_state->_buffer_size, int64_t(0));
+    atomic_store(&_state->_buffer_fill, int64_t(0));
+    atomic_store(&_state->_delay, int64_t(0));
+    _state->release();
+}
+
+void audio_sink_t::update_telemetry(uint64_t frames_written,
+                                    int64_t buffer_fill, int64_t delay)
+{
+    atomic_store(&_state->_buffer_fill, buffer_fill);
+    atomic_store(&_state->_delay, delay);
+
+    if (_drift_frame_count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &_drift_start);
+    }
+    _drift_frame_count += frames_written;
+
+    struct timespec current;
+
+    clock_gettime(CLOCK_MONOTONIC, &current);
+
+    const double elapsed =
+        (static_cast<double>(current.tv_sec) -
+         static_cast<double>(_drift_start.tv_sec)) +
+        (static_cast<double>(current.tv_nsec) -
+         static_cast<double>(_drift_start.tv_nsec)) / 1e+9;
+
+    // Too short an interval is dominated by the initial buffer fill
+    if (elapsed >= 1 && _sample_rate > 0) {
+        const double consumed =
+            static_cast<double>(_drift_frame_count) -
+            static_cast<double>(delay);
+
+        _state->set_drift_ppm
+            ((consumed / (elapsed * _sample_rate) - 1) * 1e+6);
+    }
+}
+
+uint32_t audio_sink_t::ring_write(audio_ring_t *ring, const void *buffer,
+                                  uint32_t frame_count)
+{
+    const char *source = static_cast<const char *>(buffer);
+    uint32_t written = 0;
+
+    while (written < frame_count && !stalled()) {
+        const uint32_t count =
+            ring->write(source + written * ring->frame_byte(),
+                        frame_count - written);
+
+        if (count > 0) {
+            written += count;
+            ring_written();
+        }
+        if (written < frame_count) {
+            useconds_t wait_us =
+                1000000ULL * (frame_count - written) / _sample_rate;
+
+            if (wait_us < 1000) {
+                wait_us = 1000;
+            }
+            else if (wait_us > 10000) {
+                wait_us = 10000;
+            }
+            usleep(wait_us);
+        }
+    }
+
+    return written;
+}
+
+void audio_sink_t::ring_wait_empty(const audio_ring_t *ring)
+{
+    const int64_t timeout_ns = _sample_rate > 0 ?
+        2000000000LL * ring->capacity() / _sample_rate : 0;
+
+    for (int64_t waited_ns = 0;
+         ring->readable() > 0 && !stalled() && waited_ns < timeout_ns;
+         waited_ns += 2000000) {
+        usleep(2000);
+    }
+}
+
+const char *audio_backend_name(audio_backend_t backend)
+{
+    static const char *const name[] = {
+        "ALSA", "PipeWire", "JACK", "file recorder", "aggregate"
+    };
+
+    return name[backend];
+}
+
+audio_sink_t *audio_sink_t::create(audio_backend_t backend,
+                                   const std::string &name,
+                                   device_state_t *state)
+{
+    switch (backend) {
+    case audio_backend_alsa:
+        return new alsa_sink_t(name, state);
+    case audio_backend_file:
+        return create_file_sink(name, state);
+    case audio_backend_aggregate:
+        return create_aggregate_sink(name, state);
+#ifdef HAVE_PIPEWIRE
+    case audio_backend_pipewire:
+        return create_pipewire_sink(state);
+#endif // HAVE_PIPEWIRE
+#ifdef HAVE_JACK
+    case audio_backend_jack:
+        return create_jack_sink(state);
+#endif // HAVE_JACK
+    default:
+        return NULL;
+    }
+}
+
+bool audio_sink_t::available(audio_backend_t backend)
+{
+    switch (backend) {
+    case audio_backend_alsa:
+        return true;
+#ifdef HAVE_PIPEWIRE
+    case audio_backend_pipewire:
+        return pipewire_sink_available();
+#endif // HAVE_PIPEWIRE
+#ifdef HAVE_JACK
+    case audio_backend_jack:
+        return jack_sink_available();
+#endif // HAVE_JACK
+    default:
+        return false;
+    }
+}
+
+int alsa_set_buffer_size(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params,
+                         device_state_t *state)
+{
+    snd_pcm_uframes_t period_size =
+        atomic_load(&state->_period_size_request);
+    snd_pcm_uframes_t buffer_size =
+        atomic_load(&state->_buffer_size_request);
+    int alsa_status = 0;
+
+    if (period_size > 0) {
+        const snd_pcm_uframes_t requested = period_size;
+
+        alsa_status = snd_pcm_hw_params_set_period_size_near
+            (pcm, hw_params, &period_size, NULL);
+        log_message(alsa_status == 0 ? log_info : log_error,
+                    "ALSA %s: period of %lu frames requested, %lu set",
+                    snd_pcm_name(pcm), requested, period_size);
+    }
+    if (alsa_status == 0 && buffer_size > 0) {
+        const snd_pcm_uframes_t requested = buffer_size;
+
+        alsa_status = snd_pcm_hw_params_set_buffer_size_near
+            (pcm, hw_params, &buffer_size);
+        log_message(alsa_status == 0 ? log_info : log_error,
+                    "ALSA %s: buffer of %lu frames requested, %lu set",
+                    snd_pcm_name(pcm), requested, buffer_size);
+    }
+
+    return alsa_status;
+}
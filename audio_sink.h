@@ -0,0 +1,117 @@
+#ifndef AUDIO_SINK_H_
+#define AUDIO_SINK_H_
+
+#include <string>
+#include <ctime>
+#include <alsa/asoundlib.h>
+
+#include "DeckLinkAPI.h"
+#include "audio_ring.h"
+#include "device_state.h"
+
+enum audio_backend_t {
+    audio_backend_alsa,
+    audio_backend_pipewire,
+    audio_backend_jack,
+    audio_backend_file,
+    audio_backend_aggregate
+};
+
+// "ALSA", "PipeWire" and so on, for the log
+const char *audio_backend_name(audio_backend_t backend);
+
+// Where SoundDeckLinkOutput sends its audio. write() takes interleaved
+// 16 or 32-bit little endian integer frames and blocks while the sink
+// is full, the way a blocking ALSA PCM does. Sinks publish buffer
+// fill, delay, drift and underruns to the device state.
+class audio_sink_t {
+protected:
+    device_state_t *_state;
+    unsigned int _sample_rate;
+    // Drift is measured from the first write after (re)starting,
+    // _drift_frame_count being the frames written since then
+    struct timespec _drift_start;
+    uint64_t _drift_frame_count;
+    audio_sink_t(device_state_t *state);
+    void restart_drift(void)
+    {
+        _drift_frame_count = 0;
+    }
+    void update_telemetry(uint64_t frames_written, int64_t buffer_fill,
+                          int64_t delay);
+    // For sinks queueing into a ring that their sound server or a
+    // thread of theirs plays out of. Writes all frames, sleeping
+    // roughly until the shortfall has been played while the ring is
+    // full, and returns the frames written, fewer only once stalled().
+    uint32_t ring_write(audio_ring_t *ring, const void *buffer,
+                        uint32_t frame_count);
+    // Until the ring has been played out or stalled(), for at most
+    // twice its length in case the other side stopped reading
+    void ring_wait_empty(const audio_ring_t *ring);
+    // Whether whatever plays out of the ring is gone
+    virtual bool stalled(void) const
+    {
+        return false;
+    }
+    // Called by ring_write() after it put frames into the ring, for
+    // sinks whose reader sleeps until there are some
+    virtual void ring_written(void)
+    {
+    }
+public:
+    // NULL if backend was not built in
+    static audio_sink_t *create(audio_backend_t backend,
+                                const std::string &name,
+                                device_state_t *state);
+    // Whether the sound server behind backend is running, always true
+    // for ALSA
+    static bool available(audio_backend_t backend);
+    virtual ~audio_sink_t();
+    // sample_rate is updated to the rate actually used. Channels the
+    // sink cannot take are dropped from the end of each frame.
+    virtual bool open(unsigned int *sample_rate,
+                      unsigned int sample_width_byte,
+                      unsigned int channel_count) = 0;
+    // Returns the frames written
+    virtual uint32_t write(const void *buffer, uint32_t frame_count) = 0;
+    // Resumes after stop()
+    virtual void start(void) = 0;
+    // Plays out what is queued and stops
+    virtual void stop(void) = 0;
+    // Plays out what is queued, before the sink is deleted
+    virtual void drain(void) = 0;
+    // Timecode of the first frame written, in samples since midnight,
+    // for sinks that record it
+    virtual void set_time_reference(uint64_t time_reference)
+    {
+    }
+    unsigned int sample_rate(void) const
+    {
+        return _sample_rate;
+    }
+};
+
+// Requests the buffer and period size set through
+// IDeckLinkConfiguration, if any, before snd_pcm_hw_params()
+int alsa_set_buffer_size(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params,
+                         device_state_t *state);
+
+// Records to a new file in directory per EnableAudioOutput
+audio_sink_t *create_file_sink(const std::string &directory,
+                               device_state_t *state);
+
+// Plays to the ALSA devices listed in spec, see aggregate_sink.cc
+audio_sink_t *create_aggregate_sink(const std::string &spec,
+                                    device_state_t *state);
+
+#ifdef HAVE_PIPEWIRE
+bool pipewire_sink_available(void);
+audio_sink_t *create_pipewire_sink(device_state_t *state);
+#endif // HAVE_PIPEWIRE
+
+#ifdef HAVE_JACK
+bool jack_sink_available(void);
+audio_sink_t *create_jack_sink(device_state_t *state);
+#endif // HAVE_JACK
+
+#endif // AUDIO_SINK_H_
@@ -0,0 +1,208 @@
+// Cost of the per sample frame work of the audio output and input, at
+// 2, 8 and 16 channels of 16 and 32-bit samples: the channel remapping
+// of the ALSA sink, the aggregate and the input, the float conversion
+// of the JACK sink, the aggregate's resampler, and a whole ALSA sink
+// write() into the "null" PCM, which needs no hardware. Reports ns per
+// sample frame and GB/s of source plus destination bytes touched.
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <stdlib.h>
+
+#include "audio_dsp.h"
+#include "audio_sink.h"
+
+namespace {
+
+    const unsigned int channel_count[] = { 2, 8, 16 };
+    const unsigned int sample_width_byte[] = { 2, 4 };
+    // A typical period
+    const size_t frame_count = 1024;
+
+    enum kernel_id_t {
+        kernel_extract,
+        kernel_expand,
+        kernel_to_float,
+        kernel_resample,
+        kernel_alsa_null,
+        kernel_count
+    };
+
+    const char *kernel_name[] = {
+        "extract", "expand", "to float", "resample", "alsa null"
+    };
+
+    double now(void)
+    {
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return t.tv_sec + t.tv_nsec * 1e-9;
+    }
+
+    class kernel_t {
+    public:
+        kernel_id_t _id;
+        unsigned int _channel_count;
+        unsigned int _sample_width_byte;
+        std::vector<char> _source;
+        std::vector<char> _destination;
+        std::vector<float> _planar;
+        std::vector<float *> _planar_channel;
+        audio_resampler_t _resampler;
+        audio_sink_t *_sink;
+        kernel_t(kernel_id_t id, unsigned int channel_count,
+                 unsigned int sample_width_byte)
+            : _id(id), _channel_count(channel_count),
+              _sample_width_byte(sample_width_byte), _sink(NULL)
+        {
+            const size_t frame_byte = channel_count * sample_width_byte;
+
+            _source.resize(frame_count * frame_byte);
+            for (size_t i = 0; i < _source.size(); i++) {
+                _source[i] = rand();
+            }
+            _destination.resize(frame_count * frame_byte * 2);
+            _planar.resize(frame_count * channel_count);
+            for (unsigned int c = 0; c < channel_count; c++) {
+                _planar_channel.push_back(&_planar[c * frame_count]);
+            }
+            _resampler.configure(channel_count, sample_width_byte);
+        }
+        ~kernel_t()
+        {
+            delete _sink;
+        }
+        // Bytes read and written per call of run()
+        double byte(void) const
+        {
+            const double frame_byte = static_cast<double>
+                (_channel_count * _sample_width_byte);
+
+            switch (_id) {
+            case kernel_extract:
+            case kernel_expand:
+                return frame_count * frame_byte * 1.5;
+            case kernel_to_float:
+                return frame_count * (frame_byte +
+                                      _channel_count * sizeof(float));
+            default:
+                return frame_count * frame_byte * 2;
+            }
+        }
+        void run(void)
+        {
+            const size_t frame_byte = _channel_count * _sample_width_byte;
+            // The first half of the channels, the ALSA sink dropping
+            // those the device does not have
+            const size_t half_frame_byte = _channel_count > 2 ?
+                frame_byte / 2 : _sample_width_byte;
+
+            switch (_id) {
+            case kernel_extract:
+                audio_extract_channels(&_destination[0], half_frame_byte,
+                                       &_source[0], frame_byte, 0,
+                                       frame_count);
+                break;
+            case kernel_expand:
+                audio_expand_channels(&_destination[0], frame_byte,
+                                      &_source[0], half_frame_byte,
+                                      frame_count);
+                break;
+            case kernel_to_float:
+                audio_to_float_planar(&_planar_channel[0], 0, &_source[0],
+                                      _sample_width_byte, _channel_count,
+                                      frame_count);
+                break;
+            case kernel_resample:
+                // 100 ppm off, as when following another device
+                _resampler.process(&_source[0], frame_count, 1.0001);
+                break;
+            default:
+                _sink->write(&_source[0], frame_count);
+                break;
+            }
+        }
+        // Returns false if there is nothing to measure
+        bool prepare(void)
+        {
+            if (_id != kernel_alsa_null) {
+                return true;
+            }
+
+            device_state_t *state = new device_state_t();
+            unsigned int sample_rate = 48000;
+
+            _sink = audio_sink_t::create(audio_backend_alsa, "null",
+                                         state);
+            state->release();
+
+            return _sink != NULL &&
+                _sink->open(&sample_rate, _sample_width_byte,
+                            _channel_count);
+        }
+    };
+
+    // Runs for at least min_second, returns ns per frame and GB/s
+    void measure(kernel_t *kernel, double min_second, double *ns,
+                 double *gb)
+    {
+        const double start = now();
+        double elapsed;
+        long iteration = 0;
+
+        do {
+            kernel->run();
+            iteration++;
+            elapsed = now() - start;
+        } while (elapsed < min_second);
+
+        *ns = elapsed * 1e+9 / (static_cast<double>(iteration) *
+                                frame_count);
+        *gb = kernel->byte() * iteration / elapsed * 1e-9;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    // "-s" for a quick run
+    const bool small = argc > 1 && strcmp(argv[1], "-s") == 0;
+    const double min_second = small ? 0.02 : 0.2;
+
+    printf("%lu frames per call, ns per sample frame and GB/s "
+           "(source + destination)\n",
+           static_cast<unsigned long>(frame_count));
+    printf("%-10s %8s %6s %9s %9s\n", "kernel", "channels", "bits",
+           "ns/frame", "GB/s");
+    for (int k = 0; k < kernel_count; k++) {
+        for (size_t c = 0;
+             c < sizeof(channel_count) / sizeof(*channel_count); c++) {
+            for (size_t w = 0;
+                 w < sizeof(sample_width_byte) /
+                     sizeof(*sample_width_byte); w++) {
+                kernel_t kernel(static_cast<kernel_id_t>(k),
+                                channel_count[c],
+                                sample_width_byte[w]);
+                double ns;
+                double gb;
+
+                if (!kernel.prepare()) {
+                    printf("%-10s %8u %6u %9s\n", kernel_name[k],
+                           channel_count[c], sample_width_byte[w] * 8,
+                           "skipped");
+                    continue;
+                }
+                measure(&kernel, min_second, &ns, &gb);
+                printf("%-10s %8u %6u %9.2f %9.2f\n", kernel_name[k],
+                       channel_count[c], sample_width_byte[w] * 8, ns,
+                       gb);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+// Throughput of convert_image() for every supported pixel format pair,
+// per instruction set, single threaded and on the row thread pool.
+// Reports GB/s of source plus destination bytes touched. Checks first
+// that each instruction set gives the same output as the scalar code
+// for widths 1 to 69, which cover the tails the kernels leave over,
+// and fails if one does not.
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <stdlib.h>
+#include "DeckLinkAPI.h"
+
+#include "convert.h"
+
+namespace {
+
+    const BMDPixelFormat pixel_format[] = {
+        bmdFormat8BitYUV, bmdFormat10BitYUV, bmdFormat8BitARGB,
+        bmdFormat8BitBGRA, bmdFormat10BitRGB, bmdFormat10BitRGBX,
+        bmdFormat10BitRGBXLE
+    };
+
+    const char *pixel_format_name(BMDPixelFormat pixel_format)
+    {
+        switch (pixel_format) {
+        case bmdFormat8BitYUV:
+            return "2vuy";
+        case bmdFormat10BitYUV:
+            return "v210";
+        case bmdFormat8BitARGB:
+            return "ARGB";
+        case bmdFormat8BitBGRA:
+            return "BGRA";
+        case bmdFormat10BitRGB:
+            return "r210";
+        case bmdFormat10BitRGBX:
+            return "R10b";
+        case bmdFormat10BitRGBXLE:
+            return "R10l";
+        default:
+            return "?";
+        }
+    }
+
+    const char *isa_name[] = { "scalar", "sse4.1", "avx2" };
+
+    const long compare_width_max = 69;
+
+    void fill_random(std::vector<uint8_t> *buffer)
+    {
+        for (size_t i = 0; i < buffer->size(); i++) {
+            (*buffer)[i] = rand();
+        }
+    }
+
+    double now(void)
+    {
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return t.tv_sec + t.tv_nsec * 1e-9;
+    }
+
+    // Runs for at least min_second and returns GB/s
+    double measure(const image_t &source, const image_t &destination,
+                   double min_second)
+    {
+        const double byte = static_cast<double>
+            (source._row_bytes * source._height +
+             destination._row_bytes * destination._height);
+        const double start = now();
+        double elapsed;
+        long iteration = 0;
+
+        do {
+            convert_image(source, destination,
+                          bmdDisplayModeColorspaceRec709);
+            iteration++;
+            elapsed = now() - start;
+        } while (elapsed < min_second);
+
+        return byte * iteration / elapsed * 1e-9;
+    }
+
+    // Output of the instruction sets up to best against the scalar one
+    // for every pair, false on any difference
+    bool compare(convert_isa_t best)
+    {
+        const size_t format_count =
+            sizeof(pixel_format) / sizeof(*pixel_format);
+        const long height = 3;
+        size_t mismatch_count = 0;
+
+        convert_set_thread_count(1);
+        for (size_t i = 0; i < format_count; i++) {
+            for (size_t j = 0; j < format_count; j++) {
+                if (i == j) {
+                    continue;
+                }
+                for (long width = 1; width <= compare_width_max;
+                     width++) {
+                    image_t source;
+                    image_t destination;
+
+                    source._pixel_format = pixel_format[i];
+                    source._width = width;
+                    source._height = height;
+                    source._row_bytes =
+                        row_bytes_min(pixel_format[i], width);
+                    destination = source;
+                    destination._pixel_format = pixel_format[j];
+                    destination._row_bytes =
+                        row_bytes_min(pixel_format[j], width);
+
+                    std::vector<uint8_t> source_buffer
+                        (source._row_bytes * height);
+                    std::vector<uint8_t> reference;
+
+                    fill_random(&source_buffer);
+                    source._data = &source_buffer[0];
+                    for (int isa = convert_isa_scalar; isa <= best;
+                         isa++) {
+                        std::vector<uint8_t> buffer
+                            (destination._row_bytes * height);
+
+                        destination._data = &buffer[0];
+                        convert_set_isa(static_cast<convert_isa_t>(isa));
+                        convert_image(source, destination,
+                                      bmdDisplayModeColorspaceRec709);
+                        if (isa == convert_isa_scalar) {
+                            reference.swap(buffer);
+                        }
+                        else if (buffer != reference) {
+                            printf("%s->%s width %ld: %s differs from "
+                                   "scalar\n",
+                                   pixel_format_name(pixel_format[i]),
+                                   pixel_format_name(pixel_format[j]),
+                                   width, isa_name[isa]);
+                            mismatch_count++;
+                        }
+                    }
+                }
+            }
+        }
+        printf("Up to %s against scalar, widths 1 to %ld: "
+               "%lu mismatch(es)\n\n", isa_name[best], compare_width_max,
+               static_cast<unsigned long>(mismatch_count));
+
+        return mismatch_count == 0;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    // 2160p by default, "-s" for a quick 1080p run
+    const bool small = argc > 1 && strcmp(argv[1], "-s") == 0;
+    const long width = small ? 1920 : 3840;
+    const long height = small ? 1080 : 2160;
+    const double min_second = small ? 0.05 : 0.25;
+    const size_t thread_count = convert_thread_count();
+    const convert_isa_t best = convert_isa();
+    const size_t format_count =
+        sizeof(pixel_format) / sizeof(*pixel_format);
+    std::vector<std::vector<uint8_t> > buffer(format_count);
+    std::vector<image_t> image(format_count);
+
+    if (!compare(best)) {
+        return 1;
+    }
+    convert_set_thread_count(thread_count);
+    for (size_t i = 0; i < format_count; i++) {
+        image[i]._pixel_format = pixel_format[i];
+        image[i]._width = width;
+        image[i]._height = height;
+        image[i]._row_bytes = row_bytes_min(pixel_format[i], width);
+        buffer[i].resize(image[i]._row_bytes * height);
+        fill_random(&buffer[i]);
+        image[i]._data = &buffer[i][0];
+    }
+
+    printf("%ldx%ld, GB/s (source + destination), %lu thread(s) "
+           "in the pool\n", width, height,
+           static_cast<unsigned long>(thread_count));
+    printf("%-12s %-7s %9s %9s\n", "pair", "isa", "1 thread", "pool");
+    for (size_t i = 0; i < format_count; i++) {
+        for (size_t j = 0; j < format_count; j++) {
+            if (i == j) {
+                continue;
+            }
+            for (int isa = convert_isa_scalar; isa <= best; isa++) {
+                char pair[16];
+
+                snprintf(pair, sizeof(pair), "%s->%s",
+                         pixel_format_name(pixel_format[i]),
+                         pixel_format_name(pixel_format[j]));
+                convert_set_isa(static_cast<convert_isa_t>(isa));
+                convert_set_thread_count(1);
+
+                const double single =
+                    measure(image[i], image[j], min_second);
+
+                convert_set_thread_count(thread_count);
+
+                const double pool =
+                    measure(image[i], image[j], min_second);
+
+                printf("%-12s %-7s %9.2f %9.2f\n", pair, isa_name[isa],
+                       single, pool);
+            }
+        }
+    }
+
+    return 0;
+}
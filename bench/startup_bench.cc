@@ -0,0 +1,210 @@
+// Time a host spends inside the library while starting up: loading it,
+// creating the iterator, walking the devices and querying the API
+// version. Every run is a fresh process, so that nothing is cached from
+// the previous one. Runs are repeated with the host doing some work of
+// its own between loading the library and creating the iterator, which
+// the background device scan overlaps with.
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "DeckLinkAPI.h"
+
+namespace {
+
+    enum step_t {
+        step_load,
+        step_create_iterator,
+        step_first_next,
+        step_remaining_next,
+        step_api_information,
+        step_count
+    };
+
+    const char *step_name[] = {
+        "dlopen", "create iterator", "first Next", "remaining Next",
+        "API information"
+    };
+
+    double now(void)
+    {
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return t.tv_sec + t.tv_nsec * 1e-9;
+    }
+
+    // Runs in the child, fills in ms per step and the device count
+    bool measure(const std::string &library_path, unsigned int work_ms,
+                 double *ms, double *device_count)
+    {
+        double start = now();
+        void *library = dlopen(library_path.c_str(), RTLD_NOW);
+
+        ms[step_load] = (now() - start) * 1e3;
+        if (library == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            return false;
+        }
+
+        IDeckLinkIterator *(*create_iterator)(void) =
+            reinterpret_cast<IDeckLinkIterator *(*)(void)>
+            (dlsym(library, "CreateDeckLinkIteratorInstance_0002"));
+        IDeckLinkAPIInformation *(*create_api_information)(void) =
+            reinterpret_cast<IDeckLinkAPIInformation *(*)(void)>
+            (dlsym(library, "CreateDeckLinkAPIInformationInstance_0001"));
+
+        if (create_iterator == NULL || create_api_information == NULL) {
+            fprintf(stderr, "%s: missing entry points\n",
+                    library_path.c_str());
+            return false;
+        }
+
+        // The host's own initialization
+        usleep(work_ms * 1000);
+
+        start = now();
+
+        IDeckLinkIterator *iterator = create_iterator();
+
+        ms[step_create_iterator] = (now() - start) * 1e3;
+
+        IDeckLink *deck_link;
+
+        *device_count = 0;
+        start = now();
+        if (iterator != NULL && iterator->Next(&deck_link) == S_OK) {
+            deck_link->Release();
+            (*device_count)++;
+        }
+        ms[step_first_next] = (now() - start) * 1e3;
+        start = now();
+        while (iterator != NULL && iterator->Next(&deck_link) == S_OK) {
+            deck_link->Release();
+            (*device_count)++;
+        }
+        ms[step_remaining_next] = (now() - start) * 1e3;
+        if (iterator != NULL) {
+            iterator->Release();
+        }
+
+        start = now();
+
+        IDeckLinkAPIInformation *api_information =
+            create_api_information();
+        int64_t version = 0;
+
+        if (api_information != NULL) {
+            api_information->GetInt(BMDDeckLinkAPIVersion, &version);
+            api_information->Release();
+        }
+        ms[step_api_information] = (now() - start) * 1e3;
+
+        return true;
+    }
+
+    // ms[run][step], each run in a child process
+    bool run(const std::string &library_path, unsigned int work_ms,
+             unsigned int run_count,
+             std::vector<std::vector<double> > *ms, double *device_count)
+    {
+        ms->assign(run_count, std::vector<double>(step_count + 1));
+        for (unsigned int r = 0; r < run_count; r++) {
+            int pipe_fd[2];
+
+            if (pipe(pipe_fd) != 0) {
+                return false;
+            }
+
+            const pid_t pid = fork();
+
+            if (pid == 0) {
+                close(pipe_fd[0]);
+
+                double result[step_count + 1];
+                const bool ok = measure(library_path, work_ms, result,
+                                        &result[step_count]);
+
+                if (ok && write(pipe_fd[1], result, sizeof(result)) !=
+                    static_cast<ssize_t>(sizeof(result))) {
+                    _exit(1);
+                }
+                _exit(ok ? 0 : 1);
+            }
+            close(pipe_fd[1]);
+
+            const ssize_t size = sizeof(double) * (step_count + 1);
+            const bool ok = pid > 0 &&
+                read(pipe_fd[0], &(*ms)[r][0], size) == size;
+            int status = 0;
+
+            close(pipe_fd[0]);
+            if (pid > 0) {
+                waitpid(pid, &status, 0);
+            }
+            if (!ok) {
+                return false;
+            }
+            *device_count = (*ms)[r][step_count];
+        }
+
+        return true;
+    }
+
+    double median(std::vector<double> value)
+    {
+        std::sort(value.begin(), value.end());
+
+        return value[value.size() / 2];
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    // The library built in the tree by default
+    const std::string library_path =
+        argc > 1 ? argv[1] : "./libDeckLinkAPI.so";
+    static const unsigned int work_ms[] = { 0, 100 };
+    static const unsigned int run_count = 15;
+
+    for (size_t w = 0; w < sizeof(work_ms) / sizeof(*work_ms); w++) {
+        std::vector<std::vector<double> > ms;
+        double device_count = 0;
+
+        if (!run(library_path, work_ms[w], run_count, &ms,
+                 &device_count)) {
+            fprintf(stderr, "%s: run failed\n", library_path.c_str());
+            return 1;
+        }
+        printf("%s, host busy %u ms after loading, %.0f device(s), "
+               "median of %u runs\n", library_path.c_str(), work_ms[w],
+               device_count, run_count);
+
+        double total = 0;
+
+        for (int s = 0; s < step_count; s++) {
+            std::vector<double> step(run_count);
+
+            for (unsigned int r = 0; r < run_count; r++) {
+                step[r] = ms[r][s];
+            }
+
+            const double step_median = median(step);
+
+            total += step_median;
+            printf("  %-16s %9.3f ms\n", step_name[s], step_median);
+        }
+        printf("  %-16s %9.3f ms\n", "total", total);
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Cost of the trace.h probes: a bare clock_gettime() and time stamp
+// read for comparison, an instant event and a scope, on one thread and
+// on several at once, and the time to dump the full rings. Reports the
+// wall time over the events of all threads, which should stay under
+// 50 ns per event for probes on the audio and callback paths. A scope
+// reads the time stamp twice.
+
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+
+#include "trace.h"
+
+namespace {
+
+    const unsigned int thread_count[] = { 1, 4 };
+    const long iteration_count = 2000000;
+
+    enum probe_id_t {
+        probe_clock,
+        probe_ticks,
+        probe_instant,
+        probe_scope,
+        probe_count
+    };
+
+    const char *probe_name[] = { "clock", "ticks", "instant", "scope" };
+
+    volatile int64_t sink;
+
+    class run_t {
+    public:
+        probe_id_t _id;
+        long _iteration_count;
+    };
+
+    void scope(void)
+    {
+        TRACE_SCOPE("scope");
+    }
+
+    void *run(void *arg)
+    {
+        const run_t *r = static_cast<const run_t *>(arg);
+
+        for (long i = 0; i < r->_iteration_count; i++) {
+            switch (r->_id) {
+            case probe_clock:
+                sink = trace_now_ns();
+                break;
+            case probe_ticks:
+                sink = trace_ticks();
+                break;
+            case probe_instant:
+                TRACE_INSTANT("instant");
+                break;
+            default:
+                scope();
+                break;
+            }
+        }
+        return NULL;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    // "-s" for a quick run
+    const bool small = argc > 1 && strcmp(argv[1], "-s") == 0;
+    const long iteration = small ? iteration_count / 20 : iteration_count;
+
+    printf("%-8s %8s %9s\n", "probe", "threads", "ns/event");
+    for (int p = 0; p < probe_count; p++) {
+        for (size_t t = 0;
+             t < sizeof(thread_count) / sizeof(*thread_count); t++) {
+            run_t r;
+            pthread_t thread[4];
+
+            r._id = static_cast<probe_id_t>(p);
+            r._iteration_count = iteration;
+
+            const int64_t start = trace_now_ns();
+
+            for (unsigned int i = 0; i < thread_count[t]; i++) {
+                pthread_create(&thread[i], NULL, &run, &r);
+            }
+            for (unsigned int i = 0; i < thread_count[t]; i++) {
+                pthread_join(thread[i], NULL);
+            }
+
+            // CPU time per event when the threads share fewer cores
+            const double ns = static_cast<double>(trace_now_ns() - start) /
+                (iteration * thread_count[t]);
+
+            printf("%-8s %8u %9.2f\n", probe_name[p], thread_count[t], ns);
+        }
+    }
+
+    const int64_t start = trace_now_ns();
+    const bool dumped = trace_dump();
+
+    printf("dump %s in %.1f ms\n", dumped ? "written" : "failed",
+           (trace_now_ns() - start) * 1e-6);
+
+    return 0;
+}
@@ -1,25 +1,223 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
-#define DUMMY_IUNKNOWN_REFERENCE                            \
+#include <stdint.h>
+
+// Lock-free accessors for values shared between the audio/scheduler
+// threads and everything else. These never block and compile to
+// plain loads/stores on x86.
+
+template<typename T> inline T atomic_load(const T *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T> inline void atomic_store(T *p, T value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+template<typename T> inline T atomic_add(T *p, T value)
+{
+    return __atomic_add_fetch(p, value, __ATOMIC_ACQ_REL);
+}
+
+template<typename T> inline T atomic_or(T *p, T value)
+{
+    return __atomic_or_fetch(p, value, __ATOMIC_ACQ_REL);
+}
+
+template<typename T> inline T atomic_and(T *p, T value)
+{
+    return __atomic_and_fetch(p, value, __ATOMIC_ACQ_REL);
+}
+
+template<typename T> inline T atomic_exchange(T *p, T value)
+{
+    return __atomic_exchange_n(p, value, __ATOMIC_ACQ_REL);
+}
+
+template<typename T> inline bool
+atomic_compare_exchange(T *p, T *expected, T desired)
+{
+    return __atomic_compare_exchange_n(p, expected, desired, false,
+                                       __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+}
+
+// COM reference count. Objects are created with one reference, owned
+// by whoever called the factory/QueryInterface. Copying an object
+// (e.g. into a container) starts the copy at one reference, rather
+// than sharing the count of the original.
+class reference_count_t {
+protected:
+    int32_t _count;
+public:
+    reference_count_t(void)
+        : _count(1)
+    {
+    }
+    reference_count_t(const reference_count_t &reference_count)
+        : _count(1)
+    {
+    }
+    reference_count_t &operator=(const reference_count_t &
+                                 reference_count)
+    {
+        return *this;
+    }
+    ULONG add_ref(void)
+    {
+        return atomic_add(&_count, 1);
+    }
+    ULONG release(void)
+    {
+        return atomic_add(&_count, -1);
+    }
+    ULONG count(void) const
+    {
+        return atomic_load(&_count);
+    }
+};
+
+#ifdef DEBUG_OBJECT_LEAKS
+
+#include <cstdio>
+#include <pthread.h>
+
+// Live object count per class, reported to stderr when the library
+// is unloaded
+class object_registry_t {
+protected:
+    static const size_t max_class = 64;
+    pthread_mutex_t _mutex;
+    size_t _class_count;
+    const char *_name[max_class];
+    int64_t _live[max_class];
+    int64_t _overflow;
+public:
+    object_registry_t(void)
+        : _class_count(0), _overflow(0)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+    ~object_registry_t()
+    {
+        for (size_t i = 0; i < _class_count; i++) {
+            const int64_t live = atomic_load(&_live[i]);
+
+            if (live != 0) {
+                fprintf(stderr, "%s: %lld object(s) leaked\n",
+                        _name[i], static_cast<long long>(live));
+            }
+        }
+        pthread_mutex_destroy(&_mutex);
+    }
+    int64_t *counter(const char *name)
+    {
+        int64_t *counter = &_overflow;
+
+        pthread_mutex_lock(&_mutex);
+        if (_class_count < max_class) {
+            _name[_class_count] = name;
+            _live[_class_count] = 0;
+            counter = &_live[_class_count];
+            _class_count++;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        return counter;
+    }
+};
+
+inline object_registry_t &object_registry(void)
+{
+    static object_registry_t registry;
+
+    return registry;
+}
+
+template<typename T> class object_counter_t {
+protected:
+    static int64_t *counter(void)
+    {
+        static int64_t *counter =
+            object_registry().counter(T::class_name());
+
+        return counter;
+    }
+public:
+    object_counter_t(void)
+    {
+        atomic_add(counter(), int64_t(1));
+    }
+    object_counter_t(const object_counter_t &object_counter)
+    {
+        atomic_add(counter(), int64_t(1));
+    }
+    ~object_counter_t()
+    {
+        atomic_add(counter(), int64_t(-1));
+    }
+};
+
+#define IUNKNOWN_OBJECT_COUNTER(name)                       \
+    protected:                                              \
+    static const char *class_name(void)                     \
+    {                                                       \
+        return #name;                                       \
+    }                                                       \
+    friend class object_counter_t<name>;                    \
+    object_counter_t<name> _object_counter;
+
+#else // DEBUG_OBJECT_LEAKS
+
+#define IUNKNOWN_OBJECT_COUNTER(name)
+
+#endif // DEBUG_OBJECT_LEAKS
+
+#define IUNKNOWN_REFERENCE(name)                            \
+    IUNKNOWN_OBJECT_COUNTER(name)                           \
     protected:                                              \
-    size_t _ref;                                            \
+    reference_count_t _ref;                                 \
     public:                                                 \
     virtual ULONG STDMETHODCALLTYPE AddRef(void)            \
     {                                                       \
-        return ++_ref;                                      \
+        return _ref.add_ref();                              \
     }                                                       \
     virtual ULONG STDMETHODCALLTYPE Release(void)           \
     {                                                       \
-        return --_ref;                                      \
+        const ULONG count = _ref.release();                 \
+                                                            \
+        if (count == 0) {                                   \
+            delete this;                                    \
+        }                                                   \
+        return count;                                       \
     }
 
-#define DUMMY_IUNKNOWN                      \
+#define DUMMY_IUNKNOWN(name)                \
     HRESULT STDMETHODCALLTYPE               \
     QueryInterface(REFIID iid, LPVOID *ppv) \
     {                                       \
         return E_NOINTERFACE;               \
     }                                       \
-    DUMMY_IUNKNOWN_REFERENCE
+    IUNKNOWN_REFERENCE(name)
+
+// For objects with static lifetime, handed out without transferring
+// ownership
+#define STATIC_IUNKNOWN                                     \
+    HRESULT STDMETHODCALLTYPE                               \
+    QueryInterface(REFIID iid, LPVOID *ppv)                 \
+    {                                                       \
+        return E_NOINTERFACE;                               \
+    }                                                       \
+    virtual ULONG STDMETHODCALLTYPE AddRef(void)            \
+    {                                                       \
+        return 1;                                           \
+    }                                                       \
+    virtual ULONG STDMETHODCALLTYPE Release(void)           \
+    {                                                       \
+        return 1;                                           \
+    }
 
 #endif // COMMON_H_
@@ -0,0 +1,1896 @@
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "DeckLinkAPI.h"
+
+#include "common.h"
+#include "convert.h"
+
+namespace {
+
+    // Fixed point YUV <-> RGB matrices for one colorspace. The 8-bit
+    // kernels convert between video range YUV and full range RGB with
+    // 16-bit coefficients, so that they map onto pmaddwd. The generic
+    // path uses 10-bit YUV and 12-bit RGB with 32-bit coefficients.
+    class matrix_t {
+    protected:
+        static int16_t fixed16(double value, unsigned int fraction_bits)
+        {
+            return static_cast<int16_t>(lrint(ldexp(value, fraction_bits)));
+        }
+        static int32_t fixed32(double value, unsigned int fraction_bits)
+        {
+            return static_cast<int32_t>(lrint(ldexp(value, fraction_bits)));
+        }
+    public:
+        // 12 fraction bits
+        int16_t _y;
+        int16_t _rv;
+        int16_t _gu;
+        int16_t _gv;
+        int16_t _bu;
+        // 15 fraction bits, chroma is applied to the sum of a pixel
+        // pair and therefore shifted by 16
+        int16_t _yr;
+        int16_t _yg;
+        int16_t _yb;
+        int16_t _ur;
+        int16_t _ug;
+        int16_t _ub;
+        int16_t _vr;
+        int16_t _vg;
+        int16_t _vb;
+        // 16 fraction bits, chroma shifted by 17 likewise
+        int32_t _y10;
+        int32_t _rv10;
+        int32_t _gu10;
+        int32_t _gv10;
+        int32_t _bu10;
+        int32_t _yr10;
+        int32_t _yg10;
+        int32_t _yb10;
+        int32_t _ur10;
+        int32_t _ug10;
+        int32_t _ub10;
+        int32_t _vr10;
+        int32_t _vg10;
+        int32_t _vb10;
+        matrix_t(double kr, double kb)
+        {
+            const double kg = 1 - kr - kb;
+            // Normalized Y'PbPr <-> R'G'B'
+            const double rv = 2 * (1 - kr);
+            const double gu = -2 * kb * (1 - kb) / kg;
+            const double gv = -2 * kr * (1 - kr) / kg;
+            const double bu = 2 * (1 - kb);
+            const double ur = -kr / (2 * (1 - kb));
+            const double ug = -kg / (2 * (1 - kb));
+            const double vg = -kg / (2 * (1 - kr));
+            const double vb = -kb / (2 * (1 - kr));
+            const double y8 = 255.0 / 219;
+            const double c8 = 255.0 / 224;
+            const double y10 = 4095.0 / 876;
+            const double c10 = 4095.0 / 896;
+
+            _y = fixed16(y8, 12);
+            _rv = fixed16(c8 * rv, 12);
+            _gu = fixed16(c8 * gu, 12);
+            _gv = fixed16(c8 * gv, 12);
+            _bu = fixed16(c8 * bu, 12);
+            _yr = fixed16(kr / y8, 15);
+            _yg = fixed16(kg / y8, 15);
+            _yb = fixed16(kb / y8, 15);
+            _ur = fixed16(ur / c8, 15);
+            _ug = fixed16(ug / c8, 15);
+            _ub = fixed16(0.5 / c8, 15);
+            _vr = fixed16(0.5 / c8, 15);
+            _vg = fixed16(vg / c8, 15);
+            _vb = fixed16(vb / c8, 15);
+            _y10 = fixed32(y10, 16);
+            _rv10 = fixed32(c10 * rv, 16);
+            _gu10 = fixed32(c10 * gu, 16);
+            _gv10 = fixed32(c10 * gv, 16);
+            _bu10 = fixed32(c10 * bu, 16);
+            _yr10 = fixed32(kr / y10, 16);
+            _yg10 = fixed32(kg / y10, 16);
+            _yb10 = fixed32(kb / y10, 16);
+            _ur10 = fixed32(ur / c10, 16);
+            _ug10 = fixed32(ug / c10, 16);
+            _ub10 = fixed32(0.5 / c10, 16);
+            _vr10 = fixed32(0.5 / c10, 16);
+            _vg10 = fixed32(vg / c10, 16);
+            _vb10 = fixed32(vb / c10, 16);
+        }
+    };
+
+    const matrix_t &matrix(BMDDisplayModeFlags colorspace)
+    {
+        static const matrix_t rec601(0.299, 0.114);
+        static const matrix_t rec709(0.2126, 0.0722);
+
+        return (colorspace & bmdDisplayModeColorspaceRec601) != 0 ?
+            rec601 : rec709;
+    }
+
+    inline int clamp(int value, int max)
+    {
+        return value < 0 ? 0 : value > max ? max : value;
+    }
+
+    inline uint32_t load_le32(const uint8_t *p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) |
+            (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    inline uint32_t load_be32(const uint8_t *p)
+    {
+        return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) |
+            (p[2] << 8) | p[3];
+    }
+
+    inline void store_le32(uint8_t *p, uint32_t value)
+    {
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        p[3] = value >> 24;
+    }
+
+    inline void store_be32(uint8_t *p, uint32_t value)
+    {
+        p[0] = value >> 24;
+        p[1] = value >> 16;
+        p[2] = value >> 8;
+        p[3] = value;
+    }
+
+    inline long even(long width)
+    {
+        return (width + 1) & ~1L;
+    }
+
+    // Two int16 coefficients for pmaddwd, low applies to the even
+    // 16-bit lane
+    inline int32_t coefficient_pair(int16_t low, int16_t high)
+    {
+        return static_cast<uint16_t>(low) |
+            (static_cast<uint32_t>(static_cast<uint16_t>(high)) << 16);
+    }
+
+    // Direct kernels for the common pairs. The SIMD versions do exactly
+    // the same integer arithmetic as the scalar ones, and fall back to
+    // them for the remaining pixels of a row.
+
+    typedef void (*row_kernel_t)(const uint8_t *source,
+                                 uint8_t *destination, long width,
+                                 const matrix_t &m);
+
+    template<bool bgra>
+    void yuv8_to_rgb8_scalar(const uint8_t *source, uint8_t *destination,
+                             long width, const matrix_t &m)
+    {
+        for (long x = 0; x < width; x += 2, source += 4) {
+            const int u = source[0] - 128;
+            const int v = source[2] - 128;
+
+            for (long i = 0; i < 2 && x + i < width; i++) {
+                const int y = source[1 + 2 * i] - 16;
+                const uint8_t r =
+                    clamp((m._y * y + m._rv * v + 2048) >> 12, 255);
+                const uint8_t g =
+                    clamp((m._y * y + m._gu * u + m._gv * v + 2048) >> 12,
+                          255);
+                const uint8_t b =
+                    clamp((m._y * y + m._bu * u + 2048) >> 12, 255);
+
+                if (bgra) {
+                    destination[0] = b;
+                    destination[1] = g;
+                    destination[2] = r;
+                    destination[3] = 255;
+                }
+                else {
+                    destination[0] = 255;
+                    destination[1] = r;
+                    destination[2] = g;
+                    destination[3] = b;
+                }
+                destination += 4;
+            }
+        }
+    }
+
+    template<bool bgra>
+    void rgb8_to_yuv8_scalar(const uint8_t *source, uint8_t *destination,
+                             long width, const matrix_t &m)
+    {
+        const int r = bgra ? 2 : 1;
+        const int g = bgra ? 1 : 2;
+        const int b = bgra ? 0 : 3;
+
+        for (long x = 0; x < width; x += 2, destination += 4) {
+            const uint8_t *p0 = source + 4 * x;
+            // Odd widths repeat the last pixel
+            const uint8_t *p1 = x + 1 < width ? p0 + 4 : p0;
+            const int y0 = m._yr * p0[r] + m._yg * p0[g] + m._yb * p0[b];
+            const int y1 = m._yr * p1[r] + m._yg * p1[g] + m._yb * p1[b];
+            const int u = m._ur * p0[r] + m._ug * p0[g] + m._ub * p0[b] +
+                m._ur * p1[r] + m._ug * p1[g] + m._ub * p1[b];
+            const int v = m._vr * p0[r] + m._vg * p0[g] + m._vb * p0[b] +
+                m._vr * p1[r] + m._vg * p1[g] + m._vb * p1[b];
+
+            destination[0] =
+                clamp((u + (128 << 16) + (1 << 15)) >> 16, 255);
+            destination[1] =
+                clamp((y0 + (16 << 15) + (1 << 14)) >> 15, 255);
+            destination[2] =
+                clamp((v + (128 << 16) + (1 << 15)) >> 16, 255);
+            destination[3] =
+                clamp((y1 + (16 << 15) + (1 << 14)) >> 15, 255);
+        }
+    }
+
+    // ARGB <-> BGRA is a byte reversal either way
+    void swap_rgb8_scalar(const uint8_t *source, uint8_t *destination,
+                          long width, const matrix_t &m)
+    {
+        for (long x = 0; x < width; x++) {
+            store_be32(destination + 4 * x, load_le32(source + 4 * x));
+        }
+    }
+
+    void yuv8_to_yuv10_scalar(const uint8_t *source, uint8_t *destination,
+                              long width, const matrix_t &m)
+    {
+        const long count = 2 * even(width);
+        long i = 0;
+
+        for (; i + 3 <= count; i += 3, destination += 4) {
+            store_le32(destination,
+                       (source[i] << 2) | (source[i + 1] << 12) |
+                       (source[i + 2] << 22));
+        }
+        if (i < count) {
+            uint32_t word = 0;
+
+            for (long j = 0; i + j < count; j++) {
+                word |= source[i + j] << (2 + 10 * j);
+            }
+            store_le32(destination, word);
+        }
+    }
+
+    void yuv10_to_yuv8_scalar(const uint8_t *source, uint8_t *destination,
+                              long width, const matrix_t &m)
+    {
+        const long count = 2 * even(width);
+
+        for (long i = 0; i < count; i += 3, source += 4) {
+            const uint32_t word = load_le32(source);
+
+            for (long j = 0; j < 3 && i + j < count; j++) {
+                destination[i + j] =
+                    clamp((((word >> (10 * j)) & 0x3ff) + 2) >> 2, 255);
+            }
+        }
+    }
+
+    // Component i of a v210 row, in 2vuy order
+    inline int v210_component(const uint8_t *source, long i)
+    {
+        return (load_le32(source + 4 * (i / 3)) >> (10 * (i % 3))) & 0x3ff;
+    }
+
+    // 12-bit to 8-bit full range, as pack_rgb8() rounds
+    inline int rgb12_to_rgb8(int value)
+    {
+        return (value * 255 + 2047) / 4095;
+    }
+
+    // The generic v210 to 8-bit RGB path in one step, with the
+    // arithmetic of yuv10_to_rgb12() and pack_rgb8()
+    template<bool bgra>
+    void yuv10_to_rgb8_scalar(const uint8_t *source, uint8_t *destination,
+                              long width, const matrix_t &m)
+    {
+        for (long x = 0; x < width; x++, destination += 4) {
+            const int y = v210_component(source, 2 * x + 1) - 64;
+            const int u = v210_component(source, x / 2 * 4) - 512;
+            const int v = v210_component(source, x / 2 * 4 + 2) - 512;
+            const uint8_t r = rgb12_to_rgb8
+                (clamp((m._y10 * y + m._rv10 * v + 32768) >> 16, 4095));
+            const uint8_t g = rgb12_to_rgb8
+                (clamp((m._y10 * y + m._gu10 * u + m._gv10 * v +
+                        32768) >> 16, 4095));
+            const uint8_t b = rgb12_to_rgb8
+                (clamp((m._y10 * y + m._bu10 * u + 32768) >> 16, 4095));
+
+            if (bgra) {
+                destination[0] = b;
+                destination[1] = g;
+                destination[2] = r;
+                destination[3] = 255;
+            }
+            else {
+                destination[0] = 255;
+                destination[1] = r;
+                destination[2] = g;
+                destination[3] = b;
+            }
+        }
+    }
+
+    __attribute__((target("sse4.1")))
+    void swap_rgb8_sse41(const uint8_t *source, uint8_t *destination,
+                         long width, const matrix_t &m)
+    {
+        const __m128i reverse = _mm_setr_epi8
+            (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        long x = 0;
+
+        for (; x + 4 <= width; x += 4) {
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 4 * x),
+                 _mm_shuffle_epi8
+                 (_mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                  (source + 4 * x)), reverse));
+        }
+        swap_rgb8_scalar(source + 4 * x, destination + 4 * x, width - x,
+                         m);
+    }
+
+    template<bool bgra>
+    __attribute__((target("sse4.1")))
+    void yuv8_to_rgb8_sse41(const uint8_t *source, uint8_t *destination,
+                            long width, const matrix_t &m)
+    {
+        const __m128i y_mask = _mm_setr_epi8
+            (1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1);
+        const __m128i u_mask = _mm_setr_epi8
+            (0, -1, 0, -1, 4, -1, 4, -1, 8, -1, 8, -1, 12, -1, 12, -1);
+        const __m128i v_mask = _mm_setr_epi8
+            (2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1);
+        const __m128i y_offset = _mm_set1_epi16(16);
+        const __m128i c_offset = _mm_set1_epi16(128);
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i round = _mm_set1_epi32(2048);
+        const __m128i alpha = _mm_set1_epi8(-1);
+        const __m128i k_r = _mm_set1_epi32(coefficient_pair(m._y, m._rv));
+        const __m128i k_g = _mm_set1_epi32(coefficient_pair(m._y, m._gu));
+        const __m128i k_g_v =
+            _mm_set1_epi32(coefficient_pair(m._gv, 2048));
+        const __m128i k_b = _mm_set1_epi32(coefficient_pair(m._y, m._bu));
+        long x = 0;
+
+        for (; x + 8 <= width; x += 8) {
+            const __m128i p = _mm_loadu_si128
+                (reinterpret_cast<const __m128i *>(source + 2 * x));
+            const __m128i y =
+                _mm_sub_epi16(_mm_shuffle_epi8(p, y_mask), y_offset);
+            const __m128i u =
+                _mm_sub_epi16(_mm_shuffle_epi8(p, u_mask), c_offset);
+            const __m128i v =
+                _mm_sub_epi16(_mm_shuffle_epi8(p, v_mask), c_offset);
+            const __m128i yu_lo = _mm_unpacklo_epi16(y, u);
+            const __m128i yu_hi = _mm_unpackhi_epi16(y, u);
+            const __m128i yv_lo = _mm_unpacklo_epi16(y, v);
+            const __m128i yv_hi = _mm_unpackhi_epi16(y, v);
+            const __m128i v1_lo = _mm_unpacklo_epi16(v, one);
+            const __m128i v1_hi = _mm_unpackhi_epi16(v, one);
+            const __m128i r = _mm_packs_epi32
+                (_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv_lo, k_r),
+                                              round), 12),
+                 _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv_hi, k_r),
+                                              round), 12));
+            const __m128i g = _mm_packs_epi32
+                (_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_lo, k_g),
+                                              _mm_madd_epi16(v1_lo,
+                                                             k_g_v)),
+                                12),
+                 _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_hi, k_g),
+                                              _mm_madd_epi16(v1_hi,
+                                                             k_g_v)),
+                                12));
+            const __m128i b = _mm_packs_epi32
+                (_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_lo, k_b),
+                                              round), 12),
+                 _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu_hi, k_b),
+                                              round), 12));
+            const __m128i r8 = _mm_packus_epi16(r, r);
+            const __m128i g8 = _mm_packus_epi16(g, g);
+            const __m128i b8 = _mm_packus_epi16(b, b);
+            const __m128i low = bgra ?
+                _mm_unpacklo_epi8(b8, g8) : _mm_unpacklo_epi8(alpha, r8);
+            const __m128i high = bgra ?
+                _mm_unpacklo_epi8(r8, alpha) : _mm_unpacklo_epi8(g8, b8);
+
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 4 * x),
+                 _mm_unpacklo_epi16(low, high));
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 4 * x + 16),
+                 _mm_unpackhi_epi16(low, high));
+        }
+        yuv8_to_rgb8_scalar<bgra>(source + 2 * x, destination + 4 * x,
+                                  width - x, m);
+    }
+
+    template<bool bgra>
+    __attribute__((target("sse4.1")))
+    void rgb8_to_yuv8_sse41(const uint8_t *source, uint8_t *destination,
+                            long width, const matrix_t &m)
+    {
+        const __m128i bg_mask = bgra ?
+            _mm_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1,
+                          8, -1, 9, -1, 12, -1, 13, -1) :
+            _mm_setr_epi8(3, -1, 2, -1, 7, -1, 6, -1,
+                          11, -1, 10, -1, 15, -1, 14, -1);
+        const __m128i r_mask = bgra ?
+            _mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1,
+                          10, -1, -1, -1, 14, -1, -1, -1) :
+            _mm_setr_epi8(1, -1, -1, -1, 5, -1, -1, -1,
+                          9, -1, -1, -1, 13, -1, -1, -1);
+        const __m128i k_y_bg =
+            _mm_set1_epi32(coefficient_pair(m._yb, m._yg));
+        const __m128i k_y_r = _mm_set1_epi32(coefficient_pair(m._yr, 0));
+        const __m128i k_u_bg =
+            _mm_set1_epi32(coefficient_pair(m._ub, m._ug));
+        const __m128i k_u_r = _mm_set1_epi32(coefficient_pair(m._ur, 0));
+        const __m128i k_v_bg =
+            _mm_set1_epi32(coefficient_pair(m._vb, m._vg));
+        const __m128i k_v_r = _mm_set1_epi32(coefficient_pair(m._vr, 0));
+        const __m128i y_offset = _mm_set1_epi32((16 << 15) + (1 << 14));
+        const __m128i c_offset = _mm_set1_epi32((128 << 16) + (1 << 15));
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i max = _mm_set1_epi16(255);
+        long x = 0;
+
+        for (; x + 8 <= width; x += 8) {
+            const __m128i p0 = _mm_loadu_si128
+                (reinterpret_cast<const __m128i *>(source + 4 * x));
+            const __m128i p1 = _mm_loadu_si128
+                (reinterpret_cast<const __m128i *>(source + 4 * x + 16));
+            const __m128i bg0 = _mm_shuffle_epi8(p0, bg_mask);
+            const __m128i bg1 = _mm_shuffle_epi8(p1, bg_mask);
+            const __m128i r0 = _mm_shuffle_epi8(p0, r_mask);
+            const __m128i r1 = _mm_shuffle_epi8(p1, r_mask);
+            const __m128i y = _mm_packs_epi32
+                (_mm_srai_epi32
+                 (_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(bg0, k_y_bg),
+                                              _mm_madd_epi16(r0, k_y_r)),
+                                y_offset), 15),
+                 _mm_srai_epi32
+                 (_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(bg1, k_y_bg),
+                                              _mm_madd_epi16(r1, k_y_r)),
+                                y_offset), 15));
+            const __m128i u = _mm_srai_epi32
+                (_mm_add_epi32
+                 (_mm_hadd_epi32
+                  (_mm_add_epi32(_mm_madd_epi16(bg0, k_u_bg),
+                                 _mm_madd_epi16(r0, k_u_r)),
+                   _mm_add_epi32(_mm_madd_epi16(bg1, k_u_bg),
+                                 _mm_madd_epi16(r1, k_u_r))),
+                  c_offset), 16);
+            const __m128i v = _mm_srai_epi32
+                (_mm_add_epi32
+                 (_mm_hadd_epi32
+                  (_mm_add_epi32(_mm_madd_epi16(bg0, k_v_bg),
+                                 _mm_madd_epi16(r0, k_v_r)),
+                   _mm_add_epi32(_mm_madd_epi16(bg1, k_v_bg),
+                                 _mm_madd_epi16(r1, k_v_r))),
+                  c_offset), 16);
+            const __m128i c = _mm_packs_epi32(_mm_unpacklo_epi32(u, v),
+                                              _mm_unpackhi_epi32(u, v));
+
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 2 * x),
+                 _mm_or_si128
+                 (_mm_min_epi16(_mm_max_epi16(c, zero), max),
+                  _mm_slli_epi16(_mm_min_epi16(_mm_max_epi16(y, zero),
+                                               max), 8)));
+        }
+        rgb8_to_yuv8_scalar<bgra>(source + 4 * x, destination + 2 * x,
+                                  width - x, m);
+    }
+
+    __attribute__((target("sse4.1")))
+    void yuv8_to_yuv10_sse41(const uint8_t *source, uint8_t *destination,
+                             long width, const matrix_t &m)
+    {
+        const __m128i c0_mask = _mm_setr_epi8
+            (0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+        const __m128i c1_mask = _mm_setr_epi8
+            (1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+        const __m128i c2_mask = _mm_setr_epi8
+            (2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+        long x = 0;
+
+        // 6 pixels a step, the load reads 4 bytes further
+        for (; x + 8 <= width; x += 6) {
+            const __m128i p = _mm_loadu_si128
+                (reinterpret_cast<const __m128i *>(source + 2 * x));
+
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + x / 6 * 16),
+                 _mm_or_si128
+                 (_mm_or_si128(_mm_slli_epi32(_mm_shuffle_epi8(p, c0_mask),
+                                              2),
+                               _mm_slli_epi32(_mm_shuffle_epi8(p, c1_mask),
+                                              12)),
+                  _mm_slli_epi32(_mm_shuffle_epi8(p, c2_mask), 22)));
+        }
+        yuv8_to_yuv10_scalar(source + 2 * x, destination + x / 6 * 16,
+                             width - x, m);
+    }
+
+    // The 12 components of 4 v210 words rounded to 8 bits, in bytes
+    // 0-11
+    __attribute__((target("sse4.1")))
+    inline __m128i yuv10_to_yuv8_words_sse41(__m128i words)
+    {
+        const __m128i field = _mm_set1_epi32(0x3ff);
+        const __m128i two = _mm_set1_epi32(2);
+        const __m128i max = _mm_set1_epi32(255);
+        const __m128i compact = _mm_setr_epi8
+            (0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        const __m128i c0 = _mm_min_epi32
+            (_mm_srli_epi32(_mm_add_epi32(_mm_and_si128(words, field),
+                                          two), 2), max);
+        const __m128i c1 = _mm_min_epi32
+            (_mm_srli_epi32
+             (_mm_add_epi32(_mm_and_si128(_mm_srli_epi32(words, 10),
+                                          field), two), 2), max);
+        const __m128i c2 = _mm_min_epi32
+            (_mm_srli_epi32
+             (_mm_add_epi32(_mm_and_si128(_mm_srli_epi32(words, 20),
+                                          field), two), 2), max);
+
+        return _mm_shuffle_epi8
+            (_mm_or_si128(_mm_or_si128(c0, _mm_slli_epi32(c1, 8)),
+                          _mm_slli_epi32(c2, 16)), compact);
+    }
+
+    __attribute__((target("sse4.1")))
+    void yuv10_to_yuv8_sse41(const uint8_t *source, uint8_t *destination,
+                             long width, const matrix_t &m)
+    {
+        long x = 0;
+
+        for (; x + 12 <= width; x += 12) {
+            const uint8_t *p = source + x / 6 * 16;
+            const __m128i low = yuv10_to_yuv8_words_sse41
+                (_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+            const __m128i high = yuv10_to_yuv8_words_sse41
+                (_mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                 (p + 16)));
+
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 2 * x),
+                 _mm_or_si128(low, _mm_slli_si128(high, 12)));
+            _mm_storel_epi64
+                (reinterpret_cast<__m128i *>(destination + 2 * x + 16),
+                 _mm_srli_si128(high, 4));
+        }
+        yuv10_to_yuv8_scalar(source + x / 6 * 16, destination + 2 * x,
+                             width - x, m);
+    }
+
+    // Multiplying a v210 word by this moves the 10-bit field at the
+    // given offset to the top, per 32-bit lane
+    inline __m128i field_multiplier(int o0, int o1, int o2, int o3)
+    {
+        return _mm_setr_epi32(1 << (22 - o0), 1 << (22 - o1),
+                              1 << (22 - o2), 1 << (22 - o3));
+    }
+
+    __attribute__((target("sse4.1")))
+    inline __m128i v210_field_sse41(__m128i words, __m128i multiplier)
+    {
+        return _mm_srli_epi32(_mm_mullo_epi32(words, multiplier), 22);
+    }
+
+    // (value >> 16) clamped to 12 bits, then rgb12_to_rgb8() with the
+    // division by 4095 as (t + (t >> 12) + 1) >> 12, which is exact
+    // for the t it can see
+    __attribute__((target("sse4.1")))
+    inline __m128i rgb12_to_rgb8_sse41(__m128i value)
+    {
+        const __m128i v = _mm_min_epi32
+            (_mm_max_epi32(_mm_srai_epi32(value, 16), _mm_setzero_si128()),
+             _mm_set1_epi32(4095));
+        const __m128i t = _mm_add_epi32
+            (_mm_sub_epi32(_mm_slli_epi32(v, 8), v), _mm_set1_epi32(2047));
+
+        return _mm_srli_epi32
+            (_mm_add_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 12)),
+                           _mm_set1_epi32(1)), 12);
+    }
+
+    // Four pixels from their 10-bit fields, k holding _y10, _rv10,
+    // _gu10, _gv10 and _bu10
+    template<bool bgra>
+    __attribute__((target("sse4.1")))
+    inline __m128i yuv10_to_rgb8_pixels_sse41(__m128i y, __m128i u,
+                                              __m128i v, const __m128i *k)
+    {
+        const __m128i c_offset = _mm_set1_epi32(512);
+        const __m128i u0 = _mm_sub_epi32(u, c_offset);
+        const __m128i v0 = _mm_sub_epi32(v, c_offset);
+        const __m128i y0 = _mm_add_epi32
+            (_mm_mullo_epi32(_mm_sub_epi32(y, _mm_set1_epi32(64)), k[0]),
+             _mm_set1_epi32(32768));
+        const __m128i r = rgb12_to_rgb8_sse41
+            (_mm_add_epi32(y0, _mm_mullo_epi32(v0, k[1])));
+        const __m128i g = rgb12_to_rgb8_sse41
+            (_mm_add_epi32(_mm_add_epi32(y0, _mm_mullo_epi32(u0, k[2])),
+                           _mm_mullo_epi32(v0, k[3])));
+        const __m128i b = rgb12_to_rgb8_sse41
+            (_mm_add_epi32(y0, _mm_mullo_epi32(u0, k[4])));
+
+        if (bgra) {
+            return _mm_or_si128
+                (_mm_or_si128(b, _mm_slli_epi32(g, 8)),
+                 _mm_or_si128(_mm_slli_epi32(r, 16),
+                              _mm_set1_epi32(0xff000000)));
+        }
+        return _mm_or_si128
+            (_mm_or_si128(_mm_set1_epi32(0xff), _mm_slli_epi32(r, 8)),
+             _mm_or_si128(_mm_slli_epi32(g, 16), _mm_slli_epi32(b, 24)));
+    }
+
+    // 12 pixels a step, as three groups of 4 whose fields lie in the
+    // 16 bytes at offsets 0, 8 and 16. Each field is shuffled to its
+    // pixel's lane and shifted out.
+    template<bool bgra>
+    __attribute__((target("sse4.1")))
+    void yuv10_to_rgb8_sse41(const uint8_t *source, uint8_t *destination,
+                             long width, const matrix_t &m)
+    {
+        const __m128i k[5] = {
+            _mm_set1_epi32(m._y10), _mm_set1_epi32(m._rv10),
+            _mm_set1_epi32(m._gu10), _mm_set1_epi32(m._gv10),
+            _mm_set1_epi32(m._bu10)
+        };
+        const __m128i y0 = field_multiplier(10, 0, 20, 10);
+        const __m128i u0 = field_multiplier(0, 0, 10, 10);
+        const __m128i v0 = field_multiplier(20, 20, 0, 0);
+        const __m128i y1 = field_multiplier(0, 20, 10, 0);
+        const __m128i u1 = field_multiplier(20, 20, 0, 0);
+        const __m128i v1 = field_multiplier(10, 10, 20, 20);
+        const __m128i y2 = field_multiplier(20, 10, 0, 20);
+        const __m128i u2 = field_multiplier(10, 10, 20, 20);
+        const __m128i v2 = field_multiplier(0, 0, 10, 10);
+        long x = 0;
+
+        for (; x + 12 <= width; x += 12) {
+            const uint8_t *p = source + x / 6 * 16;
+            const __m128i w0 =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const __m128i w1 =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 8));
+            const __m128i w2 =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 4 * x),
+                 yuv10_to_rgb8_pixels_sse41<bgra>
+                 (v210_field_sse41(_mm_shuffle_epi32(w0, 0x94), y0),
+                  v210_field_sse41(_mm_shuffle_epi32(w0, 0x50), u0),
+                  v210_field_sse41(_mm_shuffle_epi32(w0, 0xa0), v0), k));
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 4 * x + 16),
+                 yuv10_to_rgb8_pixels_sse41<bgra>
+                 (v210_field_sse41(_mm_shuffle_epi32(w1, 0xe5), y1),
+                  v210_field_sse41(_mm_shuffle_epi32(w1, 0xa0), u1),
+                  v210_field_sse41(_mm_shuffle_epi32(w1, 0xa5), v1), k));
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 4 * x + 32),
+                 yuv10_to_rgb8_pixels_sse41<bgra>
+                 (v210_field_sse41(_mm_shuffle_epi32(w2, 0xf9), y2),
+                  v210_field_sse41(_mm_shuffle_epi32(w2, 0xa5), u2),
+                  v210_field_sse41(_mm_shuffle_epi32(w2, 0xfa), v2), k));
+        }
+        yuv10_to_rgb8_scalar<bgra>(source + x / 6 * 16,
+                                   destination + 4 * x, width - x, m);
+    }
+
+    __attribute__((target("avx2")))
+    void swap_rgb8_avx2(const uint8_t *source, uint8_t *destination,
+                        long width, const matrix_t &m)
+    {
+        const __m256i reverse = _mm256_setr_epi8
+            (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+             3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        long x = 0;
+
+        for (; x + 8 <= width; x += 8) {
+            _mm256_storeu_si256
+                (reinterpret_cast<__m256i *>(destination + 4 * x),
+                 _mm256_shuffle_epi8
+                 (_mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                     (source + 4 * x)), reverse));
+        }
+        swap_rgb8_scalar(source + 4 * x, destination + 4 * x, width - x,
+                         m);
+    }
+
+    // pshufb only shuffles within 128-bit lanes, so the AVX2 kernels
+    // process two 8-pixel halves side by side and fix up the order
+    // with cross-lane permutes
+    template<bool bgra>
+    __attribute__((target("avx2")))
+    void yuv8_to_rgb8_avx2(const uint8_t *source, uint8_t *destination,
+                           long width, const matrix_t &m)
+    {
+        const __m256i y_mask = _mm256_setr_epi8
+            (1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1,
+             1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1);
+        const __m256i u_mask = _mm256_setr_epi8
+            (0, -1, 0, -1, 4, -1, 4, -1, 8, -1, 8, -1, 12, -1, 12, -1,
+             0, -1, 0, -1, 4, -1, 4, -1, 8, -1, 8, -1, 12, -1, 12, -1);
+        const __m256i v_mask = _mm256_setr_epi8
+            (2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1,
+             2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1);
+        const __m256i y_offset = _mm256_set1_epi16(16);
+        const __m256i c_offset = _mm256_set1_epi16(128);
+        const __m256i one = _mm256_set1_epi16(1);
+        const __m256i round = _mm256_set1_epi32(2048);
+        const __m256i alpha = _mm256_set1_epi8(-1);
+        const __m256i k_r =
+            _mm256_set1_epi32(coefficient_pair(m._y, m._rv));
+        const __m256i k_g =
+            _mm256_set1_epi32(coefficient_pair(m._y, m._gu));
+        const __m256i k_g_v =
+            _mm256_set1_epi32(coefficient_pair(m._gv, 2048));
+        const __m256i k_b =
+            _mm256_set1_epi32(coefficient_pair(m._y, m._bu));
+        long x = 0;
+
+        for (; x + 16 <= width; x += 16) {
+            const __m256i p = _mm256_loadu_si256
+                (reinterpret_cast<const __m256i *>(source + 2 * x));
+            const __m256i y =
+                _mm256_sub_epi16(_mm256_shuffle_epi8(p, y_mask), y_offset);
+            const __m256i u =
+                _mm256_sub_epi16(_mm256_shuffle_epi8(p, u_mask), c_offset);
+            const __m256i v =
+                _mm256_sub_epi16(_mm256_shuffle_epi8(p, v_mask), c_offset);
+            const __m256i yu_lo = _mm256_unpacklo_epi16(y, u);
+            const __m256i yu_hi = _mm256_unpackhi_epi16(y, u);
+            const __m256i yv_lo = _mm256_unpacklo_epi16(y, v);
+            const __m256i yv_hi = _mm256_unpackhi_epi16(y, v);
+            const __m256i v1_lo = _mm256_unpacklo_epi16(v, one);
+            const __m256i v1_hi = _mm256_unpackhi_epi16(v, one);
+            const __m256i r = _mm256_packs_epi32
+                (_mm256_srai_epi32
+                 (_mm256_add_epi32(_mm256_madd_epi16(yv_lo, k_r), round),
+                  12),
+                 _mm256_srai_epi32
+                 (_mm256_add_epi32(_mm256_madd_epi16(yv_hi, k_r), round),
+                  12));
+            const __m256i g = _mm256_packs_epi32
+                (_mm256_srai_epi32
+                 (_mm256_add_epi32(_mm256_madd_epi16(yu_lo, k_g),
+                                   _mm256_madd_epi16(v1_lo, k_g_v)), 12),
+                 _mm256_srai_epi32
+                 (_mm256_add_epi32(_mm256_madd_epi16(yu_hi, k_g),
+                                   _mm256_madd_epi16(v1_hi, k_g_v)), 12));
+            const __m256i b = _mm256_packs_epi32
+                (_mm256_srai_epi32
+                 (_mm256_add_epi32(_mm256_madd_epi16(yu_lo, k_b), round),
+                  12),
+                 _mm256_srai_epi32
+                 (_mm256_add_epi32(_mm256_madd_epi16(yu_hi, k_b), round),
+                  12));
+            const __m256i r8 = _mm256_packus_epi16(r, r);
+            const __m256i g8 = _mm256_packus_epi16(g, g);
+            const __m256i b8 = _mm256_packus_epi16(b, b);
+            const __m256i low = bgra ?
+                _mm256_unpacklo_epi8(b8, g8) :
+                _mm256_unpacklo_epi8(alpha, r8);
+            const __m256i high = bgra ?
+                _mm256_unpacklo_epi8(r8, alpha) :
+                _mm256_unpacklo_epi8(g8, b8);
+            // Pixels 0-3 | 8-11 and 4-7 | 12-15
+            const __m256i p0 = _mm256_unpacklo_epi16(low, high);
+            const __m256i p1 = _mm256_unpackhi_epi16(low, high);
+
+            _mm256_storeu_si256
+                (reinterpret_cast<__m256i *>(destination + 4 * x),
+                 _mm256_permute2x128_si256(p0, p1, 0x20));
+            _mm256_storeu_si256
+                (reinterpret_cast<__m256i *>(destination + 4 * x + 32),
+                 _mm256_permute2x128_si256(p0, p1, 0x31));
+        }
+        yuv8_to_rgb8_scalar<bgra>(source + 2 * x, destination + 4 * x,
+                                  width - x, m);
+    }
+
+    template<bool bgra>
+    __attribute__((target("avx2")))
+    void rgb8_to_yuv8_avx2(const uint8_t *source, uint8_t *destination,
+                           long width, const matrix_t &m)
+    {
+        const __m256i bg_mask = bgra ?
+            _mm256_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1,
+                             8, -1, 9, -1, 12, -1, 13, -1,
+                             0, -1, 1, -1, 4, -1, 5, -1,
+                             8, -1, 9, -1, 12, -1, 13, -1) :
+            _mm256_setr_epi8(3, -1, 2, -1, 7, -1, 6, -1,
+                             11, -1, 10, -1, 15, -1, 14, -1,
+                             3, -1, 2, -1, 7, -1, 6, -1,
+                             11, -1, 10, -1, 15, -1, 14, -1);
+        const __m256i r_mask = bgra ?
+            _mm256_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1,
+                             10, -1, -1, -1, 14, -1, -1, -1,
+                             2, -1, -1, -1, 6, -1, -1, -1,
+                             10, -1, -1, -1, 14, -1, -1, -1) :
+            _mm256_setr_epi8(1, -1, -1, -1, 5, -1, -1, -1,
+                             9, -1, -1, -1, 13, -1, -1, -1,
+                             1, -1, -1, -1, 5, -1, -1, -1,
+                             9, -1, -1, -1, 13, -1, -1, -1);
+        const __m256i k_y_bg =
+            _mm256_set1_epi32(coefficient_pair(m._yb, m._yg));
+        const __m256i k_y_r =
+            _mm256_set1_epi32(coefficient_pair(m._yr, 0));
+        const __m256i k_u_bg =
+            _mm256_set1_epi32(coefficient_pair(m._ub, m._ug));
+        const __m256i k_u_r =
+            _mm256_set1_epi32(coefficient_pair(m._ur, 0));
+        const __m256i k_v_bg =
+            _mm256_set1_epi32(coefficient_pair(m._vb, m._vg));
+        const __m256i k_v_r =
+            _mm256_set1_epi32(coefficient_pair(m._vr, 0));
+        const __m256i y_offset =
+            _mm256_set1_epi32((16 << 15) + (1 << 14));
+        const __m256i c_offset =
+            _mm256_set1_epi32((128 << 16) + (1 << 15));
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i max = _mm256_set1_epi16(255);
+        long x = 0;
+
+        for (; x + 16 <= width; x += 16) {
+            const __m256i p0 = _mm256_loadu_si256
+                (reinterpret_cast<const __m256i *>(source + 4 * x));
+            const __m256i p1 = _mm256_loadu_si256
+                (reinterpret_cast<const __m256i *>(source + 4 * x + 32));
+            const __m256i bg0 = _mm256_shuffle_epi8(p0, bg_mask);
+            const __m256i bg1 = _mm256_shuffle_epi8(p1, bg_mask);
+            const __m256i r0 = _mm256_shuffle_epi8(p0, r_mask);
+            const __m256i r1 = _mm256_shuffle_epi8(p1, r_mask);
+            // Pixels 0-3, 8-11 | 4-7, 12-15 before the permute
+            const __m256i y = _mm256_permute4x64_epi64
+                (_mm256_packs_epi32
+                 (_mm256_srai_epi32
+                  (_mm256_add_epi32
+                   (_mm256_add_epi32(_mm256_madd_epi16(bg0, k_y_bg),
+                                     _mm256_madd_epi16(r0, k_y_r)),
+                    y_offset), 15),
+                  _mm256_srai_epi32
+                  (_mm256_add_epi32
+                   (_mm256_add_epi32(_mm256_madd_epi16(bg1, k_y_bg),
+                                     _mm256_madd_epi16(r1, k_y_r)),
+                    y_offset), 15)), 0xd8);
+            // Pairs 0, 1, 4, 5 | 2, 3, 6, 7 before the permute
+            const __m256i u = _mm256_permute4x64_epi64
+                (_mm256_srai_epi32
+                 (_mm256_add_epi32
+                  (_mm256_hadd_epi32
+                   (_mm256_add_epi32(_mm256_madd_epi16(bg0, k_u_bg),
+                                     _mm256_madd_epi16(r0, k_u_r)),
+                    _mm256_add_epi32(_mm256_madd_epi16(bg1, k_u_bg),
+                                     _mm256_madd_epi16(r1, k_u_r))),
+                   c_offset), 16), 0xd8);
+            const __m256i v = _mm256_permute4x64_epi64
+                (_mm256_srai_epi32
+                 (_mm256_add_epi32
+                  (_mm256_hadd_epi32
+                   (_mm256_add_epi32(_mm256_madd_epi16(bg0, k_v_bg),
+                                     _mm256_madd_epi16(r0, k_v_r)),
+                    _mm256_add_epi32(_mm256_madd_epi16(bg1, k_v_bg),
+                                     _mm256_madd_epi16(r1, k_v_r))),
+                   c_offset), 16), 0xd8);
+            const __m256i c =
+                _mm256_packs_epi32(_mm256_unpacklo_epi32(u, v),
+                                   _mm256_unpackhi_epi32(u, v));
+
+            _mm256_storeu_si256
+                (reinterpret_cast<__m256i *>(destination + 2 * x),
+                 _mm256_or_si256
+                 (_mm256_min_epi16(_mm256_max_epi16(c, zero), max),
+                  _mm256_slli_epi16
+                  (_mm256_min_epi16(_mm256_max_epi16(y, zero), max),
+                   8)));
+        }
+        rgb8_to_yuv8_scalar<bgra>(source + 4 * x, destination + 2 * x,
+                                  width - x, m);
+    }
+
+    __attribute__((target("avx2")))
+    void yuv8_to_yuv10_avx2(const uint8_t *source, uint8_t *destination,
+                            long width, const matrix_t &m)
+    {
+        const __m256i c0_mask = _mm256_setr_epi8
+            (0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+             0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+        const __m256i c1_mask = _mm256_setr_epi8
+            (1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+             1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+        const __m256i c2_mask = _mm256_setr_epi8
+            (2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+             2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+        long x = 0;
+
+        // 12 pixels a step, 6 per lane, the loads read 4 bytes further
+        for (; x + 14 <= width; x += 12) {
+            const __m256i p = _mm256_inserti128_si256
+                (_mm256_castsi128_si256
+                 (_mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                  (source + 2 * x))),
+                 _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                 (source + 2 * x + 12)), 1);
+
+            _mm256_storeu_si256
+                (reinterpret_cast<__m256i *>(destination + x / 6 * 16),
+                 _mm256_or_si256
+                 (_mm256_or_si256
+                  (_mm256_slli_epi32(_mm256_shuffle_epi8(p, c0_mask), 2),
+                   _mm256_slli_epi32(_mm256_shuffle_epi8(p, c1_mask), 12)),
+                  _mm256_slli_epi32(_mm256_shuffle_epi8(p, c2_mask), 22)));
+        }
+        yuv8_to_yuv10_scalar(source + 2 * x, destination + x / 6 * 16,
+                             width - x, m);
+    }
+
+    // The 24 components of 8 v210 words rounded to 8 bits, in bytes
+    // 0-11 of each lane
+    __attribute__((target("avx2")))
+    inline __m256i yuv10_to_yuv8_words_avx2(__m256i words)
+    {
+        const __m256i field = _mm256_set1_epi32(0x3ff);
+        const __m256i two = _mm256_set1_epi32(2);
+        const __m256i max = _mm256_set1_epi32(255);
+        const __m256i compact = _mm256_setr_epi8
+            (0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        const __m256i c0 = _mm256_min_epi32
+            (_mm256_srli_epi32
+             (_mm256_add_epi32(_mm256_and_si256(words, field), two), 2),
+             max);
+        const __m256i c1 = _mm256_min_epi32
+            (_mm256_srli_epi32
+             (_mm256_add_epi32
+              (_mm256_and_si256(_mm256_srli_epi32(words, 10), field),
+               two), 2), max);
+        const __m256i c2 = _mm256_min_epi32
+            (_mm256_srli_epi32
+             (_mm256_add_epi32
+              (_mm256_and_si256(_mm256_srli_epi32(words, 20), field),
+               two), 2), max);
+
+        return _mm256_shuffle_epi8
+            (_mm256_or_si256(_mm256_or_si256(c0, _mm256_slli_epi32(c1, 8)),
+                             _mm256_slli_epi32(c2, 16)), compact);
+    }
+
+    __attribute__((target("avx2")))
+    void yuv10_to_yuv8_avx2(const uint8_t *source, uint8_t *destination,
+                            long width, const matrix_t &m)
+    {
+        const __m256i low_order = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 0, 0);
+        const __m256i high_order =
+            _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 0, 1);
+        const __m256i rest_order =
+            _mm256_setr_epi32(2, 4, 5, 6, 0, 0, 0, 0);
+        long x = 0;
+
+        // 24 pixels a step, 64 bytes of v210 to 48 of 2vuy
+        for (; x + 24 <= width; x += 24) {
+            const uint8_t *p = source + x / 6 * 16;
+            const __m256i low = yuv10_to_yuv8_words_avx2
+                (_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+            const __m256i high = yuv10_to_yuv8_words_avx2
+                (_mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                    (p + 32)));
+
+            _mm256_storeu_si256
+                (reinterpret_cast<__m256i *>(destination + 2 * x),
+                 _mm256_blend_epi32
+                 (_mm256_permutevar8x32_epi32(low, low_order),
+                  _mm256_permutevar8x32_epi32(high, high_order), 0xc0));
+            _mm_storeu_si128
+                (reinterpret_cast<__m128i *>(destination + 2 * x + 32),
+                 _mm256_castsi256_si128
+                 (_mm256_permutevar8x32_epi32(high, rest_order)));
+        }
+        yuv10_to_yuv8_scalar(source + x / 6 * 16, destination + 2 * x,
+                             width - x, m);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i v210_field_avx2(__m256i words, __m256i index,
+                                   __m256i offset)
+    {
+        return _mm256_and_si256
+            (_mm256_srlv_epi32(_mm256_permutevar8x32_epi32(words, index),
+                               offset), _mm256_set1_epi32(0x3ff));
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i rgb12_to_rgb8_avx2(__m256i value)
+    {
+        const __m256i v = _mm256_min_epi32
+            (_mm256_max_epi32(_mm256_srai_epi32(value, 16),
+                              _mm256_setzero_si256()),
+             _mm256_set1_epi32(4095));
+        const __m256i t = _mm256_add_epi32
+            (_mm256_sub_epi32(_mm256_slli_epi32(v, 8), v),
+             _mm256_set1_epi32(2047));
+
+        return _mm256_srli_epi32
+            (_mm256_add_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 12)),
+                              _mm256_set1_epi32(1)), 12);
+    }
+
+    template<bool bgra>
+    __attribute__((target("avx2")))
+    inline __m256i yuv10_to_rgb8_pixels_avx2(__m256i y, __m256i u,
+                                             __m256i v, const __m256i *k)
+    {
+        const __m256i c_offset = _mm256_set1_epi32(512);
+        const __m256i u0 = _mm256_sub_epi32(u, c_offset);
+        const __m256i v0 = _mm256_sub_epi32(v, c_offset);
+        const __m256i y0 = _mm256_add_epi32
+            (_mm256_mullo_epi32(_mm256_sub_epi32(y, _mm256_set1_epi32(64)),
+                                k[0]), _mm256_set1_epi32(32768));
+        const __m256i r = rgb12_to_rgb8_avx2
+            (_mm256_add_epi32(y0, _mm256_mullo_epi32(v0, k[1])));
+        const __m256i g = rgb12_to_rgb8_avx2
+            (_mm256_add_epi32
+             (_mm256_add_epi32(y0, _mm256_mullo_epi32(u0, k[2])),
+              _mm256_mullo_epi32(v0, k[3])));
+        const __m256i b = rgb12_to_rgb8_avx2
+            (_mm256_add_epi32(y0, _mm256_mullo_epi32(u0, k[4])));
+
+        if (bgra) {
+            return _mm256_or_si256
+                (_mm256_or_si256(b, _mm256_slli_epi32(g, 8)),
+                 _mm256_or_si256(_mm256_slli_epi32(r, 16),
+                                 _mm256_set1_epi32(0xff000000)));
+        }
+        return _mm256_or_si256
+            (_mm256_or_si256(_mm256_set1_epi32(0xff),
+                             _mm256_slli_epi32(r, 8)),
+             _mm256_or_si256(_mm256_slli_epi32(g, 16),
+                             _mm256_slli_epi32(b, 24)));
+    }
+
+    // 24 pixels a step, as three groups of 8 whose fields lie in the
+    // 32 bytes at offsets 0, 16 and 32. Unlike pshufb, vpermd crosses
+    // lanes, and vpsrlvd shifts each lane by its own count.
+    template<bool bgra>
+    __attribute__((target("avx2")))
+    void yuv10_to_rgb8_avx2(const uint8_t *source, uint8_t *destination,
+                            long width, const matrix_t &m)
+    {
+        const __m256i k[5] = {
+            _mm256_set1_epi32(m._y10), _mm256_set1_epi32(m._rv10),
+            _mm256_set1_epi32(m._gu10), _mm256_set1_epi32(m._gv10),
+            _mm256_set1_epi32(m._bu10)
+        };
+        // Word and bit offset of each pixel's Y, Cb and Cr
+        const __m256i index[9] = {
+            _mm256_setr_epi32(0, 1, 1, 2, 3, 3, 4, 5),
+            _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 4, 4),
+            _mm256_setr_epi32(0, 0, 2, 2, 3, 3, 4, 4),
+            _mm256_setr_epi32(1, 2, 3, 3, 4, 5, 5, 6),
+            _mm256_setr_epi32(1, 1, 2, 2, 4, 4, 5, 5),
+            _mm256_setr_epi32(2, 2, 3, 3, 4, 4, 6, 6),
+            _mm256_setr_epi32(3, 3, 4, 5, 5, 6, 7, 7),
+            _mm256_setr_epi32(2, 2, 4, 4, 5, 5, 6, 6),
+            _mm256_setr_epi32(3, 3, 4, 4, 6, 6, 7, 7)
+        };
+        const __m256i offset[9] = {
+            _mm256_setr_epi32(10, 0, 20, 10, 0, 20, 10, 0),
+            _mm256_setr_epi32(0, 0, 10, 10, 20, 20, 0, 0),
+            _mm256_setr_epi32(20, 20, 0, 0, 10, 10, 20, 20),
+            _mm256_setr_epi32(20, 10, 0, 20, 10, 0, 20, 10),
+            _mm256_setr_epi32(10, 10, 20, 20, 0, 0, 10, 10),
+            _mm256_setr_epi32(0, 0, 10, 10, 20, 20, 0, 0),
+            _mm256_setr_epi32(0, 20, 10, 0, 20, 10, 0, 20),
+            _mm256_setr_epi32(20, 20, 0, 0, 10, 10, 20, 20),
+            _mm256_setr_epi32(10, 10, 20, 20, 0, 0, 10, 10)
+        };
+        long x = 0;
+
+        for (; x + 24 <= width; x += 24) {
+            const uint8_t *p = source + x / 6 * 16;
+
+            for (int i = 0; i < 3; i++) {
+                const __m256i w = _mm256_loadu_si256
+                    (reinterpret_cast<const __m256i *>(p + 16 * i));
+
+                _mm256_storeu_si256
+                    (reinterpret_cast<__m256i *>
+                     (destination + 4 * x + 32 * i),
+                     yuv10_to_rgb8_pixels_avx2<bgra>
+                     (v210_field_avx2(w, index[3 * i], offset[3 * i]),
+                      v210_field_avx2(w, index[3 * i + 1],
+                                      offset[3 * i + 1]),
+                      v210_field_avx2(w, index[3 * i + 2],
+                                      offset[3 * i + 2]), k));
+            }
+        }
+        yuv10_to_rgb8_scalar<bgra>(source + x / 6 * 16,
+                                   destination + 4 * x, width - x, m);
+    }
+
+    class kernel_t {
+    public:
+        BMDPixelFormat _source;
+        BMDPixelFormat _destination;
+        convert_isa_t _isa;
+        row_kernel_t _kernel;
+    };
+
+    // Best first, the first entry not above the active ISA is used
+    const kernel_t kernel[] = {
+        {bmdFormat8BitYUV,  bmdFormat8BitBGRA, convert_isa_avx2,
+         yuv8_to_rgb8_avx2<true>},
+        {bmdFormat8BitYUV,  bmdFormat8BitBGRA, convert_isa_sse41,
+         yuv8_to_rgb8_sse41<true>},
+        {bmdFormat8BitYUV,  bmdFormat8BitBGRA, convert_isa_scalar,
+         yuv8_to_rgb8_scalar<true>},
+        {bmdFormat8BitYUV,  bmdFormat8BitARGB, convert_isa_avx2,
+         yuv8_to_rgb8_avx2<false>},
+        {bmdFormat8BitYUV,  bmdFormat8BitARGB, convert_isa_sse41,
+         yuv8_to_rgb8_sse41<false>},
+        {bmdFormat8BitYUV,  bmdFormat8BitARGB, convert_isa_scalar,
+         yuv8_to_rgb8_scalar<false>},
+        {bmdFormat8BitBGRA, bmdFormat8BitYUV,  convert_isa_avx2,
+         rgb8_to_yuv8_avx2<true>},
+        {bmdFormat8BitBGRA, bmdFormat8BitYUV,  convert_isa_sse41,
+         rgb8_to_yuv8_sse41<true>},
+        {bmdFormat8BitBGRA, bmdFormat8BitYUV,  convert_isa_scalar,
+         rgb8_to_yuv8_scalar<true>},
+        {bmdFormat8BitARGB, bmdFormat8BitYUV,  convert_isa_avx2,
+         rgb8_to_yuv8_avx2<false>},
+        {bmdFormat8BitARGB, bmdFormat8BitYUV,  convert_isa_sse41,
+         rgb8_to_yuv8_sse41<false>},
+        {bmdFormat8BitARGB, bmdFormat8BitYUV,  convert_isa_scalar,
+         rgb8_to_yuv8_scalar<false>},
+        {bmdFormat8BitARGB, bmdFormat8BitBGRA, convert_isa_avx2,
+         swap_rgb8_avx2},
+        {bmdFormat8BitARGB, bmdFormat8BitBGRA, convert_isa_sse41,
+         swap_rgb8_sse41},
+        {bmdFormat8BitARGB, bmdFormat8BitBGRA, convert_isa_scalar,
+         swap_rgb8_scalar},
+        {bmdFormat8BitBGRA, bmdFormat8BitARGB, convert_isa_avx2,
+         swap_rgb8_avx2},
+        {bmdFormat8BitBGRA, bmdFormat8BitARGB, convert_isa_sse41,
+         swap_rgb8_sse41},
+        {bmdFormat8BitBGRA, bmdFormat8BitARGB, convert_isa_scalar,
+         swap_rgb8_scalar},
+        {bmdFormat8BitYUV,  bmdFormat10BitYUV, convert_isa_avx2,
+         yuv8_to_yuv10_avx2},
+        {bmdFormat8BitYUV,  bmdFormat10BitYUV, convert_isa_sse41,
+         yuv8_to_yuv10_sse41},
+        {bmdFormat8BitYUV,  bmdFormat10BitYUV, convert_isa_scalar,
+         yuv8_to_yuv10_scalar},
+        {bmdFormat10BitYUV, bmdFormat8BitYUV,  convert_isa_avx2,
+         yuv10_to_yuv8_avx2},
+        {bmdFormat10BitYUV, bmdFormat8BitYUV,  convert_isa_sse41,
+         yuv10_to_yuv8_sse41},
+        {bmdFormat10BitYUV, bmdFormat8BitYUV,  convert_isa_scalar,
+         yuv10_to_yuv8_scalar},
+        {bmdFormat10BitYUV, bmdFormat8BitBGRA, convert_isa_avx2,
+         yuv10_to_rgb8_avx2<true>},
+        {bmdFormat10BitYUV, bmdFormat8BitBGRA, convert_isa_sse41,
+         yuv10_to_rgb8_sse41<true>},
+        {bmdFormat10BitYUV, bmdFormat8BitBGRA, convert_isa_scalar,
+         yuv10_to_rgb8_scalar<true>},
+        {bmdFormat10BitYUV, bmdFormat8BitARGB, convert_isa_avx2,
+         yuv10_to_rgb8_avx2<false>},
+        {bmdFormat10BitYUV, bmdFormat8BitARGB, convert_isa_sse41,
+         yuv10_to_rgb8_sse41<false>},
+        {bmdFormat10BitYUV, bmdFormat8BitARGB, convert_isa_scalar,
+         yuv10_to_rgb8_scalar<false>}
+    };
+
+    // Generic path: unpack a row to 10-bit YUV components in 2vuy
+    // order (Cb Y Cr Y), or to 12-bit full range RGBA, convert between
+    // the two if needed, and pack. Rows are padded to an even number
+    // of pixels.
+
+    typedef void (*unpack_t)(const uint8_t *source, uint16_t *row,
+                             long width);
+    typedef void (*pack_t)(const uint16_t *row, uint8_t *destination,
+                           long width);
+
+    void unpack_2vuy(const uint8_t *source, uint16_t *row, long width)
+    {
+        for (long i = 0; i < 2 * even(width); i++) {
+            row[i] = source[i] << 2;
+        }
+    }
+
+    void pack_2vuy(const uint16_t *row, uint8_t *destination, long width)
+    {
+        for (long i = 0; i < 2 * even(width); i++) {
+            destination[i] = clamp((row[i] + 2) >> 2, 255);
+        }
+    }
+
+    void unpack_v210(const uint8_t *source, uint16_t *row, long width)
+    {
+        const long count = 2 * even(width);
+
+        for (long i = 0; i < count; i += 3, source += 4) {
+            const uint32_t word = load_le32(source);
+
+            row[i] = word & 0x3ff;
+            row[i + 1] = (word >> 10) & 0x3ff;
+            row[i + 2] = (word >> 20) & 0x3ff;
+        }
+    }
+
+    void pack_v210(const uint16_t *row, uint8_t *destination, long width)
+    {
+        const long count = 2 * even(width);
+
+        for (long i = 0; i < count; i += 3, destination += 4) {
+            uint32_t word = 0;
+
+            for (long j = 0; j < 3 && i + j < count; j++) {
+                word |= static_cast<uint32_t>(row[i + j]) << (10 * j);
+            }
+            store_le32(destination, word);
+        }
+    }
+
+    template<bool bgra>
+    void unpack_rgb8(const uint8_t *source, uint16_t *row, long width)
+    {
+        static const int offset[4] = {
+            bgra ? 2 : 1, bgra ? 1 : 2, bgra ? 0 : 3, bgra ? 3 : 0
+        };
+
+        for (long x = 0; x < even(width); x++) {
+            const uint8_t *p = source + 4 * (x < width ? x : x - 1);
+
+            for (int i = 0; i < 4; i++) {
+                row[4 * x + i] = (p[offset[i]] << 4) | (p[offset[i]] >> 4);
+            }
+        }
+    }
+
+    template<bool bgra>
+    void pack_rgb8(const uint16_t *row, uint8_t *destination, long width)
+    {
+        static const int offset[4] = {
+            bgra ? 2 : 1, bgra ? 1 : 2, bgra ? 0 : 3, bgra ? 3 : 0
+        };
+
+        for (long x = 0; x < width; x++) {
+            for (int i = 0; i < 4; i++) {
+                destination[4 * x + offset[i]] =
+                    (row[4 * x + i] * 255 + 2047) / 4095;
+            }
+        }
+    }
+
+    // r210 is 2:10:10:10 big-endian, R10b/R10l are 10:10:10:2 in big
+    // and little-endian, all with 64-940 video levels
+    enum {
+        rgb10_r210,
+        rgb10_r10b,
+        rgb10_r10l
+    };
+
+    template<int layout>
+    void unpack_rgb10(const uint8_t *source, uint16_t *row, long width)
+    {
+        const unsigned int shift = layout == rgb10_r210 ? 0 : 2;
+
+        for (long x = 0; x < even(width); x++) {
+            const uint8_t *p = source + 4 * (x < width ? x : x - 1);
+            const uint32_t word = layout == rgb10_r10l ?
+                load_le32(p) : load_be32(p);
+
+            for (int i = 0; i < 3; i++) {
+                const int value = (word >> (shift + 10 * (2 - i))) & 0x3ff;
+
+                row[4 * x + i] =
+                    clamp(((value - 64) * 4095 + 438) / 876, 4095);
+            }
+            row[4 * x + 3] = 4095;
+        }
+    }
+
+    template<int layout>
+    void pack_rgb10(const uint16_t *row, uint8_t *destination, long width)
+    {
+        const unsigned int shift = layout == rgb10_r210 ? 0 : 2;
+
+        for (long x = 0; x < width; x++) {
+            uint32_t word = 0;
+
+            for (int i = 0; i < 3; i++) {
+                word |= static_cast<uint32_t>
+                    (64 + (row[4 * x + i] * 876 + 2047) / 4095) <<
+                    (shift + 10 * (2 - i));
+            }
+            if (layout == rgb10_r10l) {
+                store_le32(destination + 4 * x, word);
+            }
+            else {
+                store_be32(destination + 4 * x, word);
+            }
+        }
+    }
+
+    void yuv10_to_rgb12(const uint16_t *source, uint16_t *destination,
+                        long width, const matrix_t &m)
+    {
+        for (long x = 0; x < even(width); x += 2, source += 4) {
+            const int u = source[0] - 512;
+            const int v = source[2] - 512;
+
+            for (int i = 0; i < 2; i++, destination += 4) {
+                const int y = source[1 + 2 * i] - 64;
+
+                destination[0] =
+                    clamp((m._y10 * y + m._rv10 * v + 32768) >> 16, 4095);
+                destination[1] =
+                    clamp((m._y10 * y + m._gu10 * u + m._gv10 * v +
+                           32768) >> 16, 4095);
+                destination[2] =
+                    clamp((m._y10 * y + m._bu10 * u + 32768) >> 16, 4095);
+                destination[3] = 4095;
+            }
+        }
+    }
+
+    void rgb12_to_yuv10(const uint16_t *source, uint16_t *destination,
+                        long width, const matrix_t &m)
+    {
+        for (long x = 0; x < even(width); x += 2, source += 8) {
+            const uint16_t *p0 = source;
+            const uint16_t *p1 = source + 4;
+            const int y0 = m._yr10 * p0[0] + m._yg10 * p0[1] +
+                m._yb10 * p0[2];
+            const int y1 = m._yr10 * p1[0] + m._yg10 * p1[1] +
+                m._yb10 * p1[2];
+            const int u = m._ur10 * (p0[0] + p1[0]) +
+                m._ug10 * (p0[1] + p1[1]) + m._ub10 * (p0[2] + p1[2]);
+            const int v = m._vr10 * (p0[0] + p1[0]) +
+                m._vg10 * (p0[1] + p1[1]) + m._vb10 * (p0[2] + p1[2]);
+
+            destination[2 * x] =
+                clamp((u + (512 << 17) + (1 << 16)) >> 17, 1023);
+            destination[2 * x + 1] =
+                clamp((y0 + (64 << 16) + (1 << 15)) >> 16, 1023);
+            destination[2 * x + 2] =
+                clamp((v + (512 << 17) + (1 << 16)) >> 17, 1023);
+            destination[2 * x + 3] =
+                clamp((y1 + (64 << 16) + (1 << 15)) >> 16, 1023);
+        }
+    }
+
+    class format_t {
+    public:
+        BMDPixelFormat _pixel_format;
+        bool _yuv;
+        unpack_t _unpack;
+        pack_t _pack;
+    };
+
+    const format_t format[] = {
+        {bmdFormat8BitYUV,     true,  unpack_2vuy, pack_2vuy},
+        {bmdFormat10BitYUV,    true,  unpack_v210, pack_v210},
+        {bmdFormat8BitARGB,    false, unpack_rgb8<false>,
+         pack_rgb8<false>},
+        {bmdFormat8BitBGRA,    false, unpack_rgb8<true>,
+         pack_rgb8<true>},
+        {bmdFormat10BitRGB,    false, unpack_rgb10<rgb10_r210>,
+         pack_rgb10<rgb10_r210>},
+        {bmdFormat10BitRGBX,   false, unpack_rgb10<rgb10_r10b>,
+         pack_rgb10<rgb10_r10b>},
+        {bmdFormat10BitRGBXLE, false, unpack_rgb10<rgb10_r10l>,
+         pack_rgb10<rgb10_r10l>}
+    };
+
+    const format_t *find_format(BMDPixelFormat pixel_format)
+    {
+        for (size_t i = 0; i < sizeof(format) / sizeof(*format); i++) {
+            if (format[i]._pixel_format == pixel_format) {
+                return &format[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    convert_isa_t cpu_isa(void)
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return convert_isa_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return convert_isa_sse41;
+        }
+        return convert_isa_scalar;
+    }
+
+    int64_t initial_isa(void)
+    {
+        const char *isa = getenv("SOUNDDECK_CONVERT_ISA");
+        const convert_isa_t supported = cpu_isa();
+
+        if (isa != NULL) {
+            if (strcmp(isa, "scalar") == 0) {
+                return convert_isa_scalar;
+            }
+            if (strcmp(isa, "sse4.1") == 0 &&
+                supported >= convert_isa_sse41) {
+                return convert_isa_sse41;
+            }
+        }
+
+        return supported;
+    }
+
+    int64_t &isa_setting(void)
+    {
+        static int64_t isa = initial_isa();
+
+        return isa;
+    }
+
+    int64_t initial_thread_count(void)
+    {
+        const char *thread_count = getenv("SOUNDDECK_CONVERT_THREADS");
+
+        if (thread_count != NULL && atoi(thread_count) > 0) {
+            return atoi(thread_count);
+        }
+
+        const long cpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        return cpu > 0 ? cpu : 1;
+    }
+
+    int64_t &thread_count_setting(void)
+    {
+        static int64_t thread_count = initial_thread_count();
+
+        return thread_count;
+    }
+
+    // Runs a function over row slices on worker threads, the calling
+    // thread taking slices as well. Workers are started on demand and
+    // live until the library is unloaded. Only one job runs at a
+    // time, a concurrent caller just converts on its own thread.
+    class row_pool_t {
+    public:
+        typedef void (*row_function_t)(void *arg, long begin, long end);
+    protected:
+        class job_t {
+        public:
+            row_function_t _function;
+            void *_arg;
+            long _row_count;
+            long _slice_rows;
+            long _next_row;
+            size_t _thread_limit;
+        };
+        pthread_mutex_t _submit_mutex;
+        pthread_mutex_t _mutex;
+        pthread_cond_t _work_cond;
+        pthread_cond_t _done_cond;
+        std::vector<pthread_t> _thread;
+        job_t *_job;
+        uint64_t _generation;
+        size_t _active;
+        bool _stop;
+        static void run_slices(job_t *job)
+        {
+            while (true) {
+                const long begin =
+                    atomic_add(&job->_next_row, job->_slice_rows) -
+                    job->_slice_rows;
+
+                if (begin >= job->_row_count) {
+                    return;
+                }
+                job->_function(job->_arg, begin,
+                               std::min(begin + job->_slice_rows,
+                                        job->_row_count));
+            }
+        }
+        static void *worker(void *arg)
+        {
+            row_pool_t *pool = reinterpret_cast<row_pool_t *>(arg);
+            uint64_t generation = 0;
+
+            pthread_mutex_lock(&pool->_mutex);
+            while (true) {
+                while (!pool->_stop &&
+                       (pool->_job == NULL ||
+                        pool->_generation == generation ||
+                        pool->_active >= pool->_job->_thread_limit)) {
+                    pthread_cond_wait(&pool->_work_cond, &pool->_mutex);
+                }
+                if (pool->_stop) {
+                    break;
+                }
+                generation = pool->_generation;
+
+                job_t *job = pool->_job;
+
+                pool->_active++;
+                pthread_mutex_unlock(&pool->_mutex);
+                run_slices(job);
+                pthread_mutex_lock(&pool->_mutex);
+                if (--pool->_active == 0) {
+                    pthread_cond_broadcast(&pool->_done_cond);
+                }
+            }
+            pthread_mutex_unlock(&pool->_mutex);
+
+            return NULL;
+        }
+    public:
+        row_pool_t(void)
+            : _job(NULL), _generation(0), _active(0), _stop(false)
+        {
+            pthread_mutex_init(&_submit_mutex, NULL);
+            pthread_mutex_init(&_mutex, NULL);
+            pthread_cond_init(&_work_cond, NULL);
+            pthread_cond_init(&_done_cond, NULL);
+        }
+        ~row_pool_t()
+        {
+            pthread_mutex_lock(&_mutex);
+            _stop = true;
+            pthread_cond_broadcast(&_work_cond);
+            pthread_mutex_unlock(&_mutex);
+            for (std::vector<pthread_t>::iterator iterator =
+                     _thread.begin();
+                 iterator != _thread.end(); iterator++) {
+                pthread_join(*iterator, NULL);
+            }
+            pthread_cond_destroy(&_done_cond);
+            pthread_cond_destroy(&_work_cond);
+            pthread_mutex_destroy(&_mutex);
+            pthread_mutex_destroy(&_submit_mutex);
+        }
+        void run(row_function_t function, void *arg, long row_count,
+                 size_t thread_count)
+        {
+            if (thread_count <= 1 ||
+                pthread_mutex_trylock(&_submit_mutex) != 0) {
+                function(arg, 0, row_count);
+                return;
+            }
+
+            // The caller counts as one thread
+            while (_thread.size() + 1 < thread_count) {
+                pthread_t thread;
+
+                if (pthread_create(&thread, NULL, &row_pool_t::worker,
+                                   this) != 0) {
+                    break;
+                }
+                _thread.push_back(thread);
+            }
+
+            job_t job;
+
+            job._function = function;
+            job._arg = arg;
+            job._row_count = row_count;
+            // A few slices per thread to even out the load
+            job._slice_rows = std::max
+                (1L, (row_count + 4 * static_cast<long>(thread_count) -
+                      1) / (4 * static_cast<long>(thread_count)));
+            job._next_row = 0;
+            job._thread_limit = thread_count - 1;
+
+            pthread_mutex_lock(&_mutex);
+            _job = &job;
+            _generation++;
+            pthread_cond_broadcast(&_work_cond);
+            pthread_mutex_unlock(&_mutex);
+
+            run_slices(&job);
+
+            // No worker may still hold the job once it goes out of
+            // scope
+            pthread_mutex_lock(&_mutex);
+            _job = NULL;
+            while (_active > 0) {
+                pthread_cond_wait(&_done_cond, &_mutex);
+            }
+            pthread_mutex_unlock(&_mutex);
+            pthread_mutex_unlock(&_submit_mutex);
+        }
+    };
+
+    row_pool_t &row_pool(void)
+    {
+        static row_pool_t pool;
+
+        return pool;
+    }
+
+    class conversion_t {
+    public:
+        const image_t *_source;
+        const image_t *_destination;
+        const matrix_t *_matrix;
+        row_kernel_t _kernel;
+        const format_t *_source_format;
+        const format_t *_destination_format;
+    };
+
+    void convert_rows(void *arg, long begin, long end)
+    {
+        const conversion_t *c = reinterpret_cast<conversion_t *>(arg);
+        const long width = c->_source->_width;
+        const uint8_t *source =
+            reinterpret_cast<const uint8_t *>(c->_source->_data) +
+            begin * c->_source->_row_bytes;
+        uint8_t *destination =
+            reinterpret_cast<uint8_t *>(c->_destination->_data) +
+            begin * c->_destination->_row_bytes;
+
+        if (c->_kernel != NULL) {
+            for (long y = begin; y < end; y++) {
+                c->_kernel(source, destination, width, *c->_matrix);
+                source += c->_source->_row_bytes;
+                destination += c->_destination->_row_bytes;
+            }
+            return;
+        }
+        if (c->_source_format == c->_destination_format) {
+            const long row_bytes =
+                row_bytes_min(c->_source->_pixel_format, width);
+
+            for (long y = begin; y < end; y++) {
+                memcpy(destination, source, row_bytes);
+                source += c->_source->_row_bytes;
+                destination += c->_destination->_row_bytes;
+            }
+            return;
+        }
+
+        // 4 components per pixel for RGBA, plus the slack v210
+        // unpacking writes past the last complete group
+        std::vector<uint16_t> row(4 * even(width) + 4);
+        std::vector<uint16_t> converted
+            (c->_source_format->_yuv != c->_destination_format->_yuv ?
+             row.size() : 0);
+
+        for (long y = begin; y < end; y++) {
+            c->_source_format->_unpack(source, &row[0], width);
+            if (c->_source_format->_yuv &&
+                !c->_destination_format->_yuv) {
+                yuv10_to_rgb12(&row[0], &converted[0], width,
+                               *c->_matrix);
+            }
+            else if (!c->_source_format->_yuv &&
+                     c->_destination_format->_yuv) {
+                rgb12_to_yuv10(&row[0], &converted[0], width,
+                               *c->_matrix);
+            }
+            c->_destination_format->_pack
+                (converted.empty() ? &row[0] : &converted[0],
+                 destination, width);
+            source += c->_source->_row_bytes;
+            destination += c->_destination->_row_bytes;
+        }
+    }
+
+
+    class downscale_t {
+    public:
+        const image_t *_source;
+        const image_t *_destination;
+    };
+
+    // Averages factor x factor blocks. 2vuy is filtered per 4:2:2
+    // component, each output Cb Y Cr Y group covering factor input
+    // groups.
+    template<long factor>
+    void downscale_rows(void *arg, long begin, long end)
+    {
+        const downscale_t *d = reinterpret_cast<downscale_t *>(arg);
+        const long width = d->_destination->_width;
+        const long shift = factor == 2 ? 2 : 4;
+        const long round = 1 << (shift - 1);
+
+        for (long y = begin; y < end; y++) {
+            const uint8_t *source =
+                reinterpret_cast<const uint8_t *>(d->_source->_data) +
+                y * factor * d->_source->_row_bytes;
+            uint8_t *destination =
+                reinterpret_cast<uint8_t *>(d->_destination->_data) +
+                y * d->_destination->_row_bytes;
+
+            if (d->_source->_pixel_format == bmdFormat8BitYUV) {
+                for (long x = 0; x < even(width); x += 2) {
+                    unsigned int sum[4] = { 0, 0, 0, 0 };
+
+                    for (long i = 0; i < factor; i++) {
+                        const uint8_t *p = source +
+                            i * d->_source->_row_bytes + 2 * factor * x;
+
+                        for (long j = 0; j < factor; j++) {
+                            sum[0] += p[4 * j];
+                            sum[1] += p[2 * j + 1];
+                            sum[2] += p[4 * j + 2];
+                            sum[3] += p[2 * (factor + j) + 1];
+                        }
+                    }
+                    for (long i = 0; i < 4; i++) {
+                        destination[2 * x + i] = (sum[i] + round) >> shift;
+                    }
+                }
+            }
+            else {
+                for (long x = 0; x < 4 * width; x += 4) {
+                    unsigned int sum[4] = { 0, 0, 0, 0 };
+
+                    for (long i = 0; i < factor; i++) {
+                        const uint8_t *p = source +
+                            i * d->_source->_row_bytes + factor * x;
+
+                        for (long j = 0; j < 4 * factor; j += 4) {
+                            sum[0] += p[j];
+                            sum[1] += p[j + 1];
+                            sum[2] += p[j + 2];
+                            sum[3] += p[j + 3];
+                        }
+                    }
+                    for (long i = 0; i < 4; i++) {
+                        destination[x + i] = (sum[i] + round) >> shift;
+                    }
+                }
+            }
+        }
+    }
+}
+
+long row_bytes_min(BMDPixelFormat pixel_format, long width)
+{
+    switch (pixel_format) {
+    case bmdFormat8BitYUV:
+        return 2 * even(width);
+    case bmdFormat10BitYUV:
+        // 6 pixels per 16 bytes, rows padded to 128 bytes
+        return 128 * ((width + 47) / 48);
+    case bmdFormat12BitRGB:
+    case bmdFormat12BitRGBLE:
+        // 8 pixels per 36 bytes
+        return 36 * ((width + 7) / 8);
+    default:
+        return 4 * width;
+    }
+}
+
+bool convert_supported(BMDPixelFormat source, BMDPixelFormat destination)
+{
+    return find_format(source) != NULL && find_format(destination) != NULL;
+}
+
+bool convert_image(const image_t &source, const image_t &destination,
+                   BMDDisplayModeFlags colorspace)
+{
+    conversion_t c;
+
+    c._source = &source;
+    c._destination = &destination;
+    c._matrix = &matrix(colorspace);
+    c._kernel = NULL;
+    c._source_format = find_format(source._pixel_format);
+    c._destination_format = find_format(destination._pixel_format);
+    if (c._source_format == NULL || c._destination_format == NULL ||
+        source._data == NULL || destination._data == NULL ||
+        source._width != destination._width ||
+        source._height != destination._height ||
+        source._row_bytes <
+        row_bytes_min(source._pixel_format, source._width) ||
+        destination._row_bytes <
+        row_bytes_min(destination._pixel_format, destination._width)) {
+        return false;
+    }
+
+    const convert_isa_t active = convert_isa();
+
+    for (size_t i = 0; i < sizeof(kernel) / sizeof(*kernel); i++) {
+        if (kernel[i]._source == source._pixel_format &&
+            kernel[i]._destination == destination._pixel_format &&
+            kernel[i]._isa <= active) {
+            c._kernel = kernel[i]._kernel;
+            break;
+        }
+    }
+
+    // Not worth waking up threads for small images
+    static const long parallel_byte_min = 1 << 20;
+
+    row_pool().run(&convert_rows, &c, source._height,
+                   destination._height * destination._row_bytes >=
+                   parallel_byte_min ? convert_thread_count() : 1);
+
+    return true;
+}
+
+bool downscale_image(const image_t &source, const image_t &destination)
+{
+    if ((source._pixel_format != bmdFormat8BitYUV &&
+         source._pixel_format != bmdFormat8BitARGB &&
+         source._pixel_format != bmdFormat8BitBGRA) ||
+        destination._pixel_format != source._pixel_format ||
+        source._data == NULL || destination._data == NULL ||
+        destination._width <= 0 || destination._height <= 0 ||
+        destination._row_bytes <
+        row_bytes_min(destination._pixel_format, destination._width)) {
+        return false;
+    }
+
+    const long factor = source._width / destination._width;
+
+    // 2vuy reads whole Cb Y Cr Y groups
+    if ((factor != 2 && factor != 4) ||
+        source._height < factor * destination._height ||
+        row_bytes_min(source._pixel_format, source._width) <
+        row_bytes_min(source._pixel_format,
+                      factor * even(destination._width))) {
+        return false;
+    }
+
+    downscale_t d;
+
+    d._source = &source;
+    d._destination = &destination;
+    row_pool().run(factor == 2 ? &downscale_rows<2> : &downscale_rows<4>,
+                   &d, destination._height,
+                   source._height * source._row_bytes >= (1 << 20) ?
+                   convert_thread_count() : 1);
+
+    return true;
+}
+
+convert_isa_t convert_isa(void)
+{
+    return static_cast<convert_isa_t>(atomic_load(&isa_setting()));
+}
+
+void convert_set_isa(convert_isa_t isa)
+{
+    const convert_isa_t supported = cpu_isa();
+
+    atomic_store(&isa_setting(), static_cast<int64_t>
+                 (isa < supported ? isa : supported));
+}
+
+size_t convert_thread_count(void)
+{
+    return atomic_load(&thread_count_setting());
+}
+
+void convert_set_thread_count(size_t thread_count)
+{
+    atomic_store(&thread_count_setting(), static_cast<int64_t>
+                 (thread_count > 0 ? thread_count : 1));
+}
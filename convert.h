@@ -0,0 +1,55 @@
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include <cstddef>
+
+#include "DeckLinkAPI.h"
+
+// Pixel format conversion between 8-bit and 10-bit YUV 4:2:2
+// (2vuy, v210), 8-bit ARGB/BGRA and 10-bit RGB (r210, R10b, R10l).
+// Common pairs have SSE4.1/AVX2 kernels selected at runtime, the
+// others go through a scalar 16-bit intermediate. Large images are
+// converted in row slices on a small thread pool.
+
+class image_t {
+public:
+    BMDPixelFormat _pixel_format;
+    long _width;
+    long _height;
+    long _row_bytes;
+    void *_data;
+};
+
+enum convert_isa_t {
+    convert_isa_scalar,
+    convert_isa_sse41,
+    convert_isa_avx2
+};
+
+// Smallest row pitch that holds width pixels
+long row_bytes_min(BMDPixelFormat pixel_format, long width);
+
+bool convert_supported(BMDPixelFormat source, BMDPixelFormat destination);
+
+// colorspace is bmdDisplayModeColorspaceRec601 or Rec709, and only
+// matters when converting between YUV and RGB. Both images must have
+// the same dimensions.
+bool convert_image(const image_t &source, const image_t &destination,
+                   BMDDisplayModeFlags colorspace);
+
+// Box filter downscale of 2vuy, ARGB or BGRA by 2 or 4, the factor
+// being the ratio of the widths. The destination must have the same
+// pixel format.
+bool downscale_image(const image_t &source, const image_t &destination);
+
+// The best instruction set the CPU supports, unless lowered by
+// convert_set_isa() or SOUNDDECK_CONVERT_ISA=scalar|sse4.1|avx2
+convert_isa_t convert_isa(void);
+void convert_set_isa(convert_isa_t isa);
+
+// Threads used per conversion including the caller, by default the
+// number of online CPUs, or SOUNDDECK_CONVERT_THREADS
+size_t convert_thread_count(void);
+void convert_set_thread_count(size_t thread_count);
+
+#endif // CONVERT_H_
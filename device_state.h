@@ -0,0 +1,447 @@
+#ifndef DEVICE_STATE_H_
+#define DEVICE_STATE_H_
+
+#include <cstring>
+#include "DeckLinkAPI.h"
+#include "SoundDeckAPI.h"
+
+#include "common.h"
+#include "notification.h"
+
+// Log-linear histogram (4 buckets per octave) that can be recorded
+// into from the audio/scheduler threads without locking
+class histogram_t {
+public:
+    static const unsigned int sub_bucket_bits = 2;
+    static const size_t bucket_count = 64 << sub_bucket_bits;
+protected:
+    uint64_t _bucket[bucket_count];
+    uint64_t _max;
+    uint64_t _sum;
+    static size_t bucket_index(uint64_t value)
+    {
+        if (value < (1U << sub_bucket_bits)) {
+            return value;
+        }
+
+        const unsigned int msb = 63 - __builtin_clzll(value);
+
+        return ((msb - sub_bucket_bits + 1) << sub_bucket_bits) +
+            ((value >> (msb - sub_bucket_bits)) &
+             ((1U << sub_bucket_bits) - 1));
+    }
+public:
+    // Smallest value that falls into bucket index
+    static uint64_t bucket_lower(size_t index)
+    {
+        if (index < (1U << sub_bucket_bits)) {
+            return index;
+        }
+
+        const unsigned int msb = (index >> sub_bucket_bits) +
+            sub_bucket_bits - 1;
+
+        return static_cast<uint64_t>
+            ((1U << sub_bucket_bits) +
+             (index & ((1U << sub_bucket_bits) - 1))) <<
+            (msb - sub_bucket_bits);
+    }
+    histogram_t(void)
+        : _max(0), _sum(0)
+    {
+        memset(_bucket, 0, sizeof(_bucket));
+    }
+    void record(uint64_t value)
+    {
+        __atomic_add_fetch(&_bucket[bucket_index(value)], 1,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_sum, value, __ATOMIC_RELAXED);
+
+        uint64_t max = atomic_load(&_max);
+
+        while (value > max &&
+               !atomic_compare_exchange(&_max, &max, value)) {
+        }
+    }
+    uint64_t count(size_t index) const
+    {
+        return atomic_load(&_bucket[index]);
+    }
+    uint64_t max(void) const
+    {
+        return atomic_load(&_max);
+    }
+    // Of all values recorded
+    uint64_t sum(void) const
+    {
+        return atomic_load(&_sum);
+    }
+    // Upper bound of the bucket containing the quantile q, clamped to
+    // the observed maximum
+    uint64_t quantile(double q) const
+    {
+        uint64_t snapshot[bucket_count];
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < bucket_count; i++) {
+            snapshot[i] = count(i);
+            total += snapshot[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+
+        const uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+        uint64_t cumulative = 0;
+
+        for (size_t i = 0; i < bucket_count - 1; i++) {
+            cumulative += snapshot[i];
+            if (cumulative >= rank) {
+                const uint64_t upper = bucket_lower(i + 1) - 1;
+
+                return upper < max() ? upper : max();
+            }
+        }
+
+        return max();
+    }
+};
+
+// HDR static metadata (CEA 861.3) of a video frame, in the form
+// IDeckLinkVideoFrameMetadataExtensions hands it out. Defaults to SDR
+// with Rec. 709 primaries.
+class hdr_metadata_t {
+public:
+    static const size_t float_count = 10;
+    int64_t _eotf;
+    double _float[float_count];
+    static BMDDeckLinkFrameMetadataID float_id(size_t index)
+    {
+        static const BMDDeckLinkFrameMetadataID id[float_count] = {
+            bmdDeckLinkFrameMetadataHDRDisplayPrimariesRedX,
+            bmdDeckLinkFrameMetadataHDRDisplayPrimariesRedY,
+            bmdDeckLinkFrameMetadataHDRDisplayPrimariesGreenX,
+            bmdDeckLinkFrameMetadataHDRDisplayPrimariesGreenY,
+            bmdDeckLinkFrameMetadataHDRDisplayPrimariesBlueX,
+            bmdDeckLinkFrameMetadataHDRDisplayPrimariesBlueY,
+            bmdDeckLinkFrameMetadataHDRWhitePointX,
+            bmdDeckLinkFrameMetadataHDRWhitePointY,
+            bmdDeckLinkFrameMetadataHDRMaxDisplayMasteringLuminance,
+            bmdDeckLinkFrameMetadataHDRMinDisplayMasteringLuminance
+        };
+
+        return id[index];
+    }
+    hdr_metadata_t(void)
+        : _eotf(0)
+    {
+        static const double rec709[float_count] = {
+            0.64, 0.33, 0.30, 0.60, 0.15, 0.06, 0.3127, 0.3290,
+            100, 0.05
+        };
+
+        memcpy(_float, rec709, sizeof(_float));
+    }
+    HRESULT get_int(BMDDeckLinkFrameMetadataID id, int64_t *value) const
+    {
+        if (id != bmdDeckLinkFrameMetadataHDRElectroOpticalTransferFunc) {
+            return E_INVALIDARG;
+        }
+        *value = _eotf;
+        return S_OK;
+    }
+    HRESULT get_float(BMDDeckLinkFrameMetadataID id, double *value) const
+    {
+        for (size_t i = 0; i < float_count; i++) {
+            if (float_id(i) == id) {
+                *value = _float[i];
+                return S_OK;
+            }
+        }
+        return E_INVALIDARG;
+    }
+    // False if the frame is not flagged as carrying HDR metadata or
+    // has no IDeckLinkVideoFrameMetadataExtensions. Values the frame
+    // does not provide keep their defaults.
+    bool read(IDeckLinkVideoFrame *frame)
+    {
+        IDeckLinkVideoFrameMetadataExtensions *extensions = NULL;
+
+        if ((frame->GetFlags() & bmdFrameContainsHDRMetadata) == 0 ||
+            frame->QueryInterface
+            (IID_IDeckLinkVideoFrameMetadataExtensions,
+             reinterpret_cast<void **>(&extensions)) != S_OK ||
+            extensions == NULL) {
+            return false;
+        }
+        extensions->GetInt
+            (bmdDeckLinkFrameMetadataHDRElectroOpticalTransferFunc,
+             &_eotf);
+        for (size_t i = 0; i < float_count; i++) {
+            extensions->GetFloat(float_id(i), &_float[i]);
+        }
+        extensions->Release();
+
+        return true;
+    }
+};
+
+// State shared by all interfaces obtained from one SoundDeckLink. The
+// output and input update it on the hot path, IDeckLinkStatus reads it and
+// changes are pushed to IDeckLinkNotification subscribers. All
+// members are accessed through the atomic_* helpers only.
+class device_state_t {
+protected:
+    reference_count_t _ref;
+    int64_t _drift_ppm;
+    // Keyer level in bits 0-7, ramp target in bits 8-15 and the
+    // frames left to reach it from bit 16
+    int64_t _keyer;
+    int64_t _hdr_metadata_present;
+    int64_t _hdr_eotf;
+    int64_t _hdr_float[hdr_metadata_t::float_count];
+    static int64_t float_bits(double value)
+    {
+        int64_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+
+        return bits;
+    }
+    static double bits_float(int64_t bits)
+    {
+        double value;
+
+        memcpy(&value, &bits, sizeof(value));
+
+        return value;
+    }
+    ~device_state_t()
+    {
+    }
+public:
+    enum {
+        output_audio = 1 << 0,
+        output_video = 1 << 1
+    };
+    enum {
+        input_audio = 1 << 0,
+        input_video = 1 << 1
+    };
+    enum {
+        keyer_disabled = 0,
+        keyer_internal = 1,
+        keyer_external = 2
+    };
+    int64_t _output_enabled;
+    int64_t _input_enabled;
+    int64_t _sample_rate;
+    int64_t _video_output_mode;
+    int64_t _video_output_flags;
+    int64_t _video_output_pixel_format;
+    int64_t _buffer_size;
+    int64_t _buffer_fill;
+    int64_t _delay;
+    int64_t _underrun_count;
+    int64_t _video_input_mode;
+    int64_t _video_input_flags;
+    int64_t _video_input_pixel_format;
+    // Whether the video input has a device behind it rather than the
+    // black generator
+    int64_t _video_input_locked;
+    // Capture XRUNs plus the times the input ring was full
+    int64_t _overrun_count;
+    // ALSA sizes in sample frames set through IDeckLinkConfiguration,
+    // 0 leaves them to the driver
+    int64_t _buffer_size_request;
+    int64_t _period_size_request;
+    int64_t _keyer_mode;
+    // Wakeup lateness of the output callback thread in ns, against
+    // when it meant to wake up
+    histogram_t _jitter;
+    notifier_t _notifier;
+    device_state_t(void)
+        : _drift_ppm(0), _keyer(0xff), _hdr_metadata_present(0),
+          _hdr_eotf(0), _output_enabled(0), _input_enabled(0),
+          _sample_rate(0),
+          _video_output_mode(bmdModeUnknown),
+          _video_output_flags(bmdVideoOutputFlagDefault),
+          _video_output_pixel_format(0), _buffer_size(0),
+          _buffer_fill(0), _delay(0), _underrun_count(0),
+          _video_input_mode(bmdModeUnknown),
+          _video_input_flags(bmdVideoInputFlagDefault),
+          _video_input_pixel_format(0), _video_input_locked(0),
+          _overrun_count(0), _buffer_size_request(0),
+          _period_size_request(0), _keyer_mode(keyer_disabled)
+    {
+        const hdr_metadata_t metadata;
+
+        for (size_t i = 0; i < hdr_metadata_t::float_count; i++) {
+            _hdr_float[i] = float_bits(metadata._float[i]);
+        }
+    }
+    void add_ref(void)
+    {
+        _ref.add_ref();
+    }
+    void release(void)
+    {
+        if (_ref.release() == 0) {
+            delete this;
+        }
+    }
+    ULONG reference_count(void) const
+    {
+        return _ref.count();
+    }
+    void set_output_enabled(int64_t output, bool enabled)
+    {
+        const int64_t previous = enabled ?
+            __atomic_fetch_or(&_output_enabled, output,
+                              __ATOMIC_ACQ_REL) :
+            __atomic_fetch_and(&_output_enabled, ~output,
+                               __ATOMIC_ACQ_REL);
+
+        if (enabled ? previous == 0 :
+            previous != 0 && (previous & ~output) == 0) {
+            _notifier.post_status_changed(bmdDeckLinkStatusBusy);
+        }
+    }
+    void set_input_enabled(int64_t input, bool enabled)
+    {
+        const int64_t previous = enabled ?
+            __atomic_fetch_or(&_input_enabled, input, __ATOMIC_ACQ_REL) :
+            __atomic_fetch_and(&_input_enabled, ~input,
+                               __ATOMIC_ACQ_REL);
+
+        if (enabled ? previous == 0 :
+            previous != 0 && (previous & ~input) == 0) {
+            _notifier.post_status_changed(bmdDeckLinkStatusBusy);
+        }
+    }
+    void set_video_output_mode(BMDDisplayMode mode)
+    {
+        if (atomic_exchange(&_video_output_mode,
+                            static_cast<int64_t>(mode)) != mode) {
+            _notifier.post_status_changed
+                (bmdDeckLinkStatusCurrentVideoOutputMode);
+        }
+    }
+    void set_video_input_mode(BMDDisplayMode mode)
+    {
+        if (atomic_exchange(&_video_input_mode,
+                            static_cast<int64_t>(mode)) != mode) {
+            _notifier.post_status_changed
+                (bmdDeckLinkStatusCurrentVideoInputMode);
+        }
+    }
+    void add_overrun(void)
+    {
+        atomic_add(&_overrun_count, int64_t(1));
+        _notifier.post_status_changed
+            (bmdDeckLinkStatusSoundDeckOverrunCount);
+    }
+    void set_sample_rate(int64_t sample_rate)
+    {
+        if (atomic_exchange(&_sample_rate, sample_rate) !=
+            sample_rate) {
+            _notifier.post_status_changed
+                (bmdDeckLinkStatusSoundDeckSampleRate);
+        }
+    }
+    void add_underrun(void)
+    {
+        atomic_add(&_underrun_count, int64_t(1));
+        _notifier.post_status_changed
+            (bmdDeckLinkStatusSoundDeckUnderrunCount);
+    }
+    void set_drift_ppm(double drift_ppm)
+    {
+        atomic_store(&_drift_ppm, float_bits(drift_ppm));
+    }
+    double drift_ppm(void) const
+    {
+        return bits_float(atomic_load(&_drift_ppm));
+    }
+    void set_keyer_mode(int64_t mode)
+    {
+        atomic_store(&_keyer_mode, mode);
+    }
+    // Moves from the current level to target over frame_count output
+    // frames, immediately if frame_count is 0
+    void set_keyer_ramp(uint8_t target, uint32_t frame_count)
+    {
+        int64_t keyer = atomic_load(&_keyer);
+
+        while (!atomic_compare_exchange
+               (&_keyer, &keyer,
+                frame_count == 0 ? static_cast<int64_t>(target) :
+                (keyer & 0xff) | static_cast<int64_t>(target) << 8 |
+                static_cast<int64_t>(frame_count) << 16)) {
+        }
+        if ((keyer & 0xff) != target) {
+            _notifier.post_status_changed
+                (bmdDeckLinkStatusSoundDeckKeyerLevel);
+        }
+    }
+    // One output frame went out
+    void keyer_tick(void)
+    {
+        int64_t keyer = atomic_load(&_keyer);
+        int64_t next;
+
+        do {
+            const int64_t frame_count = keyer >> 16;
+
+            if (frame_count == 0) {
+                return;
+            }
+
+            const int64_t level = keyer & 0xff;
+            const int64_t target = (keyer >> 8) & 0xff;
+
+            next = (level + (target - level) / frame_count) |
+                target << 8 | (frame_count - 1) << 16;
+        } while (!atomic_compare_exchange(&_keyer, &keyer, next));
+        if ((next & 0xff) != (keyer & 0xff)) {
+            _notifier.post_status_changed
+                (bmdDeckLinkStatusSoundDeckKeyerLevel);
+        }
+    }
+    int64_t keyer_level(void) const
+    {
+        return atomic_load(&_keyer) & 0xff;
+    }
+    // metadata is NULL for frames without HDR metadata
+    void set_hdr_metadata(const hdr_metadata_t *metadata)
+    {
+        bool changed = atomic_exchange(&_hdr_metadata_present,
+                                       int64_t(metadata != NULL)) !=
+            (metadata != NULL);
+
+        if (metadata != NULL) {
+            changed |= atomic_exchange(&_hdr_eotf, metadata->_eotf) !=
+                metadata->_eotf;
+            for (size_t i = 0; i < hdr_metadata_t::float_count; i++) {
+                const int64_t bits = float_bits(metadata->_float[i]);
+
+                changed |= atomic_exchange(&_hdr_float[i], bits) != bits;
+            }
+        }
+        if (changed) {
+            _notifier.post_status_changed
+                (bmdDeckLinkStatusSoundDeckHDRMetadata);
+        }
+    }
+    bool hdr_metadata(hdr_metadata_t *metadata) const
+    {
+        metadata->_eotf = atomic_load(&_hdr_eotf);
+        for (size_t i = 0; i < hdr_metadata_t::float_count; i++) {
+            metadata->_float[i] = bits_float(atomic_load(&_hdr_float[i]));
+        }
+
+        return atomic_load(&_hdr_metadata_present) != 0;
+    }
+};
+
+#endif // DEVICE_STATE_H_
@@ -0,0 +1,434 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <vector>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "audio_sink.h"
+#include "log.h"
+
+namespace {
+
+    void put_u16(char *p, uint16_t value)
+    {
+        p[0] = value & 0xff;
+        p[1] = value >> 8;
+    }
+
+    void put_u32(char *p, uint32_t value)
+    {
+        put_u16(p, value & 0xffff);
+        put_u16(p + 2, value >> 16);
+    }
+
+    void put_u64(char *p, uint64_t value)
+    {
+        put_u32(p, value & 0xffffffffU);
+        put_u32(p + 4, value >> 32);
+    }
+
+    // Copies at most size - 1 characters, the rest of the field stays
+    // zero
+    void put_string(char *p, size_t size, const char *value)
+    {
+        strncpy(p, value, size - 1);
+    }
+
+    // Broadcast Wave (EBU Tech 3285) that switches itself to RF64
+    // (EBU Tech 3306) once it outgrows 4 GiB. Samples are written as
+    // they come, without pacing, in large aligned blocks by a writer
+    // thread. The file is opened with O_DIRECT where the filesystem
+    // supports it, so that hours of multichannel audio do not go
+    // through the page cache.
+    class file_sink_t : public audio_sink_t {
+    protected:
+        static const size_t block_size = 1 << 22;
+        static const size_t block_count = 4;
+        // O_DIRECT wants offsets and sizes in multiples of the logical
+        // block size, the header is padded so that the sample data
+        // starts here
+        static const size_t data_offset = 4096;
+        class pending_t {
+        public:
+            char *_block;
+            uint64_t _offset;
+            size_t _size;
+        };
+        std::string _directory;
+        std::string _path;
+        // Sample data, O_DIRECT if possible
+        int _fd;
+        // Header and the final size, never O_DIRECT
+        int _header_fd;
+        unsigned int _channel_count;
+        unsigned int _sample_width_byte;
+        std::vector<char *> _block;
+        // Host side, the block being filled
+        char *_fill_block;
+        size_t _fill;
+        uint64_t _data_byte;
+        uint64_t _submitted_byte;
+        int64_t _time_reference;
+        struct tm _origination;
+        // Writer side, protected by _mutex
+        pthread_mutex_t _mutex;
+        pthread_cond_t _cond;
+        std::deque<pending_t> _pending;
+        std::vector<char *> _free;
+        int _error;
+        bool _stop;
+        pthread_t _writer_thread;
+        bool _writer_thread_alive;
+        static void *writer_thread(void *arg)
+        {
+            file_sink_t *sink = static_cast<file_sink_t *>(arg);
+
+            pthread_mutex_lock(&sink->_mutex);
+            while (true) {
+                while (sink->_pending.empty() && !sink->_stop) {
+                    pthread_cond_wait(&sink->_cond, &sink->_mutex);
+                }
+                if (sink->_pending.empty()) {
+                    break;
+                }
+
+                const pending_t pending = sink->_pending.front();
+                int error = 0;
+
+                sink->_pending.pop_front();
+                pthread_mutex_unlock(&sink->_mutex);
+                for (size_t done = 0; done < pending._size; ) {
+                    const ssize_t written =
+                        pwrite(sink->_fd, pending._block + done,
+                               pending._size - done,
+                               pending._offset + done);
+
+                    if (written < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (written <= 0) {
+                        error = written < 0 ? errno : ENOSPC;
+                        break;
+                    }
+                    done += written;
+                }
+                pthread_mutex_lock(&sink->_mutex);
+                if (error != 0 && sink->_error == 0) {
+                    sink->_error = error;
+                }
+                sink->_free.push_back(pending._block);
+                pthread_cond_broadcast(&sink->_cond);
+            }
+            pthread_mutex_unlock(&sink->_mutex);
+
+            return NULL;
+        }
+        // Hands the filled block to the writer and waits for an empty
+        // one, false once writing failed
+        bool submit(void)
+        {
+            pending_t pending;
+
+            pending._block = _fill_block;
+            pending._offset = data_offset + _submitted_byte;
+            // The last block is padded, the file is truncated to the
+            // actual size when finished
+            pending._size = (_fill + data_offset - 1) & ~(data_offset - 1);
+            memset(_fill_block + _fill, 0, pending._size - _fill);
+            _submitted_byte += _fill;
+
+            pthread_mutex_lock(&_mutex);
+            _pending.push_back(pending);
+            pthread_cond_broadcast(&_cond);
+            while (_free.empty() && _error == 0) {
+                pthread_cond_wait(&_cond, &_mutex);
+            }
+
+            const bool ok = _error == 0;
+
+            if (ok) {
+                _fill_block = _free.back();
+                _free.pop_back();
+                _fill = 0;
+            }
+            pthread_mutex_unlock(&_mutex);
+
+            return ok;
+        }
+        void header(std::vector<char> &h) const
+        {
+            const size_t frame_byte = _channel_count * _sample_width_byte;
+            const uint64_t riff_size = data_offset + _data_byte - 8;
+            const bool rf64 = riff_size > 0xffffffffU;
+            const bool extensible =
+                _channel_count > 2 || _sample_width_byte > 2;
+
+            h.assign(data_offset, 0);
+
+            char *p = &h[0];
+
+            memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+            put_u32(p + 4, rf64 ? 0xffffffffU : riff_size);
+            memcpy(p + 8, "WAVE", 4);
+            p += 12;
+            // Reserved for the ds64 chunk until the file needs it
+            memcpy(p, rf64 ? "ds64" : "JUNK", 4);
+            put_u32(p + 4, 28);
+            if (rf64) {
+                put_u64(p + 8, riff_size);
+                put_u64(p + 16, _data_byte);
+                put_u64(p + 24, _data_byte / frame_byte);
+            }
+            p += 8 + 28;
+            memcpy(p, "fmt ", 4);
+            put_u32(p + 4, extensible ? 40 : 16);
+            put_u16(p + 8, extensible ? 0xfffe : 1);
+            put_u16(p + 10, _channel_count);
+            put_u32(p + 12, _sample_rate);
+            put_u32(p + 16, _sample_rate * frame_byte);
+            put_u16(p + 20, frame_byte);
+            put_u16(p + 22, _sample_width_byte * 8);
+            if (extensible) {
+                // KSDATAFORMAT_SUBTYPE_PCM
+                static const unsigned char pcm[16] = {
+                    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+                    0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+                };
+                uint32_t channel_mask = 0;
+
+                // The layouts whose DeckLink order matches the WAVE
+                // speaker order, anything else is left unassigned
+                switch (_channel_count) {
+                case 1:
+                    channel_mask = 0x4;
+                    break;
+                case 2:
+                    channel_mask = 0x3;
+                    break;
+                case 6:
+                    channel_mask = 0x3f;
+                    break;
+                }
+                put_u16(p + 24, 22);
+                put_u16(p + 26, _sample_width_byte * 8);
+                put_u32(p + 28, channel_mask);
+                memcpy(p + 32, pcm, sizeof(pcm));
+            }
+            p += 8 + (extensible ? 40 : 16);
+            // bext version 1, without coding history
+            memcpy(p, "bext", 4);
+            put_u32(p + 4, 602);
+            put_string(p + 8, 256, "SoundDeck recording");
+            put_string(p + 264, 32, "SoundDeck");
+            strftime(p + 328, 11, "%Y-%m-%d", &_origination);
+            strftime(p + 338, 9, "%H:%M:%S", &_origination);
+            put_u64(p + 346, atomic_load(&_time_reference));
+            put_u16(p + 354, 1);
+            p += 8 + 602;
+
+            // Pads up to the data chunk header
+            const size_t pad = &h[0] + data_offset - 8 - p - 8;
+
+            memcpy(p, "JUNK", 4);
+            put_u32(p + 4, pad);
+            p += 8 + pad;
+            memcpy(p, "data", 4);
+            put_u32(p + 4, rf64 ? 0xffffffffU : _data_byte);
+        }
+        bool write_header(void)
+        {
+            std::vector<char> h(data_offset);
+
+            header(h);
+
+            return pwrite(_header_fd, &h[0], h.size(), 0) ==
+                static_cast<ssize_t>(h.size());
+        }
+        bool create(void)
+        {
+            time_t now = time(NULL);
+            // "/sounddeck-" + 15 characters for the time + "-" + 11
+            // characters max for int + ".wav" + '\0'
+            char name[64];
+
+            localtime_r(&now, &_origination);
+            for (int i = 0; i < 100; i++) {
+                size_t length =
+                    strftime(name, sizeof(name),
+                             "/sounddeck-%Y%m%d-%H%M%S", &_origination);
+
+                if (i > 0) {
+                    length += snprintf(name + length,
+                                       sizeof(name) - length, "-%d", i);
+                }
+                snprintf(name + length, sizeof(name) - length, ".wav");
+                _path = _directory + name;
+                _header_fd = ::open(_path.c_str(),
+                                    O_WRONLY | O_CREAT | O_EXCL |
+                                    O_CLOEXEC, 0644);
+                if (_header_fd >= 0 || errno != EEXIST) {
+                    break;
+                }
+            }
+            if (_header_fd < 0) {
+                return false;
+            }
+            // Created without O_DIRECT first, some filesystems create
+            // the file before refusing the flag
+            _fd = ::open(_path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+            if (_fd < 0) {
+                _fd = dup(_header_fd);
+            }
+
+            return _fd >= 0;
+        }
+        void finish(void)
+        {
+            if (!_writer_thread_alive) {
+                return;
+            }
+            if (_fill > 0) {
+                submit();
+            }
+            pthread_mutex_lock(&_mutex);
+            _stop = true;
+            pthread_cond_broadcast(&_cond);
+            pthread_mutex_unlock(&_mutex);
+            pthread_join(_writer_thread, NULL);
+            _writer_thread_alive = false;
+            if (ftruncate(_header_fd, data_offset + _data_byte) != 0 ||
+                !write_header()) {
+                log_message(log_error, "file recorder: cannot finish %s: "
+                            "%s", _path, strerror(errno));
+            }
+        }
+    public:
+        file_sink_t(const std::string &directory, device_state_t *state)
+            : audio_sink_t(state), _directory(directory), _fd(-1),
+              _header_fd(-1), _channel_count(0), _sample_width_byte(0),
+              _fill_block(NULL), _fill(0), _data_byte(0),
+              _submitted_byte(0), _time_reference(0), _error(0),
+              _stop(false), _writer_thread_alive(false)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+            pthread_cond_init(&_cond, NULL);
+        }
+        ~file_sink_t()
+        {
+            finish();
+            if (_fd >= 0) {
+                close(_fd);
+            }
+            if (_header_fd >= 0) {
+                close(_header_fd);
+            }
+            for (size_t i = 0; i < _block.size(); i++) {
+                free(_block[i]);
+            }
+            pthread_cond_destroy(&_cond);
+            pthread_mutex_destroy(&_mutex);
+        }
+        bool open(unsigned int *sample_rate,
+                  unsigned int sample_width_byte,
+                  unsigned int channel_count)
+        {
+            if (channel_count == 0) {
+                return false;
+            }
+            if (!create()) {
+                log_message(log_error, "file recorder: cannot create a file "
+                            "in %s: %s", _directory, strerror(errno));
+                return false;
+            }
+            for (size_t i = 0; i < block_count; i++) {
+                void *block;
+
+                if (posix_memalign(&block, data_offset, block_size) != 0) {
+                    log_message(log_error, "file recorder: out of memory");
+                    return false;
+                }
+                _block.push_back(static_cast<char *>(block));
+                _free.push_back(_block.back());
+            }
+            _fill_block = _free.back();
+            _free.pop_back();
+            _channel_count = channel_count;
+            _sample_width_byte = sample_width_byte;
+            _sample_rate = *sample_rate;
+            // A valid empty file until there is more to say
+            if (!write_header() ||
+                pthread_create(&_writer_thread, NULL, &writer_thread,
+                               this) != 0) {
+                log_message(log_error, "file recorder: cannot start "
+                            "recording %s: %s", _path, strerror(errno));
+                return false;
+            }
+            _writer_thread_alive = true;
+            atomic_store(&_state->_buffer_size, static_cast<int64_t>
+                         (block_size * block_count /
+                          (channel_count * sample_width_byte)));
+
+            return true;
+        }
+        uint32_t write(const void *buffer, uint32_t frame_count)
+        {
+            const size_t frame_byte = _channel_count * _sample_width_byte;
+            const char *source = static_cast<const char *>(buffer);
+            const size_t size = frame_count * frame_byte;
+
+            for (size_t done = 0; done < size; ) {
+                const size_t n = size - done < block_size - _fill ?
+                    size - done : block_size - _fill;
+
+                memcpy(_fill_block + _fill, source + done, n);
+                _fill += n;
+                done += n;
+                if (_fill == block_size && !submit()) {
+                    // Whatever did not make it into a block is lost
+                    _data_byte = _submitted_byte;
+                    return 0;
+                }
+            }
+            _data_byte += size;
+
+            pthread_mutex_lock(&_mutex);
+
+            const size_t pending = _pending.size();
+
+            pthread_mutex_unlock(&_mutex);
+            atomic_store(&_state->_buffer_fill, static_cast<int64_t>
+                         ((pending * block_size + _fill) / frame_byte));
+
+            return frame_count;
+        }
+        void set_time_reference(uint64_t time_reference)
+        {
+            atomic_store(&_time_reference,
+                         static_cast<int64_t>(time_reference));
+        }
+        void start(void)
+        {
+        }
+        // Playback may start again, the file stays open until the
+        // output is disabled
+        void stop(void)
+        {
+        }
+        void drain(void)
+        {
+            finish();
+        }
+    };
+
+}
+
+audio_sink_t *create_file_sink(const std::string &directory,
+                               device_state_t *state)
+{
+    return new file_sink_t(directory, state);
+}
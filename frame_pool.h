@@ -0,0 +1,144 @@
+#ifndef FRAME_POOL_H_
+#define FRAME_POOL_H_
+
+#include <map>
+#include <vector>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+// Recycles video frame buffers, so that steady state playback does
+// not allocate. Buffers are bucketed by their size rounded up to the
+// allocation granularity, and are at least 64-byte aligned. Buffers of
+// UHD size are mmap()ed and backed by huge pages when possible.
+// Frames hold a reference, so the pool outlives the output that
+// created it if the host keeps frames around.
+class frame_pool_t {
+public:
+    static const size_t alignment = 64;
+    static const size_t huge_page_size = 2 << 20;
+    // 2160p 8-bit YUV is just below 16 MiB and above, 1080p 10-bit
+    // RGB (8294400 bytes) just below, so only UHD frames qualify
+    static const size_t huge_page_threshold = 8 << 20;
+    // Free buffers beyond this are returned to the system
+    static const size_t max_free_byte = 256 << 20;
+protected:
+    reference_count_t _ref;
+    pthread_mutex_t _mutex;
+    std::map<size_t, std::vector<void *> > _free;
+    size_t _free_byte;
+    ~frame_pool_t()
+    {
+        for (std::map<size_t, std::vector<void *> >::iterator
+                 iterator = _free.begin();
+             iterator != _free.end(); iterator++) {
+            for (std::vector<void *>::iterator buffer =
+                     iterator->second.begin();
+                 buffer != iterator->second.end(); buffer++) {
+                deallocate(*buffer, iterator->first);
+            }
+        }
+        pthread_mutex_destroy(&_mutex);
+    }
+    static void *allocate(size_t bucket)
+    {
+        if (bucket < huge_page_threshold) {
+            void *buffer;
+
+            return posix_memalign(&buffer, alignment, bucket) == 0 ?
+                buffer : NULL;
+        }
+
+        // Explicit huge pages need a reserved pool, which most
+        // systems lack, so fall back to transparent huge pages
+        void *buffer = mmap(NULL, bucket, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                            -1, 0);
+
+        if (buffer == MAP_FAILED) {
+            buffer = mmap(NULL, bucket, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED) {
+                return NULL;
+            }
+            madvise(buffer, bucket, MADV_HUGEPAGE);
+        }
+
+        return buffer;
+    }
+    static void deallocate(void *buffer, size_t bucket)
+    {
+        if (bucket < huge_page_threshold) {
+            free(buffer);
+        }
+        else {
+            munmap(buffer, bucket);
+        }
+    }
+public:
+    frame_pool_t(void)
+        : _free_byte(0)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+    void add_ref(void)
+    {
+        _ref.add_ref();
+    }
+    void release(void)
+    {
+        if (_ref.release() == 0) {
+            delete this;
+        }
+    }
+    static size_t bucket(size_t size)
+    {
+        const size_t granularity = size < huge_page_threshold ?
+            4096 : huge_page_size;
+
+        return (size + granularity - 1) & ~(granularity - 1);
+    }
+    // Returns a buffer of bucket(size) bytes, recycled if possible
+    void *get(size_t size)
+    {
+        const size_t b = bucket(size);
+
+        pthread_mutex_lock(&_mutex);
+
+        std::map<size_t, std::vector<void *> >::iterator iterator =
+            _free.find(b);
+
+        if (iterator != _free.end() && !iterator->second.empty()) {
+            void *buffer = iterator->second.back();
+
+            iterator->second.pop_back();
+            _free_byte -= b;
+            pthread_mutex_unlock(&_mutex);
+
+            return buffer;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        return allocate(b);
+    }
+    void put(void *buffer, size_t size)
+    {
+        const size_t b = bucket(size);
+
+        pthread_mutex_lock(&_mutex);
+        if (_free_byte + b <= max_free_byte) {
+            _free[b].push_back(buffer);
+            _free_byte += b;
+            buffer = NULL;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        if (buffer != NULL) {
+            deallocate(buffer, b);
+        }
+    }
+};
+
+#endif // FRAME_POOL_H_
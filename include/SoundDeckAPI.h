@@ -0,0 +1,57 @@
+/* Sound deck extensions to the DeckLink API
+**
+** Identifiers in this file are specific to the sound deck
+** libDeckLinkAPI.so and are not understood by Blackmagic Design
+** drivers. Four character codes are prefixed with 's' to stay clear of
+** the vendor's ranges.
+*/
+
+#ifndef SOUNDDECKAPI_H
+#define SOUNDDECKAPI_H
+
+#include "DeckLinkAPI.h"
+
+/* Enum BMDDeckLinkStatusID - Sound deck specific status IDs */
+
+enum _BMDSoundDeckLinkStatusID {
+
+    /* Integers */
+
+    bmdDeckLinkStatusSoundDeckBufferSize                         = /* 'sbsz' */ 0x7362737A,	// ALSA ring buffer size in sample frames
+    bmdDeckLinkStatusSoundDeckBufferFill                         = /* 'sbfl' */ 0x7362666C,	// Sample frames queued in the ALSA ring buffer
+    bmdDeckLinkStatusSoundDeckDelay                              = /* 'sdly' */ 0x73646C79,	// ALSA delay (queued + hardware) in sample frames
+    bmdDeckLinkStatusSoundDeckUnderrunCount                      = /* 'sxrn' */ 0x7378726E,	// Number of XRUNs since the device was opened
+    bmdDeckLinkStatusSoundDeckSchedulerJitterP50                 = /* 'sj50' */ 0x736A3530,	// Median scheduler wakeup lateness in ns
+    bmdDeckLinkStatusSoundDeckSchedulerJitterP99                 = /* 'sj99' */ 0x736A3939,	// 99th percentile scheduler wakeup lateness in ns
+    bmdDeckLinkStatusSoundDeckSchedulerJitterMax                 = /* 'sjmx' */ 0x736A6D78,	// Maximum scheduler wakeup lateness in ns
+    bmdDeckLinkStatusSoundDeckSampleRate                         = /* 'ssrt' */ 0x73737274,	// Sample rate negotiated with ALSA, 0 if audio output is disabled
+    bmdDeckLinkStatusSoundDeckOverrunCount                       = /* 'sovr' */ 0x736F7672,	// Number of capture XRUNs and input ring overflows since the device was opened
+    bmdDeckLinkStatusSoundDeckKeyerMode                          = /* 'skym' */ 0x736B796D,	// 0 if the keyer is disabled, 1 if enabled internal, 2 if enabled external
+    bmdDeckLinkStatusSoundDeckKeyerLevel                         = /* 'skyl' */ 0x736B796C,	// Keyer level 0-255, following any ramp one step per output frame
+
+    /* Flags */
+
+    bmdDeckLinkStatusSoundDeckHDRMetadata                        = /* 'shdr' */ 0x73686472,	// The last scheduled frame carried HDR metadata
+
+    /* Floats */
+
+    bmdDeckLinkStatusSoundDeckDriftPPM                           = /* 'sdpm' */ 0x7364706D	// Sample clock drift against CLOCK_MONOTONIC in ppm
+};
+
+/* The HDR metadata of the last scheduled frame is also available from
+** IDeckLinkStatus::GetInt and GetFloat under the
+** bmdDeckLinkFrameMetadataHDR* IDs, while
+** bmdDeckLinkStatusSoundDeckHDRMetadata is true.
+*/
+
+/* Enum BMDDeckLinkConfigurationID - Sound deck specific configuration IDs */
+
+enum _BMDSoundDeckLinkConfigurationID {
+
+    /* Integers */
+
+    bmdDeckLinkConfigSoundDeckBufferSize                         = /* 'scbs' */ 0x73636273,	// ALSA buffer size in sample frames requested when audio is enabled, 0 for the driver default
+    bmdDeckLinkConfigSoundDeckPeriodSize                         = /* 'scps' */ 0x73637073	// ALSA period size in sample frames requested when audio is enabled, 0 for the driver default
+};
+
+#endif /* defined(SOUNDDECKAPI_H) */
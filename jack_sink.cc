@@ -0,0 +1,247 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <jack/jack.h>
+
+#include "audio_dsp.h"
+#include "audio_ring.h"
+#include "audio_sink.h"
+#include "log.h"
+
+namespace {
+
+    // JACK client with one port per channel, connected to the
+    // physical playback ports in order. The process callback converts
+    // straight out of the ring into the port buffers.
+    class jack_sink_t : public audio_sink_t {
+    protected:
+        static const uint32_t default_buffer_size = 8192;
+        jack_client_t *_client;
+        std::vector<jack_port_t *> _port;
+        // Port buffers of the current cycle, only touched by the
+        // process callback
+        std::vector<float *> _port_buffer;
+        unsigned int _sample_width_byte;
+        audio_ring_t _ring;
+        // Set by stop(), the process callback discards the ring
+        int64_t _flush;
+        // Set by the process callback when it ran out of frames while
+        // the host was feeding, write() counts it as an underrun
+        int64_t _starved;
+        int64_t _running;
+        int64_t _shutdown;
+        static int process(jack_nframes_t frame_count, void *arg)
+        {
+            jack_sink_t *sink = static_cast<jack_sink_t *>(arg);
+
+            for (size_t c = 0; c < sink->_port.size(); c++) {
+                sink->_port_buffer[c] = static_cast<float *>
+                    (jack_port_get_buffer(sink->_port[c], frame_count));
+            }
+            if (atomic_exchange(&sink->_flush, int64_t(0)) != 0) {
+                sink->_ring.skip(sink->_ring.readable());
+            }
+
+            jack_nframes_t done = 0;
+
+            while (done < frame_count) {
+                const void *data;
+                const size_t count =
+                    sink->_ring.peek(&data, frame_count - done);
+
+                if (count == 0) {
+                    break;
+                }
+                audio_to_float_planar(&sink->_port_buffer[0], done, data,
+                                      sink->_sample_width_byte,
+                                      sink->_port_buffer.size(), count);
+                sink->_ring.skip(count);
+                done += count;
+            }
+            if (done < frame_count) {
+                for (size_t c = 0; c < sink->_port.size(); c++) {
+                    memset(sink->_port_buffer[c] + done, 0,
+                           (frame_count - done) * sizeof(float));
+                }
+                if (atomic_load(&sink->_running) != 0) {
+                    atomic_store(&sink->_starved, int64_t(1));
+                }
+            }
+
+            return 0;
+        }
+        static void shutdown(void *arg)
+        {
+            jack_sink_t *sink = static_cast<jack_sink_t *>(arg);
+
+            atomic_store(&sink->_shutdown, int64_t(1));
+        }
+        // Frames queued here plus the playback latency of the ports
+        int64_t delay(void)
+        {
+            jack_latency_range_t range;
+
+            jack_port_get_latency_range(_port[0], JackPlaybackLatency,
+                                        &range);
+
+            return _ring.readable() + range.max;
+        }
+        bool stalled(void) const
+        {
+            return atomic_load(&_shutdown) != 0;
+        }
+    public:
+        jack_sink_t(device_state_t *state)
+            : audio_sink_t(state), _client(NULL), _sample_width_byte(0),
+              _flush(0), _starved(0), _running(0), _shutdown(0)
+        {
+        }
+        ~jack_sink_t()
+        {
+            if (_client != NULL) {
+                jack_deactivate(_client);
+                jack_client_close(_client);
+            }
+        }
+        bool open(unsigned int *sample_rate,
+                  unsigned int sample_width_byte,
+                  unsigned int channel_count)
+        {
+            if (channel_count == 0) {
+                return false;
+            }
+            _client = jack_client_open("SoundDeck", JackNoStartServer,
+                                       NULL);
+            if (_client == NULL) {
+                log_message(log_error, "JACK: no server to connect to");
+                return false;
+            }
+            for (unsigned int c = 0; c < channel_count; c++) {
+                // "out_" + 10 characters max for unsigned int + '\0'
+                char port_name[15];
+
+                snprintf(port_name, 15, "out_%u", c + 1);
+
+                jack_port_t *port =
+                    jack_port_register(_client, port_name,
+                                       JACK_DEFAULT_AUDIO_TYPE,
+                                       JackPortIsOutput, 0);
+
+                if (port == NULL) {
+                    log_message(log_error, "JACK: cannot register port "
+                                "%s", port_name);
+                    return false;
+                }
+                _port.push_back(port);
+            }
+            _port_buffer.resize(_port.size());
+
+            int64_t buffer_size =
+                atomic_load(&_state->_buffer_size_request);
+
+            if (buffer_size <= 0) {
+                buffer_size = default_buffer_size;
+            }
+            _ring.allocate(channel_count * sample_width_byte, buffer_size);
+            _sample_width_byte = sample_width_byte;
+            // The server's rate is the only one there is
+            *sample_rate = jack_get_sample_rate(_client);
+            _sample_rate = *sample_rate;
+            jack_set_process_callback(_client, &process, this);
+            jack_on_shutdown(_client, &shutdown, this);
+            if (jack_activate(_client) != 0) {
+                log_message(log_error, "JACK: cannot activate the client");
+                return false;
+            }
+
+            const char **physical =
+                jack_get_ports(_client, NULL, JACK_DEFAULT_AUDIO_TYPE,
+                               JackPortIsPhysical | JackPortIsInput);
+
+            for (size_t c = 0;
+                 physical != NULL && physical[c] != NULL &&
+                     c < _port.size(); c++) {
+                jack_connect(_client, jack_port_name(_port[c]),
+                             physical[c]);
+            }
+            if (physical != NULL) {
+                jack_free(physical);
+            }
+            atomic_store(&_state->_buffer_size,
+                         static_cast<int64_t>(_ring.capacity()));
+            restart_drift();
+
+            return true;
+        }
+        uint32_t write(const void *buffer, uint32_t frame_count)
+        {
+            if (atomic_exchange(&_starved, int64_t(0)) != 0) {
+                log_message(log_warning, "JACK: underrun");
+                _state->add_underrun();
+                restart_drift();
+            }
+            atomic_store(&_running, int64_t(1));
+
+            const uint32_t written = ring_write(&_ring, buffer, frame_count);
+
+            if (written > 0) {
+                update_telemetry(written, _ring.readable(), delay());
+            }
+
+            return written;
+        }
+        void start(void)
+        {
+            atomic_store(&_starved, int64_t(0));
+            restart_drift();
+        }
+        void stop(void)
+        {
+            ring_wait_empty(&_ring);
+            atomic_store(&_running, int64_t(0));
+            atomic_store(&_flush, int64_t(1));
+        }
+        void drain(void)
+        {
+            ring_wait_empty(&_ring);
+            atomic_store(&_running, int64_t(0));
+        }
+    };
+
+}
+
+bool jack_sink_available(void)
+{
+    // The server's socket, checking for it neither registers a client
+    // with a running server nor touches libjack's process wide error
+    // callback, which a host using JACK itself may have set. JACK2
+    // names it /dev/shm/jack_<server>_<uid>_0, JACK1
+    // /dev/shm/jack-<uid>/<server>/jack_0.
+    const char *server = getenv("JACK_DEFAULT_SERVER");
+    const unsigned int uid = getuid();
+    char path[2][256];
+    struct stat status;
+
+    if (server == NULL || server[0] == '\0') {
+        server = "default";
+    }
+    snprintf(path[0], sizeof(path[0]), "/dev/shm/jack_%s_%u_0", server,
+             uid);
+    snprintf(path[1], sizeof(path[1]), "/dev/shm/jack-%u/%s/jack_0", uid,
+             server);
+    for (size_t i = 0; i < 2; i++) {
+        if (stat(path[i], &status) == 0 && S_ISSOCK(status.st_mode)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+audio_sink_t *create_jack_sink(device_state_t *state)
+{
+    return new jack_sink_t(state);
+}
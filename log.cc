@@ -0,0 +1,387 @@
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+int log_level __attribute__((visibility("hidden"))) = log_warning;
+
+namespace {
+
+    class log_record_t {
+    public:
+        // Slot state of the queue, see logger_t::post()
+        uint64_t _sequence;
+        log_level_t _level;
+        int64_t _time_ns;
+        const char *_format;
+        log_arg_t _arg[log_arg_count];
+    };
+
+    // Leaky bucket per format string
+    class rate_limit_t {
+    public:
+        static const unsigned int burst = 10;
+        double _token;
+        int64_t _time_ns;
+        uint64_t _suppressed_count;
+        rate_limit_t(void)
+            : _token(burst), _time_ns(0), _suppressed_count(0)
+        {
+        }
+        bool pass(int64_t time_ns)
+        {
+            if (_time_ns != 0) {
+                _token += (time_ns - _time_ns) * 1e-9;
+                if (_token > burst) {
+                    _token = burst;
+                }
+            }
+            _time_ns = time_ns;
+            if (_token < 1) {
+                _suppressed_count++;
+                return false;
+            }
+            _token--;
+            return true;
+        }
+    };
+
+    int64_t monotonic_ns(void)
+    {
+        struct timespec current;
+
+        clock_gettime(CLOCK_MONOTONIC, &current);
+
+        return static_cast<int64_t>(current.tv_sec) * 1000000000LL +
+            current.tv_nsec;
+    }
+
+    bool contains(const char *set, char c)
+    {
+        return c != '\0' && strchr(set, c) != NULL;
+    }
+
+    void append(std::string *text, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+    void append(std::string *text, const char *format, ...)
+    {
+        char buffer[256];
+        va_list arguments;
+
+        va_start(arguments, format);
+        vsnprintf(buffer, sizeof(buffer), format, arguments);
+        va_end(arguments);
+        *text += buffer;
+    }
+
+    // One conversion, spec being "%" with its flags, width and
+    // precision, without length modifiers
+    void append_argument(std::string *text, std::string spec,
+                         char conversion, const log_arg_t &arg)
+    {
+        switch (arg._type) {
+        case log_arg_t::type_signed:
+        case log_arg_t::type_unsigned:
+            if (conversion == 'c') {
+                spec += 'c';
+                append(text, spec.c_str(), static_cast<int>(arg._signed));
+            }
+            else if (contains("eEfFgGaA", conversion)) {
+                spec += conversion;
+                append(text, spec.c_str(),
+                       arg._type == log_arg_t::type_signed ?
+                       static_cast<double>(arg._signed) :
+                       static_cast<double>(arg._unsigned));
+            }
+            else if (contains("ouxX", conversion) ||
+                     arg._type == log_arg_t::type_unsigned) {
+                spec += "ll";
+                spec += contains("ouxX", conversion) ? conversion : 'u';
+                append(text, spec.c_str(), static_cast<unsigned long long>
+                       (arg._unsigned));
+            }
+            else {
+                spec += "lld";
+                append(text, spec.c_str(),
+                       static_cast<long long>(arg._signed));
+            }
+            break;
+        case log_arg_t::type_double:
+            spec += contains("eEfFgGaA", conversion) ? conversion : 'g';
+            append(text, spec.c_str(), arg._double);
+            break;
+        case log_arg_t::type_string:
+            spec += 's';
+            append(text, spec.c_str(), arg._string);
+            break;
+        default:
+            *text += "<missing>";
+            break;
+        }
+    }
+
+    std::string format_message(const log_record_t &record)
+    {
+        std::string text;
+        size_t a = 0;
+
+        for (const char *f = record._format; *f != '\0'; f++) {
+            if (*f != '%') {
+                text += *f;
+                continue;
+            }
+            if (f[1] == '%') {
+                text += '%';
+                f++;
+                continue;
+            }
+
+            std::string spec = "%";
+
+            for (f++; contains("-+ #0123456789.", *f); f++) {
+                spec += *f;
+            }
+            while (contains("hlLqjzt", *f)) {
+                f++;
+            }
+            if (*f == '\0') {
+                break;
+            }
+            append_argument(&text, spec, *f,
+                            a < log_arg_count ? record._arg[a++] :
+                            log_arg_t());
+        }
+
+        return text;
+    }
+
+    // Multiple producers, the writer thread consumes. A slot whose
+    // sequence equals the enqueue position is free, one past the
+    // position holds a message.
+    class logger_t {
+    protected:
+        static const size_t capacity = 256;
+        log_record_t _record[capacity];
+        uint64_t _enqueue_position;
+        uint64_t _dequeue_position;
+        uint64_t _dropped_count;
+        uint64_t _dropped_reported;
+        int64_t _wake_pending;
+        int _event_fd;
+        bool _syslog;
+        bool _stop;
+        pthread_t _thread;
+        bool _thread_alive;
+        std::map<const char *, rate_limit_t> _rate_limit;
+        void write_message(log_level_t level, const std::string &text)
+        {
+            static const char *name[] = {
+                "error", "warning", "info", "debug"
+            };
+            static const int priority[] = {
+                LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG
+            };
+
+            if (_syslog) {
+                syslog(priority[level], "%s", text.c_str());
+            }
+            else {
+                fprintf(stderr, "SoundDeck: %s: %s\n", name[level],
+                        text.c_str());
+            }
+        }
+        void consume(const log_record_t &record)
+        {
+            rate_limit_t &limit = _rate_limit[record._format];
+
+            if (!limit.pass(record._time_ns)) {
+                return;
+            }
+
+            std::string text = format_message(record);
+
+            if (limit._suppressed_count > 0) {
+                append(&text, " (%llu like it suppressed)",
+                       static_cast<unsigned long long>
+                       (limit._suppressed_count));
+                limit._suppressed_count = 0;
+            }
+            write_message(record._level, text);
+        }
+        void drain(void)
+        {
+            while (true) {
+                log_record_t &record =
+                    _record[_dequeue_position & (capacity - 1)];
+
+                if (atomic_load(&record._sequence) !=
+                    _dequeue_position + 1) {
+                    break;
+                }
+                consume(record);
+                atomic_store(&record._sequence,
+                             _dequeue_position + capacity);
+                _dequeue_position++;
+            }
+
+            static const char *const dropped_format =
+                "%llu message(s) dropped, the queue was full";
+            const uint64_t dropped = atomic_load(&_dropped_count);
+
+            // Counted on until the next one is let through
+            if (dropped != _dropped_reported &&
+                _rate_limit[dropped_format].pass(monotonic_ns())) {
+                std::string text;
+
+                append(&text, dropped_format,
+                       static_cast<unsigned long long>
+                       (dropped - _dropped_reported));
+                write_message(log_warning, text);
+                _dropped_reported = dropped;
+            }
+        }
+        static void *writer_thread(void *arg)
+        {
+            logger_t *logger = static_cast<logger_t *>(arg);
+            struct pollfd fd = { logger->_event_fd, POLLIN, 0 };
+
+            while (!atomic_load(&logger->_stop)) {
+                uint64_t count;
+
+                if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+                    break;
+                }
+                if (read(logger->_event_fd, &count, sizeof(count)) < 0) {
+                }
+                atomic_store(&logger->_wake_pending, int64_t(0));
+                logger->drain();
+            }
+            logger->drain();
+
+            return NULL;
+        }
+        void wake(void)
+        {
+            const uint64_t one = 1;
+
+            if (atomic_exchange(&_wake_pending, int64_t(1)) == 0 &&
+                write(_event_fd, &one, sizeof(one)) < 0) {
+            }
+        }
+    public:
+        logger_t(void)
+            : _enqueue_position(0), _dequeue_position(0),
+              _dropped_count(0), _dropped_reported(0), _wake_pending(0),
+              _syslog(false), _stop(false), _thread_alive(false)
+        {
+            static const char *name[] = {
+                "error", "warning", "info", "debug"
+            };
+            const char *level = getenv("SOUNDDECK_LOG_LEVEL");
+            const char *target = getenv("SOUNDDECK_LOG");
+
+            for (size_t i = 0; i < capacity; i++) {
+                _record[i]._sequence = i;
+            }
+            for (int i = log_error; level != NULL && i <= log_debug; i++) {
+                if (strcmp(level, name[i]) == 0) {
+                    atomic_store(&log_level, i);
+                }
+            }
+            if (target != NULL && strcmp(target, "syslog") == 0) {
+                openlog("SoundDeck", LOG_PID, LOG_USER);
+                _syslog = true;
+            }
+            _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            _thread_alive = _event_fd >= 0 &&
+                pthread_create(&_thread, NULL, &writer_thread, this) == 0;
+            if (!_thread_alive) {
+                atomic_store(&log_level, -1);
+            }
+        }
+        ~logger_t()
+        {
+            // Later messages are not queued any more
+            atomic_store(&log_level, -1);
+            if (_thread_alive) {
+                const uint64_t one = 1;
+
+                atomic_store(&_stop, true);
+                if (write(_event_fd, &one, sizeof(one)) < 0) {
+                }
+                pthread_join(_thread, NULL);
+            }
+            if (_event_fd >= 0) {
+                close(_event_fd);
+            }
+            if (_syslog) {
+                closelog();
+            }
+        }
+        static logger_t &instance(void)
+        {
+            static logger_t logger;
+
+            return logger;
+        }
+        void post(log_level_t level, const char *format,
+                  const log_arg_t *const *arg)
+        {
+            uint64_t position = atomic_load(&_enqueue_position);
+            log_record_t *record;
+
+            while (true) {
+                record = &_record[position & (capacity - 1)];
+
+                const int64_t difference = static_cast<int64_t>
+                    (atomic_load(&record->_sequence) - position);
+
+                if (difference < 0) {
+                    atomic_add(&_dropped_count, uint64_t(1));
+                    return;
+                }
+                if (difference == 0 &&
+                    atomic_compare_exchange(&_enqueue_position, &position,
+                                            position + 1)) {
+                    break;
+                }
+                if (difference > 0) {
+                    position = atomic_load(&_enqueue_position);
+                }
+            }
+            record->_level = level;
+            record->_time_ns = monotonic_ns();
+            record->_format = format;
+            for (size_t i = 0; i < log_arg_count; i++) {
+                if (arg[i]->_type == log_arg_t::type_none) {
+                    record->_arg[i]._type = log_arg_t::type_none;
+                    break;
+                }
+                record->_arg[i] = *arg[i];
+            }
+            atomic_store(&record->_sequence, position + 1);
+            wake();
+        }
+    };
+
+    // Reads the environment and starts the writer as the library is
+    // loaded rather than from the first, possibly real-time, caller
+    logger_t &logger = logger_t::instance();
+
+}
+
+void log_post(log_level_t level, const char *format,
+              const log_arg_t *const *arg)
+{
+    logger_t::instance().post(level, format, arg);
+}
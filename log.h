@@ -0,0 +1,133 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+// Diagnostics, warnings and errors to stderr by default.
+// SOUNDDECK_LOG_LEVEL (error, warning, info or debug) selects how much,
+// SOUNDDECK_LOG=syslog sends them to syslog instead.
+//
+// log_message() only copies its arguments into a lock-free queue and
+// never blocks, so the audio threads may call it. A background thread
+// formats and writes the messages. Each format string may emit a burst
+// of 10 messages, then one a second; the ones held back are counted in
+// the next one let through. A full queue drops messages, which are
+// counted as well.
+//
+// Formats are printf()-like string literals. Integer and floating
+// point arguments are converted whatever the length modifier says,
+// strings are copied and cut at log_arg_t::string_size - 1 characters.
+
+#include <cstring>
+#include <string>
+
+#include "DeckLinkAPI.h"
+#include "common.h"
+
+enum log_level_t {
+    log_error,
+    log_warning,
+    log_info,
+    log_debug
+};
+
+class log_arg_t {
+public:
+    static const size_t string_size = 96;
+    enum type_t {
+        type_none,
+        type_signed,
+        type_unsigned,
+        type_double,
+        type_string
+    };
+    type_t _type;
+    union {
+        int64_t _signed;
+        uint64_t _unsigned;
+        double _double;
+    };
+    char _string[string_size];
+    log_arg_t(void)
+        : _type(type_none)
+    {
+    }
+    log_arg_t(int value)
+        : _type(type_signed), _signed(value)
+    {
+    }
+    log_arg_t(long value)
+        : _type(type_signed), _signed(value)
+    {
+    }
+    log_arg_t(long long value)
+        : _type(type_signed), _signed(value)
+    {
+    }
+    log_arg_t(unsigned int value)
+        : _type(type_unsigned), _unsigned(value)
+    {
+    }
+    log_arg_t(unsigned long value)
+        : _type(type_unsigned), _unsigned(value)
+    {
+    }
+    log_arg_t(unsigned long long value)
+        : _type(type_unsigned), _unsigned(value)
+    {
+    }
+    log_arg_t(double value)
+        : _type(type_double), _double(value)
+    {
+    }
+    log_arg_t(const char *value)
+        : _type(type_string)
+    {
+        copy(value != NULL ? value : "(null)");
+    }
+    log_arg_t(const std::string &value)
+        : _type(type_string)
+    {
+        copy(value.c_str());
+    }
+protected:
+    void copy(const char *value)
+    {
+        strncpy(_string, value, string_size - 1);
+        _string[string_size - 1] = '\0';
+    }
+};
+
+// The most detailed level written, set from the environment as the
+// library is loaded. Hidden, so that neither binds to a log_level the
+// host or another library exports.
+extern int log_level __attribute__((visibility("hidden")));
+
+inline bool log_enabled(log_level_t level)
+{
+    return level <= atomic_load(&log_level);
+}
+
+// Arguments a message may have
+const size_t log_arg_count = 6;
+
+// Queues a message with its arguments up to the first of type_none
+void log_post(log_level_t level, const char *format,
+              const log_arg_t *const *arg);
+
+inline void log_message(log_level_t level, const char *format,
+                        const log_arg_t &a0 = log_arg_t(),
+                        const log_arg_t &a1 = log_arg_t(),
+                        const log_arg_t &a2 = log_arg_t(),
+                        const log_arg_t &a3 = log_arg_t(),
+                        const log_arg_t &a4 = log_arg_t(),
+                        const log_arg_t &a5 = log_arg_t())
+{
+    if (log_enabled(level)) {
+        const log_arg_t *const arg[log_arg_count] = {
+            &a0, &a1, &a2, &a3, &a4, &a5
+        };
+
+        log_post(level, format, arg);
+    }
+}
+
+#endif // LOG_H_
@@ -0,0 +1,511 @@
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "metrics.h"
+
+namespace {
+
+    // Bucket boundaries of the exported lateness histogram, the
+    // octaves from 2^10 ns (about 1 us) to 2^30 ns (about 1 s), which
+    // the buckets of histogram_t line up with
+    const unsigned int lateness_first_octave = 10;
+    const size_t lateness_bound_count = 21;
+
+    // Time a client gets to take a whole response
+    const int send_timeout_ms = 1000;
+
+    int64_t monotonic_ms(void)
+    {
+        struct timespec current;
+
+        clock_gettime(CLOCK_MONOTONIC, &current);
+
+        return static_cast<int64_t>(current.tv_sec) * 1000 +
+            current.tv_nsec / 1000000;
+    }
+
+    class sample_t {
+    public:
+        int64_t _underrun_count;
+        int64_t _overrun_count;
+        // Values below each bound, not cumulative
+        uint64_t _lateness[lateness_bound_count + 1];
+        uint64_t _lateness_sum;
+        bool _busy;
+        // Of the device in use, 0 while it is not
+        int64_t _sample_rate;
+        int64_t _buffer_size;
+        int64_t _buffer_fill;
+        int64_t _delay;
+        double _drift_ppm;
+        sample_t(void)
+            : _underrun_count(0), _overrun_count(0), _lateness_sum(0),
+              _busy(false), _sample_rate(0), _buffer_size(0),
+              _buffer_fill(0), _delay(0), _drift_ppm(0)
+        {
+            memset(_lateness, 0, sizeof(_lateness));
+        }
+        void add_counters(const device_state_t *state)
+        {
+            _underrun_count += atomic_load(&state->_underrun_count);
+            _overrun_count += atomic_load(&state->_overrun_count);
+            for (size_t i = 0; i < histogram_t::bucket_count; i++) {
+                const uint64_t count = state->_jitter.count(i);
+                const uint64_t lower = histogram_t::bucket_lower(i);
+                size_t bound = 0;
+
+                if (count == 0) {
+                    continue;
+                }
+                while (bound < lateness_bound_count &&
+                       lower >= 1ULL << (lateness_first_octave + bound)) {
+                    bound++;
+                }
+                _lateness[bound] += count;
+            }
+            _lateness_sum += state->_jitter.sum();
+        }
+        // Gauges come from the first state in use, there is rarely
+        // more than one per device
+        void add(const device_state_t *state)
+        {
+            add_counters(state);
+            if (_busy || (atomic_load(&state->_output_enabled) == 0 &&
+                          atomic_load(&state->_input_enabled) == 0)) {
+                return;
+            }
+            _busy = true;
+            _sample_rate = atomic_load(&state->_sample_rate);
+            _buffer_size = atomic_load(&state->_buffer_size);
+            _buffer_fill = atomic_load(&state->_buffer_fill);
+            _delay = atomic_load(&state->_delay);
+            _drift_ppm = state->drift_ppm();
+        }
+    };
+
+    class device_metrics_t {
+    public:
+        const char *_model_name;
+        std::vector<device_state_t *> _state;
+        // Counters of the states released since
+        sample_t _retired;
+        explicit device_metrics_t(const char *model_name)
+            : _model_name(model_name)
+        {
+        }
+        // Drops the states only held here
+        void prune(void)
+        {
+            for (size_t i = 0; i < _state.size();) {
+                if (_state[i]->reference_count() == 1) {
+                    _retired.add_counters(_state[i]);
+                    _state[i]->release();
+                    _state.erase(_state.begin() + i);
+                }
+                else {
+                    i++;
+                }
+            }
+        }
+        sample_t sample(void)
+        {
+            prune();
+
+            sample_t sample = _retired;
+
+            for (size_t i = 0; i < _state.size(); i++) {
+                sample.add(_state[i]);
+            }
+
+            return sample;
+        }
+    };
+
+    void append(std::string *text, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+    void append(std::string *text, const char *format, ...)
+    {
+        char line[512];
+        va_list arguments;
+
+        va_start(arguments, format);
+        vsnprintf(line, sizeof(line), format, arguments);
+        va_end(arguments);
+        *text += line;
+    }
+
+    // Label value with \, " and newlines escaped
+    std::string label(const char *value)
+    {
+        std::string escaped;
+
+        for (; *value != '\0'; value++) {
+            switch (*value) {
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            default:
+                escaped += *value;
+                break;
+            }
+        }
+
+        return escaped;
+    }
+
+    class metrics_registry_t {
+    protected:
+        pthread_mutex_t _mutex;
+        std::vector<device_metrics_t> _device;
+        std::string _path;
+        int _listen_fd;
+        int _stop_fd;
+        pthread_t _thread;
+        bool _thread_alive;
+        // Serving
+        bool _enabled;
+        void header(std::string *text, const char *name,
+                    const char *type, const char *help)
+        {
+            append(text, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+                   name, type);
+        }
+        std::string exposition(void)
+        {
+            std::vector<std::string> name;
+            std::vector<sample_t> sample;
+
+            pthread_mutex_lock(&_mutex);
+            for (size_t i = 0; i < _device.size(); i++) {
+                name.push_back(label(_device[i]._model_name));
+                sample.push_back(_device[i].sample());
+            }
+            pthread_mutex_unlock(&_mutex);
+
+            std::string text;
+
+            header(&text, "sounddeck_underruns_total", "counter",
+                   "Playback underruns");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_underruns_total{device=\"%s\"} "
+                       "%lld\n", name[i].c_str(),
+                       static_cast<long long>(sample[i]._underrun_count));
+            }
+            header(&text, "sounddeck_overruns_total", "counter",
+                   "Capture overruns");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_overruns_total{device=\"%s\"} "
+                       "%lld\n", name[i].c_str(),
+                       static_cast<long long>(sample[i]._overrun_count));
+            }
+            header(&text, "sounddeck_busy", "gauge",
+                   "1 while the output or input is enabled");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_busy{device=\"%s\"} %d\n",
+                       name[i].c_str(), sample[i]._busy ? 1 : 0);
+            }
+            header(&text, "sounddeck_sample_rate_hertz", "gauge",
+                   "Audio sample rate");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_sample_rate_hertz{device=\"%s\"} "
+                       "%lld\n", name[i].c_str(),
+                       static_cast<long long>(sample[i]._sample_rate));
+            }
+            header(&text, "sounddeck_buffer_size_frames", "gauge",
+                   "ALSA buffer size in sample frames");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_buffer_size_frames"
+                       "{device=\"%s\"} %lld\n", name[i].c_str(),
+                       static_cast<long long>(sample[i]._buffer_size));
+            }
+            header(&text, "sounddeck_buffer_fill_frames", "gauge",
+                   "Sample frames queued in the ALSA buffer");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_buffer_fill_frames"
+                       "{device=\"%s\"} %lld\n", name[i].c_str(),
+                       static_cast<long long>(sample[i]._buffer_fill));
+            }
+            header(&text, "sounddeck_delay_frames", "gauge",
+                   "ALSA delay, queued plus hardware, in sample frames");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_delay_frames{device=\"%s\"} "
+                       "%lld\n", name[i].c_str(),
+                       static_cast<long long>(sample[i]._delay));
+            }
+            header(&text, "sounddeck_drift_ppm", "gauge",
+                   "Sample clock drift against CLOCK_MONOTONIC");
+            for (size_t i = 0; i < name.size(); i++) {
+                append(&text, "sounddeck_drift_ppm{device=\"%s\"} %.3f\n",
+                       name[i].c_str(), sample[i]._drift_ppm);
+            }
+            // How late the output callback thread wakes up, which is
+            // not how late the frames it completes are
+            const char *const lateness =
+                "sounddeck_scheduler_wakeup_lateness_seconds";
+
+            header(&text, lateness, "histogram",
+                   "Output callback thread wakeup lateness");
+            for (size_t i = 0; i < name.size(); i++) {
+                uint64_t cumulative = 0;
+
+                for (size_t b = 0; b < lateness_bound_count; b++) {
+                    cumulative += sample[i]._lateness[b];
+                    append(&text, "%s_bucket{device=\"%s\",le=\"%.9g\"} "
+                           "%llu\n", lateness, name[i].c_str(),
+                           (1ULL << (lateness_first_octave + b)) * 1e-9,
+                           static_cast<unsigned long long>(cumulative));
+                }
+                cumulative += sample[i]._lateness[lateness_bound_count];
+                append(&text, "%s_bucket{device=\"%s\",le=\"+Inf\"} %llu\n",
+                       lateness, name[i].c_str(),
+                       static_cast<unsigned long long>(cumulative));
+                append(&text, "%s_sum{device=\"%s\"} %.9f\n", lateness,
+                       name[i].c_str(), sample[i]._lateness_sum * 1e-9);
+                append(&text, "%s_count{device=\"%s\"} %llu\n", lateness,
+                       name[i].c_str(),
+                       static_cast<unsigned long long>(cumulative));
+            }
+
+            return text;
+        }
+        // False for a client that does not read, so that it cannot
+        // hold up the others or the destructor
+        bool send_all(int fd, const std::string &data, int64_t deadline)
+        {
+            for (size_t sent = 0; sent < data.size();) {
+                const ssize_t n = send(fd, data.data() + sent,
+                                       data.size() - sent,
+                                       MSG_NOSIGNAL | MSG_DONTWAIT);
+
+                if (n > 0) {
+                    sent += n;
+                    continue;
+                }
+                if (n < 0 && errno != EINTR && errno != EAGAIN &&
+                    errno != EWOULDBLOCK) {
+                    return false;
+                }
+
+                const int64_t left = deadline - monotonic_ms();
+                struct pollfd ready[2] = {
+                    { fd, POLLOUT, 0 },
+                    { _stop_fd, POLLIN, 0 }
+                };
+
+                if (left <= 0 ||
+                    (poll(ready, 2, left) < 0 && errno != EINTR) ||
+                    ready[1].revents != 0) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+        void serve(int fd)
+        {
+            // An HTTP client sends its request right away, socat may
+            // send nothing at all
+            struct pollfd request = { fd, POLLIN, 0 };
+            char buffer[1024];
+            ssize_t size = 0;
+
+            if (poll(&request, 1, 100) == 1) {
+                size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            }
+
+            const std::string text = exposition();
+            const int64_t deadline = monotonic_ms() + send_timeout_ms;
+
+            if (size >= 4 && memcmp(buffer, "GET ", 4) == 0) {
+                std::string response;
+
+                append(&response, "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %lu\r\n\r\n",
+                       static_cast<unsigned long>(text.size()));
+                if (!send_all(fd, response, deadline)) {
+                    return;
+                }
+            }
+            send_all(fd, text, deadline);
+        }
+        static void *server_thread(void *arg)
+        {
+            metrics_registry_t *registry =
+                static_cast<metrics_registry_t *>(arg);
+            struct pollfd fd[2] = {
+                { registry->_listen_fd, POLLIN, 0 },
+                { registry->_stop_fd, POLLIN, 0 }
+            };
+
+            while (true) {
+                if (poll(fd, 2, -1) < 0 && errno != EINTR) {
+                    break;
+                }
+                if (fd[1].revents != 0) {
+                    break;
+                }
+                if (fd[0].revents == 0) {
+                    continue;
+                }
+
+                const int client = accept(registry->_listen_fd, NULL,
+                                          NULL);
+
+                if (client >= 0) {
+                    registry->serve(client);
+                    close(client);
+                }
+            }
+
+            return NULL;
+        }
+        // False if another process answers on the socket already
+        bool bind_socket(void)
+        {
+            struct sockaddr_un address;
+
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (_path.size() >= sizeof(address.sun_path)) {
+                return false;
+            }
+            memcpy(address.sun_path, _path.c_str(), _path.size());
+            _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (_listen_fd < 0) {
+                return false;
+            }
+
+            struct stat status;
+
+            // Replaces the socket a process that is gone left behind
+            if (lstat(_path.c_str(), &status) == 0 &&
+                S_ISSOCK(status.st_mode)) {
+                const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+                const bool alive = probe >= 0 &&
+                    connect(probe, reinterpret_cast<sockaddr *>(&address),
+                            sizeof(address)) == 0;
+
+                if (probe >= 0) {
+                    close(probe);
+                }
+                if (alive) {
+                    return false;
+                }
+                unlink(_path.c_str());
+            }
+
+            return bind(_listen_fd, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address)) == 0 &&
+                listen(_listen_fd, 4) == 0;
+        }
+    public:
+        metrics_registry_t(void)
+            : _listen_fd(-1), _stop_fd(-1), _thread_alive(false),
+              _enabled(false)
+        {
+            const char *path = getenv("SOUNDDECK_METRICS_SOCKET");
+
+            pthread_mutex_init(&_mutex, NULL);
+            if (path == NULL || path[0] == '\0') {
+                return;
+            }
+            _path = path;
+            if (!bind_socket()) {
+                log_message(log_error, "metrics: cannot serve on %s", path);
+                _path.clear();
+                return;
+            }
+            _stop_fd = eventfd(0, EFD_CLOEXEC);
+            _thread_alive = _stop_fd >= 0 &&
+                pthread_create(&_thread, NULL, &server_thread, this) == 0;
+            _enabled = _thread_alive;
+        }
+        ~metrics_registry_t()
+        {
+            if (_thread_alive) {
+                const uint64_t one = 1;
+
+                if (write(_stop_fd, &one, sizeof(one)) < 0) {
+                }
+                pthread_join(_thread, NULL);
+            }
+            if (_stop_fd >= 0) {
+                close(_stop_fd);
+            }
+            if (_listen_fd >= 0) {
+                close(_listen_fd);
+            }
+            if (!_path.empty()) {
+                unlink(_path.c_str());
+            }
+            for (size_t i = 0; i < _device.size(); i++) {
+                for (size_t s = 0; s < _device[i]._state.size(); s++) {
+                    _device[i]._state[s]->release();
+                }
+            }
+            pthread_mutex_destroy(&_mutex);
+        }
+        static metrics_registry_t &instance(void)
+        {
+            static metrics_registry_t registry;
+
+            return registry;
+        }
+        bool enabled(void) const
+        {
+            return _enabled;
+        }
+        void add(device_state_t *state, const char *model_name)
+        {
+            pthread_mutex_lock(&_mutex);
+
+            size_t i = _device.size();
+
+            // Hosts that scan repeatedly leave a state per scan behind
+            for (size_t d = 0; d < _device.size(); d++) {
+                _device[d].prune();
+                if (strcmp(_device[d]._model_name, model_name) == 0) {
+                    i = d;
+                }
+            }
+            if (i == _device.size()) {
+                _device.push_back(device_metrics_t(model_name));
+            }
+            state->add_ref();
+            _device[i]._state.push_back(state);
+            pthread_mutex_unlock(&_mutex);
+        }
+    };
+
+}
+
+void metrics_register(device_state_t *state, const char *model_name)
+{
+    metrics_registry_t &registry = metrics_registry_t::instance();
+
+    if (registry.enabled()) {
+        registry.add(state, model_name);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "device_state.h"
+
+// Counters, gauges and the scheduler wakeup lateness histogram of every
+// device, in the Prometheus text exposition format, on the Unix socket
+// SOUNDDECK_METRICS_SOCKET names. A background thread answers each
+// connection, as an HTTP/1.0 response if the client sent a GET, as is
+// otherwise (e.g. socat - UNIX-CONNECT:<path>). The values are those
+// device_state_t keeps for IDeckLinkStatus anyway, so the audio and
+// scheduler threads do no more work. Without the variable nothing is
+// registered and no thread started.
+
+// Exports state, labelled with the model name, for as long as anything
+// else holds a reference to it. Counters of released states are kept
+// so that the totals per name never go back.
+void metrics_register(device_state_t *state, const char *model_name);
+
+#endif // METRICS_H_
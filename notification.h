@@ -0,0 +1,236 @@
+#ifndef NOTIFICATION_H_
+#define NOTIFICATION_H_
+
+#include <cerrno>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "DeckLinkAPI.h"
+#include "SoundDeckAPI.h"
+
+#include "common.h"
+
+// Delivers IDeckLinkNotification events from a dispatcher thread.
+// post_*() only sets a pending bit and, if it was not already set,
+// pokes an eventfd, so it is safe to call from the audio thread.
+// Repeated events arriving before the dispatcher wakes up are
+// coalesced into one.
+class notifier_t {
+protected:
+    typedef std::pair<BMDNotifications, IDeckLinkNotificationCallback *>
+    subscription_t;
+    static const BMDDeckLinkStatusID *status_id(void)
+    {
+        static const BMDDeckLinkStatusID id[] = {
+            bmdDeckLinkStatusBusy,
+            bmdDeckLinkStatusCurrentVideoOutputMode,
+            bmdDeckLinkStatusSoundDeckSampleRate,
+            bmdDeckLinkStatusSoundDeckUnderrunCount,
+            bmdDeckLinkStatusCurrentVideoInputMode,
+            bmdDeckLinkStatusSoundDeckOverrunCount,
+            bmdDeckLinkStatusSoundDeckKeyerLevel,
+            bmdDeckLinkStatusSoundDeckHDRMetadata,
+            static_cast<BMDDeckLinkStatusID>(0)
+        };
+
+        return id;
+    }
+    // Bit 0 is bmdPreferencesChanged, bit i + 1 is status_id()[i]
+    static const uint64_t pending_preferences = 1;
+    uint64_t _pending;
+    int _event_fd;
+    bool _stop;
+    pthread_t _dispatch_thread;
+    bool _dispatch_thread_alive;
+    // Set by the destructor when it runs on the dispatcher, see
+    // dispatch_thread()
+    bool *_destroyed;
+    pthread_mutex_t _mutex;
+    std::vector<subscription_t> _subscription;
+    void wake(void)
+    {
+        const uint64_t one = 1;
+
+        // Cannot block, the eventfd is non-blocking and the counter
+        // only saturates after 2^64 - 2 unconsumed posts
+        if (write(_event_fd, &one, sizeof(one)) < 0) {
+        }
+    }
+    void post(uint64_t bit)
+    {
+        if ((__atomic_fetch_or(&_pending, bit, __ATOMIC_ACQ_REL) &
+             bit) == 0) {
+            wake();
+        }
+    }
+    void deliver(BMDNotifications topic, uint64_t param1)
+    {
+        std::vector<IDeckLinkNotificationCallback *> callback;
+
+        // Call outside the lock, so that a subscriber may
+        // (un)subscribe from within Notify()
+        pthread_mutex_lock(&_mutex);
+        for (std::vector<subscription_t>::const_iterator iterator =
+                 _subscription.begin();
+             iterator != _subscription.end(); iterator++) {
+            if (iterator->first == topic) {
+                iterator->second->AddRef();
+                callback.push_back(iterator->second);
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        for (std::vector<IDeckLinkNotificationCallback *>::iterator
+                 iterator = callback.begin();
+             iterator != callback.end(); iterator++) {
+            (*iterator)->Notify(topic, param1, 0);
+            (*iterator)->Release();
+        }
+    }
+    static void *dispatch_thread(void *arg)
+    {
+        notifier_t *n = reinterpret_cast<notifier_t *>(arg);
+        bool destroyed = false;
+
+        // A subscriber dropping the last reference to the owner from
+        // within Notify() destroys n on this thread, which must not
+        // touch it after deliver() returns
+        n->_destroyed = &destroyed;
+        while (!atomic_load(&n->_stop)) {
+            struct pollfd fd = { n->_event_fd, POLLIN, 0 };
+
+            if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+                break;
+            }
+
+            uint64_t count;
+
+            if (read(n->_event_fd, &count, sizeof(count)) < 0) {
+            }
+
+            const uint64_t pending =
+                atomic_exchange(&n->_pending, uint64_t(0));
+
+            if (pending & pending_preferences) {
+                n->deliver(bmdPreferencesChanged, 0);
+                if (destroyed) {
+                    return NULL;
+                }
+            }
+            for (size_t i = 0; status_id()[i] != 0; i++) {
+                if (pending & (pending_preferences << (i + 1))) {
+                    n->deliver(bmdStatusChanged, status_id()[i]);
+                    if (destroyed) {
+                        return NULL;
+                    }
+                }
+            }
+        }
+
+        return NULL;
+    }
+public:
+    notifier_t(void)
+        : _pending(0),
+          _event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          _stop(false), _dispatch_thread_alive(false), _destroyed(NULL)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+    ~notifier_t()
+    {
+        if (_dispatch_thread_alive &&
+            pthread_equal(pthread_self(), _dispatch_thread)) {
+            *_destroyed = true;
+            pthread_detach(_dispatch_thread);
+        }
+        else if (_dispatch_thread_alive) {
+            atomic_store(&_stop, true);
+            wake();
+            pthread_join(_dispatch_thread, NULL);
+        }
+        for (std::vector<subscription_t>::iterator iterator =
+                 _subscription.begin();
+             iterator != _subscription.end(); iterator++) {
+            iterator->second->Release();
+        }
+        if (_event_fd >= 0) {
+            close(_event_fd);
+        }
+        pthread_mutex_destroy(&_mutex);
+    }
+    HRESULT subscribe(BMDNotifications topic,
+                      IDeckLinkNotificationCallback *callback)
+    {
+        if (callback == NULL ||
+            (topic != bmdPreferencesChanged &&
+             topic != bmdStatusChanged)) {
+            return E_INVALIDARG;
+        }
+        if (_event_fd < 0) {
+            return E_FAIL;
+        }
+
+        const subscription_t subscription(topic, callback);
+
+        pthread_mutex_lock(&_mutex);
+        if (std::find(_subscription.begin(), _subscription.end(),
+                      subscription) != _subscription.end()) {
+            pthread_mutex_unlock(&_mutex);
+            return E_INVALIDARG;
+        }
+        // The dispatcher is only started once somebody listens
+        if (!_dispatch_thread_alive) {
+            if (pthread_create(&_dispatch_thread, NULL,
+                               &notifier_t::dispatch_thread,
+                               this) != 0) {
+                pthread_mutex_unlock(&_mutex);
+                return E_FAIL;
+            }
+            _dispatch_thread_alive = true;
+        }
+        callback->AddRef();
+        _subscription.push_back(subscription);
+        pthread_mutex_unlock(&_mutex);
+
+        return S_OK;
+    }
+    HRESULT unsubscribe(BMDNotifications topic,
+                        IDeckLinkNotificationCallback *callback)
+    {
+        pthread_mutex_lock(&_mutex);
+
+        std::vector<subscription_t>::iterator iterator =
+            std::find(_subscription.begin(), _subscription.end(),
+                      subscription_t(topic, callback));
+
+        if (iterator == _subscription.end()) {
+            pthread_mutex_unlock(&_mutex);
+            return E_INVALIDARG;
+        }
+        _subscription.erase(iterator);
+        pthread_mutex_unlock(&_mutex);
+        callback->Release();
+
+        return S_OK;
+    }
+    void post_preferences_changed(void)
+    {
+        post(pending_preferences);
+    }
+    void post_status_changed(BMDDeckLinkStatusID id)
+    {
+        for (size_t i = 0; status_id()[i] != 0; i++) {
+            if (status_id()[i] == id) {
+                post(pending_preferences << (i + 1));
+                return;
+            }
+        }
+    }
+};
+
+#endif // NOTIFICATION_H_
@@ -0,0 +1,316 @@
+#include <cstring>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+#include "audio_ring.h"
+#include "audio_sink.h"
+#include "log.h"
+
+namespace {
+
+    pthread_once_t pipewire_once = PTHREAD_ONCE_INIT;
+
+    void pipewire_init(void)
+    {
+        pw_init(NULL, NULL);
+    }
+
+    // Native PipeWire stream, so that the graph clocks the output
+    // rather than the ALSA compatibility plugin with its own buffering
+    // and resampler. The process callback runs on the graph's
+    // realtime thread and only copies out of the ring.
+    class pipewire_sink_t : public audio_sink_t {
+    protected:
+        static const uint32_t default_buffer_size = 8192;
+        struct pw_thread_loop *_loop;
+        struct pw_stream *_stream;
+        struct pw_stream_events _events;
+        audio_ring_t _ring;
+        // Set by stop(), the process callback discards the ring
+        int64_t _flush;
+        // Set by the process callback when it ran out of frames while
+        // the host was feeding, write() counts it as an underrun
+        int64_t _starved;
+        int64_t _running;
+        int64_t _stream_state;
+        static void on_state_changed(void *data,
+                                     enum pw_stream_state old,
+                                     enum pw_stream_state state,
+                                     const char *error)
+        {
+            pipewire_sink_t *sink = static_cast<pipewire_sink_t *>(data);
+
+            atomic_store(&sink->_stream_state,
+                         static_cast<int64_t>(state));
+            pw_thread_loop_signal(sink->_loop, false);
+        }
+        static void on_process(void *data)
+        {
+            pipewire_sink_t *sink = static_cast<pipewire_sink_t *>(data);
+            struct pw_buffer *buffer =
+                pw_stream_dequeue_buffer(sink->_stream);
+
+            if (buffer == NULL) {
+                return;
+            }
+
+            struct spa_data *d = &buffer->buffer->datas[0];
+            const size_t frame_byte = sink->_ring.frame_byte();
+
+            if (d->data == NULL) {
+                pw_stream_queue_buffer(sink->_stream, buffer);
+                return;
+            }
+
+            uint32_t frame_count = d->maxsize / frame_byte;
+
+            if (buffer->requested > 0 && buffer->requested < frame_count) {
+                frame_count = buffer->requested;
+            }
+            if (atomic_exchange(&sink->_flush, int64_t(0)) != 0) {
+                sink->_ring.skip(sink->_ring.readable());
+            }
+
+            const size_t read = sink->_ring.read(d->data, frame_count);
+
+            if (read < frame_count) {
+                memset(static_cast<char *>(d->data) + read * frame_byte,
+                       0, (frame_count - read) * frame_byte);
+                if (atomic_load(&sink->_running) != 0) {
+                    atomic_store(&sink->_starved, int64_t(1));
+                }
+            }
+            d->chunk->offset = 0;
+            d->chunk->stride = frame_byte;
+            d->chunk->size = frame_count * frame_byte;
+            pw_stream_queue_buffer(sink->_stream, buffer);
+        }
+        bool stalled(void) const
+        {
+            return atomic_load(&_stream_state) == PW_STREAM_STATE_ERROR ||
+                atomic_load(&_stream_state) ==
+                PW_STREAM_STATE_UNCONNECTED;
+        }
+        // Frames queued here plus those the graph has yet to play
+        int64_t delay(void)
+        {
+            struct pw_time time;
+            int64_t delay = _ring.readable();
+
+            if (pw_stream_get_time_n(_stream, &time, sizeof(time)) == 0 &&
+                time.rate.denom > 0) {
+                delay += time.delay * time.rate.num * _sample_rate /
+                    time.rate.denom;
+            }
+
+            return delay;
+        }
+    public:
+        pipewire_sink_t(device_state_t *state)
+            : audio_sink_t(state), _loop(NULL), _stream(NULL), _flush(0),
+              _starved(0), _running(0),
+              _stream_state(PW_STREAM_STATE_UNCONNECTED)
+        {
+            memset(&_events, 0, sizeof(_events));
+            _events.version = PW_VERSION_STREAM_EVENTS;
+            _events.state_changed = &on_state_changed;
+            _events.process = &on_process;
+        }
+        ~pipewire_sink_t()
+        {
+            if (_loop != NULL) {
+                pw_thread_loop_stop(_loop);
+            }
+            if (_stream != NULL) {
+                pw_stream_destroy(_stream);
+            }
+            if (_loop != NULL) {
+                pw_thread_loop_destroy(_loop);
+            }
+        }
+        bool open(unsigned int *sample_rate,
+                  unsigned int sample_width_byte,
+                  unsigned int channel_count)
+        {
+            // DeckLink order, L R C LFE Ls Rs Lrs Rrs, then
+            // unpositioned
+            static const uint32_t position[] = {
+                SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR,
+                SPA_AUDIO_CHANNEL_FC, SPA_AUDIO_CHANNEL_LFE,
+                SPA_AUDIO_CHANNEL_SL, SPA_AUDIO_CHANNEL_SR,
+                SPA_AUDIO_CHANNEL_RL, SPA_AUDIO_CHANNEL_RR
+            };
+            const uint32_t position_count =
+                sizeof(position) / sizeof(*position);
+
+            if (channel_count == 0 ||
+                channel_count > SPA_AUDIO_MAX_CHANNELS) {
+                log_message(log_error, "PipeWire: %u channels, 1 to %u "
+                            "supported", channel_count,
+                            SPA_AUDIO_MAX_CHANNELS);
+                return false;
+            }
+            pthread_once(&pipewire_once, &pipewire_init);
+
+            int64_t buffer_size =
+                atomic_load(&_state->_buffer_size_request);
+            const int64_t period_size =
+                atomic_load(&_state->_period_size_request);
+
+            if (buffer_size <= 0) {
+                buffer_size = default_buffer_size;
+            }
+            _ring.allocate(channel_count * sample_width_byte, buffer_size);
+            _sample_rate = *sample_rate;
+
+            struct pw_properties *properties = pw_properties_new
+                (PW_KEY_MEDIA_TYPE, "Audio",
+                 PW_KEY_MEDIA_CATEGORY, "Playback",
+                 PW_KEY_MEDIA_ROLE, "Production",
+                 PW_KEY_APP_NAME, "SoundDeck",
+                 NULL);
+
+            // Ask the graph to run at our rate, so that it does not
+            // resample if it can switch
+            pw_properties_setf(properties, PW_KEY_NODE_RATE, "1/%u",
+                               *sample_rate);
+            if (period_size > 0) {
+                pw_properties_setf(properties, PW_KEY_NODE_LATENCY,
+                                   "%lld/%u",
+                                   static_cast<long long>(period_size),
+                                   *sample_rate);
+            }
+
+            struct spa_audio_info_raw info;
+            uint8_t pod_buffer[1024];
+            struct spa_pod_builder builder;
+            const struct spa_pod *parameter[1];
+
+            memset(&info, 0, sizeof(info));
+            info.format = sample_width_byte == 2 ?
+                SPA_AUDIO_FORMAT_S16_LE : SPA_AUDIO_FORMAT_S32_LE;
+            info.rate = *sample_rate;
+            info.channels = channel_count;
+            for (uint32_t c = 0; c < channel_count; c++) {
+                info.position[c] = c < position_count ? position[c] :
+                    SPA_AUDIO_CHANNEL_AUX0 + c - position_count;
+            }
+            spa_pod_builder_init(&builder, pod_buffer, sizeof(pod_buffer));
+            parameter[0] = spa_format_audio_raw_build
+                (&builder, SPA_PARAM_EnumFormat, &info);
+
+            _loop = pw_thread_loop_new("sounddeck-pipewire", NULL);
+            if (_loop == NULL) {
+                log_message(log_error, "PipeWire: cannot create a loop");
+                pw_properties_free(properties);
+                return false;
+            }
+            pw_thread_loop_lock(_loop);
+            if (pw_thread_loop_start(_loop) < 0) {
+                log_message(log_error, "PipeWire: cannot start the loop");
+                pw_thread_loop_unlock(_loop);
+                pw_properties_free(properties);
+                return false;
+            }
+            // Takes ownership of properties
+            _stream = pw_stream_new_simple
+                (pw_thread_loop_get_loop(_loop), "SoundDeck output",
+                 properties, &_events, this);
+            if (_stream == NULL ||
+                pw_stream_connect
+                (_stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+                 static_cast<enum pw_stream_flags>
+                 (PW_STREAM_FLAG_AUTOCONNECT |
+                  PW_STREAM_FLAG_MAP_BUFFERS |
+                  PW_STREAM_FLAG_RT_PROCESS), parameter, 1) < 0) {
+                log_message(log_error, "PipeWire: cannot connect a stream");
+                pw_thread_loop_unlock(_loop);
+                return false;
+            }
+            // Until the format is negotiated, or it failed
+            while (atomic_load(&_stream_state) != PW_STREAM_STATE_ERROR &&
+                   atomic_load(&_stream_state) < PW_STREAM_STATE_PAUSED) {
+                if (pw_thread_loop_timed_wait(_loop, 2) != 0) {
+                    break;
+                }
+            }
+            pw_thread_loop_unlock(_loop);
+            if (atomic_load(&_stream_state) < PW_STREAM_STATE_PAUSED) {
+                log_message(log_error, "PipeWire: no format agreed on for "
+                            "%u Hz, %u-bit, %u channels", *sample_rate,
+                            sample_width_byte * 8, channel_count);
+                return false;
+            }
+            atomic_store(&_state->_buffer_size,
+                         static_cast<int64_t>(_ring.capacity()));
+            restart_drift();
+
+            return true;
+        }
+        uint32_t write(const void *buffer, uint32_t frame_count)
+        {
+            if (atomic_exchange(&_starved, int64_t(0)) != 0) {
+                log_message(log_warning, "PipeWire: underrun");
+                _state->add_underrun();
+                restart_drift();
+            }
+            atomic_store(&_running, int64_t(1));
+
+            const uint32_t written = ring_write(&_ring, buffer, frame_count);
+
+            if (written > 0) {
+                update_telemetry(written, _ring.readable(), delay());
+            }
+
+            return written;
+        }
+        void start(void)
+        {
+            atomic_store(&_starved, int64_t(0));
+            restart_drift();
+        }
+        void stop(void)
+        {
+            ring_wait_empty(&_ring);
+            atomic_store(&_running, int64_t(0));
+            atomic_store(&_flush, int64_t(1));
+        }
+        void drain(void)
+        {
+            ring_wait_empty(&_ring);
+            atomic_store(&_running, int64_t(0));
+        }
+    };
+
+}
+
+bool pipewire_sink_available(void)
+{
+    // The socket the client library would connect to, checking for it
+    // is far cheaper than connecting
+    const char *remote = getenv("PIPEWIRE_REMOTE");
+    std::string path = remote != NULL ? remote : "pipewire-0";
+
+    if (path[0] != '/') {
+        const char *directory = getenv("PIPEWIRE_RUNTIME_DIR");
+
+        if (directory == NULL) {
+            directory = getenv("XDG_RUNTIME_DIR");
+        }
+        if (directory == NULL) {
+            return false;
+        }
+        path = std::string(directory) + "/" + path;
+    }
+
+    return access(path.c_str(), F_OK) == 0;
+}
+
+audio_sink_t *create_pipewire_sink(device_state_t *state)
+{
+    return new pipewire_sink_t(state);
+}
@@ -1,32 +1,472 @@
 #include <cstdio>
 #include <cstring>
+#include <vector>
+#include <dlfcn.h>
 #include <alsa/asoundlib.h>
 #include "DeckLinkAPI.h"
 
 #include "common.h"
+#include "convert.h"
+
+namespace {
+
+    // OpenGL is resolved at runtime from whatever libGL the host has
+    // loaded, so neither the build nor hosts that never preview depend
+    // on it
+    typedef unsigned int GLenum;
+    typedef unsigned int GLuint;
+    typedef unsigned int GLbitfield;
+    typedef int GLint;
+    typedef int GLsizei;
+    typedef float GLfloat;
+    typedef char GLchar;
+
+    enum {
+        GL_QUADS = 0x0007,
+        GL_VIEWPORT = 0x0ba2,
+        GL_UNPACK_ROW_LENGTH = 0x0cf2,
+        GL_UNPACK_ALIGNMENT = 0x0cf5,
+        GL_TEXTURE_2D = 0x0de1,
+        GL_UNSIGNED_BYTE = 0x1401,
+        GL_MODELVIEW = 0x1700,
+        GL_PROJECTION = 0x1701,
+        GL_RGBA = 0x1908,
+        GL_NEAREST = 0x2600,
+        GL_TEXTURE_MAG_FILTER = 0x2800,
+        GL_TEXTURE_MIN_FILTER = 0x2801,
+        GL_TEXTURE_WRAP_S = 0x2802,
+        GL_TEXTURE_WRAP_T = 0x2803,
+        GL_COLOR_BUFFER_BIT = 0x4000,
+        GL_BGRA = 0x80e1,
+        GL_CLAMP_TO_EDGE = 0x812f,
+        GL_FRAGMENT_SHADER = 0x8b30,
+        GL_COMPILE_STATUS = 0x8b81,
+        GL_LINK_STATUS = 0x8b82
+    };
+
+    class gl_t {
+    protected:
+        void *_library;
+        void *(*_get_proc_address)(const GLchar *name);
+        void *symbol(const char *name)
+        {
+            void *address = _get_proc_address != NULL ?
+                _get_proc_address(name) : NULL;
+
+            return address != NULL ? address : dlsym(_library, name);
+        }
+        template<typename function_t>
+        bool resolve(function_t &function, const char *name)
+        {
+            function = reinterpret_cast<function_t>(symbol(name));
+
+            return function != NULL;
+        }
+    public:
+        // OpenGL 1.1
+        void (*_gen_textures)(GLsizei n, GLuint *textures);
+        void (*_bind_texture)(GLenum target, GLuint texture);
+        void (*_tex_parameteri)(GLenum target, GLenum name, GLint value);
+        void (*_tex_image_2d)(GLenum target, GLint level,
+                              GLint internal_format, GLsizei width,
+                              GLsizei height, GLint border,
+                              GLenum format, GLenum type,
+                              const void *pixels);
+        void (*_tex_sub_image_2d)(GLenum target, GLint level,
+                                  GLint x, GLint y, GLsizei width,
+                                  GLsizei height, GLenum format,
+                                  GLenum type, const void *pixels);
+        void (*_pixel_storei)(GLenum name, GLint value);
+        void (*_clear_color)(GLfloat red, GLfloat green, GLfloat blue,
+                             GLfloat alpha);
+        void (*_clear)(GLbitfield mask);
+        void (*_get_integerv)(GLenum name, GLint *value);
+        void (*_enable)(GLenum capability);
+        void (*_disable)(GLenum capability);
+        void (*_matrix_mode)(GLenum mode);
+        void (*_push_matrix)(void);
+        void (*_pop_matrix)(void);
+        void (*_load_identity)(void);
+        void (*_begin)(GLenum mode);
+        void (*_end)(void);
+        void (*_tex_coord_2f)(GLfloat s, GLfloat t);
+        void (*_vertex_2f)(GLfloat x, GLfloat y);
+        // OpenGL 2.0, optional
+        GLuint (*_create_shader)(GLenum type);
+        void (*_shader_source)(GLuint shader, GLsizei count,
+                               const GLchar **string,
+                               const GLint *length);
+        void (*_compile_shader)(GLuint shader);
+        void (*_get_shaderiv)(GLuint shader, GLenum name, GLint *value);
+        void (*_delete_shader)(GLuint shader);
+        GLuint (*_create_program)(void);
+        void (*_attach_shader)(GLuint program, GLuint shader);
+        void (*_link_program)(GLuint program);
+        void (*_get_programiv)(GLuint program, GLenum name,
+                               GLint *value);
+        void (*_use_program)(GLuint program);
+        GLint (*_get_uniform_location)(GLuint program,
+                                       const GLchar *name);
+        void (*_uniform_1i)(GLint location, GLint value);
+        void (*_uniform_1f)(GLint location, GLfloat value);
+        void (*_uniform_4f)(GLint location, GLfloat x, GLfloat y,
+                            GLfloat z, GLfloat w);
+        bool _shader;
+        gl_t(void)
+            : _library(NULL), _get_proc_address(NULL), _shader(false)
+        {
+        }
+        ~gl_t()
+        {
+            if (_library != NULL) {
+                dlclose(_library);
+            }
+        }
+        bool load(void)
+        {
+            if (_library == NULL) {
+                _library = dlopen("libGL.so.1", RTLD_LAZY | RTLD_NOLOAD);
+            }
+            if (_library == NULL) {
+                _library = dlopen("libGL.so.1", RTLD_LAZY);
+            }
+            if (_library == NULL) {
+                return false;
+            }
+            _get_proc_address = reinterpret_cast
+                <void *(*)(const GLchar *)>
+                (dlsym(_library, "glXGetProcAddressARB"));
+
+            const bool core =
+                resolve(_gen_textures, "glGenTextures") &&
+                resolve(_bind_texture, "glBindTexture") &&
+                resolve(_tex_parameteri, "glTexParameteri") &&
+                resolve(_tex_image_2d, "glTexImage2D") &&
+                resolve(_tex_sub_image_2d, "glTexSubImage2D") &&
+                resolve(_pixel_storei, "glPixelStorei") &&
+                resolve(_clear_color, "glClearColor") &&
+                resolve(_clear, "glClear") &&
+                resolve(_get_integerv, "glGetIntegerv") &&
+                resolve(_enable, "glEnable") &&
+                resolve(_disable, "glDisable") &&
+                resolve(_matrix_mode, "glMatrixMode") &&
+                resolve(_push_matrix, "glPushMatrix") &&
+                resolve(_pop_matrix, "glPopMatrix") &&
+                resolve(_load_identity, "glLoadIdentity") &&
+                resolve(_begin, "glBegin") &&
+                resolve(_end, "glEnd") &&
+                resolve(_tex_coord_2f, "glTexCoord2f") &&
+                resolve(_vertex_2f, "glVertex2f");
+
+            _shader = core &&
+                resolve(_create_shader, "glCreateShader") &&
+                resolve(_shader_source, "glShaderSource") &&
+                resolve(_compile_shader, "glCompileShader") &&
+                resolve(_get_shaderiv, "glGetShaderiv") &&
+                resolve(_delete_shader, "glDeleteShader") &&
+                resolve(_create_program, "glCreateProgram") &&
+                resolve(_attach_shader, "glAttachShader") &&
+                resolve(_link_program, "glLinkProgram") &&
+                resolve(_get_programiv, "glGetProgramiv") &&
+                resolve(_use_program, "glUseProgram") &&
+                resolve(_get_uniform_location, "glGetUniformLocation") &&
+                resolve(_uniform_1i, "glUniform1i") &&
+                resolve(_uniform_1f, "glUniform1f") &&
+                resolve(_uniform_4f, "glUniform4f");
+
+            return core;
+        }
+    };
+
+    // 2vuy is uploaded as a half width RGBA texture, each texel
+    // holding (Cb, Y0, Cr, Y1), and converted here
+    const char *yuv_shader =
+        "uniform sampler2D frame;\n"
+        "uniform float width;\n"
+        "uniform vec4 k;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 t = texture2D(frame, gl_TexCoord[0].st);\n"
+        "    float y = mod(floor(gl_TexCoord[0].s * width), 2.0) < 0.5 ?\n"
+        "        t.g : t.a;\n"
+        "    y = (y * 255.0 - 16.0) / 219.0;\n"
+        "    float u = (t.r * 255.0 - 128.0) / 224.0;\n"
+        "    float v = (t.b * 255.0 - 128.0) / 224.0;\n"
+        "    gl_FragColor = vec4(y + k.x * v, y + k.y * u + k.z * v,\n"
+        "                        y + k.w * u, 1.0);\n"
+        "}\n";
+
+}
 
 class IDeckLinkGLScreenPreviewHelper_0001 :
     public IDeckLinkGLScreenPreviewHelper {
+protected:
+    // Latest frame from SetFrame() not yet painted. Exchanged
+    // atomically, so that the scheduler thread never waits for the GL
+    // thread, and a frame superseded before painting is dropped.
+    IDeckLinkVideoFrame *_pending;
+    BMD3DPreviewFormat _3d_preview_format;
+    // Everything below is only touched from the GL thread
+    gl_t _gl;
+    bool _gl_loaded;
+    GLuint _texture;
+    GLuint _program;
+    GLint _width_location;
+    GLint _k_location;
+    long _texture_width;
+    long _texture_height;
+    GLenum _texture_format;
+    bool _texture_yuv;
+    long _width;
+    long _height;
+    std::vector<uint8_t> _bgra;
+    GLuint compile_program(void)
+    {
+        const GLuint shader = _gl._create_shader(GL_FRAGMENT_SHADER);
+        GLint status = 0;
+
+        _gl._shader_source(shader, 1, &yuv_shader, NULL);
+        _gl._compile_shader(shader);
+        _gl._get_shaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (!status) {
+            _gl._delete_shader(shader);
+            return 0;
+        }
+
+        const GLuint program = _gl._create_program();
+
+        _gl._attach_shader(program, shader);
+        _gl._link_program(program);
+        // Flagged for deletion, freed together with the program
+        _gl._delete_shader(shader);
+        _gl._get_programiv(program, GL_LINK_STATUS, &status);
+
+        return status ? program : 0;
+    }
+    void upload(GLenum format, long width, long height, long row_texels,
+                const void *pixels)
+    {
+        _gl._bind_texture(GL_TEXTURE_2D, _texture);
+        _gl._pixel_storei(GL_UNPACK_ROW_LENGTH, row_texels);
+        _gl._pixel_storei(GL_UNPACK_ALIGNMENT, 4);
+        if (width != _texture_width || height != _texture_height ||
+            format != _texture_format) {
+            _gl._tex_image_2d(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+                              0, format, GL_UNSIGNED_BYTE, pixels);
+            _texture_width = width;
+            _texture_height = height;
+            _texture_format = format;
+        }
+        else {
+            _gl._tex_sub_image_2d(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                                  format, GL_UNSIGNED_BYTE, pixels);
+        }
+        _gl._pixel_storei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    void upload(IDeckLinkVideoFrame *frame)
+    {
+        void *bytes;
+
+        if (frame->GetBytes(&bytes) != S_OK) {
+            return;
+        }
+
+        image_t source = {
+            frame->GetPixelFormat(), frame->GetWidth(),
+            frame->GetHeight(), frame->GetRowBytes(), bytes
+        };
+
+        if (source._pixel_format == bmdFormat8BitYUV && _program != 0 &&
+            source._row_bytes % 4 == 0) {
+            upload(GL_RGBA, (source._width + 1) / 2, source._height,
+                   source._row_bytes / 4, bytes);
+            _texture_yuv = true;
+        }
+        else if (source._pixel_format == bmdFormat8BitBGRA &&
+                 source._row_bytes % 4 == 0) {
+            upload(GL_BGRA, source._width, source._height,
+                   source._row_bytes / 4, bytes);
+            _texture_yuv = false;
+        }
+        else {
+            // Without shaders, or for any other format, convert on the
+            // CPU with the SIMD kernels
+            image_t destination = {
+                bmdFormat8BitBGRA, source._width, source._height,
+                4 * source._width, NULL
+            };
+
+            _bgra.resize(destination._row_bytes * destination._height);
+            destination._data = &_bgra[0];
+            if (!convert_image(source, destination,
+                               source._height < 720 ?
+                               bmdDisplayModeColorspaceRec601 :
+                               bmdDisplayModeColorspaceRec709)) {
+                return;
+            }
+            upload(GL_BGRA, destination._width, destination._height,
+                   destination._width, destination._data);
+            _texture_yuv = false;
+        }
+        _width = source._width;
+        _height = source._height;
+    }
 public:
-    DUMMY_IUNKNOWN;
+    DUMMY_IUNKNOWN(IDeckLinkGLScreenPreviewHelper_0001);
+    IDeckLinkGLScreenPreviewHelper_0001(void)
+        : _pending(NULL), _3d_preview_format(bmd3DPreviewFormatDefault),
+          _gl_loaded(false), _texture(0), _program(0),
+          _width_location(-1), _k_location(-1), _texture_width(0),
+          _texture_height(0), _texture_format(0), _texture_yuv(false),
+          _width(0), _height(0)
+    {
+    }
+    // The texture and program belong to the host's GL context, which
+    // is not current here, and go away with it
+    virtual ~IDeckLinkGLScreenPreviewHelper_0001()
+    {
+        if (_pending != NULL) {
+            _pending->Release();
+        }
+    }
     HRESULT InitializeGL(void)
     {
-        return E_FAIL;
+        if (!_gl_loaded) {
+            if (!_gl.load()) {
+                return E_FAIL;
+            }
+            _gl_loaded = true;
+        }
+        _gl._gen_textures(1, &_texture);
+        _gl._bind_texture(GL_TEXTURE_2D, _texture);
+        // Nearest, the shader must not blend neighbouring YUV pairs
+        _gl._tex_parameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                            GL_NEAREST);
+        _gl._tex_parameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+                            GL_NEAREST);
+        _gl._tex_parameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+                            GL_CLAMP_TO_EDGE);
+        _gl._tex_parameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+                            GL_CLAMP_TO_EDGE);
+        _texture_width = 0;
+        _texture_height = 0;
+        _program = _gl._shader ? compile_program() : 0;
+        if (_program != 0) {
+            _width_location =
+                _gl._get_uniform_location(_program, "width");
+            _k_location = _gl._get_uniform_location(_program, "k");
+            _gl._use_program(_program);
+            _gl._uniform_1i(_gl._get_uniform_location(_program,
+                                                      "frame"), 0);
+            _gl._use_program(0);
+        }
+        return S_OK;
     }
     HRESULT PaintGL(void)
     {
-        return E_FAIL;
+        if (!_gl_loaded || _texture == 0) {
+            return E_FAIL;
+        }
+
+        IDeckLinkVideoFrame *frame =
+            atomic_exchange(&_pending,
+                            static_cast<IDeckLinkVideoFrame *>(NULL));
+
+        if (frame != NULL) {
+            upload(frame);
+            frame->Release();
+        }
+
+        _gl._clear_color(0, 0, 0, 1);
+        _gl._clear(GL_COLOR_BUFFER_BIT);
+        if (_width == 0 || _height == 0) {
+            return S_OK;
+        }
+
+        // Scale to fit the viewport, keeping the aspect ratio
+        GLint viewport[4] = { 0, 0, 0, 0 };
+        GLfloat x = 1;
+        GLfloat y = 1;
+
+        _gl._get_integerv(GL_VIEWPORT, viewport);
+        if (viewport[2] > 0 && viewport[3] > 0) {
+            const double ratio =
+                (static_cast<double>(_width) / _height) /
+                (static_cast<double>(viewport[2]) / viewport[3]);
+
+            if (ratio > 1) {
+                y = 1 / ratio;
+            }
+            else {
+                x = ratio;
+            }
+        }
+
+        _gl._matrix_mode(GL_PROJECTION);
+        _gl._push_matrix();
+        _gl._load_identity();
+        _gl._matrix_mode(GL_MODELVIEW);
+        _gl._push_matrix();
+        _gl._load_identity();
+        _gl._enable(GL_TEXTURE_2D);
+        _gl._bind_texture(GL_TEXTURE_2D, _texture);
+        if (_texture_yuv) {
+            const bool rec601 = _height < 720;
+
+            _gl._use_program(_program);
+            _gl._uniform_1f(_width_location, _width);
+            // Rec. 601 or 709 Pr to R, Pb and Pr to G, and Pb to B
+            _gl._uniform_4f(_k_location,
+                            rec601 ? 1.402 : 1.5748,
+                            rec601 ? -0.344136 : -0.187324,
+                            rec601 ? -0.714136 : -0.468124,
+                            rec601 ? 1.772 : 1.8556);
+        }
+        _gl._begin(GL_QUADS);
+        _gl._tex_coord_2f(0, 1);
+        _gl._vertex_2f(-x, -y);
+        _gl._tex_coord_2f(1, 1);
+        _gl._vertex_2f(x, -y);
+        _gl._tex_coord_2f(1, 0);
+        _gl._vertex_2f(x, y);
+        _gl._tex_coord_2f(0, 0);
+        _gl._vertex_2f(-x, y);
+        _gl._end();
+        if (_texture_yuv) {
+            _gl._use_program(0);
+        }
+        _gl._disable(GL_TEXTURE_2D);
+        _gl._pop_matrix();
+        _gl._matrix_mode(GL_PROJECTION);
+        _gl._pop_matrix();
+        _gl._matrix_mode(GL_MODELVIEW);
+
+        return S_OK;
     }
     HRESULT SetFrame(IDeckLinkVideoFrame *theFrame)
     {
-        return E_FAIL;
+        if (theFrame != NULL) {
+            theFrame->AddRef();
+        }
+
+        IDeckLinkVideoFrame *stale = atomic_exchange(&_pending, theFrame);
+
+        if (stale != NULL) {
+            stale->Release();
+        }
+        return S_OK;
     }
     HRESULT Set3DPreviewFormat(BMD3DPreviewFormat previewFormat)
     {
-        return E_FAIL;
+        atomic_store(&_3d_preview_format, previewFormat);
+        return S_OK;
     }
 };
 
+// The entry points are all the library exports, everything else is
+// built with hidden visibility, see the Makefile
+#pragma GCC visibility push(default)
+
 extern "C" {
 
     IDeckLinkGLScreenPreviewHelper *
@@ -42,3 +482,5 @@ extern "C" {
     }
 
 }
+
+#pragma GCC visibility pop
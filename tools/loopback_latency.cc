@@ -0,0 +1,594 @@
+// Round-trip audio latency through a loopback, e.g. a cable from an
+// output to an input of the same card, or the snd-aloop driver (play
+// on "Loopback PCM" device 0, capture on device 1). Plays a maximum
+// length sequence or a logarithmic chirp through ScheduleAudioSamples,
+// captures it through IDeckLinkInput and cross-correlates, once per
+// ALSA buffer configuration.
+//
+// Latency is measured from the ScheduleAudioSamples call that queued
+// the first sample of a burst to the capture time of that sample on
+// the hardware reference clock, so it includes the output queue set
+// by the buffer size but not the delivery of the input packet.
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <complex>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "DeckLinkAPI.h"
+#include "SoundDeckAPI.h"
+
+namespace {
+
+    const unsigned int sample_rate = 48000;
+    const unsigned int channel_count = 2;
+    // Each burst is followed by silence up to one burst period, which
+    // bounds the latency that can be measured
+    const size_t burst_period = sample_rate / 2;
+    const size_t write_block = sample_rate / 200;
+    // Covers a burst period plus a burst, for circular correlation
+    // without wrap around
+    const size_t fft_size = 32768;
+
+    typedef std::complex<double> complex_t;
+
+    // In place radix-2, inverse without the 1/n scaling
+    void fft(std::vector<complex_t> &x, bool inverse)
+    {
+        const size_t n = x.size();
+
+        for (size_t i = 1, j = 0; i < n; i++) {
+            size_t bit = n >> 1;
+
+            for (; (j & bit) != 0; bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j) {
+                std::swap(x[i], x[j]);
+            }
+        }
+        for (size_t length = 2; length <= n; length <<= 1) {
+            const double angle = (inverse ? 2 : -2) * M_PI / length;
+            const complex_t step(cos(angle), sin(angle));
+
+            for (size_t i = 0; i < n; i += length) {
+                complex_t w(1);
+
+                for (size_t j = 0; j < length / 2; j++) {
+                    const complex_t u = x[i + j];
+                    const complex_t v = x[i + j + length / 2] * w;
+
+                    x[i + j] = u + v;
+                    x[i + j + length / 2] = u - v;
+                    w *= step;
+                }
+            }
+        }
+    }
+
+    class option_t {
+    public:
+        std::string _library;
+        std::string _output;
+        std::string _input;
+        std::string _signal;
+        unsigned int _channel;
+        unsigned int _burst_count;
+        // (buffer size, period size) in sample frames, 0 for the
+        // driver default
+        std::vector<std::pair<int64_t, int64_t> > _buffer;
+        option_t(void)
+            : _library("./libDeckLinkAPI.so"), _signal("mls"),
+              _channel(0), _burst_count(16)
+        {
+        }
+    };
+
+    void usage(const char *name)
+    {
+        fprintf(stderr,
+                "usage: %s [-l library] [-o output] [-i input] "
+                "[-s mls|chirp]\n"
+                "       [-c channel] [-n bursts] "
+                "[-b buffer/period]...\n"
+                "output and input match a substring of the display "
+                "name, input defaults\n"
+                "to the output device. -b may be repeated, 0/0 is the "
+                "driver default.\n", name);
+    }
+
+    // Order 12 maximum length sequence, 4095 samples
+    std::vector<double> mls(void)
+    {
+        const unsigned int order = 12;
+        std::vector<double> signal((1U << order) - 1);
+        unsigned int state = 1;
+
+        for (size_t i = 0; i < signal.size(); i++) {
+            // x^12 + x^6 + x^4 + x + 1
+            const unsigned int bit = ((state >> 11) ^ (state >> 5) ^
+                                      (state >> 3) ^ state) & 1;
+
+            signal[i] = (state & 1) != 0 ? 1.0 : -1.0;
+            state = ((state << 1) | bit) & ((1U << order) - 1);
+        }
+
+        return signal;
+    }
+
+    // 100 Hz to 16 kHz in 85 ms, faded in and out
+    std::vector<double> chirp(void)
+    {
+        const size_t length = 4096;
+        const double f0 = 100;
+        const double f1 = 16000;
+        const double duration = static_cast<double>(length) / sample_rate;
+        const double k = log(f1 / f0);
+        std::vector<double> signal(length);
+
+        for (size_t i = 0; i < length; i++) {
+            const double t = static_cast<double>(i) / sample_rate;
+            const double phase = 2 * M_PI * f0 * duration / k *
+                (exp(t / duration * k) - 1);
+            const double fade = i < 256 ? i / 256.0 :
+                length - i < 256 ? (length - i) / 256.0 : 1.0;
+
+            signal[i] = sin(phase) * fade;
+        }
+
+        return signal;
+    }
+
+    // Collects channel _channel of every packet by its stream time
+    class capture_t : public IDeckLinkInputCallback {
+    protected:
+        pthread_mutex_t _mutex;
+        std::vector<float> _sample;
+        unsigned int _channel;
+    public:
+        capture_t(size_t sample_count, unsigned int channel)
+            : _sample(sample_count, 0), _channel(channel)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+        }
+        ~capture_t()
+        {
+            pthread_mutex_destroy(&_mutex);
+        }
+        HRESULT QueryInterface(REFIID iid, LPVOID *ppv)
+        {
+            return E_NOINTERFACE;
+        }
+        ULONG AddRef(void)
+        {
+            return 1;
+        }
+        ULONG Release(void)
+        {
+            return 1;
+        }
+        HRESULT VideoInputFormatChanged(BMDVideoInputFormatChangedEvents
+                                        notificationEvents,
+                                        IDeckLinkDisplayMode *
+                                        newDisplayMode,
+                                        BMDDetectedVideoInputFormatFlags
+                                        detectedSignalFlags)
+        {
+            return S_OK;
+        }
+        HRESULT VideoInputFrameArrived(IDeckLinkVideoInputFrame *
+                                       videoFrame,
+                                       IDeckLinkAudioInputPacket *
+                                       audioPacket)
+        {
+            BMDTimeValue time;
+            void *buffer;
+
+            if (audioPacket == NULL ||
+                audioPacket->GetPacketTime(&time, sample_rate) != S_OK ||
+                audioPacket->GetBytes(&buffer) != S_OK) {
+                return S_OK;
+            }
+
+            const int32_t *sample = reinterpret_cast<int32_t *>(buffer);
+            const long count = audioPacket->GetSampleFrameCount();
+
+            pthread_mutex_lock(&_mutex);
+            for (long i = 0; i < count; i++) {
+                if (time + i >= 0 &&
+                    time + i < static_cast<BMDTimeValue>(_sample.size())) {
+                    _sample[time + i] =
+                        sample[i * channel_count + _channel] / 2147483648.0;
+                }
+            }
+            pthread_mutex_unlock(&_mutex);
+            return S_OK;
+        }
+        // Offset of the burst in the capture from position, in
+        // samples, or a negative value if there is no clear peak
+        double find(const std::vector<double> &burst, int64_t position)
+        {
+            std::vector<complex_t> x(fft_size);
+            std::vector<complex_t> b(fft_size);
+
+            pthread_mutex_lock(&_mutex);
+            for (size_t i = 0; i < fft_size; i++) {
+                const int64_t j = position + i;
+
+                if (j >= 0 && j < static_cast<int64_t>(_sample.size())) {
+                    x[i] = _sample[j];
+                }
+            }
+            pthread_mutex_unlock(&_mutex);
+            for (size_t i = 0; i < burst.size(); i++) {
+                b[i] = burst[i];
+            }
+            fft(x, false);
+            fft(b, false);
+            for (size_t i = 0; i < fft_size; i++) {
+                x[i] *= std::conj(b[i]);
+            }
+            fft(x, true);
+
+            std::vector<double> correlation(burst_period);
+            double peak = 0;
+            double sum = 0;
+            size_t peak_lag = 0;
+
+            for (size_t lag = 0; lag < burst_period; lag++) {
+                correlation[lag] = fabs(x[lag].real());
+                sum += correlation[lag];
+                if (correlation[lag] > peak) {
+                    peak = correlation[lag];
+                    peak_lag = lag;
+                }
+            }
+
+            // The peak has to stand out from the average, otherwise
+            // nothing came back
+            if (peak == 0 || peak < 20 * sum / burst_period) {
+                return -1;
+            }
+            if (peak_lag == 0 || peak_lag == burst_period - 1) {
+                return peak_lag;
+            }
+
+            // Parabolic interpolation between the neighbours
+            const double left = correlation[peak_lag - 1];
+            const double centre = correlation[peak_lag];
+            const double right = correlation[peak_lag + 1];
+            const double denominator = left - 2 * centre + right;
+
+            return peak_lag + (denominator != 0 ?
+                               0.5 * (left - right) / denominator : 0);
+        }
+    };
+
+    IDeckLink *find_device(IDeckLinkIterator *iterator,
+                           const std::string &name)
+    {
+        IDeckLink *device;
+
+        while (iterator->Next(&device) == S_OK) {
+            const char *display_name;
+
+            if (device->GetDisplayName(&display_name) == S_OK &&
+                strstr(display_name, name.c_str()) != NULL) {
+                return device;
+            }
+            device->Release();
+        }
+
+        return NULL;
+    }
+
+    void configure(IDeckLink *device, int64_t buffer_size,
+                   int64_t period_size)
+    {
+        IDeckLinkConfiguration *configuration;
+
+        if (device->QueryInterface(IID_IDeckLinkConfiguration,
+                                   reinterpret_cast<void **>
+                                   (&configuration)) != S_OK) {
+            return;
+        }
+        configuration->SetInt(bmdDeckLinkConfigSoundDeckBufferSize,
+                              buffer_size);
+        configuration->SetInt(bmdDeckLinkConfigSoundDeckPeriodSize,
+                              period_size);
+        configuration->Release();
+    }
+
+    int64_t hardware_time(IDeckLinkInput *input)
+    {
+        BMDTimeValue time;
+        BMDTimeValue time_in_frame;
+        BMDTimeValue ticks_per_frame;
+
+        input->GetHardwareReferenceClock(sample_rate, &time,
+                                         &time_in_frame,
+                                         &ticks_per_frame);
+
+        return time;
+    }
+
+    // Plays the bursts and returns the latency of each in samples,
+    // negative where none was found
+    std::vector<double> measure(IDeckLinkOutput *output,
+                                IDeckLinkInput *input,
+                                const std::vector<double> &burst,
+                                const option_t &option)
+    {
+        std::vector<double> latency;
+        // Plus a period of silence up front for the streams to
+        // settle, and one at the end for the last burst to come back
+        const size_t total = (option._burst_count + 2) * burst_period;
+        capture_t capture(total + burst_period, option._channel);
+
+        if (output->EnableAudioOutput(sample_rate,
+                                      bmdAudioSampleType32bitInteger,
+                                      channel_count,
+                                      bmdAudioOutputStreamContinuous) !=
+            S_OK) {
+            fprintf(stderr, "cannot enable audio output\n");
+            return latency;
+        }
+        if (input->EnableAudioInput(sample_rate,
+                                    bmdAudioSampleType32bitInteger,
+                                    channel_count) != S_OK) {
+            fprintf(stderr, "cannot enable audio input\n");
+            output->DisableAudioOutput();
+            return latency;
+        }
+        input->SetCallback(&capture);
+
+        // Stream time 0 of the input on the hardware clock
+        const int64_t before = hardware_time(input);
+
+        input->StartStreams();
+
+        const int64_t stream_start = (before + hardware_time(input)) / 2;
+
+        output->StartScheduledPlayback(0, sample_rate, 1.0);
+
+        std::vector<int32_t> block(write_block * channel_count);
+        // Hardware time each burst was queued at
+        std::vector<int64_t> queued;
+
+        for (size_t position = 0; position < total;
+             position += write_block) {
+            for (size_t i = 0; i < write_block; i++) {
+                const size_t period = (position + i) / burst_period;
+                const size_t offset = (position + i) % burst_period;
+                const double value =
+                    period >= 1 && period <= option._burst_count &&
+                    offset < burst.size() ? 0.5 * burst[offset] : 0;
+
+                for (unsigned int c = 0; c < channel_count; c++) {
+                    block[i * channel_count + c] =
+                        static_cast<int32_t>(value * 2147483647.0);
+                }
+            }
+
+            uint32_t written = 0;
+
+            output->ScheduleAudioSamples(&block[0], write_block, 0, 0,
+                                         &written);
+            if (position % burst_period == 0 &&
+                position / burst_period >= 1 &&
+                position / burst_period <= option._burst_count) {
+                queued.push_back(hardware_time(input));
+            }
+        }
+
+        // Drain the output into the capture
+        usleep(burst_period * 1000000ULL / sample_rate);
+        input->StopStreams();
+        output->StopScheduledPlayback(0, NULL, 0);
+        input->SetCallback(NULL);
+        input->DisableAudioInput();
+        output->DisableAudioOutput();
+
+        for (size_t i = 0; i < queued.size(); i++) {
+            const int64_t position = queued[i] - stream_start;
+            const double offset = capture.find(burst, position);
+
+            latency.push_back(offset);
+        }
+
+        return latency;
+    }
+
+    void report(int64_t buffer_size, int64_t period_size,
+                const std::vector<double> &latency)
+    {
+        double sum = 0;
+        double sum_square = 0;
+        double minimum = 0;
+        double maximum = 0;
+        size_t count = 0;
+
+        for (size_t i = 0; i < latency.size(); i++) {
+            if (latency[i] < 0) {
+                continue;
+            }
+
+            const double ms = latency[i] * 1000 / sample_rate;
+
+            minimum = count == 0 || ms < minimum ? ms : minimum;
+            maximum = count == 0 || ms > maximum ? ms : maximum;
+            sum += ms;
+            sum_square += ms * ms;
+            count++;
+        }
+
+        char buffer[16];
+        char period[16];
+
+        snprintf(buffer, sizeof(buffer), "%lld",
+                 static_cast<long long>(buffer_size));
+        snprintf(period, sizeof(period), "%lld",
+                 static_cast<long long>(period_size));
+        if (count == 0) {
+            printf("%8s %8s  no signal came back\n",
+                   buffer_size > 0 ? buffer : "default",
+                   period_size > 0 ? period : "default");
+            return;
+        }
+
+        const double mean = sum / count;
+        const double variance = sum_square / count - mean * mean;
+
+        printf("%8s %8s %5lu/%-3lu %9.3f %9.3f %9.3f %9.3f\n",
+               buffer_size > 0 ? buffer : "default",
+               period_size > 0 ? period : "default",
+               static_cast<unsigned long>(count),
+               static_cast<unsigned long>(latency.size()), mean, minimum,
+               maximum, sqrt(variance > 0 ? variance : 0));
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    option_t option;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:o:i:s:c:n:b:h")) != -1) {
+        switch (c) {
+        case 'l':
+            option._library = optarg;
+            break;
+        case 'o':
+            option._output = optarg;
+            break;
+        case 'i':
+            option._input = optarg;
+            break;
+        case 's':
+            option._signal = optarg;
+            break;
+        case 'c':
+            option._channel = atoi(optarg);
+            break;
+        case 'n':
+            option._burst_count = atoi(optarg);
+            break;
+        case 'b': {
+            long long buffer_size = 0;
+            long long period_size = 0;
+
+            if (sscanf(optarg, "%lld/%lld", &buffer_size,
+                       &period_size) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            option._buffer.push_back(std::make_pair(buffer_size,
+                                                    period_size));
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if ((option._signal != "mls" && option._signal != "chirp") ||
+        option._channel >= channel_count || option._burst_count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (option._input.empty()) {
+        option._input = option._output;
+    }
+    if (option._buffer.empty()) {
+        option._buffer.push_back(std::make_pair(0, 0));
+        option._buffer.push_back(std::make_pair(8192, 2048));
+        option._buffer.push_back(std::make_pair(4096, 1024));
+        option._buffer.push_back(std::make_pair(2048, 512));
+        option._buffer.push_back(std::make_pair(1024, 256));
+        option._buffer.push_back(std::make_pair(512, 128));
+    }
+
+    void *library = dlopen(option._library.c_str(), RTLD_NOW);
+
+    if (library == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    IDeckLinkIterator *(*create_iterator)(void) =
+        reinterpret_cast<IDeckLinkIterator *(*)(void)>
+        (dlsym(library, "CreateDeckLinkIteratorInstance_0002"));
+
+    if (create_iterator == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    IDeckLinkIterator *iterator = create_iterator();
+    IDeckLink *output_device = find_device(iterator, option._output);
+
+    iterator->Release();
+    iterator = create_iterator();
+
+    IDeckLink *input_device = find_device(iterator, option._input);
+
+    iterator->Release();
+
+    IDeckLinkOutput *output;
+    IDeckLinkInput *input;
+
+    if (output_device == NULL ||
+        output_device->QueryInterface(IID_IDeckLinkOutput,
+                                      reinterpret_cast<void **>
+                                      (&output)) != S_OK) {
+        fprintf(stderr, "no output device matching \"%s\"\n",
+                option._output.c_str());
+        return 1;
+    }
+    if (input_device == NULL ||
+        input_device->QueryInterface(IID_IDeckLinkInput,
+                                     reinterpret_cast<void **>
+                                     (&input)) != S_OK) {
+        fprintf(stderr, "no input device matching \"%s\"\n",
+                option._input.c_str());
+        return 1;
+    }
+
+    const char *output_name;
+    const char *input_name;
+
+    output_device->GetDisplayName(&output_name);
+    input_device->GetDisplayName(&input_name);
+    printf("output %s\ninput  %s\nsignal %s, %u bursts per "
+           "configuration\n\n", output_name, input_name,
+           option._signal.c_str(), option._burst_count);
+    printf("%8s %8s %9s %9s %9s %9s %9s\n", "buffer", "period", "found",
+           "mean ms", "min ms", "max ms", "jitter ms");
+
+    const std::vector<double> burst =
+        option._signal == "mls" ? mls() : chirp();
+
+    for (size_t i = 0; i < option._buffer.size(); i++) {
+        configure(output_device, option._buffer[i].first,
+                  option._buffer[i].second);
+        configure(input_device, option._buffer[i].first,
+                  option._buffer[i].second);
+        report(option._buffer[i].first, option._buffer[i].second,
+               measure(output, input, burst, option));
+    }
+
+    input->Release();
+    output->Release();
+    input_device->Release();
+    output_device->Release();
+    dlclose(library);
+
+    return 0;
+}
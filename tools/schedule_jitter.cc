@@ -0,0 +1,543 @@
+// How accurately scheduled playback hands frames back, measured the way
+// an editing host drives the output: a few frames are prerolled, each
+// ScheduledFrameCompleted schedules the next one, and a separate thread
+// writes one frame's worth of audio at a time through
+// ScheduleAudioSamples, blocking while the sink is full. Runs once per
+// display mode.
+//
+// Completion i is expected one frame duration after completion i - 1,
+// on a grid anchored at the first completion. Jitter is the distance
+// from that grid, a frame is late beyond half a frame duration and
+// dropped if the library said so. The buffered frame count is sampled
+// in every callback.
+//
+// Without a sound card, load snd-dummy ("Dummy" device) or play into
+// ALSA's null PCM through SOUNDDECK_AGGREGATE=null@1-16 -o Aggregate.
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "DeckLinkAPI.h"
+#include "SoundDeckAPI.h"
+
+namespace {
+
+    const unsigned int sample_rate = 48000;
+
+    class option_t {
+    public:
+        std::string _library;
+        std::string _output;
+        std::vector<std::string> _mode;
+        unsigned int _channel_count;
+        unsigned int _preroll;
+        unsigned int _second;
+        option_t(void)
+            : _library("./libDeckLinkAPI.so"), _channel_count(16),
+              _preroll(4), _second(5)
+        {
+        }
+    };
+
+    void usage(const char *name)
+    {
+        fprintf(stderr,
+                "usage: %s [-l library] [-o output] [-m mode]... "
+                "[-c channels]\n"
+                "       [-p preroll] [-t seconds]\n"
+                "output matches a substring of the display name, mode "
+                "the display mode\n"
+                "name, e.g. 1080p25. -m may be repeated.\n", name);
+    }
+
+    int64_t monotonic_ns(void)
+    {
+        struct timespec current;
+
+        clock_gettime(CLOCK_MONOTONIC, &current);
+
+        return static_cast<int64_t>(current.tv_sec) * 1000000000LL +
+            current.tv_nsec;
+    }
+
+    // Schedules the next frame from each completion and records when
+    // it came, what the library said and how many frames were queued
+    class host_t : public IDeckLinkVideoOutputCallback {
+    protected:
+        IDeckLinkOutput *_output;
+        std::vector<IDeckLinkMutableVideoFrame *> _frame;
+        BMDTimeValue _frame_duration;
+        BMDTimeScale _time_scale;
+        int64_t _scheduled;
+        bool _stopping;
+    public:
+        pthread_mutex_t _mutex;
+        std::vector<int64_t> _completion_ns;
+        std::vector<uint32_t> _buffered;
+        size_t _late_count;
+        size_t _dropped_count;
+        host_t(IDeckLinkOutput *output, BMDTimeValue frame_duration,
+               BMDTimeScale time_scale)
+            : _output(output), _frame_duration(frame_duration),
+              _time_scale(time_scale), _scheduled(0), _stopping(false),
+              _late_count(0), _dropped_count(0)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+        }
+        ~host_t()
+        {
+            for (size_t i = 0; i < _frame.size(); i++) {
+                _frame[i]->Release();
+            }
+            pthread_mutex_destroy(&_mutex);
+        }
+        HRESULT QueryInterface(REFIID iid, LPVOID *ppv)
+        {
+            return E_NOINTERFACE;
+        }
+        ULONG AddRef(void)
+        {
+            return 1;
+        }
+        ULONG Release(void)
+        {
+            return 1;
+        }
+        // Two more frames than are ever queued, so that none is
+        // reused while the library still holds it
+        bool allocate(long width, long height, unsigned int count)
+        {
+            for (unsigned int i = 0; i < count + 2; i++) {
+                IDeckLinkMutableVideoFrame *frame;
+
+                if (_output->CreateVideoFrame(width, height, width * 2,
+                                              bmdFormat8BitYUV,
+                                              bmdFrameFlagDefault,
+                                              &frame) != S_OK) {
+                    return false;
+                }
+                _frame.push_back(frame);
+            }
+            return true;
+        }
+        void schedule(void)
+        {
+            IDeckLinkMutableVideoFrame *frame =
+                _frame[_scheduled % _frame.size()];
+
+            _output->ScheduleVideoFrame(frame,
+                                        _scheduled * _frame_duration,
+                                        _frame_duration, _time_scale);
+            _scheduled++;
+        }
+        void stop(void)
+        {
+            pthread_mutex_lock(&_mutex);
+            _stopping = true;
+            pthread_mutex_unlock(&_mutex);
+        }
+        HRESULT ScheduledFrameCompleted(IDeckLinkVideoFrame *
+                                        completedFrame,
+                                        BMDOutputFrameCompletionResult
+                                        result)
+        {
+            const int64_t now_ns = monotonic_ns();
+            uint32_t buffered = 0;
+
+            _output->GetBufferedVideoFrameCount(&buffered);
+            pthread_mutex_lock(&_mutex);
+            switch (result) {
+            case bmdOutputFrameDisplayedLate:
+                _late_count++;
+                break;
+            case bmdOutputFrameDropped:
+                _dropped_count++;
+                break;
+            default:
+                break;
+            }
+            if (!_stopping) {
+                _completion_ns.push_back(now_ns);
+                _buffered.push_back(buffered);
+                schedule();
+            }
+            pthread_mutex_unlock(&_mutex);
+            return S_OK;
+        }
+        HRESULT ScheduledPlaybackHasStopped(void)
+        {
+            return S_OK;
+        }
+    };
+
+    // Writes one frame's worth of audio at a time, the per frame
+    // sample count following the frame rate exactly, e.g. 1601 and
+    // 1602 alternating at 29.97 Hz
+    class audio_writer_t {
+    public:
+        IDeckLinkOutput *_output;
+        unsigned int _channel_count;
+        BMDTimeValue _frame_duration;
+        BMDTimeScale _time_scale;
+        bool _stop;
+        pthread_mutex_t _mutex;
+        pthread_t _thread;
+        audio_writer_t(IDeckLinkOutput *output,
+                       unsigned int channel_count,
+                       BMDTimeValue frame_duration,
+                       BMDTimeScale time_scale)
+            : _output(output), _channel_count(channel_count),
+              _frame_duration(frame_duration), _time_scale(time_scale),
+              _stop(false)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+        }
+        ~audio_writer_t()
+        {
+            pthread_mutex_destroy(&_mutex);
+        }
+        bool stopped(void)
+        {
+            pthread_mutex_lock(&_mutex);
+
+            const bool stop = _stop;
+
+            pthread_mutex_unlock(&_mutex);
+
+            return stop;
+        }
+        static void *run(void *arg)
+        {
+            audio_writer_t *w = static_cast<audio_writer_t *>(arg);
+            const size_t maximum = static_cast<size_t>
+                (ceil(static_cast<double>(sample_rate) *
+                      w->_frame_duration / w->_time_scale));
+            std::vector<int32_t> block(maximum * w->_channel_count, 0);
+            uint64_t position = 0;
+
+            for (int64_t frame = 1; !w->stopped(); frame++) {
+                const uint64_t end = static_cast<uint64_t>
+                    (frame * w->_frame_duration) * sample_rate /
+                    w->_time_scale;
+                const uint32_t count = end - position;
+
+                for (uint32_t done = 0; done < count; ) {
+                    uint32_t written = 0;
+
+                    w->_output->ScheduleAudioSamples
+                        (&block[done * w->_channel_count], count - done,
+                         position + done, sample_rate, &written);
+                    if (written == 0) {
+                        usleep(1000);
+                        if (w->stopped()) {
+                            break;
+                        }
+                    }
+                    done += written;
+                }
+                position = end;
+            }
+
+            return NULL;
+        }
+    };
+
+    IDeckLink *find_device(IDeckLinkIterator *iterator,
+                           const std::string &name)
+    {
+        IDeckLink *device;
+
+        while (iterator->Next(&device) == S_OK) {
+            const char *display_name;
+
+            if (device->GetDisplayName(&display_name) == S_OK &&
+                strstr(display_name, name.c_str()) != NULL) {
+                return device;
+            }
+            device->Release();
+        }
+
+        return NULL;
+    }
+
+    IDeckLinkDisplayMode *find_mode(IDeckLinkOutput *output,
+                                    const std::string &name)
+    {
+        IDeckLinkDisplayModeIterator *iterator;
+        IDeckLinkDisplayMode *mode;
+
+        if (output->GetDisplayModeIterator(&iterator) != S_OK) {
+            return NULL;
+        }
+        while (iterator->Next(&mode) == S_OK) {
+            const char *mode_name;
+
+            if (mode->GetName(&mode_name) == S_OK &&
+                name == mode_name) {
+                iterator->Release();
+                return mode;
+            }
+            mode->Release();
+        }
+        iterator->Release();
+
+        return NULL;
+    }
+
+    int64_t underrun_count(IDeckLink *device)
+    {
+        IDeckLinkStatus *status;
+        int64_t count = 0;
+
+        if (device->QueryInterface(IID_IDeckLinkStatus,
+                                   reinterpret_cast<void **>
+                                   (&status)) == S_OK) {
+            status->GetInt(bmdDeckLinkStatusSoundDeckUnderrunCount,
+                           &count);
+            status->Release();
+        }
+
+        return count;
+    }
+
+    double percentile(std::vector<double> value, double p)
+    {
+        if (value.empty()) {
+            return 0;
+        }
+        std::sort(value.begin(), value.end());
+
+        return value[static_cast<size_t>
+                     (p * (value.size() - 1) + 0.5)];
+    }
+
+    // Plays mode for the configured time and prints one line
+    bool measure(IDeckLink *device, IDeckLinkOutput *output,
+                 const std::string &mode_name, const option_t &option)
+    {
+        IDeckLinkDisplayMode *mode = find_mode(output, mode_name);
+
+        if (mode == NULL) {
+            printf("%-12s unknown display mode\n", mode_name.c_str());
+            return false;
+        }
+
+        BMDTimeValue frame_duration;
+        BMDTimeScale time_scale;
+
+        mode->GetFrameRate(&frame_duration, &time_scale);
+
+        const long width = mode->GetWidth();
+        const long height = mode->GetHeight();
+        const BMDDisplayMode display_mode = mode->GetDisplayMode();
+
+        mode->Release();
+        if (output->EnableVideoOutput(display_mode,
+                                      bmdVideoOutputFlagDefault) !=
+            S_OK) {
+            printf("%-12s cannot enable video output\n",
+                   mode_name.c_str());
+            return false;
+        }
+        if (output->EnableAudioOutput(bmdAudioSampleRate48kHz,
+                                      bmdAudioSampleType32bitInteger,
+                                      option._channel_count,
+                                      bmdAudioOutputStreamTimestamped) !=
+            S_OK) {
+            printf("%-12s cannot enable audio output\n",
+                   mode_name.c_str());
+            output->DisableVideoOutput();
+            return false;
+        }
+
+        host_t host(output, frame_duration, time_scale);
+
+        if (!host.allocate(width, height, option._preroll)) {
+            printf("%-12s cannot create frames\n", mode_name.c_str());
+            output->DisableAudioOutput();
+            output->DisableVideoOutput();
+            return false;
+        }
+        output->SetScheduledFrameCompletionCallback(&host);
+        for (unsigned int i = 0; i < option._preroll; i++) {
+            host.schedule();
+        }
+
+        audio_writer_t writer(output, option._channel_count,
+                              frame_duration, time_scale);
+        const int64_t underrun_start = underrun_count(device);
+
+        output->StartScheduledPlayback(0, time_scale, 1.0);
+        pthread_create(&writer._thread, NULL, &audio_writer_t::run,
+                       &writer);
+        sleep(option._second);
+        host.stop();
+        pthread_mutex_lock(&writer._mutex);
+        writer._stop = true;
+        pthread_mutex_unlock(&writer._mutex);
+        pthread_join(writer._thread, NULL);
+
+        const int64_t underruns = underrun_count(device) - underrun_start;
+
+        output->StopScheduledPlayback(0, NULL, 0);
+        output->SetScheduledFrameCompletionCallback(NULL);
+        output->DisableAudioOutput();
+        output->DisableVideoOutput();
+
+        const double frame_ns = 1e+9 * frame_duration / time_scale;
+        std::vector<double> jitter_us;
+        uint32_t buffered_min = 0;
+        uint32_t buffered_max = 0;
+        double buffered_sum = 0;
+
+        pthread_mutex_lock(&host._mutex);
+
+        size_t late_count = host._late_count;
+        const size_t count = host._completion_ns.size();
+
+        for (size_t i = 0; i < count; i++) {
+            const double deviation_ns =
+                host._completion_ns[i] - host._completion_ns[0] -
+                i * frame_ns;
+
+            jitter_us.push_back(fabs(deviation_ns) / 1000);
+            if (deviation_ns > frame_ns / 2) {
+                late_count++;
+            }
+
+            const uint32_t buffered = host._buffered[i];
+
+            buffered_min = i == 0 || buffered < buffered_min ?
+                buffered : buffered_min;
+            buffered_max = i == 0 || buffered > buffered_max ?
+                buffered : buffered_max;
+            buffered_sum += buffered;
+        }
+
+        const size_t dropped_count = host._dropped_count;
+
+        pthread_mutex_unlock(&host._mutex);
+        printf("%-12s %7lu %9.1f %9.1f %9.1f %5lu %5lu %4u %5.2f %4u "
+               "%6lld\n", mode_name.c_str(),
+               static_cast<unsigned long>(count),
+               percentile(jitter_us, 0.5), percentile(jitter_us, 0.99),
+               percentile(jitter_us, 1.0),
+               static_cast<unsigned long>(late_count),
+               static_cast<unsigned long>(dropped_count), buffered_min,
+               count > 0 ? buffered_sum / count : 0.0, buffered_max,
+               static_cast<long long>(underruns));
+
+        return true;
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    option_t option;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:o:m:c:p:t:h")) != -1) {
+        switch (c) {
+        case 'l':
+            option._library = optarg;
+            break;
+        case 'o':
+            option._output = optarg;
+            break;
+        case 'm':
+            option._mode.push_back(optarg);
+            break;
+        case 'c':
+            option._channel_count = atoi(optarg);
+            break;
+        case 'p':
+            option._preroll = atoi(optarg);
+            break;
+        case 't':
+            option._second = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (option._channel_count == 0 || option._preroll < 2 ||
+        option._second == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (option._mode.empty()) {
+        option._mode.push_back("1080p23.98");
+        option._mode.push_back("1080p25");
+        option._mode.push_back("1080p29.97");
+        option._mode.push_back("1080i50");
+        option._mode.push_back("1080p50");
+        option._mode.push_back("1080p59.94");
+        option._mode.push_back("2160p25");
+    }
+
+    void *library = dlopen(option._library.c_str(), RTLD_NOW);
+
+    if (library == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    IDeckLinkIterator *(*create_iterator)(void) =
+        reinterpret_cast<IDeckLinkIterator *(*)(void)>
+        (dlsym(library, "CreateDeckLinkIteratorInstance_0002"));
+
+    if (create_iterator == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    IDeckLinkIterator *iterator = create_iterator();
+    IDeckLink *device = find_device(iterator, option._output);
+    IDeckLinkOutput *output;
+
+    iterator->Release();
+    if (device == NULL ||
+        device->QueryInterface(IID_IDeckLinkOutput,
+                               reinterpret_cast<void **>(&output)) !=
+        S_OK) {
+        fprintf(stderr, "no output device matching \"%s\"\n",
+                option._output.c_str());
+        return 1;
+    }
+    output->Release();
+
+    const char *output_name;
+
+    device->GetDisplayName(&output_name);
+    printf("output %s\n%u channels, %u frames preroll, %u s per mode\n\n",
+           output_name, option._channel_count, option._preroll,
+           option._second);
+    printf("%-12s %7s %9s %9s %9s %5s %5s %4s %5s %4s %6s\n", "mode",
+           "frames", "p50 us", "p99 us", "max us", "late", "drop",
+           "bmin", "bavg", "bmax", "xruns");
+    for (size_t i = 0; i < option._mode.size(); i++) {
+        // A fresh output per mode, as a host reopening the device,
+        // so that nothing left queued by the previous mode interferes
+        if (device->QueryInterface(IID_IDeckLinkOutput,
+                                   reinterpret_cast<void **>
+                                   (&output)) == S_OK) {
+            measure(device, output, option._mode[i], option);
+            output->Release();
+        }
+    }
+
+    device->Release();
+    dlclose(library);
+
+    return 0;
+}
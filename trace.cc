@@ -0,0 +1,261 @@
+#include "trace.h"
+
+#ifdef TRACE_EVENTS
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+__thread trace_ring_t *trace_thread_ring = NULL;
+
+namespace {
+
+    // Spacing of the readings the tick rate is worked out from
+    const int64_t calibration_ns = 10000000;
+
+    // A trace_ticks() and a CLOCK_MONOTONIC reading taken together
+    class clock_pair_t {
+    public:
+        int64_t _ticks;
+        int64_t _ns;
+        static clock_pair_t now(void)
+        {
+            clock_pair_t pair;
+            const int64_t before = trace_ticks();
+
+            pair._ns = trace_now_ns();
+            pair._ticks = before + (trace_ticks() - before) / 2;
+
+            return pair;
+        }
+    };
+
+    // Every ring ever created, never freed so that the events of
+    // exited threads can still be dumped, and because threads may
+    // still be recording while the process exits. Rings of exited
+    // threads are handed to new threads.
+    class trace_registry_t {
+    protected:
+        pthread_mutex_t _mutex;
+        pthread_key_t _exit_key;
+        std::vector<trace_ring_t *> _ring;
+        std::vector<trace_ring_t *> _free;
+        unsigned int _dump_count;
+        // Taken at load, the other end of the tick rate measurement
+        clock_pair_t _load;
+        // The SIGUSR2 handler writes a byte, the dump thread reads it
+        int _pipe[2];
+        pthread_t _thread;
+        bool _thread_alive;
+        static void thread_exit(void *arg)
+        {
+            trace_registry_t &registry = instance();
+
+            pthread_mutex_lock(&registry._mutex);
+            registry._free.push_back(static_cast<trace_ring_t *>(arg));
+            pthread_mutex_unlock(&registry._mutex);
+        }
+        static void signal_handler(int signal_number)
+        {
+            const int saved_errno = errno;
+            const char byte = 1;
+
+            if (write(instance()._pipe[1], &byte, 1) < 0) {
+                // Nothing to be done about it in a signal handler
+            }
+            errno = saved_errno;
+        }
+        static void *dump_thread(void *arg)
+        {
+            trace_registry_t *registry =
+                static_cast<trace_registry_t *>(arg);
+            char byte;
+
+            // Ends when the write end is closed on unload
+            while (read(registry->_pipe[0], &byte, 1) > 0) {
+                trace_dump();
+            }
+
+            return NULL;
+        }
+    public:
+        trace_registry_t(void)
+            : _dump_count(0), _load(clock_pair_t::now()),
+              _thread_alive(false)
+        {
+            pthread_mutex_init(&_mutex, NULL);
+            pthread_key_create(&_exit_key, &thread_exit);
+            if (pipe(_pipe) != 0) {
+                _pipe[0] = _pipe[1] = -1;
+                return;
+            }
+            fcntl(_pipe[1], F_SETFL, O_NONBLOCK);
+            _thread_alive = pthread_create(&_thread, NULL, &dump_thread,
+                                           this) == 0;
+
+            // Left alone if the host handles it already
+            struct sigaction action;
+
+            if (sigaction(SIGUSR2, NULL, &action) == 0 &&
+                action.sa_handler == SIG_DFL) {
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = &signal_handler;
+                action.sa_flags = SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGUSR2, &action, NULL);
+            }
+        }
+        ~trace_registry_t()
+        {
+            struct sigaction action;
+
+            if (sigaction(SIGUSR2, NULL, &action) == 0 &&
+                action.sa_handler == &signal_handler) {
+                signal(SIGUSR2, SIG_DFL);
+            }
+            if (_pipe[1] >= 0) {
+                close(_pipe[1]);
+            }
+            if (_thread_alive) {
+                pthread_join(_thread, NULL);
+            }
+            if (_pipe[0] >= 0) {
+                close(_pipe[0]);
+            }
+            dump();
+            pthread_key_delete(_exit_key);
+        }
+        static trace_registry_t &instance(void)
+        {
+            static trace_registry_t registry;
+
+            return registry;
+        }
+        trace_ring_t *create(void)
+        {
+            trace_ring_t *ring;
+
+            pthread_mutex_lock(&_mutex);
+            if (!_free.empty()) {
+                ring = _free.back();
+                _free.pop_back();
+            }
+            else {
+                ring = new trace_ring_t();
+                ring->_count = 0;
+                _ring.push_back(ring);
+            }
+            pthread_mutex_unlock(&_mutex);
+            ring->_tid = syscall(SYS_gettid);
+            pthread_setspecific(_exit_key, ring);
+
+            return ring;
+        }
+        bool dump(void)
+        {
+            pthread_mutex_lock(&_mutex);
+
+            const std::vector<trace_ring_t *> ring = _ring;
+            const unsigned int dump_index = _dump_count++;
+
+            pthread_mutex_unlock(&_mutex);
+
+            // Events are placed against a pair of readings taken now,
+            // at the tick rate since load
+            clock_pair_t current = clock_pair_t::now();
+
+            if (current._ns - _load._ns < calibration_ns) {
+                const struct timespec wait = {
+                    0, calibration_ns - (current._ns - _load._ns)
+                };
+
+                nanosleep(&wait, NULL);
+                current = clock_pair_t::now();
+            }
+
+            const double ns_per_tick =
+                static_cast<double>(current._ns - _load._ns) /
+                (current._ticks - _load._ticks);
+            const char *prefix = getenv("SOUNDDECK_TRACE_PREFIX");
+            // "-" + 2 x 10 characters max for int + "-" + ".json" +
+            // '\0'
+            char suffix[29];
+
+            snprintf(suffix, sizeof(suffix), "-%d-%u.json",
+                     static_cast<int>(getpid()), dump_index);
+
+            const std::string path =
+                std::string(prefix != NULL && prefix[0] != '\0' ?
+                            prefix : "/tmp/sounddeck-trace") + suffix;
+            FILE *file = fopen(path.c_str(), "w");
+
+            if (file == NULL) {
+                return false;
+            }
+            fprintf(file, "{\"traceEvents\":[");
+
+            const int pid = getpid();
+            bool first = true;
+
+            for (size_t r = 0; r < ring.size(); r++) {
+                const uint64_t count = atomic_load(&ring[r]->_count);
+                const uint64_t begin = count > trace_ring_t::capacity ?
+                    count - trace_ring_t::capacity : 0;
+
+                // The oldest events may be overwritten while this
+                // runs, which only garbles those
+                for (uint64_t i = begin; i < count; i++) {
+                    const trace_event_t event =
+                        ring[r]->_event[i & (trace_ring_t::capacity - 1)];
+
+                    if (event._name == NULL) {
+                        continue;
+                    }
+                    fprintf(file, "%s\n{\"name\":\"%s\",\"pid\":%d,"
+                            "\"tid\":%d,\"ts\":%.3f,", first ? "" : ",",
+                            event._name, pid, event._tid,
+                            (current._ns + (event._start - current._ticks) *
+                             ns_per_tick) / 1e+3);
+                    if (event._duration < 0) {
+                        fprintf(file, "\"ph\":\"i\",\"s\":\"t\"}");
+                    }
+                    else {
+                        fprintf(file, "\"ph\":\"X\",\"dur\":%.3f}",
+                                event._duration * ns_per_tick / 1e+3);
+                    }
+                    first = false;
+                }
+            }
+            fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+            return fclose(file) == 0;
+        }
+    };
+
+    // Sets the signal handler up as the library is loaded rather
+    // than on the first event
+    trace_registry_t &registry = trace_registry_t::instance();
+
+}
+
+trace_ring_t *trace_ring_create(void)
+{
+    trace_thread_ring = registry.create();
+
+    return trace_thread_ring;
+}
+
+bool trace_dump(void)
+{
+    return trace_registry_t::instance().dump();
+}
+
+#endif // TRACE_EVENTS
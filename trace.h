@@ -0,0 +1,133 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// Timing probes on the hot paths, built in with make TRACE=1 and
+// compiled out otherwise. Each thread records into its own ring of
+// its most recent events without locking. All rings are written out as
+// Chrome trace JSON, which Perfetto opens as well, on SIGUSR2 and when
+// the library is unloaded, to SOUNDDECK_TRACE_PREFIX (by default
+// /tmp/sounddeck-trace) followed by "-<pid>-<n>.json".
+//
+// Events are stamped with the TSC on x86, which costs a fraction of a
+// clock_gettime(), and converted to CLOCK_MONOTONIC time when dumped.
+// This assumes a constant rate TSC, as every x86 CPU of the last decade
+// has. Elsewhere they are stamped with CLOCK_MONOTONIC directly.
+
+#ifdef TRACE_EVENTS
+
+#include <cstddef>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "DeckLinkAPI.h"
+#include "common.h"
+
+class trace_event_t {
+public:
+    // A string literal
+    const char *_name;
+    // In trace_ticks() units
+    int64_t _start;
+    // Negative for an instant event
+    int64_t _duration;
+    int32_t _tid;
+};
+
+class trace_ring_t {
+public:
+    static const size_t capacity = 1 << 15;
+    // Events recorded so far, the last capacity of them are kept.
+    // Only the owning thread writes, the dump reads.
+    uint64_t _count;
+    int32_t _tid;
+    trace_event_t _event[capacity];
+    void record(const char *name, int64_t start, int64_t duration)
+    {
+        trace_event_t &event = _event[_count & (capacity - 1)];
+
+        event._name = name;
+        event._start = start;
+        event._duration = duration;
+        event._tid = _tid;
+        atomic_store(&_count, _count + 1);
+    }
+};
+
+// The calling thread's ring, NULL until its first event
+extern __thread trace_ring_t *trace_thread_ring;
+
+// Takes a ring for the calling thread, one left by an exited thread
+// if there is any
+trace_ring_t *trace_ring_create(void);
+
+inline int64_t trace_now_ns(void)
+{
+    struct timespec current;
+
+    clock_gettime(CLOCK_MONOTONIC, &current);
+
+    return static_cast<int64_t>(current.tv_sec) * 1000000000LL +
+        current.tv_nsec;
+}
+
+// The time stamp of events
+inline int64_t trace_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return static_cast<int64_t>(__rdtsc());
+#else
+    return trace_now_ns();
+#endif
+}
+
+inline void trace_record(const char *name, int64_t start,
+                         int64_t duration)
+{
+    trace_ring_t *ring = trace_thread_ring;
+
+    if (ring == NULL) {
+        ring = trace_ring_create();
+    }
+    ring->record(name, start, duration);
+}
+
+// Writes all rings out now, returns false if the file could not be
+// written
+bool trace_dump(void);
+
+class trace_scope_t {
+protected:
+    const char *_name;
+    int64_t _start;
+public:
+    explicit trace_scope_t(const char *name)
+        : _name(name), _start(trace_ticks())
+    {
+    }
+    ~trace_scope_t()
+    {
+        trace_record(_name, _start, trace_ticks() - _start);
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records the time from here to the end of the enclosing block
+#define TRACE_SCOPE(name) \
+    trace_scope_t TRACE_CONCAT(trace_scope_, __LINE__)(name)
+// Records a point in time
+#define TRACE_INSTANT(name) \
+    trace_record(name, trace_ticks(), -1)
+
+#else // TRACE_EVENTS
+
+#define TRACE_SCOPE(name)
+#define TRACE_INSTANT(name)
+
+#endif // TRACE_EVENTS
+
+#endif // TRACE_H_
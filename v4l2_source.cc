@@ -0,0 +1,212 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "v4l2_source.h"
+
+namespace {
+    const unsigned int buffer_count = 4;
+
+    int xioctl(int fd, unsigned long request, void *arg)
+    {
+        int status;
+
+        do {
+            status = ioctl(fd, request, arg);
+        } while (status < 0 && errno == EINTR);
+
+        return status;
+    }
+}
+
+v4l2_source_t::v4l2_source_t(void)
+    : _fd(-1), _pixel_format(0), _width(0), _height(0), _row_bytes(0)
+{
+}
+
+v4l2_source_t::~v4l2_source_t()
+{
+    close();
+}
+
+bool v4l2_source_t::open(const char *path, long width, long height)
+{
+    close();
+    _fd = ::open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (_fd < 0) {
+        return false;
+    }
+
+    static const uint32_t pixel_format[] = {
+        V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_YUYV
+    };
+    struct v4l2_format format;
+    bool negotiated = false;
+
+    // Drivers adjust the request to the nearest they support
+    for (size_t i = 0; i < sizeof(pixel_format) / sizeof(*pixel_format) &&
+             !negotiated; i++) {
+        memset(&format, 0, sizeof(format));
+        format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        format.fmt.pix.width = width;
+        format.fmt.pix.height = height;
+        format.fmt.pix.pixelformat = pixel_format[i];
+        format.fmt.pix.field = V4L2_FIELD_ANY;
+        negotiated = xioctl(_fd, VIDIOC_S_FMT, &format) == 0 &&
+            format.fmt.pix.pixelformat == pixel_format[i];
+    }
+    if (!negotiated) {
+        close();
+        return false;
+    }
+    _pixel_format = format.fmt.pix.pixelformat;
+    _width = format.fmt.pix.width;
+    _height = format.fmt.pix.height;
+    _row_bytes = format.fmt.pix.bytesperline;
+
+    struct v4l2_requestbuffers request;
+
+    memset(&request, 0, sizeof(request));
+    request.count = buffer_count;
+    request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    request.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(_fd, VIDIOC_REQBUFS, &request) < 0 || request.count < 2) {
+        close();
+        return false;
+    }
+    for (unsigned int i = 0; i < request.count; i++) {
+        struct v4l2_buffer buffer;
+
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = i;
+        if (xioctl(_fd, VIDIOC_QUERYBUF, &buffer) < 0) {
+            close();
+            return false;
+        }
+
+        void *data = mmap(NULL, buffer.length, PROT_READ, MAP_SHARED,
+                          _fd, buffer.m.offset);
+
+        if (data == MAP_FAILED) {
+            close();
+            return false;
+        }
+        _buffer.push_back(std::make_pair(data,
+                                         static_cast<size_t>
+                                         (buffer.length)));
+        if (xioctl(_fd, VIDIOC_QBUF, &buffer) < 0) {
+            close();
+            return false;
+        }
+    }
+
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (xioctl(_fd, VIDIOC_STREAMON, &type) < 0) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void v4l2_source_t::close(void)
+{
+    if (_fd < 0) {
+        return;
+    }
+
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    xioctl(_fd, VIDIOC_STREAMOFF, &type);
+    for (size_t i = 0; i < _buffer.size(); i++) {
+        munmap(_buffer[i].first, _buffer[i].second);
+    }
+    _buffer.clear();
+    ::close(_fd);
+    _fd = -1;
+}
+
+void v4l2_source_t::copy(const uint8_t *source, size_t size,
+                         const image_t &destination)
+{
+    const long width = _width < destination._width ?
+        _width : destination._width;
+    const long height = _height < destination._height ?
+        _height : destination._height;
+    // Whole Cb Y Cr Y groups on both sides
+    const long source_x = ((_width - width) / 2) & ~1L;
+    const long destination_x = ((destination._width - width) / 2) & ~1L;
+    const long source_y = (_height - height) / 2;
+    const long destination_y = (destination._height - height) / 2;
+
+    for (long y = 0; y < height; y++) {
+        const size_t offset = (source_y + y) * _row_bytes + source_x * 2;
+
+        if (offset + width * 2 > size) {
+            break;
+        }
+
+        const uint8_t *s = source + offset;
+        uint8_t *d = reinterpret_cast<uint8_t *>(destination._data) +
+            (destination_y + y) * destination._row_bytes +
+            destination_x * 2;
+
+        if (_pixel_format == V4L2_PIX_FMT_UYVY) {
+            memcpy(d, s, (width & ~1L) * 2);
+        }
+        else {
+            // Y0 Cb Y1 Cr to Cb Y0 Cr Y1
+            for (long x = 0; x < (width & ~1L) * 2; x += 2) {
+                d[x] = s[x + 1];
+                d[x + 1] = s[x];
+            }
+        }
+    }
+}
+
+bool v4l2_source_t::read(const image_t &destination)
+{
+    if (_fd < 0) {
+        return false;
+    }
+
+    // Requeue everything but the newest completed buffer, a frame
+    // that sat in the queue is only late
+    struct v4l2_buffer newest;
+    bool found = false;
+
+    while (true) {
+        struct v4l2_buffer buffer;
+
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(_fd, VIDIOC_DQBUF, &buffer) < 0) {
+            break;
+        }
+        if (found) {
+            xioctl(_fd, VIDIOC_QBUF, &newest);
+        }
+        newest = buffer;
+        found = true;
+    }
+    if (!found) {
+        return false;
+    }
+    if (newest.index < _buffer.size() &&
+        (newest.flags & V4L2_BUF_FLAG_ERROR) == 0) {
+        copy(reinterpret_cast<const uint8_t *>
+             (_buffer[newest.index].first), newest.bytesused,
+             destination);
+    }
+    xioctl(_fd, VIDIOC_QBUF, &newest);
+
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef V4L2_SOURCE_H_
+#define V4L2_SOURCE_H_
+
+#include <vector>
+
+#include "convert.h"
+
+// Video4Linux2 capture device used as the video input, e.g. a webcam
+// or an HDMI grabber. Only packed 4:2:2 (YUYV, UYVY) is requested,
+// which maps onto 2vuy without any colour conversion. Frames of a
+// different size than asked for are centred on black.
+class v4l2_source_t {
+protected:
+    int _fd;
+    uint32_t _pixel_format;
+    long _width;
+    long _height;
+    long _row_bytes;
+    std::vector<std::pair<void *, size_t> > _buffer;
+    // Owns the descriptor and the mappings
+    v4l2_source_t(const v4l2_source_t &);
+    v4l2_source_t &operator=(const v4l2_source_t &);
+    void copy(const uint8_t *source, size_t size,
+              const image_t &destination);
+public:
+    v4l2_source_t(void);
+    ~v4l2_source_t();
+    bool open(const char *path, long width, long height);
+    void close(void);
+    bool is_open(void) const
+    {
+        return _fd >= 0;
+    }
+    // Copies the most recent frame the device has completed into the
+    // 2vuy destination, returns false if there was none since the
+    // last call and leaves destination unchanged
+    bool read(const image_t &destination);
+};
+
+#endif // V4L2_SOURCE_H_